@@ -45,6 +45,7 @@
 #include "v4l2-utils.h"
 
 #include "gstv4l2object.h"
+#include "gstv4l2tracer.h"
 
 #ifndef USE_V4L2_TARGET_NV
 #include "gstv4l2src.h"
@@ -267,7 +268,8 @@ plugin_init (GstPlugin * plugin)
       !gst_element_register (plugin, "v4l2radio", GST_RANK_NONE,
           GST_TYPE_V4L2RADIO) ||
       !gst_device_provider_register (plugin, "v4l2deviceprovider",
-          GST_RANK_PRIMARY, GST_TYPE_V4L2_DEVICE_PROVIDER)
+          GST_RANK_PRIMARY, GST_TYPE_V4L2_DEVICE_PROVIDER) ||
+      !gst_v4l2_tracer_register (plugin)
       /* etc. */
 #ifdef GST_V4L2_ENABLE_PROBE
       || !gst_v4l2_probe_and_register (plugin)
@@ -300,6 +302,9 @@ plugin_init (GstPlugin * plugin)
 
   GST_DEBUG_CATEGORY_INIT (v4l2_debug, "v4l2", 0, "V4L2 API calls");
 
+  if (!gst_v4l2_tracer_register (plugin))
+    return FALSE;
+
 #ifndef USE_V4L2_TARGET_NV_X86
   int igpu = -1, dgpu = -1;
   igpu = system("lsmod | grep 'nvgpu' > /dev/null");
@@ -32,18 +32,31 @@
 
 #include "gstv4l2object.h"
 #include "gstv4l2allocator.h"
+#include "gstv4l2tracer.h"
+#ifdef USE_V4L2_TARGET_NV
+#include "gstv4l2personality.h"
+#endif
 
 #include <gst/allocators/gstdmabuf.h>
 
 #include <fcntl.h>
+#include <poll.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
 #include <unistd.h>
+#ifdef USE_V4L2_TARGET_NV
+#include <stdlib.h>
+#endif
 
 #define GST_V4L2_MEMORY_TYPE "V4l2Memory"
 
+#ifdef USE_V4L2_TARGET_NV
+#define GST_V4L2_GROUP_STRIDE \
+  GST_ROUND_UP_N (sizeof (GstV4l2MemoryGroup), GST_V4L2_CACHE_LINE)
+#endif
+
 #define gst_v4l2_allocator_parent_class parent_class
 G_DEFINE_TYPE (GstV4l2Allocator, gst_v4l2_allocator, GST_TYPE_ALLOCATOR);
 
@@ -58,6 +71,18 @@ GST_DEBUG_CATEGORY_STATIC (v4l2allocator_debug);
 #define IS_QUEUED(buffer) \
     ((buffer).flags & (V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE))
 
+#ifdef USE_V4L2_TARGET_NV
+/* DQBUF attempts that only yield the CPU before backing off with sleeps */
+#define GST_V4L2_DQBUF_SPIN_LIMIT 16
+/* Longest sleep between two DQBUF attempts */
+#define GST_V4L2_DQBUF_MAX_SLEEP_US 1000
+/* Bounds an epoll wait, in case the driver misses a wakeup */
+#define GST_V4L2_DQBUF_POLL_TIMEOUT_US 100000
+/* After a source change event, how long the driver may still hand out
+ * pictures of the previous format */
+#define GST_V4L2_SOURCE_DRAIN_US 50000
+#endif
+
 enum
 {
   GROUP_RELEASED,
@@ -242,15 +267,17 @@ gst_v4l2_memory_group_free (GstV4l2MemoryGroup * group, GstV4l2Object *obj)
 
 #if defined(USE_V4L2_TARGET_NV)
     if (mem) {
-      if (is_cuvid == TRUE) {
+      if (obj->personality->is_encoder && !obj->personality->is_cuvid)
+        gst_memory_unref (mem);
+      else
         g_slice_free (GstV4l2Memory, (GstV4l2Memory *)mem);
-      } else {
-        if (!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVENC)
-            || !strcmp (obj->videodev, V4L2_DEVICE_PATH_NVENC_ALT))
-          gst_memory_unref (mem);
-        else
-          g_slice_free (GstV4l2Memory, (GstV4l2Memory *)mem);
-      }
+    } else if (group->premapped) {
+      /* Exported and mapped at start but never wrapped */
+      if (group->data[i] && obj->personality->is_encoder &&
+          !obj->personality->is_cuvid)
+        obj->munmap (group->data[i], group->planes[i].length);
+      if (group->dmafd[i] >= 0)
+        close (group->dmafd[i]);
     }
 #else
     if (mem)
@@ -258,7 +285,9 @@ gst_v4l2_memory_group_free (GstV4l2MemoryGroup * group, GstV4l2Object *obj)
 #endif
   }
 
+#ifndef USE_V4L2_TARGET_NV
   g_slice_free (GstV4l2MemoryGroup, group);
+#endif
 }
 
 static GstV4l2MemoryGroup *
@@ -270,7 +299,14 @@ gst_v4l2_memory_group_new (GstV4l2Allocator * allocator, guint32 index)
   GstV4l2MemoryGroup *group;
   gsize img_size, buf_size;
 
+#ifdef USE_V4L2_TARGET_NV
+  /* The slot of an index is free again once its group was freed */
+  group = (GstV4l2MemoryGroup *) (allocator->group_arena +
+      index * GST_V4L2_GROUP_STRIDE);
+  memset (group, 0, sizeof (GstV4l2MemoryGroup));
+#else
   group = g_slice_new0 (GstV4l2MemoryGroup);
+#endif
 
   group->buffer.type = format->type;
   group->buffer.index = index;
@@ -283,10 +319,7 @@ gst_v4l2_memory_group_new (GstV4l2Allocator * allocator, guint32 index)
     /* Having multiple memories causes buffer copy issues when these buffers are
      * mapped. Also, even with two memories, both memories map to the same NvBufSurface.
      * Need to take similar care in the is_buffer_valid function. */
-    if (!V4L2_TYPE_IS_OUTPUT (obj->type) &&
-       (((!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC)) && (is_cuvid == FALSE)) ||
-       ((!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC_ALT)) && (is_cuvid == FALSE)) ||
-       ((!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC_MCCOY)) && (is_cuvid == TRUE))))
+    if (!V4L2_TYPE_IS_OUTPUT (obj->type) && obj->personality->is_decoder)
       group->n_mem = 1;
 #endif
   } else {
@@ -300,7 +333,9 @@ gst_v4l2_memory_group_new (GstV4l2Allocator * allocator, guint32 index)
     GST_ERROR_OBJECT (allocator, "Buffer index returned by VIDIOC_QUERYBUF "
         "didn't match, this indicate the presence of a bug in your driver or "
         "libv4l2");
+#ifndef USE_V4L2_TARGET_NV
     g_slice_free (GstV4l2MemoryGroup, group);
+#endif
     return NULL;
   }
 
@@ -480,6 +515,9 @@ gst_v4l2_allocator_finalize (GObject * obj)
 
   gst_atomic_queue_unref (allocator->free_queue);
   gst_object_unref (allocator->obj->element);
+#ifdef USE_V4L2_TARGET_NV
+  free (allocator->group_arena);
+#endif
 
   G_OBJECT_CLASS (parent_class)->finalize (obj);
 }
@@ -581,6 +619,11 @@ gst_v4l2_allocator_create_buf (GstV4l2Allocator * allocator)
   if (obj->ioctl (obj->video_fd, VIDIOC_CREATE_BUFS, &bcreate) < 0)
     goto create_bufs_failed;
 
+  /* The index picks the group slot, a driver going past the slots must not
+   * make us write past them */
+  if (bcreate.index >= G_N_ELEMENTS (allocator->groups))
+    goto create_bufs_out_of_range;
+
   if (allocator->groups[bcreate.index] != NULL)
     goto create_bufs_bug;
 
@@ -601,6 +644,14 @@ create_bufs_failed:
         g_strerror (errno));
     goto done;
   }
+create_bufs_out_of_range:
+  {
+    GST_ERROR_OBJECT (allocator, "created buffer has index %u, past the %u "
+        "buffers we support", bcreate.index,
+        (guint) G_N_ELEMENTS (allocator->groups));
+    allocator->can_allocate = FALSE;
+    goto done;
+  }
 create_bufs_bug:
   {
     GST_ERROR_OBJECT (allocator, "created buffer has already used buffer "
@@ -631,6 +682,10 @@ gst_v4l2_allocator_alloc (GstV4l2Allocator * allocator)
       /* Don't hammer on CREATE_BUFS */
       if (group == NULL)
         allocator->can_allocate = FALSE;
+#ifdef USE_V4L2_TARGET_NV
+      else
+        GST_V4L2_STAT_ADD (allocator->stats.created, 1);
+#endif
     }
   }
 
@@ -692,6 +747,12 @@ gst_v4l2_allocator_new (GstObject * parent, GstV4l2Object * v4l2object)
   /* Keep a ref on the elemnt so obj does not disapear */
   gst_object_ref (allocator->obj->element);
 
+#ifdef USE_V4L2_TARGET_NV
+  if (posix_memalign ((void **) &allocator->group_arena, GST_V4L2_CACHE_LINE,
+          NV_VIDEO_MAX_FRAME * GST_V4L2_GROUP_STRIDE) != 0)
+    goto arena_failed;
+#endif
+
   flags |= GST_V4L2_ALLOCATOR_PROBE (allocator, MMAP);
   flags |= GST_V4L2_ALLOCATOR_PROBE (allocator, USERPTR);
   flags |= GST_V4L2_ALLOCATOR_PROBE (allocator, DMABUF);
@@ -708,8 +769,175 @@ gst_v4l2_allocator_new (GstObject * parent, GstV4l2Object * v4l2object)
 
   GST_OBJECT_FLAG_SET (allocator, flags);
 
+#ifdef USE_V4L2_TARGET_NV
+  allocator->can_device_poll = TRUE;
+#endif
+
   return allocator;
+
+#ifdef USE_V4L2_TARGET_NV
+arena_failed:
+  {
+    GST_ERROR_OBJECT (allocator, "Failed to allocate the buffer groups");
+    gst_object_unref (allocator);
+    return NULL;
+  }
+#endif
+}
+
+#ifdef USE_V4L2_TARGET_NV
+/* Exports @plane of @group and maps it the way the backend expects. Returns
+ * MAP_FAILED on error, with no fd left open */
+static gpointer
+gst_v4l2_allocator_map_plane (GstV4l2Allocator * allocator,
+    GstV4l2MemoryGroup * group, gint plane, gint * dmafd)
+{
+  GstV4l2Object *obj = allocator->obj;
+  struct v4l2_exportbuffer expbuf = { 0 };
+  NvBufSurface *nvbuf_surf = 0;
+  gpointer data = MAP_FAILED;
+  gboolean decoder_capture;
+
+  expbuf.type = obj->type;
+  expbuf.index = group->buffer.index;
+  expbuf.plane = plane;
+  expbuf.flags = O_CLOEXEC | O_RDWR;
+
+  *dmafd = -1;
+
+  if (obj->ioctl (obj->video_fd, VIDIOC_EXPBUF, &expbuf) < 0) {
+    GST_ERROR_OBJECT (allocator, "Failed to export plane %d of buffer %u: %s",
+        plane, group->buffer.index, g_strerror (errno));
+    return MAP_FAILED;
+  }
+
+  decoder_capture = !V4L2_TYPE_IS_OUTPUT (obj->type) &&
+      obj->personality->is_decoder;
+
+  if (decoder_capture || is_cuvid == TRUE) {
+    if (NvBufSurfaceFromFd (expbuf.fd, (void **) (&nvbuf_surf)) != 0 ||
+        nvbuf_surf == NULL)
+      GST_ERROR_OBJECT (allocator, "Failed to get surface from fd = %d",
+          expbuf.fd);
+    else if (decoder_capture)
+      data = nvbuf_surf;
+    else
+      data = nvbuf_surf->surfaceList->dataPtr;
+  } else {
+    data = obj->mmap (NULL, group->planes[plane].length, PROT_READ | PROT_WRITE,
+        MAP_SHARED, expbuf.fd, group->planes[plane].m.mem_offset);
+  }
+
+  if (data == MAP_FAILED) {
+    close (expbuf.fd);
+    return MAP_FAILED;
+  }
+
+  group->planes[plane].m.fd = expbuf.fd;
+  *dmafd = expbuf.fd;
+
+  return data;
+}
+
+/* Maps all the planes of a new MMAP group ahead of its first
+ * gst_v4l2_allocator_alloc_mmap() */
+static gboolean
+gst_v4l2_allocator_map_group (GstV4l2Allocator * allocator,
+    GstV4l2MemoryGroup * group)
+{
+  gint i;
+
+  group->premapped = TRUE;
+
+  for (i = 0; i < group->n_mem; i++)
+    group->dmafd[i] = -1;
+
+  for (i = 0; i < group->n_mem; i++) {
+    group->data[i] = gst_v4l2_allocator_map_plane (allocator, group, i,
+        &group->dmafd[i]);
+    if (group->data[i] == MAP_FAILED) {
+      GST_ERROR_OBJECT (allocator, "Failed to mmap buffer %u: %s",
+          group->buffer.index, g_strerror (errno));
+      group->data[i] = NULL;
+      return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+#endif
+
+#ifdef USE_V4L2_TARGET_NV
+/* Whether the buffers kept by the last stop can serve @count buffers of
+ * @memory in the current format: same pixel format and planes, a coded
+ * size no larger than the one they were allocated for and every plane
+ * within the buffer length. Comparing against the allocation rather than
+ * the last format lets a stream that switches between a few sizes keep the
+ * buffers of the largest one. */
+static gboolean
+gst_v4l2_allocator_kept_fit (GstV4l2Allocator * allocator, guint32 count,
+    guint32 memory)
+{
+  struct v4l2_format *kept = &allocator->alloc_format;
+  struct v4l2_format *format = &allocator->obj->format;
+  guint i;
+  gint p;
+
+  if (memory != allocator->memory || count != allocator->count)
+    return FALSE;
+
+  if (V4L2_TYPE_IS_MULTIPLANAR (format->type)) {
+    if (format->fmt.pix_mp.pixelformat != kept->fmt.pix_mp.pixelformat
+        || format->fmt.pix_mp.num_planes != kept->fmt.pix_mp.num_planes
+        || format->fmt.pix_mp.width > kept->fmt.pix_mp.width
+        || format->fmt.pix_mp.height > kept->fmt.pix_mp.height)
+      return FALSE;
+  } else {
+    if (format->fmt.pix.pixelformat != kept->fmt.pix.pixelformat
+        || format->fmt.pix.width > kept->fmt.pix.width
+        || format->fmt.pix.height > kept->fmt.pix.height)
+      return FALSE;
+  }
+
+  for (i = 0; i < allocator->count; i++) {
+    GstV4l2MemoryGroup *group = allocator->groups[i];
+
+    for (p = 0; p < group->n_mem; p++) {
+      guint32 img_size = V4L2_TYPE_IS_MULTIPLANAR (format->type) ?
+          format->fmt.pix_mp.plane_fmt[p].sizeimage : format->fmt.pix.sizeimage;
+
+      if (img_size > group->planes[p].length)
+        return FALSE;
+    }
+  }
+
+  return TRUE;
+}
+
+/* Frees the groups and the driver buffers, kept by the last stop or left by
+ * a failed start, with the allocator lock held */
+static void
+gst_v4l2_allocator_release_buffers (GstV4l2Allocator * allocator)
+{
+  GstV4l2Object *obj = allocator->obj;
+  struct v4l2_requestbuffers breq = { 0, obj->type, allocator->memory };
+  guint i;
+
+  for (i = 0; i < allocator->count; i++) {
+    GstV4l2MemoryGroup *group = allocator->groups[i];
+    allocator->groups[i] = NULL;
+    if (group)
+      gst_v4l2_memory_group_free (group, obj);
+  }
+
+  if (obj->ioctl (obj->video_fd, VIDIOC_REQBUFS, &breq) < 0)
+    GST_WARNING_OBJECT (allocator,
+        "error releasing buffers buffers: %s", g_strerror (errno));
+
+  allocator->count = 0;
+  allocator->kept = FALSE;
 }
+#endif
 
 guint
 gst_v4l2_allocator_start (GstV4l2Allocator * allocator, guint32 count,
@@ -722,6 +950,8 @@ gst_v4l2_allocator_start (GstV4l2Allocator * allocator, guint32 count,
   gint i;
 #else
   guint i;
+  gboolean map;
+  gint64 start_time;
 #endif
 
   g_return_val_if_fail (count != 0, 0);
@@ -731,6 +961,34 @@ gst_v4l2_allocator_start (GstV4l2Allocator * allocator, guint32 count,
   if (g_atomic_int_get (&allocator->active))
     goto already_active;
 
+#ifdef USE_V4L2_TARGET_NV
+  g_atomic_int_set (&allocator->source_change, FALSE);
+  g_atomic_int_set (&allocator->source_drained, FALSE);
+
+  if (allocator->kept) {
+    if (gst_v4l2_allocator_kept_fit (allocator, count, memory)) {
+      GST_DEBUG_OBJECT (allocator, "reusing the %u kept %s buffers",
+          allocator->count, memory_type_to_str (memory));
+
+      for (i = 0; i < allocator->count; i++)
+        gst_atomic_queue_push (allocator->free_queue, allocator->groups[i]);
+
+      allocator->kept = FALSE;
+      allocator->stats.reqbufs_us = allocator->stats.setup_us = 0;
+      GST_V4L2_STAT_ADD (allocator->stats.reused, 1);
+      g_atomic_int_set (&allocator->active, TRUE);
+      breq.count = allocator->count;
+      goto done;
+    }
+
+    GST_DEBUG_OBJECT (allocator, "new format does not fit the %u kept "
+        "buffers", allocator->count);
+    gst_v4l2_allocator_release_buffers (allocator);
+  }
+
+  start_time = g_get_monotonic_time ();
+#endif
+
   if (obj->ioctl (obj->video_fd, VIDIOC_REQBUFS, &breq) < 0)
     goto reqbufs_failed;
 
@@ -758,7 +1016,7 @@ gst_v4l2_allocator_start (GstV4l2Allocator * allocator, guint32 count,
   allocator->can_allocate = can_allocate;
   allocator->count = breq.count;
   allocator->memory = memory;
-
+#ifndef USE_V4L2_TARGET_NV
   /* Create memory groups */
   for (i = 0; i < allocator->count; i++) {
     allocator->groups[i] = gst_v4l2_memory_group_new (allocator, i);
@@ -767,6 +1025,35 @@ gst_v4l2_allocator_start (GstV4l2Allocator * allocator, guint32 count,
 
     gst_atomic_queue_push (allocator->free_queue, allocator->groups[i]);
   }
+#else
+  allocator->alloc_format = obj->format;
+  allocator->stats.reqbufs_us = g_get_monotonic_time () - start_time;
+  start_time = g_get_monotonic_time ();
+
+  /* Create memory groups, and map them right away for the MMAP io mode,
+   * where the first acquire of each buffer would do it otherwise */
+  map = memory == V4L2_MEMORY_MMAP && obj->mode == GST_V4L2_IO_MMAP;
+  for (i = 0; i < allocator->count; i++) {
+    GstV4l2MemoryGroup *group = gst_v4l2_memory_group_new (allocator, i);
+
+    if (group && map && !gst_v4l2_allocator_map_group (allocator, group)) {
+      gst_v4l2_memory_group_free (group, obj);
+      group = NULL;
+    }
+
+    allocator->groups[i] = group;
+    if (group == NULL)
+      goto setup_failed;
+  }
+
+  for (i = 0; i < allocator->count; i++)
+    gst_atomic_queue_push (allocator->free_queue, allocator->groups[i]);
+
+  allocator->stats.setup_us = g_get_monotonic_time () - start_time;
+  GST_DEBUG_OBJECT (allocator, "set up %u buffers in %" G_GUINT64_FORMAT
+      " us, REQBUFS took %" G_GUINT64_FORMAT " us", allocator->count,
+      allocator->stats.setup_us, allocator->stats.reqbufs_us);
+#endif
 
   g_atomic_int_set (&allocator->active, TRUE);
 
@@ -790,6 +1077,15 @@ out_of_memory:
     GST_ERROR_OBJECT (allocator, "Not enough memory to allocate buffers");
     goto error;
   }
+#ifdef USE_V4L2_TARGET_NV
+setup_failed:
+  {
+    GST_ERROR_OBJECT (allocator, "Failed to set up the %u buffers",
+        allocator->count);
+    gst_v4l2_allocator_release_buffers (allocator);
+    goto error;
+  }
+#endif
 error:
   {
     breq.count = 0;
@@ -813,8 +1109,14 @@ gst_v4l2_allocator_stop (GstV4l2Allocator * allocator)
 
   GST_OBJECT_LOCK (allocator);
 
-  if (!g_atomic_int_get (&allocator->active))
+  if (!g_atomic_int_get (&allocator->active)) {
+#ifdef USE_V4L2_TARGET_NV
+    /* The kept buffers hold a reference on us, release them for good */
+    if (allocator->kept)
+      gst_v4l2_allocator_release_buffers (allocator);
+#endif
     goto done;
+  }
 
   if (gst_atomic_queue_length (allocator->free_queue) != allocator->count) {
     GST_DEBUG_OBJECT (allocator, "allocator is still in use");
@@ -826,6 +1128,25 @@ gst_v4l2_allocator_stop (GstV4l2Allocator * allocator)
     /* nothing */
   };
 
+#ifdef USE_V4L2_TARGET_NV
+  GST_INFO_OBJECT (allocator, "dequeued %" G_GUINT64_FORMAT " buffers, %"
+      G_GUINT64_FORMAT " DQBUF calls found nothing (%.2f per buffer), %"
+      G_GUINT64_FORMAT " waits", allocator->stats.dequeued,
+      allocator->stats.dqbuf_again, allocator->stats.dequeued ?
+      (gdouble) allocator->stats.dqbuf_again / allocator->stats.dequeued : 0.0,
+      allocator->stats.waits);
+
+  if (allocator->keep_buffers) {
+    GST_DEBUG_OBJECT (allocator, "keeping %u buffers allocated",
+        allocator->count);
+    allocator->keep_buffers = FALSE;
+    allocator->kept = TRUE;
+    memset (allocator->stamps, 0, sizeof (allocator->stamps));
+    g_atomic_int_set (&allocator->active, FALSE);
+    goto done;
+  }
+#endif
+
   for (i = 0; i < allocator->count; i++) {
     GstV4l2MemoryGroup *group = allocator->groups[i];
     allocator->groups[i] = NULL;
@@ -839,6 +1160,9 @@ gst_v4l2_allocator_stop (GstV4l2Allocator * allocator)
         "error releasing buffers buffers: %s", g_strerror (errno));
 
   allocator->count = 0;
+#ifdef USE_V4L2_TARGET_NV
+  memset (allocator->stamps, 0, sizeof (allocator->stamps));
+#endif
 
   g_atomic_int_set (&allocator->active, FALSE);
 
@@ -853,10 +1177,6 @@ gst_v4l2_allocator_alloc_mmap (GstV4l2Allocator * allocator)
   GstV4l2Object *obj = allocator->obj;
   GstV4l2MemoryGroup *group;
   gint i;
-#ifdef USE_V4L2_TARGET_NV
-  gint retval = 0;
-  NvBufSurface *nvbuf_surf = 0;
-#endif
 
   g_return_val_if_fail (allocator->memory == V4L2_MEMORY_MMAP, NULL);
 
@@ -872,39 +1192,14 @@ gst_v4l2_allocator_alloc_mmap (GstV4l2Allocator * allocator)
       data = obj->mmap (NULL, group->planes[i].length, PROT_READ | PROT_WRITE,
           MAP_SHARED, obj->video_fd, group->planes[i].m.mem_offset);
 #else
-      struct v4l2_exportbuffer expbuf = { 0 };
+      gint dmafd;
 
-      expbuf.type = obj->type;
-      expbuf.index = group->buffer.index;
-      expbuf.plane = i;
-      expbuf.flags = O_CLOEXEC | O_RDWR;
-
-      if (v4l2_ioctl (obj->video_fd, VIDIOC_EXPBUF, &expbuf) < 0)
-        GST_ERROR_OBJECT (allocator, "expbuf_failed");
-
-      if ((!V4L2_TYPE_IS_OUTPUT (obj->type)) &&
-          ((!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC) && (is_cuvid == FALSE)) ||
-          (!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC_ALT) && (is_cuvid == FALSE)) ||
-          (!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC_MCCOY) && (is_cuvid == TRUE))))
-      {
-        retval = NvBufSurfaceFromFd(expbuf.fd, (void**)(&nvbuf_surf));
-        if (retval != 0) {
-          g_print ("Failed to get surface from fd = %d\n", expbuf.fd);
-          data = MAP_FAILED;
-        } else {
-          data = nvbuf_surf;
-        }
+      if (group->premapped) {
+        data = group->data[i];
+        dmafd = group->dmafd[i];
       } else {
-        if (is_cuvid == TRUE) {
-          retval = NvBufSurfaceFromFd(expbuf.fd, (void**)(&nvbuf_surf));
-          data = nvbuf_surf->surfaceList->dataPtr;
-        } else if (is_cuvid == FALSE) {
-          data = obj->mmap (NULL, group->planes[i].length, PROT_READ | PROT_WRITE,
-              MAP_SHARED, expbuf.fd, group->planes[i].m.mem_offset);
-        }
+        data = gst_v4l2_allocator_map_plane (allocator, group, i, &dmafd);
       }
-
-      group->planes[0].m.fd = expbuf.fd;
 #endif
       if (data == MAP_FAILED)
         goto mmap_failed;
@@ -920,7 +1215,7 @@ gst_v4l2_allocator_alloc_mmap (GstV4l2Allocator * allocator)
 #else
       group->mem[i] = (GstMemory *) _v4l2mem_new (0, GST_ALLOCATOR (allocator),
           NULL, group->planes[i].length, 0, 0, group->planes[i].length, i, data,
-          expbuf.fd, group);
+          dmafd, group);
 #endif
     } else {
       /* Take back the allocator reference */
@@ -930,6 +1225,10 @@ gst_v4l2_allocator_alloc_mmap (GstV4l2Allocator * allocator)
     group->mems_allocated++;
   }
 
+#ifdef USE_V4L2_TARGET_NV
+  group->premapped = FALSE;
+#endif
+
   /* Ensure group size. Unlike GST, v4l2 have size (bytesused) initially set
    * to 0. As length might be bigger then the expected size exposed in the
    * format, we simply set bytesused initially and reset it here for
@@ -1339,6 +1638,19 @@ done:
   GST_OBJECT_UNLOCK (allocator);
 }
 
+static void
+gst_v4l2_allocator_trace_group (GstV4l2Allocator * allocator,
+    GstV4l2MemoryGroup * group, GstV4l2TraceEvent event)
+{
+  GstClockTime ts = GST_TIMEVAL_TO_TIME (group->buffer.timestamp);
+  gint i;
+
+  for (i = 0; i < group->n_mem; i++)
+    gst_v4l2_tracer_log (allocator->obj, event, group->buffer.index, i,
+        V4L2_TYPE_IS_MULTIPLANAR (allocator->obj->type) ?
+        group->planes[i].bytesused : group->buffer.bytesused, ts);
+}
+
 gboolean
 gst_v4l2_allocator_qbuf (GstV4l2Allocator * allocator,
     GstV4l2MemoryGroup * group)
@@ -1364,7 +1676,7 @@ gst_v4l2_allocator_qbuf (GstV4l2Allocator * allocator,
 #endif
 
   if (obj->is_encode) {
-      if ((is_cuvid == true) && (obj->sei_payload != NULL)) {
+      if (obj->personality->is_cuvid && (obj->sei_payload != NULL)) {
           gint ret;
           struct v4l2_ext_control ctl;
           struct v4l2_ext_controls ctrls;
@@ -1373,7 +1685,7 @@ gst_v4l2_allocator_qbuf (GstV4l2Allocator * allocator,
           ctl.size = obj->sei_payload_size;
           ctrls.count = 1;
           ctrls.controls = &ctl ;
-          ret = obj->ioctl (obj->video_fd, VIDIOC_S_EXT_CTRLS, &ctrls);
+          ret = obj->stream_ioctl (obj->video_fd, VIDIOC_S_EXT_CTRLS, &ctrls);
           if (ret)
           {
               printf ("Passing DS SEI data in ext ctrl failed\n");
@@ -1385,7 +1697,11 @@ gst_v4l2_allocator_qbuf (GstV4l2Allocator * allocator,
   for (i = 0; i < group->n_mem; i++)
     gst_memory_ref (group->mem[i]);
 
-  if (obj->ioctl (obj->video_fd, VIDIOC_QBUF, &group->buffer) < 0) {
+#ifdef USE_V4L2_TARGET_NV
+  allocator->qbuf_time[group->buffer.index] = g_get_monotonic_time ();
+#endif
+
+  if (obj->stream_ioctl (obj->video_fd, VIDIOC_QBUF, &group->buffer) < 0) {
     GST_ERROR_OBJECT (allocator, "failed queueing buffer %i: %s",
         group->buffer.index, g_strerror (errno));
 
@@ -1405,6 +1721,9 @@ gst_v4l2_allocator_qbuf (GstV4l2Allocator * allocator,
   GST_LOG_OBJECT (allocator, "queued buffer %i (flags 0x%X)",
       group->buffer.index, group->buffer.flags);
 
+  if (G_UNLIKELY (gst_v4l2_tracer_active))
+    gst_v4l2_allocator_trace_group (allocator, group, GST_V4L2_TRACE_QBUF);
+
   if (!IS_QUEUED (group->buffer)) {
     GST_DEBUG_OBJECT (allocator,
         "driver pretends buffer is not queued even if queue succeeded");
@@ -1415,14 +1734,169 @@ done:
   return ret;
 }
 
+#ifdef USE_V4L2_TARGET_NV
+/* Dequeues the V4L2 events the device signalled while we were waiting for a
+ * buffer. A source change makes DQBUF report GST_V4L2_FLOW_RESOLUTION_CHANGE
+ * once the buffers of the previous format are out, see
+ * gst_v4l2_allocator_source_drained(). */
+static void
+gst_v4l2_allocator_dequeue_events (GstV4l2Allocator * allocator)
+{
+  GstV4l2Object *obj = allocator->obj;
+  struct v4l2_event ev;
+
+  do {
+    memset (&ev, 0, sizeof (ev));
+    if (obj->stream_ioctl (obj->video_fd, VIDIOC_DQEVENT, &ev) < 0)
+      return;
+
+    GST_V4L2_STAT_ADD (allocator->stats.events, 1);
+    if (ev.type == V4L2_EVENT_SOURCE_CHANGE) {
+      GST_V4L2_STAT_ADD (allocator->stats.source_changes, 1);
+      GST_INFO_OBJECT (allocator, "source change event %u", ev.sequence);
+      if (!g_atomic_int_get (&allocator->source_change))
+        allocator->source_change_time = g_get_monotonic_time ();
+      g_atomic_int_set (&allocator->source_change, TRUE);
+    } else {
+      GST_DEBUG_OBJECT (allocator, "event %u of type %u", ev.sequence,
+          ev.type);
+    }
+  } while (ev.pending > 0);
+}
+
+/* Whether the pictures of the format before the source change are all out
+ * after DQBUF found nothing. Drivers following the stateful decoder
+ * interface tell with V4L2_BUF_FLAG_LAST or EPIPE, but the Tegra decoder
+ * only sends the event and expects the capture plane to be stopped, so
+ * also count it drained once none of our buffers is left queued or
+ * GST_V4L2_SOURCE_DRAIN_US passed since the event. */
+static gboolean
+gst_v4l2_allocator_source_drained (GstV4l2Allocator * allocator)
+{
+  guint32 i;
+
+  if (g_get_monotonic_time () - allocator->source_change_time >=
+      GST_V4L2_SOURCE_DRAIN_US) {
+    GST_INFO_OBJECT (allocator, "no picture of the old format for %d us",
+        GST_V4L2_SOURCE_DRAIN_US);
+    return TRUE;
+  }
+
+  for (i = 0; i < allocator->count; i++)
+    if (allocator->groups[i] && IS_QUEUED (allocator->groups[i]->buffer))
+      return FALSE;
+
+  GST_INFO_OBJECT (allocator, "no buffer left queued after the source change");
+  return TRUE;
+}
+
+/* Called after DQBUF failed with EAGAIN for the @attempt-th time in a row.
+ * The NV drivers never block in DQBUF, so wait with the device poll control
+ * when the driver has it. Otherwise wait on the pool's epoll set, which also
+ * wakes up for V4L2 events and as soon as the pool starts flushing. Once
+ * waking up stops producing buffers (interrupted device poll, fd without
+ * poll support), fall back to yielding and then sleeping with an exponential
+ * backoff. */
+static GstFlowReturn
+gst_v4l2_allocator_wait_dqbuf (GstV4l2Allocator * allocator, guint attempt)
+{
+  GstV4l2Object *obj = allocator->obj;
+  /* Events are left to the output plane's owner, which waits for the first
+   * source change itself */
+  gushort events = V4L2_TYPE_IS_OUTPUT (obj->type) ? POLLOUT : POLLIN | POLLPRI;
+  /* The device poll only returns for a picture, don't outlast the drain */
+  gboolean draining = g_atomic_int_get (&allocator->source_change);
+  gboolean woken = FALSE;
+  gulong sleep_us;
+
+  if (allocator->poll_set
+      && gst_v4l2_poll_set_is_flushing (allocator->poll_set))
+    return GST_FLOW_FLUSHING;
+
+  if (attempt <= GST_V4L2_DQBUF_SPIN_LIMIT && allocator->can_device_poll
+      && !draining) {
+    struct v4l2_ext_control control;
+    struct v4l2_ext_controls ctrls;
+    v4l2_ctrl_video_device_poll devpoll = { 0 };
+
+    memset (&control, 0, sizeof (control));
+    memset (&ctrls, 0, sizeof (ctrls));
+
+    devpoll.req_events = events | POLLERR;
+    control.id = V4L2_CID_MPEG_VIDEO_DEVICE_POLL;
+    control.string = (gchar *) &devpoll;
+    ctrls.count = 1;
+    ctrls.controls = &control;
+
+    GST_V4L2_STAT_ADD (allocator->stats.waits, 1);
+    if (obj->stream_ioctl (obj->video_fd, VIDIOC_S_EXT_CTRLS, &ctrls) == 0) {
+      woken = (devpoll.resp_events & (events | POLLERR)) != 0;
+      if (devpoll.resp_events & POLLPRI)
+        gst_v4l2_allocator_dequeue_events (allocator);
+    } else if (errno != EINTR) {
+      GST_INFO_OBJECT (allocator, "device poll failed (%s), using epoll",
+          g_strerror (errno));
+      allocator->can_device_poll = FALSE;
+    }
+  } else if (!allocator->can_device_poll && !draining && allocator->poll_set
+      && gst_v4l2_poll_set_has_device (allocator->poll_set)) {
+    guint res;
+
+    GST_V4L2_STAT_ADD (allocator->stats.waits, 1);
+    res = gst_v4l2_poll_set_wait (allocator->poll_set,
+        GST_V4L2_DQBUF_POLL_TIMEOUT_US);
+
+    if (res & GST_V4L2_POLL_FLUSHING)
+      return GST_FLOW_FLUSHING;
+    if (res & GST_V4L2_POLL_EVENT)
+      gst_v4l2_allocator_dequeue_events (allocator);
+
+    /* A timeout or a stale wakeup is as good as a sleep, an error means the
+     * device is not streaming yet or can't be waited on */
+    woken = !(res & GST_V4L2_POLL_ERROR);
+  }
+
+  if (woken)
+    return GST_FLOW_OK;
+
+  if (attempt <= GST_V4L2_DQBUF_SPIN_LIMIT) {
+    g_thread_yield ();
+    return GST_FLOW_OK;
+  }
+
+  /* Nothing tells us about events on this path, look for them ourselves */
+  if (!V4L2_TYPE_IS_OUTPUT (obj->type))
+    gst_v4l2_allocator_dequeue_events (allocator);
+
+  sleep_us = 1UL << MIN (attempt - GST_V4L2_DQBUF_SPIN_LIMIT, 10);
+  g_usleep (MIN (sleep_us, GST_V4L2_DQBUF_MAX_SLEEP_US));
+
+  return GST_FLOW_OK;
+}
+#endif
+
+#ifdef USE_V4L2_TARGET_NV
+static GstFlowReturn
+gst_v4l2_allocator_dqbuf_internal (GstV4l2Allocator * allocator,
+    GstV4l2MemoryGroup ** group_out, gboolean wait)
+#else
 GstFlowReturn
 gst_v4l2_allocator_dqbuf (GstV4l2Allocator * allocator,
     GstV4l2MemoryGroup ** group_out)
+#endif
 {
   GstV4l2Object *obj = allocator->obj;
   struct v4l2_buffer buffer = { 0 };
+#ifndef USE_V4L2_TARGET_NV
   struct v4l2_plane planes[VIDEO_MAX_PLANES] = { {0} };
+#else
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
+#endif
   gint i;
+#ifdef USE_V4L2_TARGET_NV
+  guint attempt = 0;
+  gint64 wait_start = 0, now;
+#endif
 
   GstV4l2MemoryGroup *group = NULL;
 
@@ -1434,6 +1908,10 @@ gst_v4l2_allocator_dqbuf (GstV4l2Allocator * allocator,
   if (V4L2_TYPE_IS_MULTIPLANAR (obj->type)) {
     buffer.length = obj->format.fmt.pix_mp.num_planes;
     buffer.m.planes = planes;
+#ifdef USE_V4L2_TARGET_NV
+    /* The driver only touches the planes of the format */
+    memset (planes, 0, buffer.length * sizeof (planes[0]));
+#endif
   }
 
 #ifndef USE_V4L2_TARGET_NV
@@ -1443,10 +1921,62 @@ gst_v4l2_allocator_dqbuf (GstV4l2Allocator * allocator,
  /* TODO: This could a possible bug in library */
   while (1)
   {
-    if (v4l2_ioctl (obj->video_fd, VIDIOC_DQBUF, &buffer) == 0)
+    if (g_atomic_int_get (&allocator->source_drained))
+      return GST_V4L2_FLOW_RESOLUTION_CHANGE;
+
+    if (obj->stream_ioctl (obj->video_fd, VIDIOC_DQBUF, &buffer) == 0)
       break;
-    else if (errno == EPIPE)
+    if (errno == EPIPE) {
+      if (g_atomic_int_get (&allocator->source_change))
+        return GST_V4L2_FLOW_RESOLUTION_CHANGE;
       goto error;
+    }
+
+    if (g_atomic_int_get (&allocator->source_change)
+        && gst_v4l2_allocator_source_drained (allocator)) {
+      g_atomic_int_set (&allocator->source_drained, TRUE);
+      return GST_V4L2_FLOW_RESOLUTION_CHANGE;
+    }
+
+    if (!wait)
+      return GST_V4L2_FLOW_NOT_READY;
+
+    if (attempt == 0)
+      wait_start = g_get_monotonic_time ();
+
+    GST_V4L2_STAT_ADD (allocator->stats.dqbuf_again, 1);
+    if (gst_v4l2_allocator_wait_dqbuf (allocator, ++attempt) != GST_FLOW_OK)
+      return GST_FLOW_FLUSHING;
+  }
+
+  if ((buffer.flags & V4L2_BUF_FLAG_LAST) &&
+      g_atomic_int_get (&allocator->source_change)) {
+    GST_INFO_OBJECT (allocator, "last buffer %u of the old format",
+        buffer.index);
+    g_atomic_int_set (&allocator->source_drained, TRUE);
+    /* An empty one carries no picture, it goes back with the STREAMOFF */
+    if ((V4L2_TYPE_IS_MULTIPLANAR (obj->type) ? planes[0].bytesused :
+            buffer.bytesused) == 0)
+      return GST_V4L2_FLOW_RESOLUTION_CHANGE;
+  }
+
+  now = g_get_monotonic_time ();
+  if (attempt > 0)
+    GST_V4L2_STAT_ADD (allocator->stats.wait_us, now - wait_start);
+  if (buffer.index < NV_VIDEO_MAX_FRAME && allocator->qbuf_time[buffer.index]) {
+    guint64 in_driver = now - allocator->qbuf_time[buffer.index];
+
+    GST_V4L2_STAT_ADD (allocator->stats.driver_us, in_driver);
+    GST_V4L2_STAT_MAX (allocator->stats.driver_max_us, in_driver);
+  }
+  GST_V4L2_STAT_ADD (allocator->stats.dequeued, 1);
+
+  if (buffer.index < NV_VIDEO_MAX_FRAME) {
+    GstV4l2QueueStamp *stamp = &allocator->stamps[buffer.index];
+
+    stamp->qbuf = allocator->qbuf_time[buffer.index];
+    stamp->dqbuf = now;
+    stamp->timestamp = GST_TIMEVAL_TO_TIME (buffer.timestamp);
   }
 #endif
 
@@ -1471,17 +2001,18 @@ gst_v4l2_allocator_dqbuf (GstV4l2Allocator * allocator,
 
   /* TODO: Need to resolve below WAR */
 #ifdef USE_V4L2_TARGET_NV
-  if (V4L2_TYPE_IS_MULTIPLANAR (obj->type) &&
-     ((!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC) && (is_cuvid == FALSE)) ||
-     (!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC_ALT) && (is_cuvid == FALSE)) ||
-     (!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC_MCCOY) && (is_cuvid == TRUE)))) {
-    buffer.m.planes[0].bytesused = sizeof(NvBufSurface);
-  }
+  if (obj->personality->dqbuf_fixup)
+    obj->personality->dqbuf_fixup (obj, &buffer);
 #endif
 
   if (V4L2_TYPE_IS_MULTIPLANAR (obj->type)) {
     group->buffer.m.planes = group->planes;
+#ifdef USE_V4L2_TARGET_NV
+    memcpy (group->planes, buffer.m.planes,
+        buffer.length * sizeof (planes[0]));
+#else
     memcpy (group->planes, buffer.m.planes, sizeof (planes));
+#endif
   } else {
     group->planes[0].bytesused = group->buffer.bytesused;
     group->planes[0].length = group->buffer.length;
@@ -1489,6 +2020,9 @@ gst_v4l2_allocator_dqbuf (GstV4l2Allocator * allocator,
     memcpy (&group->planes[0].m, &group->buffer.m, sizeof (group->buffer.m));
   }
 
+  if (G_UNLIKELY (gst_v4l2_tracer_active))
+    gst_v4l2_allocator_trace_group (allocator, group, GST_V4L2_TRACE_DQBUF);
+
   /* And update memory size */
   if (V4L2_TYPE_IS_OUTPUT (obj->type)) {
     gst_v4l2_allocator_reset_size (allocator, group);
@@ -1584,6 +2118,24 @@ error:
   return GST_FLOW_ERROR;
 }
 
+#ifdef USE_V4L2_TARGET_NV
+GstFlowReturn
+gst_v4l2_allocator_dqbuf (GstV4l2Allocator * allocator,
+    GstV4l2MemoryGroup ** group_out)
+{
+  return gst_v4l2_allocator_dqbuf_internal (allocator, group_out, TRUE);
+}
+
+/* Like gst_v4l2_allocator_dqbuf() but returns GST_V4L2_FLOW_NOT_READY
+ * instead of waiting when the driver has no buffer ready */
+GstFlowReturn
+gst_v4l2_allocator_try_dqbuf (GstV4l2Allocator * allocator,
+    GstV4l2MemoryGroup ** group_out)
+{
+  return gst_v4l2_allocator_dqbuf_internal (allocator, group_out, FALSE);
+}
+#endif
+
 void
 gst_v4l2_allocator_reset_group (GstV4l2Allocator * allocator,
     GstV4l2MemoryGroup * group)
@@ -1616,4 +2168,75 @@ gst_v4l2_allocator_enable_dynamic_allocation (GstV4l2Allocator * allocator,
   allocator->enable_dynamic_allocation = enable_dynamic_allocation;
   GST_OBJECT_UNLOCK (allocator);
 }
+
+/* Makes the next stop leave the buffers allocated in the driver, so that a
+ * restart after a resolution change can skip REQBUFS and the buffer setup
+ * when the new format fits. The buffers are freed on the next start
+ * otherwise. */
+void
+gst_v4l2_allocator_keep_buffers (GstV4l2Allocator * allocator)
+{
+  GST_OBJECT_LOCK (allocator);
+  allocator->keep_buffers = TRUE;
+  GST_OBJECT_UNLOCK (allocator);
+}
+
+/* Frees the buffers kept by the last stop with REQBUFS(0) now rather than
+ * on the next start or on dispose, and cancels a pending keep */
+void
+gst_v4l2_allocator_release_kept (GstV4l2Allocator * allocator)
+{
+  GST_OBJECT_LOCK (allocator);
+  allocator->keep_buffers = FALSE;
+  if (allocator->kept && !g_atomic_int_get (&allocator->active)) {
+    GST_DEBUG_OBJECT (allocator, "releasing %u kept buffers", allocator->count);
+    gst_v4l2_allocator_release_buffers (allocator);
+  }
+  GST_OBJECT_UNLOCK (allocator);
+}
+
+void
+gst_v4l2_allocator_get_stats (GstV4l2Allocator * allocator,
+    GstV4l2AllocatorStats * stats)
+{
+  stats->dequeued = GST_V4L2_STAT_GET (allocator->stats.dequeued);
+  stats->dqbuf_again = GST_V4L2_STAT_GET (allocator->stats.dqbuf_again);
+  stats->waits = GST_V4L2_STAT_GET (allocator->stats.waits);
+  stats->wait_us = GST_V4L2_STAT_GET (allocator->stats.wait_us);
+  stats->driver_us = GST_V4L2_STAT_GET (allocator->stats.driver_us);
+  stats->driver_max_us = GST_V4L2_STAT_GET (allocator->stats.driver_max_us);
+  stats->created = GST_V4L2_STAT_GET (allocator->stats.created);
+  stats->events = GST_V4L2_STAT_GET (allocator->stats.events);
+  stats->source_changes = GST_V4L2_STAT_GET (allocator->stats.source_changes);
+  stats->reused = GST_V4L2_STAT_GET (allocator->stats.reused);
+  stats->reqbufs_us = GST_V4L2_STAT_GET (allocator->stats.reqbufs_us);
+  stats->setup_us = GST_V4L2_STAT_GET (allocator->stats.setup_us);
+}
+
+/* Looks up the QBUF/DQBUF times of the buffer with @timestamp among the last
+ * buffer dequeued from each index. Called from another thread than the one
+ * dequeuing, a racing DQBUF may at worst give the times of the wrong buffer */
+gboolean
+gst_v4l2_allocator_find_stamp (GstV4l2Allocator * allocator,
+    GstClockTime timestamp, GstV4l2QueueStamp * stamp)
+{
+  guint i;
+
+  if (!GST_CLOCK_TIME_IS_VALID (timestamp))
+    return FALSE;
+
+  /* The driver only keeps microseconds */
+  timestamp = timestamp / GST_USECOND * GST_USECOND;
+
+  for (i = 0; i < MIN (allocator->count, NV_VIDEO_MAX_FRAME); i++) {
+    GstV4l2QueueStamp *cur = &allocator->stamps[i];
+
+    if (cur->dqbuf && cur->timestamp == timestamp) {
+      *stamp = *cur;
+      return TRUE;
+    }
+  }
+
+  return FALSE;
+}
 #endif
@@ -27,6 +27,9 @@
 #include "linux/videodev2.h"
 #include <gst/gst.h>
 #include <gst/gstatomicqueue.h>
+#ifdef USE_V4L2_TARGET_NV
+#include "gstv4l2pollset.h"
+#endif
 
 G_BEGIN_DECLS
 
@@ -54,12 +57,36 @@ G_BEGIN_DECLS
 
 #ifdef USE_V4L2_TARGET_NV
 #define NV_VIDEO_MAX_FRAME                        64
+#define GST_V4L2_CACHE_LINE                       64
+
+/* Returned by gst_v4l2_allocator_try_dqbuf() when no buffer is ready */
+#define GST_V4L2_FLOW_NOT_READY GST_FLOW_CUSTOM_SUCCESS_2
+
+/* Returned by DQBUF on a capture plane once the driver signalled a source
+ * change and has no more buffers of the previous format */
+#define GST_V4L2_FLOW_RESOLUTION_CHANGE (GST_FLOW_CUSTOM_SUCCESS_2 + 1)
+
+/* Statistics counters are updated with relaxed atomics so they are cheap
+ * enough to always be enabled, and can be read from any thread */
+#define GST_V4L2_STAT_ADD(counter, n) \
+    __atomic_fetch_add (&(counter), (n), __ATOMIC_RELAXED)
+#define GST_V4L2_STAT_GET(counter) \
+    __atomic_load_n (&(counter), __ATOMIC_RELAXED)
+#define GST_V4L2_STAT_MAX(counter, n) G_STMT_START { \
+    guint64 __val = (n); \
+    if (__val > GST_V4L2_STAT_GET (counter)) \
+      __atomic_store_n (&(counter), __val, __ATOMIC_RELAXED); \
+  } G_STMT_END
 #endif
 
 typedef struct _GstV4l2Allocator GstV4l2Allocator;
 typedef struct _GstV4l2AllocatorClass GstV4l2AllocatorClass;
 typedef struct _GstV4l2MemoryGroup GstV4l2MemoryGroup;
 typedef struct _GstV4l2Memory GstV4l2Memory;
+#ifdef USE_V4L2_TARGET_NV
+typedef struct _GstV4l2AllocatorStats GstV4l2AllocatorStats;
+typedef struct _GstV4l2QueueStamp GstV4l2QueueStamp;
+#endif
 typedef enum _GstV4l2Capabilities GstV4l2Capabilities;
 typedef enum _GstV4l2Return GstV4l2Return;
 typedef struct _GstV4l2Object GstV4l2Object;
@@ -97,8 +124,41 @@ struct _GstV4l2MemoryGroup
   gint mems_allocated;
   struct v4l2_buffer buffer;
   struct v4l2_plane planes[VIDEO_MAX_PLANES];
+#ifdef USE_V4L2_TARGET_NV
+  /* Planes exported and mapped by gst_v4l2_allocator_start(), wrapped by
+   * the first gst_v4l2_allocator_alloc_mmap() */
+  gboolean premapped;
+  gpointer data[VIDEO_MAX_PLANES];
+  gint dmafd[VIDEO_MAX_PLANES];
+#endif
 };
 
+#ifdef USE_V4L2_TARGET_NV
+struct _GstV4l2AllocatorStats
+{
+  guint64 dequeued;          /* buffers dequeued */
+  guint64 dqbuf_again;       /* DQBUF calls that found no buffer ready */
+  guint64 waits;             /* blocking waits on the device */
+  guint64 wait_us;           /* time spent waiting for the device */
+  guint64 driver_us;         /* sum of the QBUF to DQBUF times */
+  guint64 driver_max_us;     /* longest QBUF to DQBUF time */
+  guint64 created;           /* buffers created after start */
+  guint64 events;            /* V4L2 events dequeued while waiting */
+  guint64 source_changes;    /* of which source (resolution) changes */
+  guint64 reused;            /* starts that reused the kept buffers */
+  guint64 reqbufs_us;        /* REQBUFS of the last start */
+  guint64 setup_us;          /* buffer queries and mappings of the last start */
+};
+
+/* Monotonic QBUF and DQBUF times of the last buffer dequeued from an index */
+struct _GstV4l2QueueStamp
+{
+  GstClockTime timestamp;    /* buffer timestamp, microsecond resolution */
+  gint64 qbuf;
+  gint64 dqbuf;
+};
+#endif
+
 struct _GstV4l2Allocator
 {
   GstAllocator parent;
@@ -117,7 +177,29 @@ struct _GstV4l2Allocator
   GstAtomicQueue *pending_queue;
 
 #ifdef USE_V4L2_TARGET_NV
+  /* Storage of the groups, one cache line aligned slot per buffer index */
+  guint8 *group_arena;
+
   gboolean enable_dynamic_allocation; /* If dynamic_allocation should be set */
+
+  /* How DQBUF waits for a buffer, see gst_v4l2_allocator_wait_dqbuf() */
+  gboolean can_device_poll;
+  GstV4l2PollSet *poll_set;  /* owned by the pool */
+
+  /* Set when a source change event was dequeued, until the next start */
+  gint source_change;
+  gint64 source_change_time;
+  /* Then set once the driver returned the last buffer of the old format */
+  gint source_drained;
+
+  /* Buffers kept by the last stop, see gst_v4l2_allocator_keep_buffers() */
+  gboolean keep_buffers;
+  gboolean kept;
+  struct v4l2_format alloc_format;   /* format of the last REQBUFS */
+
+  GstV4l2AllocatorStats stats;
+  gint64 qbuf_time[NV_VIDEO_MAX_FRAME];  /* monotonic time of the last QBUF */
+  GstV4l2QueueStamp stamps[NV_VIDEO_MAX_FRAME];
 #endif
 };
 
@@ -168,12 +250,32 @@ gboolean             gst_v4l2_allocator_qbuf           (GstV4l2Allocator * alloc
 GstFlowReturn        gst_v4l2_allocator_dqbuf          (GstV4l2Allocator * allocator,
                                                         GstV4l2MemoryGroup ** group);
 
+#ifdef USE_V4L2_TARGET_NV
+GstFlowReturn        gst_v4l2_allocator_try_dqbuf      (GstV4l2Allocator * allocator,
+                                                        GstV4l2MemoryGroup ** group);
+#endif
+
 void                 gst_v4l2_allocator_reset_group    (GstV4l2Allocator * allocator,
                                                         GstV4l2MemoryGroup * group);
 #ifdef USE_V4L2_TARGET_NV
 void
 gst_v4l2_allocator_enable_dynamic_allocation (GstV4l2Allocator * allocator,
                                               gboolean enable_dynamic_allocation);
+
+void
+gst_v4l2_allocator_keep_buffers (GstV4l2Allocator * allocator);
+
+void
+gst_v4l2_allocator_release_kept (GstV4l2Allocator * allocator);
+
+void
+gst_v4l2_allocator_get_stats (GstV4l2Allocator * allocator,
+                              GstV4l2AllocatorStats * stats);
+
+gboolean
+gst_v4l2_allocator_find_stamp (GstV4l2Allocator * allocator,
+                               GstClockTime timestamp,
+                               GstV4l2QueueStamp * stamp);
 #endif
 
 G_END_DECLS
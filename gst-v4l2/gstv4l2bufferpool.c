@@ -44,11 +44,16 @@
 #include <gstv4l2bufferpool.h>
 
 #include "gstv4l2object.h"
+#include "gstv4l2tracer.h"
+#ifdef USE_V4L2_TARGET_NV
+#include "gstv4l2personality.h"
+#endif
 #include "nvbufsurftransform.h"
 #include "gst/gst-i18n-plugin.h"
 #include <gst/glib-compat-private.h>
 #ifdef USE_V4L2_TARGET_NV
 #include <stdlib.h>
+#include <sys/stat.h>
 #endif
 
 GST_DEBUG_CATEGORY_STATIC (v4l2bufferpool_debug);
@@ -75,14 +80,38 @@ static void gst_v4l2_buffer_pool_release_buffer (GstBufferPool * bpool,
     GstBuffer * buffer);
 #ifdef USE_V4L2_TARGET_NV
 #define VPx_FRAME_HEADER_SIZE   12
-static void
-report_metadata (GstV4l2Object * obj, guint32 buffer_index,
-    v4l2_ctrl_videodec_outputbuf_metadata * metadata);
-static void
-v4l2_video_dec_get_enable_frame_type_reporting (GstV4l2Object * obj,
-    guint32 buffer_index, v4l2_ctrl_videodec_outputbuf_metadata * dec_metadata);
 #endif
 
+/* A buffer index is queued in the driver while its bit is set in
+ * queued_mask, pool->buffers[index] is only meaningful then. The two planes
+ * queue and dequeue from different threads, so the mask is only updated
+ * atomically and the buffer is stored before its bit is set. */
+static inline gboolean
+gst_v4l2_buffer_pool_is_queued (GstV4l2BufferPool * pool, guint index)
+{
+  return (g_atomic_int_get (&pool->queued_mask[index / 32]) &
+      (1u << (index % 32))) != 0;
+}
+
+static inline void
+gst_v4l2_buffer_pool_mark_queued (GstV4l2BufferPool * pool, guint index)
+{
+  g_atomic_int_or (&pool->queued_mask[index / 32], 1u << (index % 32));
+}
+
+static inline void
+gst_v4l2_buffer_pool_mark_dequeued (GstV4l2BufferPool * pool, guint index)
+{
+  g_atomic_int_and (&pool->queued_mask[index / 32], ~(1u << (index % 32)));
+}
+
+/* Wakes up gst_v4l2_buffer_pool_poll() waiting for a queued buffer */
+static void
+gst_v4l2_buffer_pool_wake (GstV4l2BufferPool * pool)
+{
+  gst_v4l2_poll_set_wake (pool->poll_set);
+}
+
 static gboolean
 #ifdef USE_V4L2_TARGET_NV
 gst_v4l2_is_buffer_valid (GstBuffer * buffer, GstV4l2MemoryGroup ** out_group, gboolean is_encode)
@@ -144,8 +173,10 @@ gst_v4l2_buffer_pool_copy_buffer (GstV4l2BufferPool * pool, GstBuffer * dest,
   GST_LOG_OBJECT (pool, "copying buffer");
 
 #ifdef USE_V4L2_TARGET_NV
-  gboolean ret;
-  gint retn = 0;
+  GstFlowReturn ret;
+
+  GST_V4L2_STAT_ADD (pool->stats.copies, 1);
+  GST_V4L2_STAT_ADD (pool->stats.copied_bytes, gst_buffer_get_size (src));
 #endif
 
   if (finfo && (finfo->format != GST_VIDEO_FORMAT_UNKNOWN &&
@@ -188,128 +219,77 @@ gst_v4l2_buffer_pool_copy_buffer (GstV4l2BufferPool * pool, GstBuffer * dest,
   gst_buffer_copy_into (dest, src,
       GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
 #else
-  if (((!strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVDEC)) && (is_cuvid == FALSE)) ||
-     ((!strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVDEC_ALT)) && (is_cuvid == FALSE)) ||
-     ((!strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVDEC_MCCOY)) && (is_cuvid == TRUE)) ||
-     ((!strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVENC)
-       || !strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVENC_ALT)) && (!V4L2_TYPE_IS_OUTPUT (pool->obj->type))))
-  {
-    ret = gst_buffer_copy_into (dest, src,
-            GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
-    if (ret == FALSE)
-      GST_ERROR_OBJECT (src,"Copy Failed");
+  if (pool->obj->personality->copy) {
+    ret = pool->obj->personality->copy (pool->obj, dest, src);
+    if (ret != GST_FLOW_OK)
+      return ret;
   }
+#endif
 
-  if ((!strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVENC)
-       || !strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVENC_ALT)) && !V4L2_TYPE_IS_OUTPUT (pool->obj->type))
-  {
-    GstMapInfo outmap = { NULL, (GstMapFlags) 0, NULL, 0, 0, };
-    void *sBaseAddr = NULL;
-    GstV4l2Memory *outmemory = NULL;
-    outmemory = (GstV4l2Memory *)gst_buffer_peek_memory (src, 0);
-    NvBufSurface *nvbuf_surf = NULL;
-    gboolean already_mapped = 0;
-
-    retn = NvBufSurfaceFromFd(outmemory->dmafd, (void**)(&nvbuf_surf));
-    if (retn != 0) {
-      GST_ERROR_OBJECT (src,"NvBufSurfaceFromFd Failed for fd = %d", outmemory->dmafd);
-      return FALSE;
-    }
-
-    if (!nvbuf_surf->surfaceList[0].mappedAddr.addr[0])
-      retn = NvBufSurfaceMap(nvbuf_surf, 0, 0, NVBUF_MAP_READ_WRITE);
-    else
-      //Dont do unmapping
-      already_mapped = TRUE;
-    if (retn != 0) {
-      GST_ERROR_OBJECT (src,"NvBufSurfaceMap Failed for fd = %d", outmemory->dmafd);
-      return FALSE;
-    }
-    sBaseAddr = (void*)nvbuf_surf->surfaceList[0].mappedAddr.addr[0];
-    if (!gst_buffer_map (dest, &outmap, GST_MAP_WRITE))
-      goto invalid_buffer;
-
-    memcpy (outmap.data, sBaseAddr, gst_buffer_get_size (src));
-    //Unmap only if we have mapped it
-    if (already_mapped == FALSE)
-      retn = NvBufSurfaceUnMap(nvbuf_surf, 0, 0);
-    if (retn != 0) {
-      GST_ERROR_OBJECT (src,"NvBufSurfaceUnMap Failed for fd = %d", outmemory->dmafd);
-      gst_buffer_unmap (dest, &outmap);
-      return FALSE;
-    }
+  GST_CAT_LOG_OBJECT (CAT_PERFORMANCE, pool, "slow copy into buffer %p", dest);
 
-    gst_buffer_unmap (dest, &outmap);
-  }
+  return GST_FLOW_OK;
 
-  if ((!strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVENC)
-       || !strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVENC_ALT))
-      && V4L2_TYPE_IS_OUTPUT (pool->obj->type))
+invalid_buffer:
   {
-    GstV4l2Memory *inmemory = NULL;
-    GstMapInfo inmap = { NULL, (GstMapFlags) 0, NULL, 0, 0, };
-    if (is_cuvid == FALSE) {
-#ifndef USE_V4L2_TARGET_NV_X86
-      NvBufSurfTransformParams transform_params;
-
-      memset(&transform_params, 0, sizeof(NvBufSurfTransformParams));
-
-      if (!gst_buffer_map (src, &inmap, GST_MAP_READ))
-        goto invalid_buffer;
-
-      NvBufSurface *src_buf = (NvBufSurface *)inmap.data;
-
-      inmemory = (GstV4l2Memory *)gst_buffer_peek_memory (dest, 0);
+    GST_ERROR_OBJECT (pool, "could not map buffer");
+    return GST_FLOW_ERROR;
+  }
+}
 
-      NvBufSurface *nvbuf_surf = 0;
-      NvBufSurfaceFromFd(inmemory->dmafd, (void**)(&nvbuf_surf));
-      retn = NvBufSurfTransform (src_buf, nvbuf_surf, &transform_params);
-      if (retn != 0) {
-        GST_ERROR_OBJECT(src, "NvBufSurfTransform Failed");
-        gst_buffer_unmap(src, &inmap);
-        return GST_FLOW_ERROR;
-      }
+#ifdef USE_V4L2_TARGET_NV
+/* Lower bound on the capture buffers left in the driver before the encoded
+ * frames go back to being copied, so that a downstream holding on to them
+ * cannot starve the encoder */
+#define GST_V4L2_EXPORT_MIN_QUEUED 2
+
+/* Replaces the memory of @dest with the mapped bitstream of the encoder
+ * capture buffer @src. @src must have been acquired from the pool, the
+ * wrapped memory owns it and requeues it when downstream drops the last
+ * reference. Takes ownership of @src. */
+static GstFlowReturn
+gst_v4l2_buffer_pool_export_buffer (GstV4l2BufferPool * pool, GstBuffer * dest,
+    GstBuffer * src)
+{
+  GstV4l2Memory *mem = (GstV4l2Memory *) gst_buffer_peek_memory (src, 0);
+  NvBufSurface *nvbuf_surf = NULL;
+  GstMemory *wrapped;
+  gsize size = gst_buffer_get_size (src);
 
-      gst_buffer_unmap(src, &inmap);
-#endif
-    }
-    if (is_cuvid == TRUE){
-      NvBufSurface *src_bufsurf = NULL;
-      NvBufSurface *dst_bufsurf = NULL;
+  GST_LOG_OBJECT (pool, "exporting buffer %p", src);
 
-      if (!gst_buffer_map (src, &inmap, GST_MAP_READ))
-            goto invalid_buffer;
-      src_bufsurf = (NvBufSurface*)inmap.data;
+  if (NvBufSurfaceFromFd (mem->dmafd, (void **) (&nvbuf_surf)) != 0) {
+    GST_ERROR_OBJECT (pool, "NvBufSurfaceFromFd Failed for fd = %d",
+        mem->dmafd);
+    goto failed;
+  }
 
-      inmemory = (GstV4l2Memory *)gst_buffer_peek_memory (dest, 0);
+  /* The mapping is kept for the lifetime of the surface, following exports
+   * and copies of this buffer reuse it */
+  if (!nvbuf_surf->surfaceList[0].mappedAddr.addr[0] &&
+      NvBufSurfaceMap (nvbuf_surf, 0, 0, NVBUF_MAP_READ_WRITE) != 0) {
+    GST_ERROR_OBJECT (pool, "NvBufSurfaceMap Failed for fd = %d", mem->dmafd);
+    goto failed;
+  }
 
-      retn = NvBufSurfaceFromFd(inmemory->dmafd, (void**)(&dst_bufsurf));
-      if (retn != 0) {
-        GST_ERROR_OBJECT(src, "NvBufSurfaceFromFd Failed");
-        gst_buffer_unmap(src, &inmap);
-        return GST_FLOW_ERROR;
-      }
+  wrapped = gst_memory_new_wrapped (GST_MEMORY_FLAG_READONLY,
+      nvbuf_surf->surfaceList[0].mappedAddr.addr[0], size, 0, size, src,
+      (GDestroyNotify) gst_buffer_unref);
 
-      if (NvBufSurfaceCopy(src_bufsurf, dst_bufsurf) != 0)
-      {
-          g_print("ERROR in BufSurfacecopy \n");
-          return GST_FLOW_ERROR;
-      }
-      gst_buffer_unmap(src, &inmap);
-    }
-  }
-#endif
+  gst_buffer_copy_into (dest, src,
+      GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1);
+  gst_buffer_replace_all_memory (dest, wrapped);
 
-  GST_CAT_LOG_OBJECT (CAT_PERFORMANCE, pool, "slow copy into buffer %p", dest);
+  GST_V4L2_STAT_ADD (pool->stats.exports, 1);
+  GST_V4L2_STAT_ADD (pool->stats.exported_bytes, size);
 
   return GST_FLOW_OK;
 
-invalid_buffer:
-  {
-    GST_ERROR_OBJECT (pool, "could not map buffer");
-    return GST_FLOW_ERROR;
-  }
+failed:
+  gst_buffer_unref (src);
+  return GST_FLOW_ERROR;
 }
+#endif
 
 struct UserPtrData
 {
@@ -317,6 +297,12 @@ struct UserPtrData
   gboolean is_frame;
   GstVideoFrame frame;
   GstMapInfo map;
+#ifdef USE_V4L2_TARGET_NV
+  gboolean in_slab;          /* an entry of the pool's userptr_slab */
+  gboolean gathered;         /* data is in staging, nothing to unmap */
+  guint8 *staging;
+  gsize staging_size;
+#endif
 };
 
 static GQuark
@@ -335,12 +321,24 @@ _unmap_userptr_frame (struct UserPtrData *data)
 {
   if (data->is_frame)
     gst_video_frame_unmap (&data->frame);
+#ifndef USE_V4L2_TARGET_NV
   else
     gst_buffer_unmap (data->buffer, &data->map);
+#else
+  else if (!data->gathered)
+    gst_buffer_unmap (data->buffer, &data->map);
+#endif
 
   if (data->buffer)
     gst_buffer_unref (data->buffer);
 
+#ifdef USE_V4L2_TARGET_NV
+  if (data->in_slab) {
+    data->buffer = NULL;
+    return;
+  }
+#endif
+
   g_slice_free (struct UserPtrData, data);
 }
 
@@ -370,7 +368,23 @@ gst_v4l2_buffer_pool_import_userptr (GstV4l2BufferPool * pool,
   else
     flags = GST_MAP_WRITE;
 
+#ifndef USE_V4L2_TARGET_NV
   data = g_slice_new0 (struct UserPtrData);
+#else
+  /* A buffer index has a single import at a time, whose entry is reused
+   * every frame. The qdata of the previous import goes first, its destroy
+   * notify releases the same entry. */
+  gst_mini_object_set_qdata (GST_MINI_OBJECT (dest), GST_V4L2_IMPORT_QUARK,
+      NULL, NULL);
+
+  if (!pool->userptr_slab)
+    pool->userptr_slab = g_new0 (struct UserPtrData, NV_VIDEO_MAX_FRAME);
+
+  data = &pool->userptr_slab[group->buffer.index];
+  data->in_slab = TRUE;
+  data->gathered = FALSE;
+  data->buffer = NULL;
+#endif
 
   if (finfo && (finfo->format != GST_VIDEO_FORMAT_UNKNOWN &&
           finfo->format != GST_VIDEO_FORMAT_ENCODED)) {
@@ -433,6 +447,26 @@ gst_v4l2_buffer_pool_import_userptr (GstV4l2BufferPool * pool,
 
     data->is_frame = FALSE;
 
+#ifdef USE_V4L2_TARGET_NV
+    /* Mapping an access unit spread over several memories merges them into
+     * a new allocation every frame, gather it into storage the entry keeps
+     * instead */
+    if (V4L2_TYPE_IS_OUTPUT (pool->obj->type) && gst_buffer_n_memory (src) > 1) {
+      gsize total = gst_buffer_get_size (src);
+
+      if (data->staging_size < total) {
+        g_free (data->staging);
+        data->staging = g_malloc (total);
+        data->staging_size = total;
+      }
+
+      gst_buffer_extract (src, 0, data->staging, total);
+      data->gathered = TRUE;
+      data->map.data = data->staging;
+      data->map.size = total;
+      GST_V4L2_STAT_ADD (pool->stats.gathers, 1);
+    } else
+#endif
     if (!gst_buffer_map (src, &data->map, flags))
       goto invalid_buffer;
 
@@ -462,7 +496,9 @@ not_our_buffer:
 invalid_buffer:
   {
     GST_ERROR_OBJECT (pool, "could not map buffer");
+#ifndef USE_V4L2_TARGET_NV
     g_slice_free (struct UserPtrData, data);
+#endif
     return GST_FLOW_ERROR;
   }
 non_contiguous_mem:
@@ -515,8 +551,7 @@ gst_v4l2_buffer_pool_import_dmabuf (GstV4l2BufferPool * pool,
 #else
   g_return_val_if_fail (pool->vallocator->memory == V4L2_MEMORY_DMABUF, FALSE);
 
-  if ((!strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVENC)
-       || !strcmp (pool->obj->videodev, V4L2_DEVICE_PATH_NVENC_ALT))
+  if (pool->obj->personality->is_encoder
       && V4L2_TYPE_IS_OUTPUT (pool->obj->type))
   {
     gint dmafd = -1;
@@ -531,7 +566,7 @@ gst_v4l2_buffer_pool_import_dmabuf (GstV4l2BufferPool * pool,
     }
 
     NvBufSurface *src_bufsurf = (NvBufSurface*)inmap.data;
-    if ((is_cuvid == FALSE) && ((src_bufsurf->memType == NVBUF_MEM_CUDA_PINNED) ||
+    if (!pool->obj->personality->is_cuvid && ((src_bufsurf->memType == NVBUF_MEM_CUDA_PINNED) ||
          (src_bufsurf->memType == NVBUF_MEM_CUDA_DEVICE) ||
          (src_bufsurf->memType == NVBUF_MEM_CUDA_UNIFIED)))
     {
@@ -615,6 +650,208 @@ import_failed:
 #endif
 }
 
+#ifdef USE_V4L2_TARGET_NV
+static GQuark
+gst_v4l2_buffer_pool_dmabuf_id_quark (void)
+{
+  static GQuark quark = 0;
+
+  if (quark == 0)
+    quark = g_quark_from_static_string ("GstV4l2BufferPoolDmabufId");
+
+  return quark;
+}
+
+/* Reads the identity of the dmabuf behind an NvBufSurface input buffer. It
+ * is kept on the memory, which upstream recycles along with its surface, so
+ * that only the first frame of each pays for the map and the fstat(). */
+static gboolean
+gst_v4l2_buffer_pool_get_dmabuf_id (GstBuffer * src, GstV4l2ImportId * id)
+{
+  GstMemory *mem;
+  GstV4l2ImportId *cached;
+  GstMapInfo map;
+  struct stat st;
+  gint fd;
+
+  if (gst_buffer_n_memory (src) < 1)
+    return FALSE;
+
+  mem = gst_buffer_peek_memory (src, 0);
+  cached = gst_mini_object_get_qdata (GST_MINI_OBJECT (mem),
+      gst_v4l2_buffer_pool_dmabuf_id_quark ());
+  if (cached) {
+    *id = *cached;
+    return TRUE;
+  }
+
+  if (!gst_buffer_map (src, &map, GST_MAP_READ))
+    return FALSE;
+
+  fd = ((NvBufSurface *) map.data)->surfaceList->bufferDesc;
+  gst_buffer_unmap (src, &map);
+
+  if (fd < 0 || fstat (fd, &st) < 0)
+    return FALSE;
+
+  id->dev = st.st_dev;
+  id->ino = st.st_ino;
+
+  cached = g_new (GstV4l2ImportId, 1);
+  *cached = *id;
+  gst_mini_object_set_qdata (GST_MINI_OBJECT (mem),
+      gst_v4l2_buffer_pool_dmabuf_id_quark (), cached, g_free);
+
+  return TRUE;
+}
+
+/* Generation of an upstream pool, set on it the first time one of its
+ * buffers is imported. Unlike its address it can't match a pool allocated
+ * where a freed one was. 0 for input buffers without a pool. */
+static guint
+gst_v4l2_buffer_pool_import_generation (GstBufferPool * upstream)
+{
+  static gint last_generation = 0;
+  static GQuark quark = 0;
+  guint generation;
+
+  if (upstream == NULL)
+    return 0;
+
+  if (quark == 0)
+    quark = g_quark_from_static_string ("GstV4l2BufferPoolGeneration");
+
+  generation = GPOINTER_TO_UINT (g_object_get_qdata (G_OBJECT (upstream),
+          quark));
+  if (generation == 0) {
+    generation = g_atomic_int_add (&last_generation, 1) + 1;
+    g_object_set_qdata (G_OBJECT (upstream), quark,
+        GUINT_TO_POINTER (generation));
+  }
+
+  return generation;
+}
+
+/* Identifies the user memory of a single memory input buffer by the range
+ * it maps to, which is what USERPTR queues. vb2 pins the user memory of a
+ * buffer index and only pins again when the address or length queued to it
+ * changes. A GstMemory would not do: sub-memories of one parent share none
+ * of their ranges, and a freed memory can be allocated again at another
+ * address. An access unit over several memories is gathered into storage
+ * of the index instead, see gst_v4l2_buffer_pool_import_userptr(). */
+static gboolean
+gst_v4l2_buffer_pool_get_userptr_id (GstBuffer * src, GstV4l2ImportId * id)
+{
+  GstMemory *mem;
+  GstMapInfo map;
+
+  if (gst_buffer_n_memory (src) != 1)
+    return FALSE;
+
+  mem = gst_buffer_peek_memory (src, 0);
+  if (!gst_memory_map (mem, &map, GST_MAP_READ))
+    return FALSE;
+
+  id->data = (guintptr) map.data;
+  id->size = map.size;
+  gst_memory_unmap (mem, &map);
+
+  return id->data != 0;
+}
+
+/* Acquires a free buffer to import @src into, preferably the one @src was
+ * imported into last time. The driver then finds the same dmabuf or user
+ * memory in that index and can skip attaching, pinning or mapping it again.
+ * The free buffers are taken out of the pool until that one shows up, and
+ * put back after. */
+static GstFlowReturn
+gst_v4l2_buffer_pool_acquire_import (GstV4l2BufferPool * pool,
+    GstBuffer * src, GstBuffer ** buffer)
+{
+  GstBufferPool *bpool = GST_BUFFER_POOL (pool);
+  GstBufferPoolAcquireParams params = { 0 };
+  GstBuffer *stash[NV_VIDEO_MAX_FRAME];
+  GstV4l2MemoryGroup *group = NULL;
+  GstV4l2ImportId id = { 0, };
+  GstFlowReturn ret = GST_FLOW_OK;
+  gboolean known;
+  guint generation;
+  gint want = -1, n = 0, n_free, i;
+
+  params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+  *buffer = NULL;
+
+  /* A new upstream pool comes with new dmabufs and memories */
+  generation = gst_v4l2_buffer_pool_import_generation (src->pool);
+  if (generation != pool->import_generation) {
+    memset (pool->import_ids, 0, sizeof (pool->import_ids));
+    pool->import_generation = generation;
+  }
+
+  if (pool->obj->mode == GST_V4L2_IO_DMABUF_IMPORT)
+    known = gst_v4l2_buffer_pool_get_dmabuf_id (src, &id);
+  else
+    known = gst_v4l2_buffer_pool_get_userptr_id (src, &id);
+
+  if (known) {
+    for (i = 0; i < NV_VIDEO_MAX_FRAME; i++) {
+      if (pool->import_ids[i].ino == id.ino &&
+          pool->import_ids[i].dev == id.dev &&
+          pool->import_ids[i].data == id.data &&
+          pool->import_ids[i].size == id.size) {
+        want = i;
+        break;
+      }
+    }
+  }
+
+  /* Stop before the free buffers run out, the pool would try to allocate */
+  n_free = (gint) pool->num_allocated - g_atomic_int_get (&pool->num_queued);
+  if (want < 0 || gst_v4l2_buffer_pool_is_queued (pool, want) || n_free < 1)
+    n_free = 1;
+
+  while (n < n_free) {
+    GstBuffer *buf;
+
+    ret = gst_buffer_pool_acquire_buffer (bpool, &buf, &params);
+    if (ret != GST_FLOW_OK)
+      break;
+
+    if (gst_v4l2_is_buffer_valid (buf, &group, pool->obj->is_encode) &&
+        (gint) group->buffer.index == want) {
+      *buffer = buf;
+      break;
+    }
+
+    stash[n++] = buf;
+  }
+
+  if (*buffer) {
+    GST_V4L2_STAT_ADD (pool->stats.import_hits, 1);
+  } else if (n) {
+    if (want >= 0)
+      GST_V4L2_STAT_ADD (pool->stats.import_misses, 1);
+    *buffer = stash[--n];
+    ret = GST_FLOW_OK;
+  }
+
+  for (i = 0; i < n; i++)
+    gst_buffer_unref (stash[i]);
+
+  if (*buffer == NULL)
+    return ret;
+
+  if (gst_v4l2_is_buffer_valid (*buffer, &group, pool->obj->is_encode) &&
+      known) {
+    if (want >= 0 && want != (gint) group->buffer.index)
+      memset (&pool->import_ids[want], 0, sizeof (GstV4l2ImportId));
+    pool->import_ids[group->buffer.index] = id;
+  }
+
+  return GST_FLOW_OK;
+}
+#endif
+
 static GstFlowReturn
 gst_v4l2_buffer_pool_prepare_buffer (GstV4l2BufferPool * pool,
     GstBuffer * dest, GstBuffer * src)
@@ -887,14 +1124,104 @@ gst_v4l2_buffer_pool_resurect_buffer (GstV4l2BufferPool * pool)
   ret =
       gst_buffer_pool_acquire_buffer (GST_BUFFER_POOL (pool), &buffer, &params);
 
-  if (ret == GST_FLOW_OK)
+  if (ret == GST_FLOW_OK) {
     gst_buffer_unref (buffer);
+#ifdef USE_V4L2_TARGET_NV
+    GST_V4L2_STAT_ADD (pool->stats.resurrected, 1);
+#endif
+  }
 
   g_signal_handler_unblock (pool->vallocator, pool->group_released_handler);
 
   return ret;
 }
 
+#ifdef USE_V4L2_TARGET_NV
+/* Adaptive capture buffer count: the pool grows when the driver queue runs
+ * low, and holds one buffer back from the driver per window in which it
+ * never did. A window spans several downstream hold times so that a slow
+ * consumer does not make the pool shrink between two of its frames. */
+#define GST_V4L2_ADAPTIVE_LOW 2
+#define GST_V4L2_ADAPTIVE_SPARE 2
+#define GST_V4L2_ADAPTIVE_WINDOW_US (2 * G_USEC_PER_SEC)
+
+static void
+gst_v4l2_buffer_pool_adaptive_reset (GstV4l2BufferPool * pool, gint64 now)
+{
+  pool->window_start = now;
+  pool->window_min = G_MAXUINT;
+}
+
+/* Called on a capture plane running low, puts back a held back buffer or
+ * creates one */
+static void
+gst_v4l2_buffer_pool_adaptive_grow (GstV4l2BufferPool * pool)
+{
+  guint count = pool->vallocator->count;
+
+  GST_V4L2_STAT_ADD (pool->stats.dry, 1);
+
+  /* Start a new window first, the buffer must not be held back again on its
+   * way to the driver */
+  GST_OBJECT_LOCK (pool);
+  gst_v4l2_buffer_pool_adaptive_reset (pool, g_get_monotonic_time ());
+  GST_OBJECT_UNLOCK (pool);
+
+  if (gst_v4l2_buffer_pool_resurect_buffer (pool) != GST_FLOW_OK)
+    return;
+
+  GST_OBJECT_LOCK (pool);
+  if (pool->vallocator->count == count && pool->parked > 0)
+    pool->parked--;
+  GST_OBJECT_UNLOCK (pool);
+
+  GST_DEBUG_OBJECT (pool, "queue ran low, %u buffers, %u held back",
+      pool->vallocator->count, pool->parked);
+}
+
+/* Called with capture buffer @index coming back from downstream, returns
+ * FALSE when it should be held back instead of queued */
+static gboolean
+gst_v4l2_buffer_pool_adaptive_release (GstV4l2BufferPool * pool, guint index)
+{
+  gint64 now = g_get_monotonic_time ();
+  guint queued = g_atomic_int_get (&pool->num_queued);
+  gboolean requeue = TRUE;
+
+  GST_OBJECT_LOCK (pool);
+  /* Created or held back buffers were never handed out */
+  if (pool->dequeued_at[index]) {
+    gint64 hold = now - pool->dequeued_at[index];
+
+    GST_V4L2_STAT_MAX (pool->stats.hold_max_us, hold);
+    pool->hold_avg_us += (hold - pool->hold_avg_us) / 8;
+    pool->dequeued_at[index] = 0;
+  }
+  pool->window_min = MIN (pool->window_min, queued);
+
+  if (now - pool->window_start >= MAX (GST_V4L2_ADAPTIVE_WINDOW_US,
+          4 * pool->hold_avg_us)) {
+    if (pool->window_min >= GST_V4L2_ADAPTIVE_LOW + GST_V4L2_ADAPTIVE_SPARE
+        && pool->vallocator->count - pool->parked > pool->min_latency) {
+      pool->parked++;
+      requeue = FALSE;
+    }
+    gst_v4l2_buffer_pool_adaptive_reset (pool, now);
+  }
+  GST_OBJECT_UNLOCK (pool);
+
+  if (!requeue) {
+    GST_V4L2_STAT_ADD (pool->stats.parked, 1);
+    GST_DEBUG_OBJECT (pool, "queue stayed above %u, holding back buffer %u "
+        "(%u held back, downstream holds %" G_GINT64_FORMAT " us)",
+        GST_V4L2_ADAPTIVE_LOW + GST_V4L2_ADAPTIVE_SPARE, index, pool->parked,
+        pool->hold_avg_us);
+  }
+
+  return requeue;
+}
+#endif
+
 static gboolean
 gst_v4l2_buffer_pool_streamon (GstV4l2BufferPool * pool)
 {
@@ -927,6 +1254,15 @@ gst_v4l2_buffer_pool_streamon (GstV4l2BufferPool * pool)
          * them back. */
         for (i = 0; i < n; i++)
           gst_v4l2_buffer_pool_resurect_buffer (pool);
+
+#ifdef USE_V4L2_TARGET_NV
+        /* Buffers created on top of the initial ones stay out for now */
+        GST_OBJECT_LOCK (pool);
+        pool->parked = pool->vallocator->count > pool->num_allocated ?
+            pool->vallocator->count - pool->num_allocated : 0;
+        gst_v4l2_buffer_pool_adaptive_reset (pool, g_get_monotonic_time ());
+        GST_OBJECT_UNLOCK (pool);
+#endif
       }
 
       if (obj->ioctl (pool->video_fd, VIDIOC_STREAMON, &obj->type) < 0)
@@ -994,9 +1330,10 @@ gst_v4l2_buffer_pool_streamoff (GstV4l2BufferPool * pool)
 #else
   for (i = 0; i < VIDEO_MAX_FRAME; i++) {
 #endif
-    if (pool->buffers[i]) {
+    if (gst_v4l2_buffer_pool_is_queued (pool, i)) {
       buffers[i] = pool->buffers[i];
       pool->buffers[i] = NULL;
+      gst_v4l2_buffer_pool_mark_dequeued (pool, i);
       g_atomic_int_add (&pool->num_queued, -1);
     }
   }
@@ -1004,6 +1341,14 @@ gst_v4l2_buffer_pool_streamoff (GstV4l2BufferPool * pool)
   GST_OBJECT_UNLOCK (pool);
 
 #ifdef USE_V4L2_TARGET_NV
+  {
+    GstBuffer *ready;
+
+    /* Dequeued ahead of time, never handed out */
+    while ((ready = gst_atomic_queue_pop (pool->ready_queue)))
+      pclass->release_buffer (GST_BUFFER_POOL (pool), ready);
+  }
+
   for (i = 0; i < NV_VIDEO_MAX_FRAME; i++) {
 #else
   for (i = 0; i < VIDEO_MAX_FRAME; i++) {
@@ -1031,9 +1376,17 @@ gst_v4l2_buffer_pool_start (GstBufferPool * bpool)
   guint size, min_buffers, max_buffers;
   guint max_latency, min_latency, copy_threshold = 0;
   gboolean can_allocate = FALSE, ret = TRUE;
+#ifdef USE_V4L2_TARGET_NV
+  gint64 start_time = g_get_monotonic_time (), step_time;
+#endif
 
   GST_DEBUG_OBJECT (pool, "activating pool");
 
+#ifdef USE_V4L2_TARGET_NV
+  /* The format is set by now, and nothing has been queued yet */
+  gst_v4l2_probe_direct_ioctl (obj);
+#endif
+
   config = gst_buffer_pool_get_config (bpool);
   if (!gst_buffer_pool_config_get_params (config, &caps, &size, &min_buffers,
           &max_buffers))
@@ -1147,6 +1500,10 @@ gst_v4l2_buffer_pool_start (GstBufferPool * bpool)
   pool->max_latency = max_latency;
   pool->min_latency = min_latency;
   pool->num_queued = 0;
+#ifdef USE_V4L2_TARGET_NV
+  memset (pool->import_ids, 0, sizeof (pool->import_ids));
+  pool->import_generation = 0;
+#endif
 
   if (max_buffers != 0 && max_buffers < min_buffers)
     max_buffers = min_buffers;
@@ -1160,10 +1517,19 @@ gst_v4l2_buffer_pool_start (GstBufferPool * bpool)
     if (!gst_buffer_pool_set_active (pool->other_pool, TRUE))
       goto other_pool_failed;
 
+#ifdef USE_V4L2_TARGET_NV
+  step_time = g_get_monotonic_time ();
+#endif
+
   /* now, allocate the buffers: */
   if (!pclass->start (bpool))
     goto start_failed;
 
+#ifdef USE_V4L2_TARGET_NV
+  pool->stats.alloc_us = g_get_monotonic_time () - step_time;
+  step_time = g_get_monotonic_time ();
+#endif
+
   if (!V4L2_TYPE_IS_OUTPUT (obj->type)) {
     pool->group_released_handler =
         g_signal_connect_swapped (pool->vallocator, "group-released",
@@ -1171,6 +1537,17 @@ gst_v4l2_buffer_pool_start (GstBufferPool * bpool)
     ret = gst_v4l2_buffer_pool_streamon (pool);
   }
 
+#ifdef USE_V4L2_TARGET_NV
+  pool->stats.streamon_us = g_get_monotonic_time () - step_time;
+  pool->stats.start_us = g_get_monotonic_time () - start_time;
+  GST_DEBUG_OBJECT (pool, "activated in %" G_GUINT64_FORMAT " us: REQBUFS %"
+      G_GUINT64_FORMAT " us, buffer setup %" G_GUINT64_FORMAT " us, "
+      "allocation %" G_GUINT64_FORMAT " us, STREAMON %" G_GUINT64_FORMAT
+      " us", pool->stats.start_us, pool->vallocator->stats.reqbufs_us,
+      pool->vallocator->stats.setup_us, pool->stats.alloc_us,
+      pool->stats.streamon_us);
+#endif
+
   return ret;
 
   /* ERRORS */
@@ -1260,14 +1637,8 @@ gst_v4l2_buffer_pool_flush_start (GstBufferPool * bpool)
 
   GST_DEBUG_OBJECT (pool, "start flushing");
 
-#ifndef USE_V4L2_TARGET_NV
-  gst_poll_set_flushing (pool->poll, TRUE);
-#endif
-
-  GST_OBJECT_LOCK (pool);
-  pool->empty = FALSE;
-  g_cond_broadcast (&pool->empty_cond);
-  GST_OBJECT_UNLOCK (pool);
+  g_atomic_int_set (&pool->flushing, TRUE);
+  gst_v4l2_poll_set_set_flushing (pool->poll_set, TRUE);
 
   if (pool->other_pool)
     gst_buffer_pool_set_flushing (pool->other_pool, TRUE);
@@ -1283,23 +1654,43 @@ gst_v4l2_buffer_pool_flush_stop (GstBufferPool * bpool)
   if (pool->other_pool)
     gst_buffer_pool_set_flushing (pool->other_pool, FALSE);
 
-#ifndef USE_V4L2_TARGET_NV
-  gst_poll_set_flushing (pool->poll, FALSE);
-#endif
+  g_atomic_int_set (&pool->flushing, FALSE);
+  gst_v4l2_poll_set_set_flushing (pool->poll_set, FALSE);
 }
 
 static GstFlowReturn
 gst_v4l2_buffer_pool_poll (GstV4l2BufferPool * pool)
 {
-  gint ret;
+  guint res;
+
+  GST_V4L2_TRACE (pool->obj, GST_V4L2_TRACE_POLL_START, -1, -1, 0,
+      GST_CLOCK_TIME_NONE);
 
   /* In RW mode there is no queue, hence no need to wait while the queue is
    * empty */
   if (pool->obj->mode != GST_V4L2_IO_RW) {
-    GST_OBJECT_LOCK (pool);
-    while (pool->empty)
-      g_cond_wait (&pool->empty_cond, GST_OBJECT_GET_LOCK (pool));
-    GST_OBJECT_UNLOCK (pool);
+#ifdef USE_V4L2_TARGET_NV
+    gint64 wait_start = g_get_monotonic_time ();
+#endif
+
+    while (g_atomic_int_get (&pool->num_queued) == 0) {
+      /* Blocks until qbuf or flush_start wake us up, a stale wakeup only
+       * costs one more loop */
+      res = gst_v4l2_poll_set_wait_wake (pool->poll_set);
+
+      if (res & GST_V4L2_POLL_FLUSHING)
+        break;
+      if (res & GST_V4L2_POLL_ERROR) {
+        GST_WARNING_OBJECT (pool, "failed waiting for queued buffers: %s",
+            g_strerror (errno));
+        break;
+      }
+    }
+
+#ifdef USE_V4L2_TARGET_NV
+    GST_V4L2_STAT_ADD (pool->stats.queue_wait_us,
+        g_get_monotonic_time () - wait_start);
+#endif
   }
 
   if (!pool->can_poll_device)
@@ -1307,30 +1698,19 @@ gst_v4l2_buffer_pool_poll (GstV4l2BufferPool * pool)
 
   GST_LOG_OBJECT (pool, "polling device");
 
-again:
-  ret = gst_poll_wait (pool->poll, GST_CLOCK_TIME_NONE);
-  if (G_UNLIKELY (ret < 0)) {
-    switch (errno) {
-      case EBUSY:
-        goto stopped;
-      case EAGAIN:
-      case EINTR:
-        goto again;
-      case ENXIO:
-        GST_WARNING_OBJECT (pool,
-            "v4l2 device doesn't support polling. Disabling"
-            " using libv4l2 in this case may cause deadlocks");
-        pool->can_poll_device = FALSE;
-        goto done;
-      default:
-        goto select_error;
-    }
-  }
-
-  if (gst_poll_fd_has_error (pool->poll, &pool->pollfd))
-    goto select_error;
+  /* Same set as the wait above: flushing ends this wait too, and a stale
+   * queue wakeup only loops */
+  do {
+    res = gst_v4l2_poll_set_wait (pool->poll_set, -1);
+    if (res & GST_V4L2_POLL_FLUSHING)
+      goto stopped;
+    if (res & GST_V4L2_POLL_ERROR)
+      goto select_error;
+  } while (!(res & (GST_V4L2_POLL_DEVICE | GST_V4L2_POLL_EVENT)));
 
 done:
+  GST_V4L2_TRACE (pool->obj, GST_V4L2_TRACE_POLL_END, -1, -1, 0,
+      GST_CLOCK_TIME_NONE);
   return GST_FLOW_OK;
 
   /* ERRORS */
@@ -1342,7 +1722,7 @@ stopped:
 select_error:
   {
     GST_ELEMENT_ERROR (pool->obj->element, RESOURCE, READ, (NULL),
-        ("poll error %d: %s (%d)", ret, g_strerror (errno), errno));
+        ("poll error: %s (%d)", g_strerror (errno), errno));
     return GST_FLOW_ERROR;
   }
 }
@@ -1354,6 +1734,7 @@ gst_v4l2_buffer_pool_qbuf (GstV4l2BufferPool * pool, GstBuffer * buf)
   const GstV4l2Object *obj = pool->obj;
   GstClockTime timestamp;
   gint index;
+  gboolean was_empty;
 
 #ifdef USE_V4L2_TARGET_NV
   if (!gst_v4l2_is_buffer_valid (buf, &group, pool->obj->is_encode)) {
@@ -1369,7 +1750,7 @@ gst_v4l2_buffer_pool_qbuf (GstV4l2BufferPool * pool, GstBuffer * buf)
 
   index = group->buffer.index;
 
-  if (pool->buffers[index] != NULL)
+  if (gst_v4l2_buffer_pool_is_queued (pool, index))
     goto already_queued;
 
   GST_LOG_OBJECT (pool, "queuing buffer %i", index);
@@ -1401,16 +1782,20 @@ gst_v4l2_buffer_pool_qbuf (GstV4l2BufferPool * pool, GstBuffer * buf)
     GST_TIME_TO_TIMEVAL (timestamp, group->buffer.timestamp);
   }
 
-  GST_OBJECT_LOCK (pool);
-  g_atomic_int_inc (&pool->num_queued);
   pool->buffers[index] = buf;
+  gst_v4l2_buffer_pool_mark_queued (pool, index);
+  was_empty = g_atomic_int_add (&pool->num_queued, 1) == 0;
 
   if (!gst_v4l2_allocator_qbuf (pool->vallocator, group))
     goto queue_failed;
 
-  pool->empty = FALSE;
-  g_cond_signal (&pool->empty_cond);
-  GST_OBJECT_UNLOCK (pool);
+  if (was_empty)
+    gst_v4l2_buffer_pool_wake (pool);
+
+#ifdef USE_V4L2_TARGET_NV
+  GST_V4L2_STAT_ADD (pool->stats.depth[MIN (g_atomic_int_get
+              (&pool->num_queued), GST_V4L2_POOL_DEPTH_BINS - 1)], 1);
+#endif
 
   return GST_FLOW_OK;
 
@@ -1426,13 +1811,14 @@ queue_failed:
     GST_BUFFER_FLAG_SET (buf, GST_BUFFER_FLAG_TAG_MEMORY);
     g_atomic_int_add (&pool->num_queued, -1);
     pool->buffers[index] = NULL;
-    GST_OBJECT_UNLOCK (pool);
+    gst_v4l2_buffer_pool_mark_dequeued (pool, index);
     return GST_FLOW_ERROR;
   }
 }
 
 static GstFlowReturn
-gst_v4l2_buffer_pool_dqbuf (GstV4l2BufferPool * pool, GstBuffer ** buffer)
+gst_v4l2_buffer_pool_dqbuf (GstV4l2BufferPool * pool, GstBuffer ** buffer,
+    gboolean wait)
 {
   GstFlowReturn res;
   GstBuffer *outbuf;
@@ -1443,64 +1829,54 @@ gst_v4l2_buffer_pool_dqbuf (GstV4l2BufferPool * pool, GstBuffer ** buffer)
   gsize size;
   gint i;
 
+#ifdef USE_V4L2_TARGET_NV
+  if (!wait) {
+    res = gst_v4l2_allocator_try_dqbuf (pool->vallocator, &group);
+    if (res == GST_V4L2_FLOW_NOT_READY)
+      return res;
+  } else {
+    if ((res = gst_v4l2_buffer_pool_poll (pool)) != GST_FLOW_OK)
+      goto poll_failed;
+
+    GST_LOG_OBJECT (pool, "dequeueing a buffer");
+
+    res = gst_v4l2_allocator_dqbuf (pool->vallocator, &group);
+  }
+#else
   if ((res = gst_v4l2_buffer_pool_poll (pool)) != GST_FLOW_OK)
     goto poll_failed;
 
   GST_LOG_OBJECT (pool, "dequeueing a buffer");
 
   res = gst_v4l2_allocator_dqbuf (pool->vallocator, &group);
+#endif
   if (res == GST_FLOW_EOS)
     goto eos;
+  if (res == GST_FLOW_FLUSHING)
+    goto poll_failed;
+#ifdef USE_V4L2_TARGET_NV
+  if (res == GST_V4L2_FLOW_RESOLUTION_CHANGE)
+    goto resolution_change;
+#endif
   if (res != GST_FLOW_OK)
     goto dqbuf_failed;
 
   /* get our GstBuffer with that index from the pool, if the buffer was
    * outstanding we have a serious problem.
    */
-  outbuf = pool->buffers[group->buffer.index];
-  if (outbuf == NULL)
+  if (!gst_v4l2_buffer_pool_is_queued (pool, group->buffer.index))
     goto no_buffer;
+  outbuf = pool->buffers[group->buffer.index];
 
   /* mark the buffer outstanding */
   pool->buffers[group->buffer.index] = NULL;
-  if (g_atomic_int_dec_and_test (&pool->num_queued)) {
-    GST_OBJECT_LOCK (pool);
-    pool->empty = TRUE;
-    GST_OBJECT_UNLOCK (pool);
-  }
+  gst_v4l2_buffer_pool_mark_dequeued (pool, group->buffer.index);
+  g_atomic_int_add (&pool->num_queued, -1);
 
 #ifdef USE_V4L2_TARGET_NV
   if (pool->obj->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
-      && obj->enableMVBufferMeta
-      && (!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVENC)
-          || !strcmp (obj->videodev, V4L2_DEVICE_PATH_NVENC_ALT)))
-  {
-    v4l2_ctrl_videoenc_outputbuf_metadata_MV enc_mv_metadata;
-    memset ((void *) &enc_mv_metadata, 0, sizeof (enc_mv_metadata));
-
-    if (get_motion_vectors (obj, group->buffer.index, &enc_mv_metadata) == 0)
-    {
-      guint32 numMVs = enc_mv_metadata.bufSize / sizeof (MVInfo), i;
-      MVInfo *pInfo = enc_mv_metadata.pMVInfo;
-      g_print ("Num MVs = %d \n", numMVs);
-
-      for (i = 0; i < numMVs; i++, pInfo++)
-        g_print ("%d: mv_x=%d mv_y=%d weight=%d\n ", i, pInfo->mv_x,
-            pInfo->mv_y, pInfo->weight);
-    }
-  }
-
-  if (pool->obj->type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
-      && (((!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC)) && (is_cuvid == FALSE))
-      || ((!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC_ALT)) && (is_cuvid == FALSE))
-      || ((!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC_MCCOY)) && (is_cuvid == TRUE)))
-      && (obj->Enable_frame_type_reporting || obj->Enable_error_check)) {
-    v4l2_ctrl_videodec_outputbuf_metadata dec_metadata;
-    memset ((void *) &dec_metadata, 0, sizeof (dec_metadata));
-    v4l2_video_dec_get_enable_frame_type_reporting (obj, group->buffer.index,
-        &dec_metadata);
-    report_metadata (obj, group->buffer.index, &dec_metadata);
-  }
+      && obj->personality->fetch_metadata)
+    obj->personality->fetch_metadata (obj, group->buffer.index);
 #endif
   timestamp = GST_TIMEVAL_TO_TIME (group->buffer.timestamp);
 
@@ -1524,6 +1900,14 @@ gst_v4l2_buffer_pool_dqbuf (GstV4l2BufferPool * pool, GstBuffer ** buffer)
   if (V4L2_TYPE_IS_OUTPUT (obj->type))
     goto done;
 
+#ifdef USE_V4L2_TARGET_NV
+  if (gst_buffer_get_size (outbuf) == 0)
+    GST_V4L2_STAT_ADD (pool->stats.empty, 1);
+
+  if (pool->adaptive)
+    pool->dequeued_at[group->buffer.index] = g_get_monotonic_time ();
+#endif
+
   /* Check for driver bug in reporting feild */
   if (group->buffer.field == V4L2_FIELD_ANY) {
     /* Only warn once to avoid the spamming */
@@ -1595,8 +1979,12 @@ gst_v4l2_buffer_pool_dqbuf (GstV4l2BufferPool * pool, GstBuffer ** buffer)
       GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_DELTA_UNIT);
   }
 
-  if (group->buffer.flags & V4L2_BUF_FLAG_ERROR)
+  if (group->buffer.flags & V4L2_BUF_FLAG_ERROR) {
     GST_BUFFER_FLAG_SET (outbuf, GST_BUFFER_FLAG_CORRUPTED);
+#ifdef USE_V4L2_TARGET_NV
+    GST_V4L2_STAT_ADD (pool->stats.corrupted, 1);
+#endif
+  }
 
   GST_BUFFER_TIMESTAMP (outbuf) = timestamp;
   GST_BUFFER_OFFSET (outbuf) = group->buffer.sequence;
@@ -1617,6 +2005,13 @@ eos:
   {
     return GST_FLOW_EOS;
   }
+#ifdef USE_V4L2_TARGET_NV
+resolution_change:
+  {
+    GST_INFO_OBJECT (pool, "source change, all buffers of the old format out");
+    return res;
+  }
+#endif
 dqbuf_failed:
   {
     return GST_FLOW_ERROR;
@@ -1665,7 +2060,26 @@ gst_v4l2_buffer_pool_acquire_buffer (GstBufferPool * bpool, GstBuffer ** buffer,
           /* just dequeue a buffer, we basically use the queue of v4l2 as the
            * storage for our buffers. This function does poll first so we can
            * interrupt it fine. */
-          ret = gst_v4l2_buffer_pool_dqbuf (pool, buffer);
+#ifdef USE_V4L2_TARGET_NV
+          if ((*buffer = gst_atomic_queue_pop (pool->ready_queue))) {
+            ret = GST_FLOW_OK;
+            break;
+          }
+
+          ret = gst_v4l2_buffer_pool_dqbuf (pool, buffer, TRUE);
+
+          /* Drain what else completed in the same burst so that the next
+           * acquires don't pay a poll and a wakeup each */
+          if (ret == GST_FLOW_OK && pool->batch_dequeue) {
+            GstBuffer *ready;
+
+            while (gst_v4l2_buffer_pool_dqbuf (pool, &ready, FALSE) ==
+                GST_FLOW_OK)
+              gst_atomic_queue_push (pool->ready_queue, ready);
+          }
+#else
+          ret = gst_v4l2_buffer_pool_dqbuf (pool, buffer, TRUE);
+#endif
           break;
         }
         default:
@@ -1706,6 +2120,10 @@ gst_v4l2_buffer_pool_acquire_buffer (GstBufferPool * bpool, GstBuffer ** buffer,
       break;
   }
 done:
+#ifdef USE_V4L2_TARGET_NV
+  if (ret == GST_FLOW_OK && !V4L2_TYPE_IS_OUTPUT (obj->type))
+    g_atomic_int_inc (&pool->num_held);
+#endif
   return ret;
 }
 
@@ -1718,6 +2136,11 @@ gst_v4l2_buffer_pool_release_buffer (GstBufferPool * bpool, GstBuffer * buffer)
 
   GST_DEBUG_OBJECT (pool, "release buffer %p", buffer);
 
+#ifdef USE_V4L2_TARGET_NV
+  if (!V4L2_TYPE_IS_OUTPUT (obj->type))
+    g_atomic_int_add (&pool->num_held, -1);
+#endif
+
   switch (obj->type) {
     case V4L2_BUF_TYPE_VIDEO_CAPTURE:
     case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
@@ -1741,6 +2164,15 @@ gst_v4l2_buffer_pool_release_buffer (GstBufferPool * bpool, GstBuffer * buffer)
           if (gst_v4l2_is_buffer_valid (buffer, &group)) {
 #endif
             gst_v4l2_allocator_reset_group (pool->vallocator, group);
+#ifdef USE_V4L2_TARGET_NV
+            /* held back in the pool until the queue runs low again */
+            if (pool->adaptive && pool->streaming &&
+                !gst_v4l2_buffer_pool_adaptive_release (pool,
+                    group->buffer.index)) {
+              pclass->release_buffer (bpool, buffer);
+              break;
+            }
+#endif
             /* queue back in the device */
             if (pool->other_pool)
               gst_v4l2_buffer_pool_prepare_buffer (pool, buffer, NULL);
@@ -1790,7 +2222,7 @@ gst_v4l2_buffer_pool_release_buffer (GstBufferPool * bpool, GstBuffer * buffer)
 
           index = group->buffer.index;
 
-          if (pool->buffers[index] == NULL) {
+          if (!gst_v4l2_buffer_pool_is_queued (pool, index)) {
             GST_LOG_OBJECT (pool, "buffer %u not queued, putting on free list",
                 index);
 
@@ -1829,6 +2261,12 @@ gst_v4l2_buffer_pool_dispose (GObject * object)
 {
   GstV4l2BufferPool *pool = GST_V4L2_BUFFER_POOL (object);
 
+#ifdef USE_V4L2_TARGET_NV
+  /* Frees the buffers kept for a restart that did not happen */
+  if (pool->vallocator)
+    gst_v4l2_allocator_stop (pool->vallocator);
+#endif
+
   if (pool->vallocator)
     gst_object_unref (pool->vallocator);
   pool->vallocator = NULL;
@@ -1852,16 +2290,24 @@ gst_v4l2_buffer_pool_finalize (GObject * object)
   if (pool->video_fd >= 0)
     pool->obj->close (pool->video_fd);
 
-#ifndef USE_V4L2_TARGET_NV
-  gst_poll_free (pool->poll);
-#endif
-
   /* This can't be done in dispose method because we must not set pointer
    * to NULL as it is part of the v4l2object and dispose could be called
    * multiple times */
   gst_object_unref (pool->obj->element);
 
-  g_cond_clear (&pool->empty_cond);
+  gst_v4l2_poll_set_free (pool->poll_set);
+
+#ifdef USE_V4L2_TARGET_NV
+  gst_atomic_queue_unref (pool->ready_queue);
+
+  if (pool->userptr_slab) {
+    gint i;
+
+    for (i = 0; i < NV_VIDEO_MAX_FRAME; i++)
+      g_free (pool->userptr_slab[i].staging);
+    g_free (pool->userptr_slab);
+  }
+#endif
 
   /* FIXME have we done enough here ? */
 
@@ -1871,11 +2317,10 @@ gst_v4l2_buffer_pool_finalize (GObject * object)
 static void
 gst_v4l2_buffer_pool_init (GstV4l2BufferPool * pool)
 {
-#ifndef USE_V4L2_TARGET_NV
-  pool->poll = gst_poll_new (TRUE);
+#ifdef USE_V4L2_TARGET_NV
+  pool->ready_queue = gst_atomic_queue_new (NV_VIDEO_MAX_FRAME);
 #endif
-  g_cond_init (&pool->empty_cond);
-  pool->empty = TRUE;
+  pool->poll_set = gst_v4l2_poll_set_new ();
 }
 
 static void
@@ -1932,27 +2377,31 @@ gst_v4l2_buffer_pool_new (GstV4l2Object * obj, GstCaps * caps)
   g_object_ref_sink (pool);
   g_free (name);
 
-#ifndef USE_V4L2_TARGET_NV
-  gst_poll_fd_init (&pool->pollfd);
-  pool->pollfd.fd = fd;
-  gst_poll_add_fd (pool->poll, &pool->pollfd);
-  if (V4L2_TYPE_IS_OUTPUT (obj->type))
-    gst_poll_fd_ctl_write (pool->poll, &pool->pollfd, TRUE);
-  else
-    gst_poll_fd_ctl_read (pool->poll, &pool->pollfd, TRUE);
-#endif
-
   pool->video_fd = fd;
   pool->obj = obj;
+
+  if (pool->poll_set == NULL)
+    goto poll_set_failed;
+  pool->can_poll_device = gst_v4l2_poll_set_add_device (pool->poll_set, fd,
+      V4L2_TYPE_IS_OUTPUT (obj->type));
+#ifndef USE_V4L2_TARGET_NV
+  if (!pool->can_poll_device)
+    GST_WARNING_OBJECT (pool, "v4l2 device doesn't support polling. Disabling"
+        " using libv4l2 in this case may cause deadlocks");
+#endif
   /* TODO: Check with poll_device set to FALSE */
 
 #ifdef USE_V4L2_TARGET_NV
   pool->can_poll_device = FALSE;
+  pool->batch_dequeue = !V4L2_TYPE_IS_OUTPUT (obj->type);
 #endif
 
   pool->vallocator = gst_v4l2_allocator_new (GST_OBJECT (pool), obj);
   if (pool->vallocator == NULL)
     goto allocator_failed;
+#ifdef USE_V4L2_TARGET_NV
+  pool->vallocator->poll_set = pool->poll_set;
+#endif
 
   gst_object_ref (obj->element);
 
@@ -1961,17 +2410,14 @@ gst_v4l2_buffer_pool_new (GstV4l2Object * obj, GstCaps * caps)
   gst_buffer_pool_config_set_params (config, caps, obj->info.size, 0, 0);
 #else
   /* TODO: Fix below once have a single source for Jetson TX1, TX2 and Xavier */
-  if (((!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC)) && (is_cuvid == FALSE)) ||
-     ((!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC_ALT)) && (is_cuvid == FALSE)) ||
-     ((!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVDEC_MCCOY)) && (is_cuvid == TRUE))) {
+  if (obj->personality->is_decoder) {
      gst_buffer_pool_config_set_params (config, caps, obj->info.size, 0, 0);
      /* Need to adjust the size to 0th plane's size since we will only output
      v4l2 memory associated with 0th plane. */
       if (!V4L2_TYPE_IS_OUTPUT(obj->type))
         gst_buffer_pool_config_set_params (config, caps, obj->info.width * obj->info.height, 0, 0);
   }
-  if (!strcmp(obj->videodev, V4L2_DEVICE_PATH_NVENC)
-      || !strcmp(obj->videodev, V4L2_DEVICE_PATH_NVENC_ALT))
+  if (obj->personality->is_encoder)
       gst_buffer_pool_config_set_params (config, caps, obj->info.size, 0, 0);
 #endif
   /* This will simply set a default config, but will not configure the pool
@@ -1986,6 +2432,12 @@ dup_failed:
     GST_ERROR ("failed to dup fd %d (%s)", errno, g_strerror (errno));
     return NULL;
   }
+poll_set_failed:
+  {
+    GST_ERROR_OBJECT (pool, "Failed to create poll set");
+    gst_object_unref (pool);
+    return NULL;
+  }
 allocator_failed:
   {
     GST_ERROR_OBJECT (pool, "Failed to create V4L2 allocator");
@@ -2109,6 +2561,11 @@ gst_v4l2_buffer_pool_process (GstV4l2BufferPool * pool, GstBuffer ** buf)
             GST_TRACE_OBJECT (pool, "Only %i buffer left in the capture queue.",
                 num_queued);
 
+#ifdef USE_V4L2_TARGET_NV
+            if (pool->adaptive && num_queued < GST_V4L2_ADAPTIVE_LOW)
+              gst_v4l2_buffer_pool_adaptive_grow (pool);
+#endif
+
             /* If we have no more buffer, and can allocate it time to do so */
 #ifdef USE_V4L2_TARGET_NV
             if (num_queued == 0 && pool->enable_dynamic_allocation) {
@@ -2160,15 +2617,34 @@ gst_v4l2_buffer_pool_process (GstV4l2BufferPool * pool, GstBuffer ** buf)
           }
 
           /* buffer not from our pool, grab a frame and copy it into the target */
-          if ((ret = gst_v4l2_buffer_pool_dqbuf (pool, &tmp)) != GST_FLOW_OK)
+#ifdef USE_V4L2_TARGET_NV
+          /* When exporting, the frame is acquired so that the pool takes it
+           * back whenever its last reference goes away */
+          if (g_atomic_int_get (&pool->export_bitstream))
+            ret = gst_buffer_pool_acquire_buffer (bpool, &tmp, NULL);
+          else
+#endif
+            ret = gst_v4l2_buffer_pool_dqbuf (pool, &tmp, TRUE);
+          if (ret != GST_FLOW_OK)
             goto done;
 
+#ifdef USE_V4L2_TARGET_NV
+          /* Given back below through release_buffer() as if acquired */
+          if (!tmp->pool)
+            g_atomic_int_inc (&pool->num_held);
+#endif
+
           /* An empty buffer on capture indicates the end of stream */
           if (gst_buffer_get_size (tmp) == 0) {
             gboolean corrupted = GST_BUFFER_FLAG_IS_SET (tmp,
                 GST_BUFFER_FLAG_CORRUPTED);
 
-            gst_v4l2_buffer_pool_release_buffer (bpool, tmp);
+#ifdef USE_V4L2_TARGET_NV
+            if (tmp->pool)
+              gst_buffer_unref (tmp);
+            else
+#endif
+              gst_v4l2_buffer_pool_release_buffer (bpool, tmp);
 
             if (corrupted)
               goto buffer_corrupted;
@@ -2176,10 +2652,37 @@ gst_v4l2_buffer_pool_process (GstV4l2BufferPool * pool, GstBuffer ** buf)
               goto eos;
           }
 
+#ifdef USE_V4L2_TARGET_NV
+          if (tmp->pool) {
+            guint num_queued = g_atomic_int_get (&pool->num_queued);
+
+            if (num_queued >= MAX (pool->copy_threshold,
+                    GST_V4L2_EXPORT_MIN_QUEUED)) {
+              if ((ret = gst_v4l2_buffer_pool_export_buffer (pool, *buf,
+                          tmp)) != GST_FLOW_OK)
+                goto copy_failed;
+              break;
+            }
+
+            GST_DEBUG_OBJECT (pool, "only %u buffers queued, copying", num_queued);
+          }
+
+          /* The target may come without memory when exporting */
+          if (gst_buffer_get_size (*buf) < gst_buffer_get_size (tmp))
+            gst_buffer_append_memory (*buf, gst_allocator_alloc (NULL,
+                    gst_buffer_get_size (tmp) - gst_buffer_get_size (*buf),
+                    NULL));
+#endif
+
           ret = gst_v4l2_buffer_pool_copy_buffer (pool, *buf, tmp);
 
           /* an queue the buffer again after the copy */
-          gst_v4l2_buffer_pool_release_buffer (bpool, tmp);
+#ifdef USE_V4L2_TARGET_NV
+          if (tmp->pool)
+            gst_buffer_unref (tmp);
+          else
+#endif
+            gst_v4l2_buffer_pool_release_buffer (bpool, tmp);
 
           if (ret != GST_FLOW_OK)
             goto copy_failed;
@@ -2265,7 +2768,7 @@ gst_v4l2_buffer_pool_process (GstV4l2BufferPool * pool, GstBuffer ** buf)
 
           GST_LOG_OBJECT (pool, "processing buffer %i from our pool", index);
 
-          if (pool->buffers[index] != NULL) {
+          if (gst_v4l2_buffer_pool_is_queued (pool, index)) {
             GST_LOG_OBJECT (pool, "buffer %i already queued, copying", index);
             goto copying;
           }
@@ -2283,6 +2786,15 @@ gst_v4l2_buffer_pool_process (GstV4l2BufferPool * pool, GstBuffer ** buf)
              * be strange because we would expect the upstream element to have
              * allocated them and returned to us.. */
             params.flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT;
+#ifdef USE_V4L2_TARGET_NV
+            if ((obj->mode == GST_V4L2_IO_DMABUF_IMPORT &&
+                    obj->personality->is_encoder &&
+                    !obj->personality->is_cuvid) ||
+                obj->mode == GST_V4L2_IO_USERPTR)
+              ret = gst_v4l2_buffer_pool_acquire_import (pool, *buf,
+                  &to_queue);
+            else
+#endif
             ret = gst_buffer_pool_acquire_buffer (bpool, &to_queue, &params);
             if (ret != GST_FLOW_OK)
               goto acquire_failed;
@@ -2314,6 +2826,7 @@ gst_v4l2_buffer_pool_process (GstV4l2BufferPool * pool, GstBuffer ** buf)
             gst_v4l2_allocator_flush (pool->vallocator);
 
             pool->buffers[group->buffer.index] = NULL;
+            gst_v4l2_buffer_pool_mark_dequeued (pool, group->buffer.index);
 
             gst_mini_object_set_qdata (GST_MINI_OBJECT (to_queue),
                 GST_V4L2_IMPORT_QUARK, NULL, NULL);
@@ -2334,7 +2847,7 @@ gst_v4l2_buffer_pool_process (GstV4l2BufferPool * pool, GstBuffer ** buf)
             GstBuffer *out;
             /* all buffers are queued, try to dequeue one and release it back
              * into the pool so that _acquire can get to it again. */
-            ret = gst_v4l2_buffer_pool_dqbuf (pool, &out);
+            ret = gst_v4l2_buffer_pool_dqbuf (pool, &out, TRUE);
             if (ret == GST_FLOW_OK && out->pool == NULL)
               /* release the rendered buffer back into the pool. This wakes up any
                * thread waiting for a buffer in _acquire(). */
@@ -2442,11 +2955,168 @@ gst_v4l2_buffer_pool_enable_dynamic_allocation (GstV4l2BufferPool * pool,
 
   GST_OBJECT_LOCK (pool);
   pool->enable_dynamic_allocation = enable_dynamic_allocation;
+  /* The adaptive mode creates its buffers the same way */
   if (pool->vallocator)
-    gst_v4l2_allocator_enable_dynamic_allocation (pool->vallocator, enable_dynamic_allocation);
+    gst_v4l2_allocator_enable_dynamic_allocation (pool->vallocator,
+        enable_dynamic_allocation || pool->adaptive);
   GST_OBJECT_UNLOCK (pool);
 }
 
+/* In adaptive mode the capture pool follows the demand: it creates buffers
+ * with CREATE_BUFS when the driver queue runs low, and holds buffers back
+ * from the driver again once the queue stayed deep for a while. The driver
+ * cannot free a single buffer, so held back buffers stay allocated until the
+ * pool is stopped but are the first to be put back when the queue runs
+ * low. */
+void
+gst_v4l2_buffer_pool_enable_adaptive_allocation (GstV4l2BufferPool * pool,
+    gboolean enable)
+{
+  GST_DEBUG_OBJECT (pool, "adaptive allocation enable %d", enable);
+
+  GST_OBJECT_LOCK (pool);
+  pool->adaptive = enable;
+  gst_v4l2_buffer_pool_adaptive_reset (pool, g_get_monotonic_time ());
+  if (pool->vallocator)
+    gst_v4l2_allocator_enable_dynamic_allocation (pool->vallocator,
+        enable || pool->enable_dynamic_allocation);
+  GST_OBJECT_UNLOCK (pool);
+}
+
+/* Number of capture buffers acquired from the pool and not released yet,
+ * mostly those held downstream */
+guint
+gst_v4l2_buffer_pool_n_held (GstV4l2BufferPool * pool)
+{
+  return MAX (g_atomic_int_get (&pool->num_held), 0);
+}
+
+/* Releases the buffers of an idle capture pool, through the allocator stop
+ * as on deactivation, and frees their memory with REQBUFS(0). The
+ * configuration is kept, the next gst_buffer_pool_set_active() allocates
+ * them again and restarts streaming. Fails while buffers are held
+ * downstream: the base class would only stop the pool once they come back,
+ * and a reactivation in between would not restart streaming. */
+gboolean
+gst_v4l2_buffer_pool_trim (GstV4l2BufferPool * pool)
+{
+  GstBufferPool *bpool = GST_BUFFER_POOL (pool);
+  guint held;
+
+  if (!gst_buffer_pool_is_active (bpool))
+    return TRUE;
+
+  if ((held = gst_v4l2_buffer_pool_n_held (pool)) > 0) {
+    GST_DEBUG_OBJECT (pool, "%u buffers still held, not releasing", held);
+    return FALSE;
+  }
+
+  GST_DEBUG_OBJECT (pool, "releasing the %u idle buffers",
+      pool->vallocator->count);
+
+  if (!gst_buffer_pool_set_active (bpool, FALSE))
+    return FALSE;
+
+  GST_V4L2_STAT_ADD (pool->stats.trims, 1);
+  return TRUE;
+}
+
+/* Deactivates the pool with its driver buffers left allocated, see
+ * gst_v4l2_allocator_keep_buffers(). Returns FALSE when they could not be
+ * kept, the pool is then deactivated as usual, which frees them once the
+ * buffers still in use come back. */
+gboolean
+gst_v4l2_buffer_pool_keep_buffers (GstV4l2BufferPool * pool)
+{
+  GstBufferPool *bpool = GST_BUFFER_POOL (pool);
+
+  GST_DEBUG_OBJECT (pool, "deactivating, keeping the buffers");
+
+  gst_v4l2_allocator_keep_buffers (pool->vallocator);
+  if (gst_buffer_pool_set_active (bpool, FALSE) && pool->vallocator->kept)
+    return TRUE;
+
+  GST_DEBUG_OBJECT (pool, "buffers still in use, not keeping them");
+  gst_v4l2_allocator_release_kept (pool->vallocator);
+  return FALSE;
+}
+
+void
+gst_v4l2_buffer_pool_enable_export (GstV4l2BufferPool * pool,
+    gboolean export_bitstream)
+{
+  GST_DEBUG_OBJECT (pool, "bitstream export enable %d", export_bitstream);
+
+  g_atomic_int_set (&pool->export_bitstream, export_bitstream);
+}
+
+/* Snapshot of the pool and allocator counters, named after the plane */
+GstStructure *
+gst_v4l2_buffer_pool_get_stats (GstV4l2BufferPool * pool)
+{
+  GstV4l2AllocatorStats astats = { 0 };
+  GValue depth = G_VALUE_INIT;
+  GstStructure *s;
+  gint i;
+
+  if (pool->vallocator)
+    gst_v4l2_allocator_get_stats (pool->vallocator, &astats);
+
+  g_value_init (&depth, GST_TYPE_ARRAY);
+  for (i = 0; i < GST_V4L2_POOL_DEPTH_BINS; i++) {
+    GValue bin = G_VALUE_INIT;
+
+    g_value_init (&bin, G_TYPE_UINT64);
+    g_value_set_uint64 (&bin, GST_V4L2_STAT_GET (pool->stats.depth[i]));
+    gst_value_array_append_and_take_value (&depth, &bin);
+  }
+
+  s = gst_structure_new (V4L2_TYPE_IS_OUTPUT (pool->obj->type) ?
+      "output" : "capture",
+      "queued", G_TYPE_UINT, g_atomic_int_get (&pool->num_queued),
+      "held", G_TYPE_UINT, gst_v4l2_buffer_pool_n_held (pool),
+      "dequeued", G_TYPE_UINT64, astats.dequeued,
+      "dqbuf-again", G_TYPE_UINT64, astats.dqbuf_again,
+      "device-waits", G_TYPE_UINT64, astats.waits,
+      "device-wait-us", G_TYPE_UINT64, astats.wait_us,
+      "queue-wait-us", G_TYPE_UINT64,
+      GST_V4L2_STAT_GET (pool->stats.queue_wait_us),
+      "driver-time-avg-us", G_TYPE_UINT64,
+      astats.dequeued ? astats.driver_us / astats.dequeued : 0,
+      "driver-time-max-us", G_TYPE_UINT64, astats.driver_max_us,
+      "events", G_TYPE_UINT64, astats.events,
+      "source-changes", G_TYPE_UINT64, astats.source_changes,
+      "reused", G_TYPE_UINT64, astats.reused,
+      "copies", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.copies),
+      "copied-bytes", G_TYPE_UINT64,
+      GST_V4L2_STAT_GET (pool->stats.copied_bytes),
+      "exports", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.exports),
+      "exported-bytes", G_TYPE_UINT64,
+      GST_V4L2_STAT_GET (pool->stats.exported_bytes),
+      "gathers", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.gathers),
+      "import-hits", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.import_hits),
+      "import-misses", G_TYPE_UINT64,
+      GST_V4L2_STAT_GET (pool->stats.import_misses),
+      "resurrected", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.resurrected),
+      "allocated", G_TYPE_UINT64, astats.created,
+      "corrupted", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.corrupted),
+      "empty", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.empty),
+      "dry", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.dry),
+      "parked", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.parked),
+      "held-back", G_TYPE_UINT, pool->parked,
+      "hold-avg-us", G_TYPE_UINT64, (guint64) pool->hold_avg_us,
+      "hold-max-us", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.hold_max_us),
+      "trims", G_TYPE_UINT64, GST_V4L2_STAT_GET (pool->stats.trims),
+      "start-us", G_TYPE_UINT64, pool->stats.start_us,
+      "start-reqbufs-us", G_TYPE_UINT64, astats.reqbufs_us,
+      "start-setup-us", G_TYPE_UINT64, astats.setup_us,
+      "start-alloc-us", G_TYPE_UINT64, pool->stats.alloc_us,
+      "start-streamon-us", G_TYPE_UINT64, pool->stats.streamon_us, NULL);
+  gst_structure_take_value (s, "queued-depth", &depth);
+
+  return s;
+}
+
 gint
 get_motion_vectors(GstV4l2Object *obj, guint32 bufferIndex,
             v4l2_ctrl_videoenc_outputbuf_metadata_MV *enc_mv_metadata)
@@ -2468,66 +3138,11 @@ get_motion_vectors(GstV4l2Object *obj, guint32 bufferIndex,
 
   if (!GST_V4L2_IS_OPEN (obj))
     g_print ("V4L2 device is not open\n");
-  ret = obj->ioctl (obj->video_fd, VIDIOC_G_EXT_CTRLS, &ctrls);
+  ret = obj->stream_ioctl (obj->video_fd, VIDIOC_G_EXT_CTRLS, &ctrls);
 
   if (ret < 0)
     g_print ("Error getting dfata\n");
   return ret;
 }
-
-static void
-report_metadata (GstV4l2Object * obj, guint32 buffer_index,
-    v4l2_ctrl_videodec_outputbuf_metadata * metadata)
-{
-  if (obj->Enable_frame_type_reporting) {
-    switch (metadata->CodecParams.H264DecParams.FrameType) {
-      case 0:
-        g_print ("FrameType = B\n");
-        break;
-      case 1:
-        g_print ("FrameType = P\n");
-        break;
-      case 2:
-        g_print ("FrameType = I\n");
-        if (metadata->CodecParams.H264DecParams.dpbInfo.currentFrame.bIdrFrame) {
-          g_print (" (IDR)\n");
-        }
-        break;
-    }
-    g_print ("nActiveRefFrames = %d\n",
-        metadata->CodecParams.H264DecParams.dpbInfo.nActiveRefFrames);
-  }
-  if (obj->Enable_error_check) {
-    g_print
-        ("ErrorType= %d  Decoded MBs= %d  Concealed MBs= %d  FrameDecodeTime %d\n",
-        metadata->FrameDecStats.DecodeError, metadata->FrameDecStats.DecodedMBs,
-        metadata->FrameDecStats.ConcealedMBs,
-        metadata->FrameDecStats.FrameDecodeTime);
-  }
-}
-
-static void
-v4l2_video_dec_get_enable_frame_type_reporting (GstV4l2Object * obj,
-    guint32 buffer_index, v4l2_ctrl_videodec_outputbuf_metadata * dec_metadata)
-{
-  v4l2_ctrl_video_metadata metadata;
-  struct v4l2_ext_control control;
-  struct v4l2_ext_controls ctrls;
-  gint ret = -1;
-
-  ctrls.count = 1;
-  ctrls.controls = &control;
-  ctrls.ctrl_class = V4L2_CTRL_CLASS_MPEG;
-
-  metadata.buffer_index = buffer_index;
-  metadata.VideoDecMetadata = dec_metadata;
-
-  control.id = V4L2_CID_MPEG_VIDEODEC_METADATA;
-  control.string = (gchar *) &metadata;
-
-  ret = obj->ioctl (obj->video_fd, VIDIOC_G_EXT_CTRLS, &ctrls);
-  if (ret < 0)
-    g_print ("Error while getting report metadata\n");
-}
 #endif
 
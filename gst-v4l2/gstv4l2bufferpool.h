@@ -38,9 +38,12 @@
 typedef struct _GstV4l2BufferPool GstV4l2BufferPool;
 typedef struct _GstV4l2BufferPoolClass GstV4l2BufferPoolClass;
 typedef struct _GstV4l2Meta GstV4l2Meta;
+typedef struct _GstV4l2PoolStats GstV4l2PoolStats;
+typedef struct _GstV4l2ImportId GstV4l2ImportId;
 
 #include "gstv4l2object.h"
 #include "gstv4l2allocator.h"
+#include "gstv4l2pollset.h"
 
 G_BEGIN_DECLS
 
@@ -59,18 +62,54 @@ G_BEGIN_DECLS
  * simply waiting for next buffer. */
 #define GST_V4L2_FLOW_CORRUPTED_BUFFER GST_FLOW_CUSTOM_SUCCESS_1
 
+/* Bins of the queued-depth histogram, the last one also counts all deeper
+ * queues */
+#define GST_V4L2_POOL_DEPTH_BINS 16
+
+struct _GstV4l2PoolStats
+{
+  guint64 depth[GST_V4L2_POOL_DEPTH_BINS]; /* buffers in the driver after each QBUF */
+  guint64 queue_wait_us;    /* time poll waited for a buffer to be queued */
+  guint64 copies;           /* gst_v4l2_buffer_pool_copy_buffer() calls */
+  guint64 copied_bytes;
+  guint64 exports;          /* capture buffers handed downstream without a copy */
+  guint64 exported_bytes;
+  guint64 gathers;          /* multi-memory USERPTR input gathered in place */
+  guint64 import_hits;      /* inputs queued to the index they used before */
+  guint64 import_misses;    /* known inputs whose index was not free */
+  guint64 resurrected;      /* lost buffers reallocated */
+  guint64 corrupted;        /* dequeued with V4L2_BUF_FLAG_ERROR */
+  guint64 empty;            /* dequeued without payload */
+  guint64 dry;              /* adaptive: times the driver queue ran low */
+  guint64 parked;           /* adaptive: buffers taken out of the queue */
+  guint64 hold_max_us;      /* longest a capture buffer stayed downstream */
+  guint64 trims;            /* idle releases of all the buffers */
+  guint64 start_us;         /* duration of the last activation */
+  guint64 alloc_us;         /* of which wrapping the buffers */
+  guint64 streamon_us;      /* of which queueing them and STREAMON */
+};
+
+/* Identity of an imported input buffer across the frames upstream recycles
+ * it for: the dmabuf behind it, stable across exports unlike its fd, or
+ * the user memory range USERPTR queues. All 0 when unknown. */
+struct _GstV4l2ImportId
+{
+  guint64 dev;               /* device of the dmabuf */
+  guint64 ino;               /* inode of the dmabuf */
+  guintptr data;             /* mapped address of the user memory */
+  gsize size;                /* mapped size of the user memory */
+};
+
 struct _GstV4l2BufferPool
 {
   GstBufferPool parent;
 
   GstV4l2Object *obj;        /* the v4l2 object */
   gint video_fd;             /* a dup(2) of the v4l2object's video_fd */
-  GstPoll *poll;             /* a poll for video_fd */
-  GstPollFD pollfd;
-  gboolean can_poll_device;
+  gboolean can_poll_device;  /* video_fd is in poll_set */
 
-  gboolean empty;
-  GCond empty_cond;
+  GstV4l2PollSet *poll_set;  /* video_fd, and wakeups when the queue stops
+                              * being empty or when flushing */
 
   GstV4l2Allocator *vallocator;
   GstAllocator *allocator;
@@ -93,8 +132,10 @@ struct _GstV4l2BufferPool
 
 #ifdef USE_V4L2_TARGET_NV
   GstBuffer *buffers[NV_VIDEO_MAX_FRAME];
+  guint queued_mask[(NV_VIDEO_MAX_FRAME + 31) / 32];
 #else
   GstBuffer *buffers[VIDEO_MAX_FRAME];
+  guint queued_mask[(VIDEO_MAX_FRAME + 31) / 32];
 #endif
 
   /* signal handlers */
@@ -105,6 +146,38 @@ struct _GstV4l2BufferPool
 
 #ifdef USE_V4L2_TARGET_NV
   gboolean enable_dynamic_allocation; /* If dynamic_allocation should be set */
+
+  /* Capture buffers the driver had ready along with the last one dequeued,
+   * handed out by the next acquires without polling again */
+  gboolean batch_dequeue;
+  GstAtomicQueue *ready_queue;
+
+  /* Encoded capture buffers are wrapped into the downstream buffer instead
+   * of being copied, and only requeued once downstream drops them */
+  gboolean export_bitstream;
+
+  /* Adaptive capture buffer count, see
+   * gst_v4l2_buffer_pool_enable_adaptive_allocation() */
+  gboolean adaptive;
+  guint parked;              /* buffers held back from the driver queue */
+  gint num_held;             /* capture buffers handed out and not released */
+  guint window_min;          /* lowest queued depth since window_start */
+  gint64 window_start;
+  gint64 hold_avg_us;        /* moving average of the downstream hold time */
+  gint64 dequeued_at[NV_VIDEO_MAX_FRAME];
+
+  /* USERPTR import state of each buffer index, allocated on the first
+   * import, see gst_v4l2_buffer_pool_import_userptr() */
+  struct UserPtrData *userptr_slab;
+
+  /* Input last imported into each buffer index, so that a recycled input
+   * buffer goes to the index it used before. Only valid for the upstream
+   * pool of the last input buffer, see
+   * gst_v4l2_buffer_pool_import_generation() */
+  GstV4l2ImportId import_ids[NV_VIDEO_MAX_FRAME];
+  guint import_generation;
+
+  GstV4l2PoolStats stats;
 #endif
 };
 
@@ -130,9 +203,27 @@ gboolean            gst_v4l2_buffer_pool_flush   (GstBufferPool *pool);
 void
 gst_v4l2_buffer_pool_enable_dynamic_allocation (GstV4l2BufferPool * pool,
                                                 gboolean enable_dynamic_allocation);
+gboolean
+gst_v4l2_buffer_pool_keep_buffers (GstV4l2BufferPool * pool);
+
+void
+gst_v4l2_buffer_pool_enable_adaptive_allocation (GstV4l2BufferPool * pool,
+                                                 gboolean enable);
+
+guint
+gst_v4l2_buffer_pool_n_held (GstV4l2BufferPool * pool);
+
+gboolean
+gst_v4l2_buffer_pool_trim (GstV4l2BufferPool * pool);
+
+void
+gst_v4l2_buffer_pool_enable_export (GstV4l2BufferPool * pool,
+                                    gboolean export_bitstream);
 gint
 get_motion_vectors (GstV4l2Object *obj, guint32 bufferIndex,
             v4l2_ctrl_videoenc_outputbuf_metadata_MV *enc_mv_metadata);
+GstStructure *
+gst_v4l2_buffer_pool_get_stats (GstV4l2BufferPool * pool);
 #endif
 
 G_END_DECLS
@@ -0,0 +1,399 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gstv4l2object.h"
+#include "gstv4l2latency.h"
+
+static const gchar *span_names[GST_V4L2_LATENCY_N_SPANS] = {
+  "total",
+  "submit",
+  "device",
+  "deliver",
+};
+
+/* start and end stamp of each span */
+static const GstV4l2LatencyStamp span_stamps[GST_V4L2_LATENCY_N_SPANS][2] = {
+  {GST_V4L2_LATENCY_INPUT, GST_V4L2_LATENCY_PUSH},
+  {GST_V4L2_LATENCY_INPUT, GST_V4L2_LATENCY_OUTPUT_QBUF},
+  {GST_V4L2_LATENCY_OUTPUT_QBUF, GST_V4L2_LATENCY_CAPTURE_DQBUF},
+  {GST_V4L2_LATENCY_CAPTURE_DQBUF, GST_V4L2_LATENCY_PUSH},
+};
+
+GType
+gst_v4l2_latency_meta_api_get_type (void)
+{
+  static gsize type = 0;
+  static const gchar *tags[] = { NULL };
+
+  if (g_once_init_enter (&type)) {
+    GType _type = gst_meta_api_type_register ("GstV4l2LatencyMetaAPI", tags);
+    g_once_init_leave (&type, _type);
+  }
+  return (GType) type;
+}
+
+static gboolean
+gst_v4l2_latency_meta_init (GstMeta * meta, gpointer params,
+    GstBuffer * buffer)
+{
+  GstV4l2LatencyMeta *lmeta = (GstV4l2LatencyMeta *) meta;
+  gint i;
+
+  for (i = 0; i < GST_V4L2_LATENCY_N_STAMPS; i++)
+    lmeta->stamps[i] = GST_CLOCK_TIME_NONE;
+
+  return TRUE;
+}
+
+static gboolean
+gst_v4l2_latency_meta_transform (GstBuffer * dest, GstMeta * meta,
+    GstBuffer * buffer, GQuark type, gpointer data)
+{
+  GstV4l2LatencyMeta *smeta = (GstV4l2LatencyMeta *) meta;
+  GstV4l2LatencyMeta *dmeta;
+
+  if (!GST_META_TRANSFORM_IS_COPY (type))
+    return FALSE;
+
+  dmeta = gst_buffer_get_v4l2_latency_meta (dest);
+  if (!dmeta)
+    dmeta = (GstV4l2LatencyMeta *) gst_buffer_add_meta (dest,
+        GST_V4L2_LATENCY_META_INFO, NULL);
+  if (!dmeta)
+    return FALSE;
+
+  memcpy (dmeta->stamps, smeta->stamps, sizeof (dmeta->stamps));
+
+  return TRUE;
+}
+
+const GstMetaInfo *
+gst_v4l2_latency_meta_get_info (void)
+{
+  static const GstMetaInfo *info = NULL;
+
+  if (g_once_init_enter ((GstMetaInfo **) & info)) {
+    const GstMetaInfo *mi =
+        gst_meta_register (GST_V4L2_LATENCY_META_API_TYPE,
+        "GstV4l2LatencyMeta", sizeof (GstV4l2LatencyMeta),
+        gst_v4l2_latency_meta_init, NULL, gst_v4l2_latency_meta_transform);
+    g_once_init_leave ((GstMetaInfo **) & info, (GstMetaInfo *) mi);
+  }
+  return info;
+}
+
+void
+gst_v4l2_latency_init (GstV4l2Latency * latency)
+{
+  g_mutex_init (&latency->lock);
+  gst_v4l2_latency_reset (latency);
+}
+
+void
+gst_v4l2_latency_clear (GstV4l2Latency * latency)
+{
+  g_mutex_clear (&latency->lock);
+}
+
+void
+gst_v4l2_latency_reset (GstV4l2Latency * latency)
+{
+  gint i;
+
+  g_mutex_lock (&latency->lock);
+  for (i = 0; i < GST_V4L2_LATENCY_RING; i++)
+    latency->input[i] = GST_CLOCK_TIME_NONE;
+  memset (latency->filled, 0, sizeof (latency->filled));
+  memset (latency->pos, 0, sizeof (latency->pos));
+  latency->frames = 0;
+  latency->unmatched = 0;
+  latency->first_input = GST_CLOCK_TIME_NONE;
+  latency->first_push = GST_CLOCK_TIME_NONE;
+  latency->format_wait = 0;
+  g_mutex_unlock (&latency->lock);
+}
+
+void
+gst_v4l2_latency_input (GstV4l2Latency * latency, guint32 frame_number)
+{
+  GstClockTime now = g_get_monotonic_time () * GST_USECOND;
+
+  g_mutex_lock (&latency->lock);
+  latency->input[frame_number % GST_V4L2_LATENCY_RING] = now;
+  if (!GST_CLOCK_TIME_IS_VALID (latency->first_input))
+    latency->first_input = now;
+  g_mutex_unlock (&latency->lock);
+}
+
+/* Accounts @wait spent blocked on the device for the stream format */
+void
+gst_v4l2_latency_format_wait (GstV4l2Latency * latency, GstClockTime wait)
+{
+  g_mutex_lock (&latency->lock);
+  latency->format_wait += wait;
+  g_mutex_unlock (&latency->lock);
+}
+
+static gboolean
+gst_v4l2_latency_find_stamp (GstV4l2Object * obj, GstClockTime timestamp,
+    GstClockTime * qbuf, GstClockTime * dqbuf)
+{
+#ifdef USE_V4L2_TARGET_NV
+  GstBufferPool *bpool = gst_v4l2_object_ref_pool (obj);
+  GstV4l2BufferPool *pool;
+  GstV4l2QueueStamp stamp;
+  gboolean found;
+
+  if (!bpool)
+    return FALSE;
+
+  pool = GST_V4L2_BUFFER_POOL (bpool);
+  found = pool->vallocator &&
+      gst_v4l2_allocator_find_stamp (pool->vallocator, timestamp, &stamp);
+  gst_object_unref (bpool);
+
+  if (!found)
+    return FALSE;
+
+  if (qbuf && stamp.qbuf)
+    *qbuf = stamp.qbuf * GST_USECOND;
+  if (dqbuf)
+    *dqbuf = stamp.dqbuf * GST_USECOND;
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+/* The "video/x-raw" reference caps DeepStream's latency measurement reads
+ * from the GstReferenceTimestampMeta of each component, built once */
+static GstCaps *
+gst_v4l2_latency_reference_caps (void)
+{
+  static GstCaps *caps = NULL;
+
+  if (g_once_init_enter (&caps)) {
+    GstCaps *c = gst_caps_new_simple ("video/x-raw",
+        "component_name", G_TYPE_STRING, "",
+        "frame_num", G_TYPE_INT, 0,
+        "in_timestamp", G_TYPE_DOUBLE, 0.0,
+        "out_timestamp", G_TYPE_DOUBLE, 0.0, NULL);
+    GST_MINI_OBJECT_FLAG_SET (c, GST_MINI_OBJECT_FLAG_MAY_BE_LEAKED);
+    g_once_init_leave (&caps, c);
+  }
+  return caps;
+}
+
+/* Stores the input and push time of the frame, as wall-clock milliseconds,
+ * in the reference caps of @name. Like GstV4l2LatencyMeta the meta stays on
+ * the pooled buffer, its caps are copied from the static ones once and then
+ * refilled in place unless a copy of an earlier buffer still holds them. */
+static void
+gst_v4l2_latency_add_reference (GstBuffer * buffer, const gchar * name,
+    guint32 frame_number, const GstClockTime * stamps)
+{
+  GstReferenceTimestampMeta *meta = NULL;
+  GstStructure *s;
+  gpointer state = NULL;
+  GstMeta *m;
+  gdouble in_ms, out_ms;
+
+  while ((m = gst_buffer_iterate_meta_filtered (buffer, &state,
+              GST_REFERENCE_TIMESTAMP_META_API_TYPE))) {
+    GstReferenceTimestampMeta *rmeta = (GstReferenceTimestampMeta *) m;
+
+    if (!GST_META_FLAG_IS_SET (m, GST_META_FLAG_POOLED) ||
+        gst_caps_get_size (rmeta->reference) == 0)
+      continue;
+    s = gst_caps_get_structure (rmeta->reference, 0);
+    if (g_strcmp0 (gst_structure_get_string (s, "component_name"),
+            name) == 0) {
+      meta = rmeta;
+      break;
+    }
+  }
+
+  if (!meta) {
+    meta = gst_buffer_add_reference_timestamp_meta (buffer,
+        gst_v4l2_latency_reference_caps (), 0, 0);
+    if (!meta)
+      return;
+    GST_META_FLAG_SET (meta, GST_META_FLAG_POOLED);
+  }
+
+  if (!gst_caps_is_writable (meta->reference)) {
+    GstCaps *caps = gst_caps_copy (meta->reference);
+
+    gst_caps_unref (meta->reference);
+    meta->reference = caps;
+    gst_structure_set (gst_caps_get_structure (caps, 0),
+        "component_name", G_TYPE_STRING, name, NULL);
+  }
+
+  out_ms = g_get_real_time () / 1000.0;
+  in_ms = out_ms;
+  if (GST_CLOCK_TIME_IS_VALID (stamps[GST_V4L2_LATENCY_INPUT]))
+    in_ms -= (gdouble) (stamps[GST_V4L2_LATENCY_PUSH] -
+        stamps[GST_V4L2_LATENCY_INPUT]) / GST_MSECOND;
+
+  gst_structure_set (gst_caps_get_structure (meta->reference, 0),
+      "frame_num", G_TYPE_INT, (gint) frame_number,
+      "in_timestamp", G_TYPE_DOUBLE, in_ms,
+      "out_timestamp", G_TYPE_DOUBLE, out_ms, NULL);
+}
+
+/* Collects the stamps of the frame whose @buffer is about to be pushed,
+ * adds its intervals to the windows and, if @attach_meta, stores them in
+ * the buffer's GstV4l2LatencyMeta. With a @reference_name the frame's
+ * GstReferenceTimestampMeta for DeepStream is filled in as well. */
+void
+gst_v4l2_latency_output (GstV4l2Latency * latency, guint32 frame_number,
+    GstBuffer * buffer, GstV4l2Object * output, GstV4l2Object * capture,
+    gboolean attach_meta, const gchar * reference_name)
+{
+  GstClockTime stamps[GST_V4L2_LATENCY_N_STAMPS];
+  gboolean complete = TRUE;
+  gint i;
+
+  for (i = 0; i < GST_V4L2_LATENCY_N_STAMPS; i++)
+    stamps[i] = GST_CLOCK_TIME_NONE;
+
+  gst_v4l2_latency_find_stamp (output, GST_BUFFER_PTS (buffer),
+      &stamps[GST_V4L2_LATENCY_OUTPUT_QBUF],
+      &stamps[GST_V4L2_LATENCY_OUTPUT_DQBUF]);
+  gst_v4l2_latency_find_stamp (capture, GST_BUFFER_PTS (buffer), NULL,
+      &stamps[GST_V4L2_LATENCY_CAPTURE_DQBUF]);
+  stamps[GST_V4L2_LATENCY_PUSH] = g_get_monotonic_time () * GST_USECOND;
+
+  g_mutex_lock (&latency->lock);
+  stamps[GST_V4L2_LATENCY_INPUT] =
+      latency->input[frame_number % GST_V4L2_LATENCY_RING];
+  latency->input[frame_number % GST_V4L2_LATENCY_RING] = GST_CLOCK_TIME_NONE;
+
+  for (i = 0; i < GST_V4L2_LATENCY_N_SPANS; i++) {
+    GstClockTime start = stamps[span_stamps[i][0]];
+    GstClockTime end = stamps[span_stamps[i][1]];
+
+    if (!GST_CLOCK_TIME_IS_VALID (start) || !GST_CLOCK_TIME_IS_VALID (end)
+        || end < start) {
+      complete = FALSE;
+      continue;
+    }
+
+    latency->window[i][latency->pos[i]] =
+        MIN ((end - start) / GST_USECOND, G_MAXUINT32);
+    latency->pos[i] = (latency->pos[i] + 1) % GST_V4L2_LATENCY_WINDOW;
+    if (latency->filled[i] < GST_V4L2_LATENCY_WINDOW)
+      latency->filled[i]++;
+  }
+
+  if (!GST_CLOCK_TIME_IS_VALID (latency->first_push))
+    latency->first_push = stamps[GST_V4L2_LATENCY_PUSH];
+
+  latency->frames++;
+  if (!complete)
+    latency->unmatched++;
+  g_mutex_unlock (&latency->lock);
+
+  if (attach_meta && gst_buffer_is_writable (buffer)) {
+    GstV4l2LatencyMeta *meta = gst_buffer_get_v4l2_latency_meta (buffer);
+
+    if (!meta) {
+      meta = (GstV4l2LatencyMeta *) gst_buffer_add_meta (buffer,
+          GST_V4L2_LATENCY_META_INFO, NULL);
+      /* Keep it when the buffer goes back to the pool */
+      GST_META_FLAG_SET (meta, GST_META_FLAG_POOLED);
+    }
+    memcpy (meta->stamps, stamps, sizeof (meta->stamps));
+  }
+
+  if (reference_name && gst_buffer_is_writable (buffer))
+    gst_v4l2_latency_add_reference (buffer, reference_name, frame_number,
+        stamps);
+}
+
+static gint
+gst_v4l2_latency_compare (gconstpointer a, gconstpointer b)
+{
+  guint32 va = *(const guint32 *) a, vb = *(const guint32 *) b;
+
+  return (va > vb) - (va < vb);
+}
+
+/* p50/p95/p99 of each span over the window and the startup times since
+ * the last reset, in microseconds */
+GstStructure *
+gst_v4l2_latency_get_stats (GstV4l2Latency * latency)
+{
+  static const guint percentiles[] = { 50, 95, 99 };
+  guint32 *sorted = g_new (guint32, GST_V4L2_LATENCY_WINDOW);
+  GstStructure *s;
+  guint64 frames, unmatched, first_frame = 0, format_wait;
+  guint i, j;
+
+  s = gst_structure_new_empty ("v4l2-latency");
+
+  for (i = 0; i < GST_V4L2_LATENCY_N_SPANS; i++) {
+    guint n;
+
+    g_mutex_lock (&latency->lock);
+    n = latency->filled[i];
+    memcpy (sorted, latency->window[i], n * sizeof (guint32));
+    g_mutex_unlock (&latency->lock);
+
+    qsort (sorted, n, sizeof (guint32), gst_v4l2_latency_compare);
+
+    for (j = 0; j < G_N_ELEMENTS (percentiles); j++) {
+      gchar name[32];
+      guint rank = (n * percentiles[j] + 99) / 100;
+
+      g_snprintf (name, sizeof (name), "%s-p%u-us", span_names[i],
+          percentiles[j]);
+      gst_structure_set (s, name, G_TYPE_UINT64,
+          (guint64) (n ? sorted[MAX (rank, 1) - 1] : 0), NULL);
+    }
+  }
+
+  g_mutex_lock (&latency->lock);
+  frames = latency->frames;
+  unmatched = latency->unmatched;
+  if (GST_CLOCK_TIME_IS_VALID (latency->first_input)
+      && GST_CLOCK_TIME_IS_VALID (latency->first_push))
+    first_frame = (latency->first_push - latency->first_input) / GST_USECOND;
+  format_wait = latency->format_wait / GST_USECOND;
+  g_mutex_unlock (&latency->lock);
+
+  gst_structure_set (s, "frames", G_TYPE_UINT64, frames,
+      "unmatched", G_TYPE_UINT64, unmatched,
+      "first-frame-us", G_TYPE_UINT64, first_frame,
+      "format-wait-us", G_TYPE_UINT64, format_wait, NULL);
+
+  g_free (sorted);
+
+  return s;
+}
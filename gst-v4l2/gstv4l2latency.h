@@ -0,0 +1,114 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __GST_V4L2_LATENCY_H__
+#define __GST_V4L2_LATENCY_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstV4l2Object GstV4l2Object;
+typedef struct _GstV4l2LatencyMeta GstV4l2LatencyMeta;
+typedef struct _GstV4l2Latency GstV4l2Latency;
+
+/* Points of a frame's way through the element, as monotonic times in ns */
+typedef enum
+{
+  GST_V4L2_LATENCY_INPUT,           /* handle_frame called */
+  GST_V4L2_LATENCY_OUTPUT_QBUF,
+  GST_V4L2_LATENCY_OUTPUT_DQBUF,
+  GST_V4L2_LATENCY_CAPTURE_DQBUF,
+  GST_V4L2_LATENCY_PUSH,            /* frame handed to finish_frame */
+  GST_V4L2_LATENCY_N_STAMPS
+} GstV4l2LatencyStamp;
+
+/* Intervals aggregated on the element */
+typedef enum
+{
+  GST_V4L2_LATENCY_SPAN_TOTAL,      /* input to push */
+  GST_V4L2_LATENCY_SPAN_SUBMIT,     /* input to output QBUF */
+  GST_V4L2_LATENCY_SPAN_DEVICE,     /* output QBUF to capture DQBUF */
+  GST_V4L2_LATENCY_SPAN_DELIVER,    /* capture DQBUF to push */
+  GST_V4L2_LATENCY_N_SPANS
+} GstV4l2LatencySpan;
+
+/* Stamps of a frame, attached to the output buffer when enabled. The meta
+ * is pooled with the buffer so it is only allocated once per buffer. A stamp
+ * is GST_CLOCK_TIME_NONE when it could not be matched to the frame. */
+struct _GstV4l2LatencyMeta
+{
+  GstMeta meta;
+
+  GstClockTime stamps[GST_V4L2_LATENCY_N_STAMPS];
+};
+
+GType gst_v4l2_latency_meta_api_get_type (void);
+#define GST_V4L2_LATENCY_META_API_TYPE (gst_v4l2_latency_meta_api_get_type())
+
+const GstMetaInfo *gst_v4l2_latency_meta_get_info (void);
+#define GST_V4L2_LATENCY_META_INFO (gst_v4l2_latency_meta_get_info())
+
+#define gst_buffer_get_v4l2_latency_meta(b) \
+  ((GstV4l2LatencyMeta *) gst_buffer_get_meta ((b), GST_V4L2_LATENCY_META_API_TYPE))
+
+#define GST_V4L2_LATENCY_RING    256    /* frames in flight */
+#define GST_V4L2_LATENCY_WINDOW  1024   /* samples for the percentiles */
+
+/* Per-element state, all storage is preallocated so the latency can always
+ * be measured */
+struct _GstV4l2Latency
+{
+  GMutex lock;
+
+  /* input time of the frames in flight, by system_frame_number */
+  GstClockTime input[GST_V4L2_LATENCY_RING];
+
+  /* last GST_V4L2_LATENCY_WINDOW intervals, in microseconds */
+  guint32 window[GST_V4L2_LATENCY_N_SPANS][GST_V4L2_LATENCY_WINDOW];
+  guint filled[GST_V4L2_LATENCY_N_SPANS];
+  guint pos[GST_V4L2_LATENCY_N_SPANS];
+
+  guint64 frames;
+  guint64 unmatched;
+
+  /* startup after a reset: first input, first push and the time spent
+   * waiting for the stream format in between */
+  GstClockTime first_input;
+  GstClockTime first_push;
+  GstClockTime format_wait;
+};
+
+void gst_v4l2_latency_init (GstV4l2Latency * latency);
+void gst_v4l2_latency_clear (GstV4l2Latency * latency);
+void gst_v4l2_latency_reset (GstV4l2Latency * latency);
+
+void gst_v4l2_latency_input (GstV4l2Latency * latency, guint32 frame_number);
+void gst_v4l2_latency_output (GstV4l2Latency * latency, guint32 frame_number,
+    GstBuffer * buffer, GstV4l2Object * output, GstV4l2Object * capture,
+    gboolean attach_meta, const gchar * reference_name);
+void gst_v4l2_latency_format_wait (GstV4l2Latency * latency,
+    GstClockTime wait);
+
+GstStructure *gst_v4l2_latency_get_stats (GstV4l2Latency * latency);
+
+G_END_DECLS
+
+#endif /* __GST_V4L2_LATENCY_H__ */
@@ -38,6 +38,10 @@
 
 #include "linux/videodev2.h"
 #include "gstv4l2object.h"
+#ifdef USE_V4L2_TARGET_NV
+#include "v4l2-fake.h"
+#include "gstv4l2personality.h"
+#endif
 
 #ifndef USE_V4L2_TARGET_NV
 #include "gstv4l2tuner.h"
@@ -579,7 +583,24 @@ gst_v4l2_object_new (GstElement * element,
 
   v4l2object->no_initial_format = FALSE;
 
+#ifdef USE_V4L2_TARGET_NV
+  v4l2object->personality = &gst_v4l2_personality_generic;
+#endif
+
   /* We now disable libv4l2 by default, but have an env to enable it. */
+#ifdef USE_V4L2_TARGET_NV
+  /* The fake device takes precedence, plugin_init always sets
+   * GST_V4L2_USE_LIBV4L2 */
+  if (gst_v4l2_fake_device_enabled ()) {
+    v4l2object->fd_open = NULL;
+    v4l2object->close = gst_v4l2_fake_close;
+    v4l2object->dup = gst_v4l2_fake_dup;
+    v4l2object->ioctl = gst_v4l2_fake_ioctl;
+    v4l2object->read = gst_v4l2_fake_read;
+    v4l2object->mmap = gst_v4l2_fake_mmap;
+    v4l2object->munmap = gst_v4l2_fake_munmap;
+  } else
+#endif
 #ifdef HAVE_LIBV4L2
   if (g_getenv ("GST_V4L2_USE_LIBV4L2")) {
     v4l2object->fd_open = v4l2_fd_open;
@@ -601,6 +622,11 @@ gst_v4l2_object_new (GstElement * element,
     v4l2object->munmap = munmap;
   }
 
+#ifdef USE_V4L2_TARGET_NV
+  v4l2object->stream_ioctl = v4l2object->ioctl;
+  v4l2object->direct_ioctl = g_getenv ("GST_V4L2_DIRECT_IOCTL") != NULL;
+#endif
+
   return v4l2object;
 }
 
@@ -972,6 +998,7 @@ gst_v4l2_object_open (GstV4l2Object * v4l2object)
     return FALSE;
   v4l2object->is_encode = !g_strcmp0(v4l2object->videodev, V4L2_DEVICE_PATH_NVENC)
                           || !g_strcmp0(v4l2object->videodev, V4L2_DEVICE_PATH_NVENC_ALT);
+  v4l2object->personality = gst_v4l2_personality_select (v4l2object);
 #endif
 
   return TRUE;
@@ -983,6 +1010,10 @@ gst_v4l2_object_open_shared (GstV4l2Object * v4l2object, GstV4l2Object * other)
   gboolean ret;
 
   ret = gst_v4l2_dup (v4l2object, other);
+#ifdef USE_V4L2_TARGET_NV
+  if (ret)
+    v4l2object->personality = other->personality;
+#endif
 
   return ret;
 }
@@ -3118,39 +3149,7 @@ gst_v4l2_object_setup_pool (GstV4l2Object * v4l2object, GstCaps * caps)
   /* TODO : Remove forced mode setting once supported */
   if (v4l2object->device_caps & V4L2_CAP_STREAMING) {
     if (v4l2object->req_mode == GST_V4L2_IO_AUTO) {
-      if ((V4L2_TYPE_IS_OUTPUT (v4l2object->type)) &&
-          (!strcmp (v4l2object->videodev, V4L2_DEVICE_PATH_NVENC)
-           || !strcmp (v4l2object->videodev, V4L2_DEVICE_PATH_NVENC_ALT))) {
-        /* Currently, DMABUF_IMPORT io mode is used on encoder
-           output plane, when default mode V4L2_IO_AUTO is set */
-
-        if (is_cuvid == TRUE) {
-          mode = GST_V4L2_IO_MMAP; //TODO make this default to dmabuf_import
-        } else if (is_cuvid == FALSE) {
-          mode = GST_V4L2_IO_DMABUF_IMPORT;
-        }
-      } else {
-        if (is_cuvid == TRUE){
-          mode = GST_V4L2_IO_MMAP;
-        } else {
-          /* Currently, MMAP io mode is used on encoder
-             capture plane, when default mode V4L2_IO_AUTO is set.
-             Currently, MMAP io mode is used on decoder
-             capture plane and USERPTR io mode is used on decoder
-             output plane, when default mode V4L2_IO_AUTO is set. */
-          if (V4L2_TYPE_IS_OUTPUT (v4l2object->type)) {
-            mode = GST_V4L2_IO_USERPTR;
-            if((GST_V4L2_PIXELFORMAT(v4l2object) == V4L2_PIX_FMT_MJPEG) ||
-                (GST_V4L2_PIXELFORMAT(v4l2object) == V4L2_PIX_FMT_JPEG))
-              /* Note: Currently, MMAP io mode is used on JPEG decoder output and
-               * capture plane, when default mode V4L2_IO_AUTO is set.
-               * */
-              mode = GST_V4L2_IO_MMAP; //TODO: Support userptr mode for JPEG
-          } else {
-            mode = GST_V4L2_IO_MMAP;
-          }
-        }
-      }
+      mode = v4l2object->personality->default_io_mode (v4l2object);
     } else if (v4l2object->req_mode == GST_V4L2_IO_USERPTR) {
       /* Currently, USERPTR io mode only supported on decoder
          output plane */
@@ -3181,8 +3180,22 @@ gst_v4l2_object_setup_pool (GstV4l2Object * v4l2object, GstCaps * caps)
   /* Map the buffers */
   GST_LOG_OBJECT (v4l2object->dbg_obj, "initiating buffer pool");
 
+#ifdef USE_V4L2_TARGET_NV
+  {
+    GstBufferPool *pool = gst_v4l2_buffer_pool_new (v4l2object, caps);
+
+    if (!pool)
+      goto buffer_pool_new_failed;
+
+    /* Taken by gst_v4l2_object_ref_pool() from other threads */
+    GST_OBJECT_LOCK (v4l2object->element);
+    v4l2object->pool = pool;
+    GST_OBJECT_UNLOCK (v4l2object->element);
+  }
+#else
   if (!(v4l2object->pool = gst_v4l2_buffer_pool_new (v4l2object, caps)))
     goto buffer_pool_new_failed;
+#endif
 
   GST_V4L2_SET_ACTIVE (v4l2object);
 
@@ -3758,9 +3771,7 @@ gst_v4l2_object_set_format_full (GstV4l2Object * v4l2object, GstCaps * caps,
   }
 
 #ifdef USE_V4L2_TARGET_NV
-  if ((((!strcmp (v4l2object->videodev, V4L2_DEVICE_PATH_NVDEC)) && (is_cuvid == FALSE)) ||
-      ((!strcmp (v4l2object->videodev, V4L2_DEVICE_PATH_NVDEC_ALT)) && (is_cuvid == FALSE)) ||
-      ((!strcmp (v4l2object->videodev, V4L2_DEVICE_PATH_NVDEC_MCCOY)) && (is_cuvid == TRUE))) &&
+  if (v4l2object->personality->is_decoder &&
       (v4l2object->open_mjpeg_block == TRUE) &&
       (g_str_equal(gst_structure_get_name(gst_caps_get_structure (caps, 0)), "image/jpeg")))
     format.fmt.pix_mp.pixelformat = pixelformat = V4L2_PIX_FMT_MJPEG;
@@ -4463,10 +4474,21 @@ gst_v4l2_object_stop (GstV4l2Object * v4l2object)
     goto done;
 
   if (v4l2object->pool) {
+#ifdef USE_V4L2_TARGET_NV
+    GstBufferPool *pool = v4l2object->pool;
+
+    GST_DEBUG_OBJECT (v4l2object->dbg_obj, "deactivating pool");
+    gst_buffer_pool_set_active (pool, FALSE);
+    GST_OBJECT_LOCK (v4l2object->element);
+    v4l2object->pool = NULL;
+    GST_OBJECT_UNLOCK (v4l2object->element);
+    gst_object_unref (pool);
+#else
     GST_DEBUG_OBJECT (v4l2object->dbg_obj, "deactivating pool");
     gst_buffer_pool_set_active (v4l2object->pool, FALSE);
     gst_object_unref (v4l2object->pool);
     v4l2object->pool = NULL;
+#endif
   }
 
   GST_V4L2_SET_INACTIVE (v4l2object);
@@ -4713,9 +4735,7 @@ gst_v4l2_object_decide_allocation (GstV4l2Object * obj, GstQuery * query)
      * pushed downstream the other one can already be queued for the next
      * frame. */
 #ifdef USE_V4L2_TARGET_NV
-    if (((!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC)) && (is_cuvid == FALSE)) ||
-       ((!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC_ALT)) && (is_cuvid == FALSE)) ||
-       ((!strcmp (obj->videodev, V4L2_DEVICE_PATH_NVDEC_MCCOY)) && (is_cuvid == TRUE))) {
+    if (obj->personality->is_decoder) {
       GstV4l2VideoDec *videodec = NULL;
       videodec = GST_V4L2_VIDEO_DEC (obj->element);
       own_min = min + obj->min_buffers + videodec->num_extra_surfaces;
@@ -4996,3 +5016,68 @@ set_v4l2_video_mpeg_class (GstV4l2Object * v4l2object, guint label,
   return TRUE;
 }
 #endif
+
+#ifdef USE_V4L2_TARGET_NV
+/* Statistics of the pools of a mem-to-mem element, one field per plane */
+/* Returns a reference to the current pool, or NULL. The streaming thread
+ * replaces and drops the pool on renegotiation and stop, other threads must
+ * take it with this rather than reading the field */
+GstBufferPool *
+gst_v4l2_object_ref_pool (GstV4l2Object * v4l2object)
+{
+  GstBufferPool *pool;
+
+  GST_OBJECT_LOCK (v4l2object->element);
+  pool = v4l2object->pool ? gst_object_ref (v4l2object->pool) : NULL;
+  GST_OBJECT_UNLOCK (v4l2object->element);
+
+  return pool;
+}
+
+GstStructure *
+gst_v4l2_object_get_m2m_stats (GstV4l2Object * output, GstV4l2Object * capture)
+{
+  GstStructure *s = gst_structure_new_empty ("v4l2-stats");
+  GstV4l2Object *objs[2] = { output, capture };
+  gint i;
+
+  for (i = 0; i < 2; i++) {
+    GstBufferPool *pool = gst_v4l2_object_ref_pool (objs[i]);
+    GstStructure *plane;
+
+    if (!pool)
+      continue;
+
+    plane = gst_v4l2_buffer_pool_get_stats (GST_V4L2_BUFFER_POOL (pool));
+    gst_structure_set (s, gst_structure_get_name (plane), GST_TYPE_STRUCTURE,
+        plane, NULL);
+    gst_structure_free (plane);
+    gst_object_unref (pool);
+  }
+
+  return s;
+}
+
+/* Posts the pool statistics as an element message once every @interval_ms,
+ * to be called from the streaming thread */
+void
+gst_v4l2_object_post_m2m_stats (GstElement * element, GstV4l2Object * output,
+    GstV4l2Object * capture, guint interval_ms, gint64 * last_post)
+{
+  gint64 now;
+
+  if (interval_ms == 0)
+    return;
+
+  now = g_get_monotonic_time ();
+  if (*last_post == 0)
+    *last_post = now;
+  if (now - *last_post < (gint64) interval_ms * 1000)
+    return;
+
+  *last_post = now;
+  gst_element_post_message (element,
+      gst_message_new_element (GST_OBJECT (element),
+          gst_v4l2_object_get_m2m_stats (output, capture)));
+}
+#endif
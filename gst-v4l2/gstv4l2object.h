@@ -44,6 +44,9 @@
 
 typedef struct _GstV4l2Object GstV4l2Object;
 typedef struct _GstV4l2ObjectClassHelper GstV4l2ObjectClassHelper;
+#ifdef USE_V4L2_TARGET_NV
+typedef struct _GstV4l2Personality GstV4l2Personality;
+#endif
 
 #include <gstv4l2bufferpool.h>
 
@@ -149,6 +152,8 @@ struct _GstV4l2Object {
 
 #ifdef USE_V4L2_TARGET_NV
   gboolean is_encode;
+  /* backend specific behaviour, selected when the device is opened */
+  const GstV4l2Personality *personality;
 #endif
 
   /* the video-device's file descriptor */
@@ -242,6 +247,14 @@ struct _GstV4l2Object {
   gpointer (*mmap) (gpointer start, gsize length, gint prot, gint flags,
       gint fd,  off_t offset);
   gint (*munmap) (gpointer _start, gsize length);
+#ifdef USE_V4L2_TARGET_NV
+  /* Used for QBUF, DQBUF and the per-buffer controls. Either ioctl, or
+   * the raw ioctl(2) once gst_v4l2_probe_direct_ioctl found libv4l2 has
+   * nothing to emulate on this fd */
+  gint (*stream_ioctl) (gint fd, gulong request, ...);
+  /* GST_V4L2_DIRECT_IOCTL is set */
+  gboolean direct_ioctl;
+#endif
 
   /* Quirks */
   /* Skips interlacing probes */
@@ -352,6 +365,11 @@ GstStructure * gst_v4l2_object_v4l2fourcc_to_structure (guint32 fourcc);
 gboolean     gst_v4l2_open           (GstV4l2Object * v4l2object);
 gboolean     gst_v4l2_dup            (GstV4l2Object * v4l2object, GstV4l2Object * other);
 gboolean     gst_v4l2_close          (GstV4l2Object * v4l2object);
+#ifdef USE_V4L2_TARGET_NV
+void         gst_v4l2_probe_direct_ioctl (GstV4l2Object * v4l2object);
+gint         gst_v4l2_wait_event     (GstV4l2Object * v4l2object,
+                                      struct v4l2_event * event, gint64 timeout_us);
+#endif
 
 /* norm/input/output */
 gboolean     gst_v4l2_get_norm       (GstV4l2Object * v4l2object, v4l2_std_id * norm);
@@ -374,6 +392,14 @@ gboolean     gst_v4l2_set_controls    (GstV4l2Object * v4l2object, GstStructure
 #ifdef USE_V4L2_TARGET_NV
 gboolean set_v4l2_video_mpeg_class (GstV4l2Object * v4l2object, guint label,
     gint params);
+
+/* pool statistics */
+GstBufferPool * gst_v4l2_object_ref_pool (GstV4l2Object * v4l2object);
+GstStructure * gst_v4l2_object_get_m2m_stats (GstV4l2Object * output,
+    GstV4l2Object * capture);
+void gst_v4l2_object_post_m2m_stats (GstElement * element,
+    GstV4l2Object * output, GstV4l2Object * capture, guint interval_ms,
+    gint64 * last_post);
 #endif
 
 G_END_DECLS
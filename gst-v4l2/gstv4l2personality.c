@@ -0,0 +1,377 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#include "gstv4l2object.h"
+#include "gstv4l2personality.h"
+#include "nvbufsurftransform.h"
+
+GST_DEBUG_CATEGORY_EXTERN (v4l2_debug);
+#define GST_CAT_DEFAULT v4l2_debug
+
+static GstV4l2IOMode
+gst_v4l2_personality_tegra_dec_io_mode (GstV4l2Object * obj)
+{
+  /* Currently, MMAP io mode is used on decoder capture plane and USERPTR io
+   * mode is used on decoder output plane, when default mode V4L2_IO_AUTO is
+   * set. */
+  if (!V4L2_TYPE_IS_OUTPUT (obj->type))
+    return GST_V4L2_IO_MMAP;
+
+  /* Note: Currently, MMAP io mode is used on JPEG decoder output and capture
+   * plane, when default mode V4L2_IO_AUTO is set. */
+  if (GST_V4L2_PIXELFORMAT (obj) == V4L2_PIX_FMT_MJPEG ||
+      GST_V4L2_PIXELFORMAT (obj) == V4L2_PIX_FMT_JPEG)
+    return GST_V4L2_IO_MMAP;    //TODO: Support userptr mode for JPEG
+
+  return GST_V4L2_IO_USERPTR;
+}
+
+static GstV4l2IOMode
+gst_v4l2_personality_tegra_enc_io_mode (GstV4l2Object * obj)
+{
+  /* Currently, DMABUF_IMPORT io mode is used on encoder output plane and
+   * MMAP io mode on encoder capture plane, when default mode V4L2_IO_AUTO is
+   * set */
+  if (V4L2_TYPE_IS_OUTPUT (obj->type))
+    return GST_V4L2_IO_DMABUF_IMPORT;
+
+  return GST_V4L2_IO_MMAP;
+}
+
+static GstV4l2IOMode
+gst_v4l2_personality_cuvid_io_mode (GstV4l2Object * obj)
+{
+  return GST_V4L2_IO_MMAP;      //TODO make this default to dmabuf_import
+}
+
+static GstV4l2IOMode
+gst_v4l2_personality_generic_io_mode (GstV4l2Object * obj)
+{
+  if (is_cuvid)
+    return gst_v4l2_personality_cuvid_io_mode (obj);
+
+  return gst_v4l2_personality_tegra_dec_io_mode (obj);
+}
+
+static GstFlowReturn
+gst_v4l2_personality_copy_metadata (GstV4l2Object * obj, GstBuffer * dest,
+    GstBuffer * src)
+{
+  if (!gst_buffer_copy_into (dest, src,
+          GST_BUFFER_COPY_FLAGS | GST_BUFFER_COPY_TIMESTAMPS, 0, -1))
+    GST_ERROR_OBJECT (src, "Copy Failed");
+
+  return GST_FLOW_OK;
+}
+
+/* The encoded bitstream lives in the NvBufSurface behind the capture buffer
+ * and is not reachable through the GstMemory */
+static GstFlowReturn
+gst_v4l2_personality_copy_bitstream (GstV4l2Object * obj, GstBuffer * dest,
+    GstBuffer * src)
+{
+  GstMapInfo outmap = { NULL, (GstMapFlags) 0, NULL, 0, 0, };
+  GstV4l2Memory *outmemory = (GstV4l2Memory *) gst_buffer_peek_memory (src, 0);
+  NvBufSurface *nvbuf_surf = NULL;
+  gboolean already_mapped = FALSE;
+  gint retn;
+
+  gst_v4l2_personality_copy_metadata (obj, dest, src);
+
+  retn = NvBufSurfaceFromFd (outmemory->dmafd, (void **) (&nvbuf_surf));
+  if (retn != 0) {
+    GST_ERROR_OBJECT (src, "NvBufSurfaceFromFd Failed for fd = %d",
+        outmemory->dmafd);
+    return GST_FLOW_ERROR;
+  }
+
+  if (!nvbuf_surf->surfaceList[0].mappedAddr.addr[0])
+    retn = NvBufSurfaceMap (nvbuf_surf, 0, 0, NVBUF_MAP_READ_WRITE);
+  else
+    //Dont do unmapping
+    already_mapped = TRUE;
+  if (retn != 0) {
+    GST_ERROR_OBJECT (src, "NvBufSurfaceMap Failed for fd = %d",
+        outmemory->dmafd);
+    return GST_FLOW_ERROR;
+  }
+
+  if (!gst_buffer_map (dest, &outmap, GST_MAP_WRITE)) {
+    GST_ERROR_OBJECT (obj->dbg_obj, "could not map buffer");
+    return GST_FLOW_ERROR;
+  }
+
+  memcpy (outmap.data, nvbuf_surf->surfaceList[0].mappedAddr.addr[0],
+      gst_buffer_get_size (src));
+  gst_buffer_unmap (dest, &outmap);
+
+  //Unmap only if we have mapped it
+  if (!already_mapped && NvBufSurfaceUnMap (nvbuf_surf, 0, 0) != 0) {
+    GST_ERROR_OBJECT (src, "NvBufSurfaceUnMap Failed for fd = %d",
+        outmemory->dmafd);
+    return GST_FLOW_ERROR;
+  }
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_v4l2_personality_tegra_enc_copy (GstV4l2Object * obj, GstBuffer * dest,
+    GstBuffer * src)
+{
+#ifndef USE_V4L2_TARGET_NV_X86
+  NvBufSurfTransformParams transform_params;
+  GstMapInfo inmap = { NULL, (GstMapFlags) 0, NULL, 0, 0, };
+  GstV4l2Memory *inmemory;
+  NvBufSurface *nvbuf_surf = NULL;
+  gint retn;
+#endif
+
+  if (!V4L2_TYPE_IS_OUTPUT (obj->type))
+    return gst_v4l2_personality_copy_bitstream (obj, dest, src);
+
+#ifndef USE_V4L2_TARGET_NV_X86
+  memset (&transform_params, 0, sizeof (NvBufSurfTransformParams));
+
+  if (!gst_buffer_map (src, &inmap, GST_MAP_READ)) {
+    GST_ERROR_OBJECT (obj->dbg_obj, "could not map buffer");
+    return GST_FLOW_ERROR;
+  }
+
+  inmemory = (GstV4l2Memory *) gst_buffer_peek_memory (dest, 0);
+  NvBufSurfaceFromFd (inmemory->dmafd, (void **) (&nvbuf_surf));
+
+  retn = NvBufSurfTransform ((NvBufSurface *) inmap.data, nvbuf_surf,
+      &transform_params);
+  gst_buffer_unmap (src, &inmap);
+  if (retn != 0) {
+    GST_ERROR_OBJECT (src, "NvBufSurfTransform Failed");
+    return GST_FLOW_ERROR;
+  }
+#endif
+
+  return GST_FLOW_OK;
+}
+
+static GstFlowReturn
+gst_v4l2_personality_cuvid_enc_copy (GstV4l2Object * obj, GstBuffer * dest,
+    GstBuffer * src)
+{
+  GstMapInfo inmap = { NULL, (GstMapFlags) 0, NULL, 0, 0, };
+  GstV4l2Memory *inmemory;
+  NvBufSurface *dst_bufsurf = NULL;
+  gint retn;
+
+  if (!V4L2_TYPE_IS_OUTPUT (obj->type))
+    return gst_v4l2_personality_copy_bitstream (obj, dest, src);
+
+  if (!gst_buffer_map (src, &inmap, GST_MAP_READ)) {
+    GST_ERROR_OBJECT (obj->dbg_obj, "could not map buffer");
+    return GST_FLOW_ERROR;
+  }
+
+  inmemory = (GstV4l2Memory *) gst_buffer_peek_memory (dest, 0);
+
+  retn = NvBufSurfaceFromFd (inmemory->dmafd, (void **) (&dst_bufsurf));
+  if (retn != 0) {
+    GST_ERROR_OBJECT (src, "NvBufSurfaceFromFd Failed");
+    gst_buffer_unmap (src, &inmap);
+    return GST_FLOW_ERROR;
+  }
+
+  retn = NvBufSurfaceCopy ((NvBufSurface *) inmap.data, dst_bufsurf);
+  gst_buffer_unmap (src, &inmap);
+  if (retn != 0) {
+    GST_ERROR_OBJECT (src, "NvBufSurfaceCopy Failed");
+    return GST_FLOW_ERROR;
+  }
+
+  return GST_FLOW_OK;
+}
+
+static void
+gst_v4l2_personality_dec_dqbuf_fixup (GstV4l2Object * obj,
+    struct v4l2_buffer *buffer)
+{
+  /* The decoder capture plane carries an NvBufSurface, whatever the driver
+   * says it used */
+  if (V4L2_TYPE_IS_MULTIPLANAR (obj->type))
+    buffer->m.planes[0].bytesused = sizeof (NvBufSurface);
+}
+
+static void
+report_metadata (GstV4l2Object * obj, guint32 buffer_index,
+    v4l2_ctrl_videodec_outputbuf_metadata * metadata)
+{
+  if (obj->Enable_frame_type_reporting) {
+    switch (metadata->CodecParams.H264DecParams.FrameType) {
+      case 0:
+        g_print ("FrameType = B\n");
+        break;
+      case 1:
+        g_print ("FrameType = P\n");
+        break;
+      case 2:
+        g_print ("FrameType = I\n");
+        if (metadata->CodecParams.H264DecParams.dpbInfo.currentFrame.bIdrFrame) {
+          g_print (" (IDR)\n");
+        }
+        break;
+    }
+    g_print ("nActiveRefFrames = %d\n",
+        metadata->CodecParams.H264DecParams.dpbInfo.nActiveRefFrames);
+  }
+  if (obj->Enable_error_check) {
+    g_print
+        ("ErrorType= %d  Decoded MBs= %d  Concealed MBs= %d  FrameDecodeTime %d\n",
+        metadata->FrameDecStats.DecodeError, metadata->FrameDecStats.DecodedMBs,
+        metadata->FrameDecStats.ConcealedMBs,
+        metadata->FrameDecStats.FrameDecodeTime);
+  }
+}
+
+static void
+v4l2_video_dec_get_enable_frame_type_reporting (GstV4l2Object * obj,
+    guint32 buffer_index, v4l2_ctrl_videodec_outputbuf_metadata * dec_metadata)
+{
+  v4l2_ctrl_video_metadata metadata;
+  struct v4l2_ext_control control;
+  struct v4l2_ext_controls ctrls;
+  gint ret = -1;
+
+  ctrls.count = 1;
+  ctrls.controls = &control;
+  ctrls.ctrl_class = V4L2_CTRL_CLASS_MPEG;
+
+  metadata.buffer_index = buffer_index;
+  metadata.VideoDecMetadata = dec_metadata;
+
+  control.id = V4L2_CID_MPEG_VIDEODEC_METADATA;
+  control.string = (gchar *) &metadata;
+
+  ret = obj->stream_ioctl (obj->video_fd, VIDIOC_G_EXT_CTRLS, &ctrls);
+  if (ret < 0)
+    g_print ("Error while getting report metadata\n");
+}
+
+static void
+gst_v4l2_personality_dec_fetch_metadata (GstV4l2Object * obj, guint32 index)
+{
+  v4l2_ctrl_videodec_outputbuf_metadata dec_metadata;
+
+  if (!obj->Enable_frame_type_reporting && !obj->Enable_error_check)
+    return;
+
+  memset ((void *) &dec_metadata, 0, sizeof (dec_metadata));
+  v4l2_video_dec_get_enable_frame_type_reporting (obj, index, &dec_metadata);
+  report_metadata (obj, index, &dec_metadata);
+}
+
+static void
+gst_v4l2_personality_enc_fetch_metadata (GstV4l2Object * obj, guint32 index)
+{
+  v4l2_ctrl_videoenc_outputbuf_metadata_MV enc_mv_metadata;
+  guint32 numMVs, i;
+  MVInfo *pInfo;
+
+  if (!obj->enableMVBufferMeta)
+    return;
+
+  memset ((void *) &enc_mv_metadata, 0, sizeof (enc_mv_metadata));
+  if (get_motion_vectors (obj, index, &enc_mv_metadata) != 0)
+    return;
+
+  numMVs = enc_mv_metadata.bufSize / sizeof (MVInfo);
+  pInfo = enc_mv_metadata.pMVInfo;
+  g_print ("Num MVs = %d \n", numMVs);
+
+  for (i = 0; i < numMVs; i++, pInfo++)
+    g_print ("%d: mv_x=%d mv_y=%d weight=%d\n ", i, pInfo->mv_x,
+        pInfo->mv_y, pInfo->weight);
+}
+
+const GstV4l2Personality gst_v4l2_personality_generic = {
+  "generic", FALSE, FALSE, FALSE,
+  gst_v4l2_personality_generic_io_mode,
+  NULL, NULL, NULL
+};
+
+static const GstV4l2Personality gst_v4l2_personality_tegra_dec = {
+  "tegra-dec", TRUE, FALSE, FALSE,
+  gst_v4l2_personality_tegra_dec_io_mode,
+  gst_v4l2_personality_copy_metadata,
+  gst_v4l2_personality_dec_dqbuf_fixup,
+  gst_v4l2_personality_dec_fetch_metadata
+};
+
+static const GstV4l2Personality gst_v4l2_personality_cuvid_dec = {
+  "cuvid-dec", TRUE, FALSE, TRUE,
+  gst_v4l2_personality_cuvid_io_mode,
+  gst_v4l2_personality_copy_metadata,
+  gst_v4l2_personality_dec_dqbuf_fixup,
+  gst_v4l2_personality_dec_fetch_metadata
+};
+
+static const GstV4l2Personality gst_v4l2_personality_tegra_enc = {
+  "tegra-enc", FALSE, TRUE, FALSE,
+  gst_v4l2_personality_tegra_enc_io_mode,
+  gst_v4l2_personality_tegra_enc_copy,
+  NULL,
+  gst_v4l2_personality_enc_fetch_metadata
+};
+
+static const GstV4l2Personality gst_v4l2_personality_cuvid_enc = {
+  "cuvid-enc", FALSE, TRUE, TRUE,
+  gst_v4l2_personality_cuvid_io_mode,
+  gst_v4l2_personality_cuvid_enc_copy,
+  NULL,
+  gst_v4l2_personality_enc_fetch_metadata
+};
+
+const GstV4l2Personality *
+gst_v4l2_personality_select (GstV4l2Object * obj)
+{
+  const GstV4l2Personality *personality = &gst_v4l2_personality_generic;
+  const gchar *dev = obj->videodev;
+
+  if (!g_strcmp0 (dev, V4L2_DEVICE_PATH_NVENC)
+      || !g_strcmp0 (dev, V4L2_DEVICE_PATH_NVENC_ALT)) {
+    personality = is_cuvid ? &gst_v4l2_personality_cuvid_enc :
+        &gst_v4l2_personality_tegra_enc;
+  } else if (!g_strcmp0 (dev, V4L2_DEVICE_PATH_NVDEC)
+      || !g_strcmp0 (dev, V4L2_DEVICE_PATH_NVDEC_ALT)) {
+    if (!is_cuvid)
+      personality = &gst_v4l2_personality_tegra_dec;
+  } else if (!g_strcmp0 (dev, V4L2_DEVICE_PATH_NVDEC_MCCOY)) {
+    if (is_cuvid)
+      personality = &gst_v4l2_personality_cuvid_dec;
+  }
+
+  GST_INFO_OBJECT (obj->dbg_obj, "using the %s personality for %s",
+      personality->name, dev);
+
+  return personality;
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __GST_V4L2_PERSONALITY_H__
+#define __GST_V4L2_PERSONALITY_H__
+
+#include <gstv4l2object.h>
+
+G_BEGIN_DECLS
+
+/* What differs between the NVIDIA codec backends. One personality is
+ * picked per GstV4l2Object when the device is opened, so that the per-frame
+ * paths test flags or call hooks instead of comparing device paths. A NULL
+ * hook means there is nothing to do for that backend. */
+struct _GstV4l2Personality
+{
+  const gchar *name;
+
+  gboolean is_decoder;
+  gboolean is_encoder;
+  gboolean is_cuvid;
+
+  /* io-mode used on the plane of @obj when it is set to auto */
+  GstV4l2IOMode (*default_io_mode) (GstV4l2Object * obj);
+
+  /* Device specific part of copying @src, not from our pool, into @dest */
+  GstFlowReturn (*copy) (GstV4l2Object * obj, GstBuffer * dest,
+      GstBuffer * src);
+
+  /* Fixes up a v4l2_buffer just dequeued from the driver */
+  void (*dqbuf_fixup) (GstV4l2Object * obj, struct v4l2_buffer * buffer);
+
+  /* Fetches the driver metadata of the capture buffer @index just dequeued */
+  void (*fetch_metadata) (GstV4l2Object * obj, guint32 index);
+};
+
+const GstV4l2Personality *gst_v4l2_personality_select (GstV4l2Object * obj);
+
+extern const GstV4l2Personality gst_v4l2_personality_generic;
+
+G_END_DECLS
+
+#endif /* __GST_V4L2_PERSONALITY_H__ */
@@ -0,0 +1,221 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "gstv4l2pollset.h"
+
+GST_DEBUG_CATEGORY_EXTERN (v4l2_debug);
+#define GST_CAT_DEFAULT v4l2_debug
+
+struct _GstV4l2PollSet
+{
+  gint epoll_fd;
+  gint wake_fd;
+  gint device_fd;               /* -1 until a pollable device fd is added */
+  gint flushing;
+};
+
+GstV4l2PollSet *
+gst_v4l2_poll_set_new (void)
+{
+  GstV4l2PollSet *set;
+  struct epoll_event ev = { 0 };
+
+  set = g_new0 (GstV4l2PollSet, 1);
+  set->device_fd = -1;
+
+  set->epoll_fd = epoll_create1 (EPOLL_CLOEXEC);
+  if (set->epoll_fd < 0)
+    goto epoll_failed;
+
+  set->wake_fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (set->wake_fd < 0)
+    goto eventfd_failed;
+
+  ev.events = EPOLLIN;
+  ev.data.fd = set->wake_fd;
+  if (epoll_ctl (set->epoll_fd, EPOLL_CTL_ADD, set->wake_fd, &ev) < 0)
+    goto add_failed;
+
+  return set;
+
+epoll_failed:
+  {
+    GST_ERROR ("could not create epoll set: %s", g_strerror (errno));
+    g_free (set);
+    return NULL;
+  }
+eventfd_failed:
+  {
+    GST_ERROR ("could not create eventfd: %s", g_strerror (errno));
+    close (set->epoll_fd);
+    g_free (set);
+    return NULL;
+  }
+add_failed:
+  {
+    GST_ERROR ("could not poll eventfd: %s", g_strerror (errno));
+    close (set->wake_fd);
+    close (set->epoll_fd);
+    g_free (set);
+    return NULL;
+  }
+}
+
+void
+gst_v4l2_poll_set_free (GstV4l2PollSet * set)
+{
+  if (set == NULL)
+    return;
+
+  close (set->wake_fd);
+  close (set->epoll_fd);
+  g_free (set);
+}
+
+/* Adds the device @fd, waiting for it to be writable on an @output plane,
+ * and readable or having a V4L2 event otherwise. Returns FALSE when @fd does
+ * not support polling. */
+gboolean
+gst_v4l2_poll_set_add_device (GstV4l2PollSet * set, gint fd, gboolean output)
+{
+  struct epoll_event ev = { 0 };
+
+  g_return_val_if_fail (set->device_fd < 0, FALSE);
+
+  ev.events = output ? EPOLLOUT : EPOLLIN | EPOLLPRI;
+  ev.data.fd = fd;
+  if (epoll_ctl (set->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    GST_INFO ("fd %d can't be polled: %s", fd, g_strerror (errno));
+    return FALSE;
+  }
+
+  set->device_fd = fd;
+
+  return TRUE;
+}
+
+gboolean
+gst_v4l2_poll_set_has_device (GstV4l2PollSet * set)
+{
+  return set->device_fd >= 0;
+}
+
+void
+gst_v4l2_poll_set_wake (GstV4l2PollSet * set)
+{
+  guint64 one = 1;
+
+  if (write (set->wake_fd, &one, sizeof (one)) < 0)
+    GST_WARNING ("failed to signal eventfd: %s", g_strerror (errno));
+}
+
+/* While flushing, waits return GST_V4L2_POLL_FLUSHING right away */
+void
+gst_v4l2_poll_set_set_flushing (GstV4l2PollSet * set, gboolean flushing)
+{
+  g_atomic_int_set (&set->flushing, flushing);
+  if (flushing)
+    gst_v4l2_poll_set_wake (set);
+}
+
+gboolean
+gst_v4l2_poll_set_is_flushing (GstV4l2PollSet * set)
+{
+  return g_atomic_int_get (&set->flushing);
+}
+
+static void
+gst_v4l2_poll_set_clear_wake (GstV4l2PollSet * set)
+{
+  guint64 count;
+
+  if (read (set->wake_fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+    GST_WARNING ("failed to read eventfd: %s", g_strerror (errno));
+}
+
+/* Waits up to @timeout_us, or forever when negative, for the device or the
+ * eventfd. A wakeup is only reported once. */
+guint
+gst_v4l2_poll_set_wait (GstV4l2PollSet * set, gint64 timeout_us)
+{
+  struct epoll_event events[2];
+  guint result = 0;
+  gint n, i;
+
+  if (g_atomic_int_get (&set->flushing))
+    return GST_V4L2_POLL_FLUSHING;
+
+  n = epoll_wait (set->epoll_fd, events, G_N_ELEMENTS (events),
+      timeout_us < 0 ? -1 : (gint) ((timeout_us + 999) / 1000));
+  if (n < 0)
+    return errno == EINTR ? 0 : GST_V4L2_POLL_ERROR;
+
+  for (i = 0; i < n; i++) {
+    if (events[i].data.fd == set->wake_fd) {
+      gst_v4l2_poll_set_clear_wake (set);
+      result |= GST_V4L2_POLL_WAKE;
+      continue;
+    }
+
+    if (events[i].events & (EPOLLIN | EPOLLOUT))
+      result |= GST_V4L2_POLL_DEVICE;
+    if (events[i].events & EPOLLPRI)
+      result |= GST_V4L2_POLL_EVENT;
+    if (events[i].events & (EPOLLERR | EPOLLHUP))
+      result |= GST_V4L2_POLL_ERROR;
+  }
+
+  if (g_atomic_int_get (&set->flushing))
+    result |= GST_V4L2_POLL_FLUSHING;
+
+  return result;
+}
+
+/* Waits for gst_v4l2_poll_set_wake() or flushing only. V4L2 devices report
+ * POLLERR while nothing is queued, so the device can't be part of this
+ * wait. */
+guint
+gst_v4l2_poll_set_wait_wake (GstV4l2PollSet * set)
+{
+  struct pollfd pfd = { set->wake_fd, POLLIN, 0 };
+
+  if (g_atomic_int_get (&set->flushing))
+    return GST_V4L2_POLL_FLUSHING;
+
+  if (poll (&pfd, 1, -1) < 0)
+    return errno == EINTR ? 0 : GST_V4L2_POLL_ERROR;
+
+  gst_v4l2_poll_set_clear_wake (set);
+
+  if (g_atomic_int_get (&set->flushing))
+    return GST_V4L2_POLL_FLUSHING | GST_V4L2_POLL_WAKE;
+
+  return GST_V4L2_POLL_WAKE;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __GST_V4L2_POLL_SET_H__
+#define __GST_V4L2_POLL_SET_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstV4l2PollSet GstV4l2PollSet;
+
+/* What gst_v4l2_poll_set_wait() woke up for, 0 on timeout */
+typedef enum
+{
+  GST_V4L2_POLL_WAKE     = (1 << 0),    /* gst_v4l2_poll_set_wake() was called */
+  GST_V4L2_POLL_FLUSHING = (1 << 1),
+  GST_V4L2_POLL_DEVICE   = (1 << 2),    /* a buffer can be dequeued */
+  GST_V4L2_POLL_EVENT    = (1 << 3),    /* a V4L2 event can be dequeued */
+  GST_V4L2_POLL_ERROR    = (1 << 4),
+} GstV4l2PollResult;
+
+/* An epoll set with the device fd of a plane and an eventfd, so that buffer
+ * completions, V4L2 events, new buffers being queued and flushing all wake
+ * up the single thread dequeuing that plane. */
+GstV4l2PollSet *gst_v4l2_poll_set_new (void);
+void gst_v4l2_poll_set_free (GstV4l2PollSet * set);
+
+gboolean gst_v4l2_poll_set_add_device (GstV4l2PollSet * set, gint fd,
+    gboolean output);
+gboolean gst_v4l2_poll_set_has_device (GstV4l2PollSet * set);
+
+void gst_v4l2_poll_set_wake (GstV4l2PollSet * set);
+void gst_v4l2_poll_set_set_flushing (GstV4l2PollSet * set, gboolean flushing);
+gboolean gst_v4l2_poll_set_is_flushing (GstV4l2PollSet * set);
+
+guint gst_v4l2_poll_set_wait (GstV4l2PollSet * set, gint64 timeout_us);
+guint gst_v4l2_poll_set_wait_wake (GstV4l2PollSet * set);
+
+G_END_DECLS
+
+#endif /* __GST_V4L2_POLL_SET_H__ */
@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "gstv4l2object.h"
+#include "gstv4l2tracer.h"
+
+#define GST_TYPE_V4L2_TRACER (gst_v4l2_tracer_get_type ())
+
+typedef struct _GstV4l2Tracer GstV4l2Tracer;
+typedef struct _GstV4l2TracerClass GstV4l2TracerClass;
+
+struct _GstV4l2Tracer
+{
+  GstTracer parent;
+};
+
+struct _GstV4l2TracerClass
+{
+  GstTracerClass parent_class;
+};
+
+GType gst_v4l2_tracer_get_type (void);
+
+G_DEFINE_TYPE (GstV4l2Tracer, gst_v4l2_tracer, GST_TYPE_TRACER);
+
+/* number of live tracer instances, tested by GST_V4L2_TRACE () */
+gint gst_v4l2_tracer_active = 0;
+
+static GstTracerRecord *tr_queue;
+
+static const gchar *event_names[] = {
+  "handle-frame",
+  "qbuf",
+  "dqbuf",
+  "poll-start",
+  "poll-end",
+  "acquire",
+  "finish-frame",
+  "pushed",
+};
+
+void
+gst_v4l2_tracer_log (GstV4l2Object * obj, GstV4l2TraceEvent event,
+    gint index, gint plane, guint bytesused, GstClockTime ts)
+{
+  g_return_if_fail (event < G_N_ELEMENTS (event_names));
+
+  gst_tracer_record_log (tr_queue,
+      obj->element ? GST_OBJECT_NAME (obj->element) : "",
+      event_names[event], V4L2_TYPE_IS_OUTPUT (obj->type) ? "output" :
+      "capture", index, plane, bytesused, (guint64) ts,
+      (guint64) gst_util_get_timestamp ());
+}
+
+static GstStructure *
+gst_v4l2_tracer_field (GType type, const gchar * description)
+{
+  return gst_structure_new ("value",
+      "type", G_TYPE_GTYPE, type,
+      "description", G_TYPE_STRING, description,
+      "related", GST_TYPE_TRACER_VALUE_SCOPE, GST_TRACER_VALUE_SCOPE_ELEMENT,
+      NULL);
+}
+
+static void
+gst_v4l2_tracer_finalize (GObject * object)
+{
+  g_atomic_int_dec_and_test (&gst_v4l2_tracer_active);
+
+  G_OBJECT_CLASS (gst_v4l2_tracer_parent_class)->finalize (object);
+}
+
+static void
+gst_v4l2_tracer_class_init (GstV4l2TracerClass * klass)
+{
+  GObjectClass *gobject_class = G_OBJECT_CLASS (klass);
+
+  gobject_class->finalize = gst_v4l2_tracer_finalize;
+
+  tr_queue = gst_tracer_record_new ("nvv4l2-queue.class",
+      "element", GST_TYPE_STRUCTURE,
+      gst_v4l2_tracer_field (G_TYPE_STRING, "name of the element"),
+      "event", GST_TYPE_STRUCTURE,
+      gst_v4l2_tracer_field (G_TYPE_STRING, "queue event"),
+      "queue", GST_TYPE_STRUCTURE,
+      gst_v4l2_tracer_field (G_TYPE_STRING, "output or capture"),
+      "index", GST_TYPE_STRUCTURE,
+      gst_v4l2_tracer_field (G_TYPE_INT, "v4l2 buffer index, -1 if none"),
+      "plane", GST_TYPE_STRUCTURE,
+      gst_v4l2_tracer_field (G_TYPE_INT, "buffer plane, -1 if none"),
+      "bytesused", GST_TYPE_STRUCTURE,
+      gst_v4l2_tracer_field (G_TYPE_UINT, "bytes used in the plane"),
+      "ts", GST_TYPE_STRUCTURE,
+      gst_v4l2_tracer_field (G_TYPE_UINT64, "buffer timestamp"),
+      "time", GST_TYPE_STRUCTURE,
+      gst_v4l2_tracer_field (G_TYPE_UINT64, "monotonic time of the event"),
+      NULL);
+  GST_OBJECT_FLAG_SET (tr_queue, GST_OBJECT_FLAG_MAY_BE_LEAKED);
+}
+
+static void
+gst_v4l2_tracer_init (GstV4l2Tracer * self)
+{
+  g_atomic_int_inc (&gst_v4l2_tracer_active);
+}
+
+gboolean
+gst_v4l2_tracer_register (GstPlugin * plugin)
+{
+  return gst_tracer_register (plugin, "nvv4l2", GST_TYPE_V4L2_TRACER);
+}
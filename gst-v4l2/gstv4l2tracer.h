@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __GST_V4L2_TRACER_H__
+#define __GST_V4L2_TRACER_H__
+
+#include <gst/gst.h>
+
+G_BEGIN_DECLS
+
+typedef struct _GstV4l2Object GstV4l2Object;
+
+/* The "nvv4l2" tracer logs one "nvv4l2-queue" record per queue event, with
+ * the element, the queue (output/capture), the buffer index and plane, the
+ * bytesused, the buffer timestamp and the monotonic time of the event:
+ *
+ *   GST_TRACERS=nvv4l2 GST_DEBUG=GST_TRACER:7 gst-launch-1.0 ...
+ *
+ * Together, the events give the timeline of each frame: upstream
+ * (handle-frame), OUTPUT queue (qbuf to dqbuf on output), hardware and
+ * CAPTURE queue (qbuf to dqbuf on capture, poll-start/poll-end),
+ * downstream (finish-frame to pushed). While the tracer is not loaded the
+ * hooks cost a single integer test. */
+typedef enum
+{
+  GST_V4L2_TRACE_HANDLE_FRAME,
+  GST_V4L2_TRACE_QBUF,
+  GST_V4L2_TRACE_DQBUF,
+  GST_V4L2_TRACE_POLL_START,
+  GST_V4L2_TRACE_POLL_END,
+  GST_V4L2_TRACE_ACQUIRE,
+  GST_V4L2_TRACE_FINISH_FRAME,
+  GST_V4L2_TRACE_PUSHED,
+} GstV4l2TraceEvent;
+
+extern gint gst_v4l2_tracer_active;
+
+#define GST_V4L2_TRACE(obj, event, index, plane, bytesused, ts) \
+G_STMT_START { \
+  if (G_UNLIKELY (gst_v4l2_tracer_active)) \
+    gst_v4l2_tracer_log (obj, event, index, plane, bytesused, ts); \
+} G_STMT_END
+
+gboolean gst_v4l2_tracer_register (GstPlugin * plugin);
+
+void gst_v4l2_tracer_log (GstV4l2Object * obj, GstV4l2TraceEvent event,
+    gint index, gint plane, guint bytesused, GstClockTime ts);
+
+G_END_DECLS
+
+#endif /* __GST_V4L2_TRACER_H__ */
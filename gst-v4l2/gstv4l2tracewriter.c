@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "gstv4l2tracewriter.h"
+
+GST_DEBUG_CATEGORY_EXTERN (v4l2_debug);
+#define GST_CAT_DEFAULT v4l2_debug
+
+/* Must be a power of two */
+#define GST_V4L2_TRACE_RING_SIZE     1024
+/* The writer thread wakes up on its own every so often, producers only
+ * signal it when a ring gets half full */
+#define GST_V4L2_TRACE_FLUSH_MS      100
+
+typedef struct
+{
+  V4l2TraceRecord records[GST_V4L2_TRACE_RING_SIZE];
+  guint head;                   /* only written by the producer */
+  guint tail;                   /* only written by the writer thread */
+} GstV4l2TraceRing;
+
+struct _GstV4l2TraceWriter
+{
+  FILE *file;
+  GThread *thread;
+  gint wake_fd;
+  gint running;
+  guint64 dropped;
+
+  GstV4l2TraceRing rings[V4L2_TRACE_N_EVENTS];
+};
+
+static void
+gst_v4l2_trace_writer_wake (GstV4l2TraceWriter * writer)
+{
+  guint64 one = 1;
+
+  if (write (writer->wake_fd, &one, sizeof (one)) < 0)
+    GST_WARNING ("failed to wake the trace writer: %s", g_strerror (errno));
+}
+
+static void
+gst_v4l2_trace_writer_drain (GstV4l2TraceWriter * writer)
+{
+  gint i;
+
+  for (i = 0; i < V4L2_TRACE_N_EVENTS; i++) {
+    GstV4l2TraceRing *ring = &writer->rings[i];
+    guint head = __atomic_load_n (&ring->head, __ATOMIC_ACQUIRE);
+    guint tail = ring->tail;
+
+    while (tail != head) {
+      guint start = tail & (GST_V4L2_TRACE_RING_SIZE - 1);
+      guint n = MIN (head - tail, GST_V4L2_TRACE_RING_SIZE - start);
+
+      if (fwrite (&ring->records[start], sizeof (V4l2TraceRecord), n,
+              writer->file) != n)
+        GST_WARNING ("failed to write trace records: %s", g_strerror (errno));
+      tail += n;
+    }
+
+    __atomic_store_n (&ring->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  fflush (writer->file);
+}
+
+static gpointer
+gst_v4l2_trace_writer_thread (GstV4l2TraceWriter * writer)
+{
+  struct pollfd pfd = { writer->wake_fd, POLLIN, 0 };
+  guint64 count;
+
+  while (g_atomic_int_get (&writer->running)) {
+    if (poll (&pfd, 1, GST_V4L2_TRACE_FLUSH_MS) > 0
+        && read (writer->wake_fd, &count, sizeof (count)) < 0)
+      GST_WARNING ("failed to read the trace writer wakeup: %s",
+          g_strerror (errno));
+
+    gst_v4l2_trace_writer_drain (writer);
+  }
+
+  gst_v4l2_trace_writer_drain (writer);
+
+  return NULL;
+}
+
+GstV4l2TraceWriter *
+gst_v4l2_trace_writer_new (const gchar * path)
+{
+  GstV4l2TraceWriter *writer;
+  V4l2TraceHeader header = { {0} };
+
+  writer = g_new0 (GstV4l2TraceWriter, 1);
+
+  writer->file = fopen (path, "wb");
+  if (writer->file == NULL)
+    goto open_failed;
+
+  memcpy (header.magic, V4L2_TRACE_MAGIC, sizeof (header.magic));
+  header.version = V4L2_TRACE_VERSION;
+  header.record_size = sizeof (V4l2TraceRecord);
+  header.start_time_us = g_get_monotonic_time ();
+  if (fwrite (&header, sizeof (header), 1, writer->file) != 1)
+    goto write_failed;
+
+  writer->wake_fd = eventfd (0, EFD_CLOEXEC);
+  if (writer->wake_fd < 0)
+    goto write_failed;
+
+  writer->running = TRUE;
+  writer->thread = g_thread_new ("v4l2-trace",
+      (GThreadFunc) gst_v4l2_trace_writer_thread, writer);
+
+  return writer;
+
+open_failed:
+  {
+    GST_WARNING ("failed to open trace file %s: %s", path, g_strerror (errno));
+    g_free (writer);
+    return NULL;
+  }
+write_failed:
+  {
+    GST_WARNING ("failed to set up trace file %s: %s", path,
+        g_strerror (errno));
+    fclose (writer->file);
+    g_free (writer);
+    return NULL;
+  }
+}
+
+void
+gst_v4l2_trace_writer_free (GstV4l2TraceWriter * writer)
+{
+  if (writer == NULL)
+    return;
+
+  g_atomic_int_set (&writer->running, FALSE);
+  gst_v4l2_trace_writer_wake (writer);
+  g_thread_join (writer->thread);
+
+  if (writer->dropped)
+    GST_WARNING ("dropped %" G_GUINT64_FORMAT " trace records",
+        writer->dropped);
+
+  close (writer->wake_fd);
+  fclose (writer->file);
+  g_free (writer);
+}
+
+void
+gst_v4l2_trace_writer_push (GstV4l2TraceWriter * writer, guint event,
+    guint32 frame_number, GstClockTime pts, guint32 size, guint32 flags)
+{
+  GstV4l2TraceRing *ring;
+  V4l2TraceRecord *record;
+  guint head, tail;
+
+  g_return_if_fail (event < V4L2_TRACE_N_EVENTS);
+
+  ring = &writer->rings[event];
+  head = ring->head;
+  tail = __atomic_load_n (&ring->tail, __ATOMIC_ACQUIRE);
+
+  if (head - tail >= GST_V4L2_TRACE_RING_SIZE) {
+    __atomic_fetch_add (&writer->dropped, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  record = &ring->records[head & (GST_V4L2_TRACE_RING_SIZE - 1)];
+  record->event = event;
+  record->frame_number = frame_number;
+  record->pts = pts;
+  record->time_us = g_get_monotonic_time ();
+  record->size = size;
+  record->flags = flags;
+
+  __atomic_store_n (&ring->head, head + 1, __ATOMIC_RELEASE);
+
+  if (head - tail + 1 == GST_V4L2_TRACE_RING_SIZE / 2)
+    gst_v4l2_trace_writer_wake (writer);
+}
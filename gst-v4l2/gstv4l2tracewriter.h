@@ -0,0 +1,44 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __GST_V4L2_TRACE_WRITER_H__
+#define __GST_V4L2_TRACE_WRITER_H__
+
+#include <gst/gst.h>
+
+#include "v4l2-trace-format.h"
+
+G_BEGIN_DECLS
+
+typedef struct _GstV4l2TraceWriter GstV4l2TraceWriter;
+
+/* Writes V4l2TraceRecords to a file from a background thread. Each event
+ * has its own preallocated single-producer ring, so all records of a given
+ * event must be pushed from the same thread. Pushing never blocks nor
+ * allocates, records are dropped and counted when a ring is full. */
+GstV4l2TraceWriter *gst_v4l2_trace_writer_new (const gchar * path);
+void gst_v4l2_trace_writer_free (GstV4l2TraceWriter * writer);
+
+void gst_v4l2_trace_writer_push (GstV4l2TraceWriter * writer, guint event,
+    guint32 frame_number, GstClockTime pts, guint32 size, guint32 flags);
+
+G_END_DECLS
+
+#endif /* __GST_V4L2_TRACE_WRITER_H__ */
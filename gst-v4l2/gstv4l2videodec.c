@@ -31,6 +31,7 @@
 #include <string.h>
 #include "gstv4l2object.h"
 #include "gstv4l2videodec.h"
+#include "gstv4l2tracer.h"
 #include "gstnvdsseimeta.h"
 
 #include "stdlib.h"
@@ -48,7 +49,8 @@ typedef enum {
   CAP_BUF_DYNAMIC_ALLOC_DISABLED,
   CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_FW_PLAYBACK,
   CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_RW_PLAYBACK,
-  CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_FW_RW_PLAYBACK
+  CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_FW_RW_PLAYBACK,
+  CAP_BUF_DYNAMIC_ALLOC_ADAPTIVE
 } CaptureBufferDynamicAllocationModes;
 
 #define DEFAULT_SKIP_FRAME_TYPE V4L2_SKIP_FRAMES_TYPE_NONE
@@ -58,6 +60,10 @@ typedef enum {
 #define DEFAULT_ERROR_CHECK FALSE
 #define DEFAULT_MAX_PERFORMANCE FALSE
 #define DEFAULT_CAP_BUF_DYNAMIC_ALLOCATION CAP_BUF_DYNAMIC_ALLOC_DISABLED
+/* cuvid used to wait for the stream format without limit */
+#define DEFAULT_FORMAT_TIMEOUT (is_cuvid ? -1 : 600)
+#define DEFAULT_FAST_FLUSH FALSE
+#define DEFAULT_IDLE_TRIM_TIMEOUT 0
 #define GST_TYPE_V4L2_VID_DEC_SKIP_FRAMES (gst_video_dec_skip_frames ())
 #define GST_TYPE_V4L2_DEC_CAP_BUF_DYNAMIC_ALLOC (gst_video_dec_capture_buffer_dynamic_allocation ())
 
@@ -65,28 +71,29 @@ gboolean default_cudadec_low_latency;
 gboolean default_sei_extract_data;
 gint default_num_extra_surfaces;
 
-static gboolean enable_latency_measurement = FALSE;
 uint8_t *parse_sei_data (uint8_t *bs, guint size, uint32_t *payload_size);
 
 #ifdef USE_V4L2_TARGET_NV
-GstVideoCodecFrame *
-gst_v4l2_video_dec_find_nearest_frame (GstBuffer * buf, GList * frames);
+/* A pending frame this far behind the last decoded one in decoding order is
+ * not going to be output anymore, whatever the reordering of the codec */
+#define GST_V4L2_DEC_REORDER_DEPTH 32
+#define GST_V4L2_DEC_FRAME_SLOT(n) ((n) & (GST_V4L2_DEC_FRAME_INDEX_SIZE - 1))
 
 static void
-gst_v4l2_video_dec_clean_older_frames (GstV4l2VideoDec * self,
-    GstBuffer * buf, GList * frames);
+gst_v4l2_video_dec_add_frame (GstV4l2VideoDec * self,
+    GstVideoCodecFrame * frame);
 
-#endif
+static void
+gst_v4l2_video_dec_remove_frame (GstV4l2VideoDec * self,
+    GstVideoCodecFrame * frame);
 
-static gdouble get_current_system_timestamp(void)
-{
-  struct timeval t1;
-  double elapsedTime = 0;
-  gettimeofday(&t1, NULL);
-  elapsedTime = (t1.tv_sec) * 1000.0;
-  elapsedTime += (t1.tv_usec) / 1000.0;
-  return elapsedTime;
-}
+static GstVideoCodecFrame *
+gst_v4l2_video_dec_take_frame (GstV4l2VideoDec * self, GstBuffer * buf);
+
+static void
+gst_v4l2_video_dec_clear_frames (GstV4l2VideoDec * self);
+
+#endif
 
 static GType
 gst_video_dec_skip_frames (void)
@@ -123,6 +130,8 @@ gst_video_dec_capture_buffer_dynamic_allocation (void)
        "Capture buffer dynamic allocation enabled for reverse playback", "rw_cap_buf_dyn_alloc_enabled"},
       {CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_FW_RW_PLAYBACK,
        "Capture buffer dynamic allocation enabled for forward and reverse playback", "fw_rw_cap_buf_dyn_alloc_enabled"},
+      {CAP_BUF_DYNAMIC_ALLOC_ADAPTIVE,
+       "Capture buffer count adapted to how long downstream holds the buffers", "cap_buf_dyn_alloc_adaptive"},
       {0, NULL, NULL}
     };
 
@@ -234,6 +243,13 @@ enum
   PROP_SKIP_FRAME,
   PROP_DROP_FRAME_INTERVAL,
   PROP_NUM_EXTRA_SURFACES,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_LATENCY,
+  PROP_LATENCY_META,
+  PROP_FORMAT_TIMEOUT,
+  PROP_FAST_FLUSH,
+  PROP_IDLE_TRIM_TIMEOUT,
 /*Properties exposed on Tegra only */
   PROP_DISABLE_DPB,
   PROP_USE_FULL_FRAME,
@@ -363,6 +379,26 @@ gst_v4l2_video_dec_set_property_tegra (GObject * object,
       self->num_extra_surfaces = g_value_get_uint (value);
       break;
 
+    case PROP_STATS_INTERVAL:
+      self->stats_interval = g_value_get_uint (value);
+      break;
+
+    case PROP_LATENCY_META:
+      self->latency_meta = g_value_get_boolean (value);
+      break;
+
+    case PROP_FORMAT_TIMEOUT:
+      self->format_timeout = g_value_get_int (value);
+      break;
+
+    case PROP_FAST_FLUSH:
+      self->fast_flush = g_value_get_boolean (value);
+      break;
+
+    case PROP_IDLE_TRIM_TIMEOUT:
+      self->idle_trim_timeout = g_value_get_uint (value);
+      break;
+
     case PROP_DISABLE_DPB:
       self->disable_dpb = g_value_get_boolean (value);
       break;
@@ -432,6 +468,26 @@ gst_v4l2_video_dec_set_property_cuvid (GObject * object,
       self->num_extra_surfaces = g_value_get_uint (value);
       break;
 
+    case PROP_STATS_INTERVAL:
+      self->stats_interval = g_value_get_uint (value);
+      break;
+
+    case PROP_LATENCY_META:
+      self->latency_meta = g_value_get_boolean (value);
+      break;
+
+    case PROP_FORMAT_TIMEOUT:
+      self->format_timeout = g_value_get_int (value);
+      break;
+
+    case PROP_FAST_FLUSH:
+      self->fast_flush = g_value_get_boolean (value);
+      break;
+
+    case PROP_IDLE_TRIM_TIMEOUT:
+      self->idle_trim_timeout = g_value_get_uint (value);
+      break;
+
     case PROP_CUDADEC_MEM_TYPE:
       self->cudadec_mem_type = g_value_get_enum (value);
       break;
@@ -489,6 +545,35 @@ gst_v4l2_video_dec_get_property_tegra (GObject * object,
       g_value_set_uint (value, self->num_extra_surfaces);
       break;
 
+    case PROP_STATS:
+      g_value_take_boxed (value,
+          gst_v4l2_object_get_m2m_stats (self->v4l2output, self->v4l2capture));
+      break;
+
+    case PROP_STATS_INTERVAL:
+      g_value_set_uint (value, self->stats_interval);
+      break;
+
+    case PROP_LATENCY:
+      g_value_take_boxed (value, gst_v4l2_latency_get_stats (&self->latency));
+      break;
+
+    case PROP_LATENCY_META:
+      g_value_set_boolean (value, self->latency_meta);
+      break;
+
+    case PROP_FORMAT_TIMEOUT:
+      g_value_set_int (value, self->format_timeout);
+      break;
+
+    case PROP_FAST_FLUSH:
+      g_value_set_boolean (value, self->fast_flush);
+      break;
+
+    case PROP_IDLE_TRIM_TIMEOUT:
+      g_value_set_uint (value, self->idle_trim_timeout);
+      break;
+
     case PROP_DISABLE_DPB:
       g_value_set_boolean (value, self->disable_dpb);
       break;
@@ -554,6 +639,35 @@ gst_v4l2_video_dec_get_property_cuvid (GObject * object,
       g_value_set_uint (value, self->num_extra_surfaces);
       break;
 
+    case PROP_STATS:
+      g_value_take_boxed (value,
+          gst_v4l2_object_get_m2m_stats (self->v4l2output, self->v4l2capture));
+      break;
+
+    case PROP_STATS_INTERVAL:
+      g_value_set_uint (value, self->stats_interval);
+      break;
+
+    case PROP_LATENCY:
+      g_value_take_boxed (value, gst_v4l2_latency_get_stats (&self->latency));
+      break;
+
+    case PROP_LATENCY_META:
+      g_value_set_boolean (value, self->latency_meta);
+      break;
+
+    case PROP_FORMAT_TIMEOUT:
+      g_value_set_int (value, self->format_timeout);
+      break;
+
+    case PROP_FAST_FLUSH:
+      g_value_set_boolean (value, self->fast_flush);
+      break;
+
+    case PROP_IDLE_TRIM_TIMEOUT:
+      g_value_set_uint (value, self->idle_trim_timeout);
+      break;
+
     case PROP_CUDADEC_MEM_TYPE:
       g_value_set_enum(value, self->cudadec_mem_type);
       break;
@@ -662,6 +776,121 @@ gst_v4l2_video_dec_close (GstVideoDecoder * decoder)
   return TRUE;
 }
 
+#ifdef USE_V4L2_TARGET_NV
+/* Releases the capture buffers of a decoder that got no input for
+ * idle-trim-timeout. Only done when no frame is pending, so nothing has to
+ * be drained: the processing thread is stopped and the next handle_frame()
+ * allocates the buffers again and restarts it. Nothing is released while
+ * downstream holds capture buffers, a sink keeping its last sample does. */
+static void
+gst_v4l2_video_dec_trim_capture (GstV4l2VideoDec * self)
+{
+  GstVideoDecoder *decoder = GST_VIDEO_DECODER (self);
+  GstBufferPool *pool;
+  GList *frames;
+  GstCaps *caps;
+
+  GST_VIDEO_DECODER_STREAM_LOCK (decoder);
+  pool = self->v4l2capture->pool;
+  if (self->trimmed || !pool || !gst_buffer_pool_is_active (pool) ||
+      !g_atomic_int_get (&self->active) ||
+      gst_pad_get_task_state (decoder->srcpad) != GST_TASK_STARTED) {
+    GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+    return;
+  }
+
+  /* Pictures still waiting for reordering would need a drain */
+  frames = gst_video_decoder_get_frames (decoder);
+  if (frames) {
+    GST_DEBUG_OBJECT (self, "No input for %u ms, but %u frames are pending",
+        self->idle_trim_timeout, g_list_length (frames));
+    g_list_free_full (frames, (GDestroyNotify) gst_video_codec_frame_unref);
+    GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+    return;
+  }
+
+  /* Reclaim our buffers from downstream, see set_format() */
+  caps = gst_pad_get_current_caps (decoder->srcpad);
+  if (caps) {
+    GstQuery *query = gst_query_new_allocation (caps, FALSE);
+    gst_pad_peer_query (decoder->srcpad, query);
+    gst_query_unref (query);
+    gst_caps_unref (caps);
+  }
+
+  if (gst_v4l2_buffer_pool_n_held (GST_V4L2_BUFFER_POOL (pool)) > 0) {
+    GST_DEBUG_OBJECT (self, "No input for %u ms, but %u capture buffers are "
+        "still held downstream", self->idle_trim_timeout,
+        gst_v4l2_buffer_pool_n_held (GST_V4L2_BUFFER_POOL (pool)));
+    GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+    return;
+  }
+
+  GST_DEBUG_OBJECT (self, "No input for %u ms, releasing the capture buffers",
+      self->idle_trim_timeout);
+
+  gst_object_ref (pool);
+  GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+
+  gst_v4l2_object_unlock (self->v4l2capture);
+  set_v4l2_video_mpeg_class (self->v4l2capture,
+      V4L2_CID_MPEG_SET_POLL_INTERRUPT, 0);
+  gst_pad_stop_task (decoder->srcpad);
+
+  GST_VIDEO_DECODER_STREAM_LOCK (decoder);
+  gst_v4l2_object_unlock_stop (self->v4l2capture);
+
+  /* A frame that came in meanwhile is decoded once the next one restarts
+   * the processing thread, and so is everything when the buffers are back
+   * in use: the capture plane is then left streaming as it is */
+  frames = gst_video_decoder_get_frames (decoder);
+  if (!frames && pool == self->v4l2capture->pool &&
+      gst_v4l2_buffer_pool_trim (GST_V4L2_BUFFER_POOL (pool))) {
+    self->trimmed = TRUE;
+    /* The reference pictures went with the buffers */
+    self->idr_received = FALSE;
+  } else {
+    GST_DEBUG_OBJECT (self, "Capture buffers in use again, not released");
+  }
+  g_list_free_full (frames, (GDestroyNotify) gst_video_codec_frame_unref);
+  GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+
+  gst_object_unref (pool);
+}
+
+static gpointer
+gst_v4l2_video_dec_trim_thread (gpointer data)
+{
+  GstV4l2VideoDec *self = data;
+  gint64 timeout = (gint64) self->idle_trim_timeout * G_TIME_SPAN_MILLISECOND;
+  gint64 last_input;
+
+  g_mutex_lock (&self->trim_lock);
+  while (!self->trim_stop) {
+    last_input = __atomic_load_n (&self->last_input, __ATOMIC_RELAXED);
+
+    if (g_get_monotonic_time () - last_input < timeout) {
+      g_cond_wait_until (&self->trim_cond, &self->trim_lock,
+          last_input + timeout);
+      continue;
+    }
+
+    g_mutex_unlock (&self->trim_lock);
+    gst_v4l2_video_dec_trim_capture (self);
+    g_mutex_lock (&self->trim_lock);
+
+    /* Nothing more to release until the input resumes */
+    while (!self->trim_stop &&
+        __atomic_load_n (&self->last_input, __ATOMIC_RELAXED) == last_input)
+      g_cond_wait_until (&self->trim_cond, &self->trim_lock,
+          g_get_monotonic_time () + timeout);
+  }
+  g_mutex_unlock (&self->trim_lock);
+
+  return NULL;
+}
+#endif
+
 static gboolean
 gst_v4l2_video_dec_start (GstVideoDecoder * decoder)
 {
@@ -674,9 +903,16 @@ gst_v4l2_video_dec_start (GstVideoDecoder * decoder)
   self->output_flow = GST_FLOW_OK;
 #if USE_V4L2_TARGET_NV
   self->decoded_picture_cnt = 0;
+
+  self->last_input = g_get_monotonic_time ();
+  if (self->idle_trim_timeout > 0) {
+    self->trim_stop = FALSE;
+    self->trim_thread = g_thread_new ("v4l2dec-trim",
+        gst_v4l2_video_dec_trim_thread, self);
+  }
 #endif
 
-  self->hash_pts_systemtime = g_hash_table_new(NULL, NULL);
+  gst_v4l2_latency_reset (&self->latency);
   return TRUE;
 }
 
@@ -687,6 +923,18 @@ gst_v4l2_video_dec_stop (GstVideoDecoder * decoder)
 
   GST_DEBUG_OBJECT (self, "Stopping");
 
+#ifdef USE_V4L2_TARGET_NV
+  if (self->trim_thread) {
+    g_mutex_lock (&self->trim_lock);
+    self->trim_stop = TRUE;
+    g_cond_signal (&self->trim_cond);
+    g_mutex_unlock (&self->trim_lock);
+    g_thread_join (self->trim_thread);
+    self->trim_thread = NULL;
+  }
+  self->trimmed = FALSE;
+#endif
+
   gst_v4l2_object_unlock (self->v4l2output);
   gst_v4l2_object_unlock (self->v4l2capture);
 
@@ -707,7 +955,9 @@ gst_v4l2_video_dec_stop (GstVideoDecoder * decoder)
   gst_v4l2_object_stop (self->v4l2output);
   gst_v4l2_object_stop (self->v4l2capture);
 
-  g_hash_table_destroy (self->hash_pts_systemtime);
+#ifdef USE_V4L2_TARGET_NV
+  gst_v4l2_video_dec_clear_frames (self);
+#endif
 
   if (self->input_state) {
     gst_video_codec_state_unref (self->input_state);
@@ -719,6 +969,36 @@ gst_v4l2_video_dec_stop (GstVideoDecoder * decoder)
   return TRUE;
 }
 
+#ifdef USE_V4L2_TARGET_NV
+/* Whether the output plane can keep streaming from @old_caps to @new_caps.
+ * Only byte-stream H.264/H.265 qualifies: its parameter sets come in-band,
+ * while codec_data is only queued when the output plane starts, and the
+ * output format must not change, as that takes a new S_FMT. */
+static gboolean
+gst_v4l2_video_dec_can_keep_output (GstCaps * old_caps, GstCaps * new_caps)
+{
+  GstStructure *old_s = gst_caps_get_structure (old_caps, 0);
+  GstStructure *new_s = gst_caps_get_structure (new_caps, 0);
+  const gchar *name = gst_structure_get_name (new_s);
+
+  if (!gst_structure_has_name (old_s, name))
+    return FALSE;
+
+  if (g_strcmp0 (name, "video/x-h264") && g_strcmp0 (name, "video/x-h265"))
+    return FALSE;
+
+  if (gst_structure_has_field (new_s, "codec_data") ||
+      g_strcmp0 (gst_structure_get_string (new_s, "stream-format"),
+          "byte-stream"))
+    return FALSE;
+
+  return !g_strcmp0 (gst_structure_get_string (old_s, "stream-format"),
+      "byte-stream") &&
+      !g_strcmp0 (gst_structure_get_string (old_s, "alignment"),
+      gst_structure_get_string (new_s, "alignment"));
+}
+#endif
+
 static gboolean
 gst_v4l2_video_dec_set_format (GstVideoDecoder * decoder,
     GstVideoCodecState * state)
@@ -756,6 +1036,21 @@ gst_v4l2_video_dec_set_format (GstVideoDecoder * decoder,
     else
         self->idr_received = FALSE;
 
+#ifdef USE_V4L2_TARGET_NV
+    /* Same stream: the driver signals the new resolution with a source
+     * change event once the pictures of the old one are out, and the
+     * processing thread restarts only the capture plane then. The output
+     * plane keeps streaming. */
+    if (is_cuvid == FALSE && GST_V4L2_IS_ACTIVE (self->v4l2output) &&
+        gst_v4l2_video_dec_can_keep_output (self->input_state->caps,
+            state->caps)) {
+      GST_DEBUG_OBJECT (self, "Resolution change, keeping the output plane");
+      gst_video_codec_state_unref (self->input_state);
+      self->input_state = gst_video_codec_state_ref (state);
+      return TRUE;
+    }
+#endif
+
     gst_video_codec_state_unref (self->input_state);
     self->input_state = NULL;
 
@@ -946,9 +1241,28 @@ gst_v4l2_video_dec_flush (GstVideoDecoder * decoder)
   if (self->v4l2output->pool)
     gst_v4l2_buffer_pool_flush (self->v4l2output->pool);
 
+#ifdef USE_V4L2_TARGET_NV
+  /* Stopping the output plane is enough for the driver to drop the pending
+   * bitstream. The capture plane keeps streaming on the buffers it has
+   * queued, the pictures still decoded from before the flush come out with
+   * no frame left for them and go straight back to the driver. Decoding
+   * resumes from the next key frame. */
+  if (is_cuvid == FALSE && self->fast_flush && self->v4l2capture->pool &&
+      gst_buffer_pool_is_active (GST_BUFFER_POOL (self->v4l2capture->pool))) {
+    GST_DEBUG_OBJECT (self, "Fast flush, capture plane left streaming");
+    self->idr_received = FALSE;
+  } else if (self->trimmed) {
+    /* Released while idle, nothing to flush */
+  } else
+#endif
   if (self->v4l2capture->pool)
     gst_v4l2_buffer_pool_flush (self->v4l2capture->pool);
 
+#ifdef USE_V4L2_TARGET_NV
+  /* The base class drops all pending frames along with the flush */
+  gst_v4l2_video_dec_clear_frames (self);
+#endif
+
   return TRUE;
 }
 
@@ -1079,83 +1393,131 @@ gst_v4l2_video_dec_drain (GstVideoDecoder * decoder)
 }
 
 #ifdef USE_V4L2_TARGET_NV
-GstVideoCodecFrame *
-gst_v4l2_video_dec_find_nearest_frame (GstBuffer * buf, GList * frames)
+/* Takes frame @n out of the index if its slot still holds it. Must be called
+ * with the frame lock held. */
+static inline GstVideoCodecFrame *
+gst_v4l2_video_dec_steal_frame (GstV4l2VideoDec * self, guint32 n)
 {
-  GstVideoCodecFrame *best = NULL;
-  GstClockTimeDiff best_diff = G_MAXINT64;
-  GstClockTime timestamp;
-  GList *l;
+  GstVideoCodecFrame **slot = &self->frame_index[GST_V4L2_DEC_FRAME_SLOT (n)];
+  GstVideoCodecFrame *frame = *slot;
 
-  timestamp = buf->pts;
+  if (frame == NULL || frame->system_frame_number != n)
+    return NULL;
 
-  for (l = frames; l; l = l->next) {
-    GstVideoCodecFrame *tmp = l->data;
-    GstClockTimeDiff diff = ABS (GST_CLOCK_DIFF (timestamp, tmp->pts));
+  *slot = NULL;
+  return frame;
+}
 
-    if (diff < best_diff) {
-      best = tmp;
-      best_diff = diff;
+/* Gives the frames evicted from the index back to the base class, without
+ * the frame lock held as this takes the stream lock */
+static void
+gst_v4l2_video_dec_release_ghosts (GstV4l2VideoDec * self,
+    GstVideoCodecFrame ** ghosts, guint n_ghosts)
+{
+  guint i;
 
-      if (diff == 0)
-        break;
-    }
+  for (i = 0; i < n_ghosts; i++) {
+    GstVideoCodecFrame *tmp = ghosts[i];
+
+    GST_LOG_OBJECT (self,
+        "discarding ghost frame %p (#%d) PTS:%" GST_TIME_FORMAT " DTS:%"
+        GST_TIME_FORMAT, tmp, tmp->system_frame_number,
+        GST_TIME_ARGS (tmp->pts), GST_TIME_ARGS (tmp->dts));
+    gst_video_decoder_release_frame (GST_VIDEO_DECODER (self), tmp);
+    gst_video_codec_frame_unref (tmp);
   }
+}
+
+static void
+gst_v4l2_video_dec_add_frame (GstV4l2VideoDec * self,
+    GstVideoCodecFrame * frame)
+{
+  GstVideoCodecFrame *ghosts[GST_V4L2_DEC_FRAME_INDEX_SIZE], *ghost;
+  guint32 n = frame->system_frame_number;
+  guint n_ghosts = 0;
 
-  if (best)
-    gst_video_codec_frame_ref (best);
+  g_mutex_lock (&self->frame_lock);
 
-  g_list_foreach (frames, (GFunc) gst_video_codec_frame_unref, NULL);
-  g_list_free (frames);
+  if (self->frame_oldest == self->frame_next)
+    self->frame_oldest = n;
 
-  return best;
+  /* Make room, whatever still sits in the slot is long gone */
+  while ((gint32) (n - self->frame_oldest) >= GST_V4L2_DEC_FRAME_INDEX_SIZE) {
+    if ((ghost = gst_v4l2_video_dec_steal_frame (self, self->frame_oldest)))
+      ghosts[n_ghosts++] = ghost;
+    self->frame_oldest++;
+  }
+
+  self->frame_index[GST_V4L2_DEC_FRAME_SLOT (n)] =
+      gst_video_codec_frame_ref (frame);
+  self->frame_next = n + 1;
+
+  g_mutex_unlock (&self->frame_lock);
+
+  gst_v4l2_video_dec_release_ghosts (self, ghosts, n_ghosts);
 }
 
+static void
+gst_v4l2_video_dec_remove_frame (GstV4l2VideoDec * self,
+    GstVideoCodecFrame * frame)
+{
+  GstVideoCodecFrame *tmp;
+
+  g_mutex_lock (&self->frame_lock);
+  tmp = gst_v4l2_video_dec_steal_frame (self, frame->system_frame_number);
+  g_mutex_unlock (&self->frame_lock);
+
+  if (tmp)
+    gst_video_codec_frame_unref (tmp);
+}
+
+/* Looks up the frame from the number the driver returned as timestamp of
+ * @buf. Frames queued long enough before it that they will not be output
+ * anymore, e.g. because of corrupted input data or interlaced streams, are
+ * released at the same time before they pile up and use all the memory. */
+static GstVideoCodecFrame *
+gst_v4l2_video_dec_take_frame (GstV4l2VideoDec * self, GstBuffer * buf)
+{
+  GstVideoCodecFrame *ghosts[GST_V4L2_DEC_FRAME_INDEX_SIZE], *ghost, *frame;
+  guint n_ghosts = 0;
+  guint32 n;
+
+  if (!GST_CLOCK_TIME_IS_VALID (GST_BUFFER_TIMESTAMP (buf)))
+    return NULL;
+
+  n = GST_BUFFER_TIMESTAMP (buf) / GST_SECOND;
+
+  g_mutex_lock (&self->frame_lock);
+
+  frame = gst_v4l2_video_dec_steal_frame (self, n);
+
+  while ((gint32) (n - self->frame_oldest) > GST_V4L2_DEC_REORDER_DEPTH) {
+    if ((ghost = gst_v4l2_video_dec_steal_frame (self, self->frame_oldest)))
+      ghosts[n_ghosts++] = ghost;
+    self->frame_oldest++;
+  }
+
+  g_mutex_unlock (&self->frame_lock);
+
+  gst_v4l2_video_dec_release_ghosts (self, ghosts, n_ghosts);
+
+  return frame;
+}
 
 static void
-gst_v4l2_video_dec_clean_older_frames (GstV4l2VideoDec * self,
-    GstBuffer * buf, GList * frames)
+gst_v4l2_video_dec_clear_frames (GstV4l2VideoDec * self)
 {
-  GList *l;
-  GstClockTime timestamp;
-
-  timestamp = buf->pts;
-
-  if (GST_CLOCK_TIME_IS_VALID (timestamp)) {
-    /* We could release all frames stored with pts < timestamp since the
-     * decoder will likely output frames in display order */
-    for (l = frames; l; l = l->next) {
-      GstVideoCodecFrame *tmp = l->data;
-
-      if (tmp->pts < timestamp) {
-        GST_LOG_OBJECT (self,
-            "discarding ghost frame %p (#%d) PTS:%" GST_TIME_FORMAT " DTS:%"
-            GST_TIME_FORMAT, tmp, tmp->system_frame_number,
-            GST_TIME_ARGS (tmp->pts), GST_TIME_ARGS (tmp->dts));
-        gst_video_decoder_release_frame (GST_VIDEO_DECODER (self), tmp);
-      } else {
-        gst_video_codec_frame_unref (tmp);
-      }
-    }
-  } else {
-    /* We will release all frames with invalid timestamp because we don't even
-     * know if they will be output some day. */
-    for (l = frames; l; l = l->next) {
-      GstVideoCodecFrame *tmp = l->data;
-
-      if (!GST_CLOCK_TIME_IS_VALID (tmp->pts)) {
-        GST_LOG_OBJECT (self,
-            "discarding frame %p (#%d) with invalid PTS:%" GST_TIME_FORMAT
-            " DTS:%" GST_TIME_FORMAT, tmp, tmp->system_frame_number,
-            GST_TIME_ARGS (tmp->pts), GST_TIME_ARGS (tmp->dts));
-        gst_video_decoder_release_frame (GST_VIDEO_DECODER (self), tmp);
-      } else {
-        gst_video_codec_frame_unref (tmp);
-      }
+  guint i;
+
+  g_mutex_lock (&self->frame_lock);
+  for (i = 0; i < GST_V4L2_DEC_FRAME_INDEX_SIZE; i++) {
+    if (self->frame_index[i]) {
+      gst_video_codec_frame_unref (self->frame_index[i]);
+      self->frame_index[i] = NULL;
     }
   }
-
-  g_list_free (frames);
+  self->frame_oldest = self->frame_next;
+  g_mutex_unlock (&self->frame_lock);
 }
 
 #endif
@@ -1192,6 +1554,59 @@ gst_v4l2_video_dec_get_oldest_frame (GstVideoDecoder * decoder)
 }
 #endif
 
+#ifdef USE_V4L2_TARGET_NV
+static GstFlowReturn gst_v4l2_video_dec_setup_capture (GstVideoDecoder *
+    decoder);
+
+/* Called from the processing thread once the driver has handed out the last
+ * picture of the previous format. The output plane keeps streaming, only the
+ * capture pool is restarted. The Tegra decoder wants the capture plane
+ * stopped and its buffers freed with REQBUFS(0) before the new format is
+ * read, other decoders restart on the buffers they already have when the
+ * new coded size fits into them. */
+static GstFlowReturn
+gst_v4l2_video_dec_reset_capture (GstVideoDecoder * decoder)
+{
+  GstV4l2VideoDec *self = GST_V4L2_VIDEO_DEC (decoder);
+  GstBufferPool *pool = GST_BUFFER_POOL (self->v4l2capture->pool);
+  GstFlowReturn ret;
+  GstCaps *caps;
+
+  GST_DEBUG_OBJECT (self, "Resolution change, restarting the capture plane");
+
+  /* Reclaim our buffers from downstream, see set_format() */
+  caps = gst_pad_get_current_caps (decoder->srcpad);
+  if (caps) {
+    GstQuery *query = gst_query_new_allocation (caps, FALSE);
+    gst_pad_peer_query (decoder->srcpad, query);
+    gst_query_unref (query);
+    gst_caps_unref (caps);
+  }
+
+  GST_VIDEO_DECODER_STREAM_LOCK (decoder);
+
+  if (is_cuvid == TRUE)
+    gst_v4l2_buffer_pool_keep_buffers (GST_V4L2_BUFFER_POOL (pool));
+  if (!gst_buffer_pool_set_active (pool, FALSE)) {
+    GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+    GST_ELEMENT_ERROR (self, RESOURCE, SETTINGS,
+        (_("Failed to allocate required memory.")),
+        ("Capture pool deactivation failed"));
+    return GST_FLOW_ERROR;
+  }
+
+  /* Nobody waits for this stop, set_format() must not see it later */
+  g_mutex_lock (&self->v4l2capture->cplane_stopped_lock);
+  self->v4l2capture->capture_plane_stopped = FALSE;
+  g_mutex_unlock (&self->v4l2capture->cplane_stopped_lock);
+
+  ret = gst_v4l2_video_dec_setup_capture (decoder);
+  GST_VIDEO_DECODER_STREAM_UNLOCK (decoder);
+
+  return ret;
+}
+#endif
+
 static void
 gst_v4l2_video_dec_loop (GstVideoDecoder * decoder)
 {
@@ -1203,6 +1618,8 @@ gst_v4l2_video_dec_loop (GstVideoDecoder * decoder)
   GstFlowReturn ret;
 
   GST_LOG_OBJECT (decoder, "Allocate output buffer");
+  GST_V4L2_TRACE (self->v4l2capture, GST_V4L2_TRACE_ACQUIRE, -1, -1, 0,
+      GST_CLOCK_TIME_NONE);
 
   self->output_flow = GST_FLOW_OK;
   do {
@@ -1221,6 +1638,10 @@ gst_v4l2_video_dec_loop (GstVideoDecoder * decoder)
     ret = gst_buffer_pool_acquire_buffer (pool, &buffer, NULL);
     g_object_unref (pool);
 
+#ifdef USE_V4L2_TARGET_NV
+    if (ret == GST_V4L2_FLOW_RESOLUTION_CHANGE)
+      goto resolution_change;
+#endif
     if (ret != GST_FLOW_OK)
       goto beach;
 
@@ -1229,20 +1650,15 @@ gst_v4l2_video_dec_loop (GstVideoDecoder * decoder)
 
   } while (ret == GST_V4L2_FLOW_CORRUPTED_BUFFER);
 
+#ifdef USE_V4L2_TARGET_NV
+  if (ret == GST_V4L2_FLOW_RESOLUTION_CHANGE)
+    goto resolution_change;
+#endif
   if (ret != GST_FLOW_OK)
     goto beach;
 
 #ifdef USE_V4L2_TARGET_NV
-  frame = gst_v4l2_video_dec_find_nearest_frame (buffer,
-          gst_video_decoder_get_frames (GST_VIDEO_DECODER (self)));
-  /* So we have a timestamped  buffer and get, or not, corresponding frame.
-   * Assuming decoder output frames in display order, frames preceding this
-   * frame could be discarded as they seems useless due to e.g interlaced
-   * stream, corrupted input data...
-   * In any cases, not likely to be seen again. so drop it before they pile up
-   * and use all the memory. */
-  gst_v4l2_video_dec_clean_older_frames (self, buffer,
-          gst_video_decoder_get_frames (GST_VIDEO_DECODER (self)));
+  frame = gst_v4l2_video_dec_take_frame (self, buffer);
 #else
   frame = gst_v4l2_video_dec_get_oldest_frame (decoder);
 #endif
@@ -1255,41 +1671,18 @@ gst_v4l2_video_dec_loop (GstVideoDecoder * decoder)
   }
 #endif
   if (frame) {
+    GstClockTime pts = frame->pts;
+
     frame->output_buffer = buffer;
     buffer = NULL;
 
-    if(enable_latency_measurement) /* TODO with better option */
-    {
-      gpointer in_time = g_hash_table_lookup (self->hash_pts_systemtime,
-              &frame->pts);
-      gdouble input_time = *((gdouble*)in_time);
-      gdouble output_time = get_current_system_timestamp ();
-      if (output_time < input_time)
-      {
-          gdouble time = G_MAXDOUBLE - input_time;
-          GST_DEBUG_OBJECT (self, "True Decode Latency = %f \n",
-                  output_time + time);
-      }
-      else
-      {
-          GST_DEBUG_OBJECT (self, "True Decode Latency = %f \n",
-                  (output_time - input_time));
-      }
-      GstCaps *reference = gst_caps_new_simple ("video/x-raw",
-          "component_name", G_TYPE_STRING, GST_ELEMENT_NAME(self),
-          "frame_num", G_TYPE_INT, self->frame_num++,
-          "in_timestamp", G_TYPE_DOUBLE, input_time,
-          "out_timestamp", G_TYPE_DOUBLE, output_time,
-          NULL);
-      GstReferenceTimestampMeta * dec_meta =
-        gst_buffer_add_reference_timestamp_meta (frame->output_buffer, reference,
-            0, 0);
-      if(dec_meta == NULL)
-      {
-        GST_DEBUG_OBJECT (decoder, "dec_meta: %p", dec_meta);
-      }
-      gst_caps_unref(reference);
-    }
+    gst_v4l2_latency_output (&self->latency, frame->system_frame_number,
+        frame->output_buffer, self->v4l2output, self->v4l2capture,
+        self->latency_meta,
+        self->latency_reference ? GST_ELEMENT_NAME (self) : NULL);
+
+    GST_V4L2_TRACE (self->v4l2capture, GST_V4L2_TRACE_FINISH_FRAME, -1, -1,
+        gst_buffer_get_size (frame->output_buffer), frame->pts);
 
 #if USE_V4L2_TARGET_NV
 
@@ -1307,17 +1700,35 @@ gst_v4l2_video_dec_loop (GstVideoDecoder * decoder)
       goto beach;
 
     self->decoded_picture_cnt += 1;
+
+    gst_v4l2_object_post_m2m_stats (GST_ELEMENT (self), self->v4l2output,
+        self->v4l2capture, self->stats_interval, &self->stats_last_post);
 #else
     ret = gst_video_decoder_finish_frame (decoder, frame);
 #endif
 
+    GST_V4L2_TRACE (self->v4l2capture, GST_V4L2_TRACE_PUSHED, -1, -1, 0, pts);
+
   } else {
+#ifdef USE_V4L2_TARGET_NV
+    if (self->fast_flush)
+      GST_LOG_OBJECT (decoder, "Dropping a picture of a flushed frame");
+    else
+#endif
     GST_WARNING_OBJECT (decoder, "Decoder is producing too many buffers");
     gst_buffer_unref (buffer);
   }
 
   return;
 
+#ifdef USE_V4L2_TARGET_NV
+resolution_change:
+  gst_buffer_replace (&buffer, NULL);
+  ret = gst_v4l2_video_dec_reset_capture (decoder);
+  if (ret == GST_FLOW_OK)
+    return;
+#endif
+
 beach:
   GST_DEBUG_OBJECT (decoder, "Leaving output thread: %s",
       gst_flow_get_name (ret));
@@ -1375,6 +1786,148 @@ gst_v4l2_video_remove_padding (GstCapsFeatures * features,
   return TRUE;
 }
 
+/* Negotiates the decoded format the driver reports on the capture plane and
+ * activates the capture pool. Called by handle_frame() once the stream format
+ * is known, and by the processing thread after a resolution change. */
+static GstFlowReturn
+gst_v4l2_video_dec_setup_capture (GstVideoDecoder * decoder)
+{
+  GstV4l2Error error = GST_V4L2_ERROR_INIT;
+  GstV4l2VideoDec *self = GST_V4L2_VIDEO_DEC (decoder);
+  GstVideoInfo info;
+  GstVideoCodecState *output_state;
+  GstCaps *acquired_caps, *available_caps, *caps, *filter;
+  GstStructure *st;
+
+  /* For decoders G_FMT returns coded size, G_SELECTION returns visible size
+   * in the compose rectangle. gst_v4l2_object_acquire_format() checks both
+   * and returns the visible size as with/height and the coded size as
+   * padding. */
+  if (!gst_v4l2_object_acquire_format (self->v4l2capture, &info))
+    goto not_negotiated;
+
+  /* Create caps from the acquired format, remove the format field */
+  acquired_caps = gst_video_info_to_caps (&info);
+  GST_DEBUG_OBJECT (self, "Acquired caps: %" GST_PTR_FORMAT, acquired_caps);
+  st = gst_caps_get_structure (acquired_caps, 0);
+  gst_structure_remove_field (st, "format");
+
+  /* Probe currently available pixel formats */
+  available_caps = gst_v4l2_object_probe_caps (self->v4l2capture, NULL);
+  available_caps = gst_caps_make_writable (available_caps);
+  GST_DEBUG_OBJECT (self, "Available caps: %" GST_PTR_FORMAT, available_caps);
+
+  /* Replace coded size with visible size, we want to negotiate visible size
+   * with downstream, not coded size. */
+  gst_caps_map_in_place (available_caps, gst_v4l2_video_remove_padding, self);
+
+  filter = gst_caps_intersect_full (available_caps, acquired_caps,
+      GST_CAPS_INTERSECT_FIRST);
+  GST_DEBUG_OBJECT (self, "Filtered caps: %" GST_PTR_FORMAT, filter);
+  gst_caps_unref (acquired_caps);
+  gst_caps_unref (available_caps);
+#ifndef USE_V4L2_TARGET_NV
+  caps = gst_pad_peer_query_caps (decoder->srcpad, filter);
+  gst_caps_unref (filter);
+#else
+  caps = gst_pad_peer_query_caps (decoder->srcpad,
+      gst_pad_get_pad_template_caps (GST_VIDEO_DECODER_SRC_PAD (decoder)));
+  gst_caps_unref (filter);
+
+  if (gst_caps_is_empty (caps)) {
+    GstPad *pad = GST_VIDEO_DECODER_SRC_PAD (decoder);
+    caps = gst_pad_get_pad_template_caps (pad);
+  }
+#endif
+
+  GST_DEBUG_OBJECT (self, "Possible decoded caps: %" GST_PTR_FORMAT, caps);
+  if (gst_caps_is_empty (caps)) {
+    gst_caps_unref (caps);
+    goto not_negotiated;
+  }
+
+  /* Fixate pixel format */
+  caps = gst_caps_fixate (caps);
+
+  GST_DEBUG_OBJECT (self, "Chosen decoded caps: %" GST_PTR_FORMAT, caps);
+
+  /* Try to set negotiated format, on success replace acquired format */
+#ifndef USE_V4L2_TARGET_NV
+  if (gst_v4l2_object_set_format (self->v4l2capture, caps, &error))
+    gst_video_info_from_caps (&info, caps);
+  else
+    gst_v4l2_clear_error (&error);
+#endif
+  gst_caps_unref (caps);
+
+  output_state = gst_video_decoder_set_output_state (decoder,
+      info.finfo->format, info.width, info.height, self->input_state);
+
+#ifdef USE_V4L2_TARGET_NV
+  if (output_state->caps)
+      gst_caps_unref (output_state->caps);
+  output_state->caps = gst_video_info_to_caps (&output_state->info);
+  GstCapsFeatures *features = gst_caps_features_new ("memory:NVMM", NULL);
+  gst_caps_set_features (output_state->caps, 0, features);
+#endif
+  /* Copy the rest of the information, there might be more in the future */
+  output_state->info.interlace_mode = info.interlace_mode;
+  gst_video_codec_state_unref (output_state);
+
+  if (!gst_video_decoder_negotiate (decoder)) {
+    if (GST_PAD_IS_FLUSHING (decoder->srcpad))
+      goto flushing;
+    else
+      goto not_negotiated;
+  }
+
+  /* Ensure our internal pool is activated */
+  if (!gst_buffer_pool_set_active (GST_BUFFER_POOL (self->v4l2capture->pool),
+          TRUE))
+    goto activate_failed;
+
+#ifdef USE_V4L2_TARGET_NV
+  if (self->v4l2capture->pool) {
+    if (self->cap_buf_dynamic_allocation == CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_FW_RW_PLAYBACK) {
+      gst_v4l2_buffer_pool_enable_dynamic_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
+          TRUE);
+    } else if (self->cap_buf_dynamic_allocation == CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_RW_PLAYBACK && self->rate < 0) {
+      gst_v4l2_buffer_pool_enable_dynamic_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
+          TRUE);
+    } else if (self->cap_buf_dynamic_allocation == CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_FW_PLAYBACK && self->rate > 0) {
+      gst_v4l2_buffer_pool_enable_dynamic_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
+          TRUE);
+    } else {
+      gst_v4l2_buffer_pool_enable_dynamic_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
+          FALSE);
+    }
+    gst_v4l2_buffer_pool_enable_adaptive_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
+        self->cap_buf_dynamic_allocation == CAP_BUF_DYNAMIC_ALLOC_ADAPTIVE);
+  }
+#endif
+
+  return GST_FLOW_OK;
+
+  /* ERRORS */
+not_negotiated:
+  {
+    GST_ERROR_OBJECT (self, "not negotiated");
+    gst_v4l2_error (self, &error);
+    return GST_FLOW_NOT_NEGOTIATED;
+  }
+activate_failed:
+  {
+    GST_ELEMENT_ERROR (self, RESOURCE, SETTINGS,
+        (_("Failed to allocate required memory.")),
+        ("Buffer pool activation failed"));
+    return GST_FLOW_ERROR;
+  }
+flushing:
+  {
+    return GST_FLOW_FLUSHING;
+  }
+}
+
 static GstFlowReturn
 gst_v4l2_video_dec_handle_frame (GstVideoDecoder * decoder,
     GstVideoCodecFrame * frame)
@@ -1391,6 +1944,8 @@ gst_v4l2_video_dec_handle_frame (GstVideoDecoder * decoder,
 #endif
 
   GST_DEBUG_OBJECT (self, "Handling frame %d", frame->system_frame_number);
+  GST_V4L2_TRACE (self->v4l2output, GST_V4L2_TRACE_HANDLE_FRAME, -1, -1,
+      gst_buffer_get_size (frame->input_buffer), frame->pts);
 
 #ifdef USE_V4L2_TARGET_NV
   /* CUVID and TEGRA decoders return format when SPS/PPS is received along with
@@ -1423,11 +1978,21 @@ gst_v4l2_video_dec_handle_frame (GstVideoDecoder * decoder,
     }
   }
 
-  if (enable_latency_measurement)
-  {
-      self->buffer_in_time = get_current_system_timestamp ();
-      g_hash_table_insert (self->hash_pts_systemtime, &frame->pts, &self->buffer_in_time);
-  }
+  gst_v4l2_latency_input (&self->latency, frame->system_frame_number);
+#ifdef USE_V4L2_TARGET_NV
+  __atomic_store_n (&self->last_input, g_get_monotonic_time (),
+      __ATOMIC_RELAXED);
+#endif
+
+#ifdef USE_V4L2_TARGET_NV
+  /* The driver copies the timestamp of the bitstream buffer to the decoded
+   * picture, queue the frame number in place of the PTS so that the picture
+   * leads straight back to its frame. finish_frame() restores the PTS. */
+  gst_v4l2_video_dec_add_frame (self, frame);
+  frame->input_buffer = gst_buffer_make_writable (frame->input_buffer);
+  GST_BUFFER_TIMESTAMP (frame->input_buffer) =
+      (GstClockTime) frame->system_frame_number * GST_SECOND;
+#endif
 
   if (G_UNLIKELY (!g_atomic_int_get (&self->active)))
     goto flushing;
@@ -1440,13 +2005,23 @@ gst_v4l2_video_dec_handle_frame (GstVideoDecoder * decoder,
       goto not_negotiated;
   }
 
+#ifdef USE_V4L2_TARGET_NV
+  /* Allocated again only now that the input resumed */
+  if (G_UNLIKELY (self->trimmed)) {
+    self->trimmed = FALSE;
+    /* Unless a renegotiation replaced the pool in between */
+    if (GST_V4L2_IS_ACTIVE (self->v4l2capture)) {
+      if (!gst_buffer_pool_set_active (GST_BUFFER_POOL (self->v4l2capture->
+                  pool), TRUE))
+        goto activate_failed;
+      GST_DEBUG_OBJECT (self, "Input resumed, capture buffers allocated again");
+    }
+  }
+#endif
+
   if (G_UNLIKELY (!GST_V4L2_IS_ACTIVE (self->v4l2capture))) {
     GstBufferPool *pool = GST_BUFFER_POOL (self->v4l2output->pool);
-    GstVideoInfo info;
-    GstVideoCodecState *output_state;
     GstBuffer *codec_data;
-    GstCaps *acquired_caps, *available_caps, *caps, *filter;
-    GstStructure *st;
 
     GST_DEBUG_OBJECT (self, "Sending header");
 
@@ -1518,164 +2093,37 @@ gst_v4l2_video_dec_handle_frame (GstVideoDecoder * decoder,
     }
 
     if (V4L2_TYPE_IS_OUTPUT (obj->type)) {
-      gint retval;
-      gint dqevent_loop_count = 0;
       struct v4l2_event ev;
-#ifndef USE_V4L2_TARGET_NV_X86
-      /* This is WAR for Bug 3544450 */
-      if(!processed)
-      {
-        processed = TRUE;
-        /* Wait for DQEVENT for 0.6 sec */
-        while (dqevent_loop_count < LOOP_COUNT_TO_WAIT_FOR_DQEVENT) {
-          memset (&ev, 0, sizeof (ev));
-          retval = obj->ioctl (obj->video_fd, VIDIOC_DQEVENT, &ev);
-          dqevent_loop_count ++;
-          if (retval != 0)
-          {
-            if (errno == EINVAL)
-                goto process_failed;
-            usleep (WAIT_TIME_PER_LOOP_FOR_DQEVENT); //TODO is this needed ?
-            continue;
-          }
-          else
-            break;
-        }
-        if (dqevent_loop_count == LOOP_COUNT_TO_WAIT_FOR_DQEVENT) {
-          g_print ("Stream format not found, dropping the frame\n");
-          goto drop;
-        }
-      }
-      else
-#endif
-      {
-        while (1) {
-          memset (&ev, 0, sizeof (ev));
-          retval = obj->ioctl (obj->video_fd, VIDIOC_DQEVENT, &ev);
-          if (retval != 0)
-          {
-            if (errno == EINVAL)
-                goto process_failed;
-            if (is_cuvid != TRUE) {
-              if (ev.sequence == 0) {
-                g_print ("Stream format not found, dropping the frame\n");
-                goto drop;
-              }
-            }
-            usleep(100*1000); //TODO is this needed ?
-            continue;
-          }
-          else
-            break;
-        }
-      }
-    }
-#endif
-
-    /* For decoders G_FMT returns coded size, G_SELECTION returns visible size
-     * in the compose rectangle. gst_v4l2_object_acquire_format() checks both
-     * and returns the visible size as with/height and the coded size as
-     * padding. */
-    if (!gst_v4l2_object_acquire_format (self->v4l2capture, &info))
-      goto not_negotiated;
-
-    /* Create caps from the acquired format, remove the format field */
-    acquired_caps = gst_video_info_to_caps (&info);
-    GST_DEBUG_OBJECT (self, "Acquired caps: %" GST_PTR_FORMAT, acquired_caps);
-    st = gst_caps_get_structure (acquired_caps, 0);
-    gst_structure_remove_field (st, "format");
-
-    /* Probe currently available pixel formats */
-    available_caps = gst_v4l2_object_probe_caps (self->v4l2capture, NULL);
-    available_caps = gst_caps_make_writable (available_caps);
-    GST_DEBUG_OBJECT (self, "Available caps: %" GST_PTR_FORMAT, available_caps);
-
-    /* Replace coded size with visible size, we want to negotiate visible size
-     * with downstream, not coded size. */
-    gst_caps_map_in_place (available_caps, gst_v4l2_video_remove_padding, self);
-
-    filter = gst_caps_intersect_full (available_caps, acquired_caps,
-        GST_CAPS_INTERSECT_FIRST);
-    GST_DEBUG_OBJECT (self, "Filtered caps: %" GST_PTR_FORMAT, filter);
-    gst_caps_unref (acquired_caps);
-    gst_caps_unref (available_caps);
-#ifndef USE_V4L2_TARGET_NV
-    caps = gst_pad_peer_query_caps (decoder->srcpad, filter);
-    gst_caps_unref (filter);
-#else
-    caps = gst_pad_peer_query_caps (decoder->srcpad,
-        gst_pad_get_pad_template_caps (GST_VIDEO_DECODER_SRC_PAD (decoder)));
-    gst_caps_unref (filter);
-
-    if (gst_caps_is_empty (caps)) {
-      GstPad *pad = GST_VIDEO_DECODER_SRC_PAD (decoder);
-      caps = gst_pad_get_pad_template_caps (pad);
-    }
-#endif
-
-    GST_DEBUG_OBJECT (self, "Possible decoded caps: %" GST_PTR_FORMAT, caps);
-    if (gst_caps_is_empty (caps)) {
-      gst_caps_unref (caps);
-      goto not_negotiated;
-    }
+      gint64 timeout_us = self->format_timeout;
+      gint64 wait_start, waited;
 
-    /* Fixate pixel format */
-    caps = gst_caps_fixate (caps);
-
-    GST_DEBUG_OBJECT (self, "Chosen decoded caps: %" GST_PTR_FORMAT, caps);
-
-    /* Try to set negotiated format, on success replace acquired format */
-#ifndef USE_V4L2_TARGET_NV
-    if (gst_v4l2_object_set_format (self->v4l2capture, caps, &error))
-      gst_video_info_from_caps (&info, caps);
-    else
-      gst_v4l2_clear_error (&error);
+#ifndef USE_V4L2_TARGET_NV_X86
+      /* This is WAR for Bug 3544450: on Tegra only the first frame waits,
+       * the following ones are dropped until the format is known */
+      if (processed && is_cuvid != TRUE)
+        timeout_us = 0;
+      processed = TRUE;
 #endif
-    gst_caps_unref (caps);
-
-    output_state = gst_video_decoder_set_output_state (decoder,
-        info.finfo->format, info.width, info.height, self->input_state);
+      if (timeout_us > 0)
+        timeout_us *= 1000;
 
-#ifdef USE_V4L2_TARGET_NV
-    if (output_state->caps)
-        gst_caps_unref (output_state->caps);
-    output_state->caps = gst_video_info_to_caps (&output_state->info);
-    GstCapsFeatures *features = gst_caps_features_new ("memory:NVMM", NULL);
-    gst_caps_set_features (output_state->caps, 0, features);
-#endif
-    /* Copy the rest of the information, there might be more in the future */
-    output_state->info.interlace_mode = info.interlace_mode;
-    gst_video_codec_state_unref (output_state);
-
-    if (!gst_video_decoder_negotiate (decoder)) {
-      if (GST_PAD_IS_FLUSHING (decoder->srcpad))
-        goto flushing;
-      else
-        goto not_negotiated;
-    }
-
-    /* Ensure our internal pool is activated */
-    if (!gst_buffer_pool_set_active (GST_BUFFER_POOL (self->v4l2capture->pool),
-            TRUE))
-      goto activate_failed;
-
-#ifdef USE_V4L2_TARGET_NV
-    if (self->v4l2capture->pool) {
-      if (self->cap_buf_dynamic_allocation == CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_FW_RW_PLAYBACK) {
-        gst_v4l2_buffer_pool_enable_dynamic_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
-            TRUE);
-      } else if (self->cap_buf_dynamic_allocation == CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_RW_PLAYBACK && self->rate < 0) {
-        gst_v4l2_buffer_pool_enable_dynamic_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
-            TRUE);
-      } else if (self->cap_buf_dynamic_allocation == CAP_BUF_DYNAMIC_ALLOC_ENABLED_FOR_FW_PLAYBACK && self->rate > 0) {
-        gst_v4l2_buffer_pool_enable_dynamic_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
-            TRUE);
-      } else {
-        gst_v4l2_buffer_pool_enable_dynamic_allocation (GST_V4L2_BUFFER_POOL (self->v4l2capture->pool),
-            FALSE);
+      wait_start = g_get_monotonic_time ();
+      if (gst_v4l2_wait_event (obj, &ev, timeout_us) != 0) {
+        if (errno != ETIMEDOUT)
+          goto process_failed;
+        g_print ("Stream format not found, dropping the frame\n");
+        goto drop;
       }
+      waited = g_get_monotonic_time () - wait_start;
+      GST_DEBUG_OBJECT (self, "got event %u after %" G_GINT64_FORMAT " us",
+          ev.type, waited);
+      gst_v4l2_latency_format_wait (&self->latency, waited * GST_USECOND);
     }
 #endif
+
+    ret = gst_v4l2_video_dec_setup_capture (decoder);
+    if (ret != GST_FLOW_OK)
+      goto drop;
   }
 
   task_state = gst_pad_get_task_state (GST_VIDEO_DECODER_SRC_PAD (self));
@@ -1809,6 +2257,9 @@ process_failed:
   }
 drop:
   {
+#ifdef USE_V4L2_TARGET_NV
+    gst_v4l2_video_dec_remove_frame (self, frame);
+#endif
     gst_video_decoder_drop_frame (decoder, frame);
     return ret;
   }
@@ -2024,10 +2475,15 @@ gst_v4l2_video_dec_finalize (GObject * object)
 #ifdef USE_V4L2_TARGET_NV
   g_cond_clear (&self->v4l2capture->cplane_stopped_cond);
   g_mutex_clear (&self->v4l2capture->cplane_stopped_lock);
+  gst_v4l2_video_dec_clear_frames (self);
+  g_mutex_clear (&self->frame_lock);
+  g_cond_clear (&self->trim_cond);
+  g_mutex_clear (&self->trim_lock);
 #endif
 
   gst_v4l2_object_destroy (self->v4l2capture);
   gst_v4l2_object_destroy (self->v4l2output);
+  gst_v4l2_latency_clear (&self->latency);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -2060,13 +2516,18 @@ gst_v4l2_video_dec_init (GstV4l2VideoDec * self)
   self->idr_received = FALSE;
   self->rate = 1;
   self->cap_buf_dynamic_allocation = DEFAULT_CAP_BUF_DYNAMIC_ALLOCATION;
+  self->format_timeout = DEFAULT_FORMAT_TIMEOUT;
+  self->fast_flush = DEFAULT_FAST_FLUSH;
+  self->idle_trim_timeout = DEFAULT_IDLE_TRIM_TIMEOUT;
+  g_mutex_init (&self->frame_lock);
+  g_mutex_init (&self->trim_lock);
+  g_cond_init (&self->trim_cond);
 #endif
 
-  const gchar * latency = g_getenv("NVDS_ENABLE_LATENCY_MEASUREMENT");
-  if(latency)
-  {
-    enable_latency_measurement = TRUE;
-  }
+  gst_v4l2_latency_init (&self->latency);
+  self->latency_reference =
+      g_getenv ("NVDS_ENABLE_LATENCY_MEASUREMENT") != NULL;
+  self->latency_meta = self->latency_reference;
 }
 
 static void
@@ -2159,6 +2620,48 @@ gst_v4l2_video_dec_class_init (GstV4l2VideoDecClass * klass)
           55, 55,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_READY));
 
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats",
+          "Statistics",
+          "Queue statistics of the output and capture buffer pools",
+          GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+      g_param_spec_uint ("stats-interval",
+          "Statistics interval",
+          "Interval in ms at which the stats are posted as element message, 0 to disable",
+          0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_LATENCY,
+      g_param_spec_boxed ("latency",
+          "Latency",
+          "p50/p95/p99 in us of the input to push time and its parts over the last frames",
+          GST_TYPE_STRUCTURE,
+          G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LATENCY_META,
+      g_param_spec_boolean ("latency-meta",
+          "Latency meta",
+          "Attach the per-frame latency stamps to the output buffers",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_FORMAT_TIMEOUT,
+      g_param_spec_int ("format-timeout",
+          "Format timeout",
+          "Time in ms to wait for the stream format before dropping the frame, -1 to wait forever",
+          -1, G_MAXINT, DEFAULT_FORMAT_TIMEOUT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_IDLE_TRIM_TIMEOUT,
+      g_param_spec_uint ("idle-trim-timeout",
+          "Idle trim timeout",
+          "Time in ms without input after which the capture buffers are released until the input resumes, 0 to keep them",
+          0, G_MAXUINT, DEFAULT_IDLE_TRIM_TIMEOUT,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
+
   if (is_cuvid == FALSE) {
     g_object_class_install_property (gobject_class, PROP_DISABLE_DPB,
         g_param_spec_boolean ("disable-dpb",
@@ -2204,6 +2707,15 @@ gst_v4l2_video_dec_class_init (GstV4l2VideoDecClass * klass)
           DEFAULT_CAP_BUF_DYNAMIC_ALLOCATION,
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS));
 
+    /* Relies on the Tegra decoder dropping the pending bitstream on an
+     * output plane STREAMOFF alone */
+    g_object_class_install_property (gobject_class, PROP_FAST_FLUSH,
+        g_param_spec_boolean ("fast-flush",
+            "Fast flush",
+            "Flush only the output plane on seeks, the capture plane keeps streaming on its buffers",
+            DEFAULT_FAST_FLUSH,
+            G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS | GST_PARAM_MUTABLE_PLAYING));
+
   } else if (is_cuvid == TRUE) {
     g_object_class_install_property (gobject_class, PROP_CUDADEC_MEM_TYPE,
         g_param_spec_enum ("cudadec-memtype",
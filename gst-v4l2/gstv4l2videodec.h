@@ -30,6 +30,7 @@
 
 #include <gstv4l2object.h>
 #include <gstv4l2bufferpool.h>
+#include <gstv4l2latency.h>
 
 G_BEGIN_DECLS
 #define GST_TYPE_V4L2_VIDEO_DEC \
@@ -48,8 +49,8 @@ G_BEGIN_DECLS
 #ifdef USE_V4L2_TARGET_NV
 #define GstV4l2VideoDec GstNvV4l2VideoDec
 #define GstV4l2VideoDecClass GstNvV4l2VideoDecClass
-#define  LOOP_COUNT_TO_WAIT_FOR_DQEVENT  6
-#define  WAIT_TIME_PER_LOOP_FOR_DQEVENT 100*1000
+/* Must be a power of two, and larger than the number of frames in flight */
+#define GST_V4L2_DEC_FRAME_INDEX_SIZE 256
 #endif
 
 typedef struct _GstV4l2VideoDec GstV4l2VideoDec;
@@ -71,10 +72,10 @@ struct _GstV4l2VideoDec
   GstVideoCodecState *input_state;
   gboolean active;
   GstFlowReturn output_flow;
-  guint64 frame_num;
+  GstV4l2Latency latency;
+  gboolean latency_meta;
+  gboolean latency_reference;   /* NVDS_ENABLE_LATENCY_MEASUREMENT */
 #ifdef USE_V4L2_TARGET_NV
-  GHashTable* hash_pts_systemtime;
-  gdouble buffer_in_time;
   guint64 decoded_picture_cnt;
   guint32 skip_frames;
   gboolean idr_received;
@@ -93,6 +94,27 @@ struct _GstV4l2VideoDec
   gboolean extract_sei_type5_data;
   gdouble rate;
   guint32 cap_buf_dynamic_allocation;
+  guint stats_interval;
+  gint64 stats_last_post;
+  gint format_timeout;      /* ms, -1 waits forever */
+  gboolean fast_flush;
+
+  /* Releases the capture buffers after idle_trim_timeout ms without input,
+   * they are allocated again on the next frame */
+  guint idle_trim_timeout;
+  gint64 last_input;        /* monotonic time of the last handle_frame() */
+  gboolean trimmed;
+  GThread *trim_thread;
+  GMutex trim_lock;
+  GCond trim_cond;
+  gboolean trim_stop;
+
+  /* Frames waiting for a decoded picture, indexed by system_frame_number
+   * which is what gets queued as the v4l2_buffer timestamp */
+  GMutex frame_lock;
+  GstVideoCodecFrame *frame_index[GST_V4L2_DEC_FRAME_INDEX_SIZE];
+  guint32 frame_oldest;     /* lowest frame number possibly in the index */
+  guint32 frame_next;       /* frame number after the last one inserted */
 #endif
 };
 
@@ -37,6 +37,8 @@
 
 #include "gstv4l2object.h"
 #include "gstv4l2videoenc.h"
+#include "gstv4l2tracer.h"
+#include "gstv4l2tracewriter.h"
 #include "gstnvdsseimeta.h"
 
 #include <string.h>
@@ -44,7 +46,6 @@
 
 GST_DEBUG_CATEGORY_STATIC (gst_v4l2_video_enc_debug);
 #define GST_CAT_DEFAULT gst_v4l2_video_enc_debug
-static gboolean enable_latency_measurement = FALSE;
 
 #ifdef USE_V4L2_TARGET_NV
 #define OUTPUT_CAPS \
@@ -72,17 +73,22 @@ typedef struct
 } GstV4l2VideoEncCData;
 
 #ifdef USE_V4L2_TARGET_NV
-GstVideoCodecFrame *
-gst_v4l2_video_enc_find_nearest_frame (GstV4l2VideoEnc *self,
-    GstBuffer * buf, GList * frames);
+static void
+gst_v4l2_video_enc_add_frame (GstV4l2VideoEnc * self,
+    GstVideoCodecFrame * frame);
+static void
+gst_v4l2_video_enc_remove_frame (GstV4l2VideoEnc * self,
+    GstVideoCodecFrame * frame);
+static GstVideoCodecFrame *
+gst_v4l2_video_enc_take_frame (GstV4l2VideoEnc * self, GstBuffer * buf);
+static void
+gst_v4l2_video_enc_clear_frames (GstV4l2VideoEnc * self);
 gboolean set_v4l2_video_encoder_properties (GstVideoEncoder * encoder);
 gboolean setQpRange (GstV4l2Object * v4l2object, guint label, guint MinQpI,
     guint MaxQpI, guint MinQpP, guint MaxQpP, guint MinQpB, guint MaxQpB);
 gboolean setHWPresetType (GstV4l2Object * v4l2object, guint label,
     enum v4l2_enc_hw_preset_type type);
-gint gst_v4l2_trace_file_open (FILE ** file);
-void gst_v4l2_trace_file_close (FILE * file);
-void gst_v4l2_trace_printf (FILE * file, const gchar *fmt, ...);
+static GstV4l2TraceWriter *gst_v4l2_trace_writer_open (void);
 
 static gboolean
 gst_v4l2_video_enc_parse_quantization_range (GstV4l2VideoEnc * self,
@@ -112,6 +118,11 @@ enum
   PROP_BITRATE,
   PROP_RATE_CONTROL,
   PROP_INTRA_FRAME_INTERVAL,
+  PROP_STATS,
+  PROP_STATS_INTERVAL,
+  PROP_LATENCY,
+  PROP_LATENCY_META,
+  PROP_EXPORT_BITSTREAM,
   /* Properties exposed on dGPU only */
   PROP_CUDAENC_GPU_ID,
   PROP_CUDAENC_PRESET_ID,
@@ -160,16 +171,6 @@ enum
 G_DEFINE_ABSTRACT_TYPE (GstV4l2VideoEnc, gst_v4l2_video_enc,
     GST_TYPE_VIDEO_ENCODER);
 
-static gdouble get_current_system_timestamp(void)
-{
-  struct timeval t1;
-  double elapsedTime = 0;
-  gettimeofday(&t1, NULL);
-  elapsedTime = (t1.tv_sec) * 1000.0;
-  elapsedTime += (t1.tv_usec) / 1000.0;
-  return elapsedTime;
-}
-
 #ifdef USE_V4L2_TARGET_NV
 GType
 gst_v4l2_enc_output_io_mode_get_type (void)
@@ -242,6 +243,18 @@ gst_v4l2_video_enc_set_property_tegra (GObject * object,
       self->iframeinterval = g_value_get_uint (value);
       break;
 
+    case PROP_STATS_INTERVAL:
+      self->stats_interval = g_value_get_uint (value);
+      break;
+
+    case PROP_LATENCY_META:
+      self->latency_meta = g_value_get_boolean (value);
+      break;
+
+    case PROP_EXPORT_BITSTREAM:
+      self->export_bitstream = g_value_get_boolean (value);
+      break;
+
     case PROP_PEAK_BITRATE:
       self->peak_bitrate = g_value_get_uint (value);
       break;
@@ -332,6 +345,18 @@ gst_v4l2_video_enc_set_property_cuvid (GObject * object,
       self->iframeinterval = g_value_get_uint (value);
       break;
 
+    case PROP_STATS_INTERVAL:
+      self->stats_interval = g_value_get_uint (value);
+      break;
+
+    case PROP_LATENCY_META:
+      self->latency_meta = g_value_get_boolean (value);
+      break;
+
+    case PROP_EXPORT_BITSTREAM:
+      self->export_bitstream = g_value_get_boolean (value);
+      break;
+
     case PROP_CUDAENC_GPU_ID:
       self->cudaenc_gpu_id = g_value_get_uint (value);
       break;
@@ -394,6 +419,27 @@ gst_v4l2_video_enc_get_property_tegra (GObject * object,
       g_value_set_uint (value, self->iframeinterval);
       break;
 
+    case PROP_STATS:
+      g_value_take_boxed (value,
+          gst_v4l2_object_get_m2m_stats (self->v4l2output, self->v4l2capture));
+      break;
+
+    case PROP_STATS_INTERVAL:
+      g_value_set_uint (value, self->stats_interval);
+      break;
+
+    case PROP_LATENCY:
+      g_value_take_boxed (value, gst_v4l2_latency_get_stats (&self->latency));
+      break;
+
+    case PROP_LATENCY_META:
+      g_value_set_boolean (value, self->latency_meta);
+      break;
+
+    case PROP_EXPORT_BITSTREAM:
+      g_value_set_boolean (value, self->export_bitstream);
+      break;
+
     case PROP_PEAK_BITRATE:
       g_value_set_uint (value, self->peak_bitrate);
       break;
@@ -476,6 +522,27 @@ gst_v4l2_video_enc_get_property_cuvid (GObject * object,
       g_value_set_uint (value, self->iframeinterval);
       break;
 
+    case PROP_STATS:
+      g_value_take_boxed (value,
+          gst_v4l2_object_get_m2m_stats (self->v4l2output, self->v4l2capture));
+      break;
+
+    case PROP_STATS_INTERVAL:
+      g_value_set_uint (value, self->stats_interval);
+      break;
+
+    case PROP_LATENCY:
+      g_value_take_boxed (value, gst_v4l2_latency_get_stats (&self->latency));
+      break;
+
+    case PROP_LATENCY_META:
+      g_value_set_boolean (value, self->latency_meta);
+      break;
+
+    case PROP_EXPORT_BITSTREAM:
+      g_value_set_boolean (value, self->export_bitstream);
+      break;
+
     case PROP_CUDAENC_GPU_ID:
       g_value_set_uint(value, self->cudaenc_gpu_id);
       break;
@@ -556,10 +623,10 @@ gst_v4l2_video_enc_open (GstVideoEncoder * encoder)
   }
 
   if (self->measure_latency) {
-    if (gst_v4l2_trace_file_open (&self->tracing_file_enc) == 0) {
+    self->trace_writer = gst_v4l2_trace_writer_open ();
+    if (self->trace_writer)
       g_print ("%s: open trace file successfully\n", __func__);
-      self->got_frame_pt = g_queue_new ();
-    } else
+    else
       g_print ("%s: failed to open trace file\n", __func__);
   }
 
@@ -617,9 +684,9 @@ gst_v4l2_video_enc_close (GstVideoEncoder * encoder)
   gst_caps_replace (&self->probed_sinkcaps, NULL);
 
 #ifdef USE_V4L2_TARGET_NV
-  if (self->tracing_file_enc) {
-    gst_v4l2_trace_file_close (self->tracing_file_enc);
-    g_queue_free (self->got_frame_pt);
+  if (self->trace_writer) {
+    gst_v4l2_trace_writer_free (self->trace_writer);
+    self->trace_writer = NULL;
   }
 #endif
 
@@ -637,7 +704,7 @@ gst_v4l2_video_enc_start (GstVideoEncoder * encoder)
   g_atomic_int_set (&self->active, TRUE);
   self->output_flow = GST_FLOW_OK;
 
-  self->hash_pts_systemtime = g_hash_table_new(NULL, NULL);
+  gst_v4l2_latency_reset (&self->latency);
 
   return TRUE;
 }
@@ -666,7 +733,9 @@ gst_v4l2_video_enc_stop (GstVideoEncoder * encoder)
   gst_v4l2_object_stop (self->v4l2output);
   gst_v4l2_object_stop (self->v4l2capture);
 
-  g_hash_table_destroy (self->hash_pts_systemtime);
+#ifdef USE_V4L2_TARGET_NV
+  gst_v4l2_video_enc_clear_frames (self);
+#endif
 
   if (self->input_state) {
     gst_video_codec_state_unref (self->input_state);
@@ -865,6 +934,11 @@ gst_v4l2_video_enc_flush (GstVideoEncoder * encoder)
   gst_v4l2_object_unlock_stop (self->v4l2output);
   gst_v4l2_object_unlock_stop (self->v4l2capture);
 
+#ifdef USE_V4L2_TARGET_NV
+  /* The base class drops all pending frames along with the flush */
+  gst_v4l2_video_enc_clear_frames (self);
+#endif
+
   return TRUE;
 }
 
@@ -1104,63 +1178,228 @@ not_negotiated:
 }
 
 #ifdef USE_V4L2_TARGET_NV
-GstVideoCodecFrame *
-gst_v4l2_video_enc_find_nearest_frame (GstV4l2VideoEnc *self,
-    GstBuffer * buf, GList * frames)
+#define GST_V4L2_VIDEO_ENC_FRAME_MASK (GST_V4L2_VIDEO_ENC_FRAME_INDEX_SIZE - 1)
+
+/* The driver returns the timestamp with microsecond precision, key the
+ * frames by what will come back rather than by their PTS */
+static inline GstClockTime
+gst_v4l2_video_enc_frame_key (GstClockTime pts)
 {
-  GstVideoCodecFrame *best = NULL;
-  GstClockTimeDiff best_diff = G_MAXINT64;
-  GstClockTime timestamp;
-  GList *l;
+  struct timeval tv;
 
-  timestamp = buf->pts;
+  GST_TIME_TO_TIMEVAL (pts, tv);
+  return GST_TIMEVAL_TO_TIME (tv);
+}
 
-  for (l = frames; l; l = l->next) {
-    GstVideoCodecFrame *tmp = l->data;
-    GstClockTimeDiff diff = ABS (GST_CLOCK_DIFF (timestamp, tmp->pts));
+static inline guint
+gst_v4l2_video_enc_frame_hash (GstClockTime key)
+{
+  return (guint) ((key * G_GUINT64_CONSTANT (0x9E3779B97F4A7C15)) >> 32) &
+      GST_V4L2_VIDEO_ENC_FRAME_MASK;
+}
 
-    if (diff < best_diff) {
-      best = tmp;
-      best_diff = diff;
+/* Empties slot @i, moving back the entries probed past it. Must be called
+ * with the frame lock held. */
+static GstVideoCodecFrame *
+gst_v4l2_video_enc_remove_slot (GstV4l2VideoEnc * self, guint i)
+{
+  GstV4l2VideoEncFrameSlot *slots = self->frame_index;
+  GstVideoCodecFrame *frame = slots[i].frame;
+  guint j = i, k;
 
-      if (diff == 0)
-        break;
+  for (;;) {
+    j = (j + 1) & GST_V4L2_VIDEO_ENC_FRAME_MASK;
+    if (!slots[j].frame)
+      break;
+
+    /* Entries hashed between the hole and their slot stay where they are */
+    k = gst_v4l2_video_enc_frame_hash (slots[j].key);
+    if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+      continue;
+
+    slots[i] = slots[j];
+    i = j;
+  }
+
+  slots[i].frame = NULL;
+  self->n_frames--;
+
+  return frame;
+}
+
+/* Takes the oldest frame queued with @key out of the index, or @frame if
+ * not NULL. Must be called with the frame lock held. */
+static GstVideoCodecFrame *
+gst_v4l2_video_enc_steal_frame (GstV4l2VideoEnc * self, GstClockTime key,
+    GstVideoCodecFrame * frame)
+{
+  GstV4l2VideoEncFrameSlot *slots = self->frame_index;
+  guint i, best = G_MAXUINT;
+
+  for (i = gst_v4l2_video_enc_frame_hash (key); slots[i].frame;
+      i = (i + 1) & GST_V4L2_VIDEO_ENC_FRAME_MASK) {
+    if (slots[i].key != key || (frame && slots[i].frame != frame))
+      continue;
+
+    /* Duplicate timestamps go out in the order they came in */
+    if (best == G_MAXUINT || (gint32) (slots[i].frame->system_frame_number -
+            slots[best].frame->system_frame_number) < 0)
+      best = i;
+  }
+
+  if (best == G_MAXUINT)
+    return NULL;
+
+  return gst_v4l2_video_enc_remove_slot (self, best);
+}
+
+static void
+gst_v4l2_video_enc_add_frame (GstV4l2VideoEnc * self,
+    GstVideoCodecFrame * frame)
+{
+  GstV4l2VideoEncFrameSlot *slots = self->frame_index;
+  GstClockTime key = gst_v4l2_video_enc_frame_key (frame->pts);
+  GstVideoCodecFrame *ghost = NULL;
+  guint i;
+
+  g_mutex_lock (&self->frame_lock);
+
+  /* Frames the driver never gave back would end up filling the index, make
+   * room by forgetting the oldest one. This does not happen in practice. */
+  if (self->n_frames >= GST_V4L2_VIDEO_ENC_FRAME_INDEX_SIZE * 3 / 4) {
+    guint oldest = G_MAXUINT;
+
+    for (i = 0; i < GST_V4L2_VIDEO_ENC_FRAME_INDEX_SIZE; i++) {
+      if (slots[i].frame && (oldest == G_MAXUINT ||
+              (gint32) (slots[i].frame->system_frame_number -
+                  slots[oldest].frame->system_frame_number) < 0))
+        oldest = i;
     }
+    ghost = gst_v4l2_video_enc_remove_slot (self, oldest);
   }
 
-  /* For slice output mode, video encoder will ouput multi buffer with
-   * one input buffer. Which will cause frames list haven't any entry.
-   * So the best will be NULL. Video bit stream will be discard in
-   * function gst_v4l2_video_enc_loop() when the best is NULL.
-   * Here reuse previous frame when the best is NULL to handle discard
-   * bit stream issue when slice output mode enabled. */
-  /* Video encoder will output the same PTS for slices. Reuse previous
-   * frame for the same PTS slices */
-  if (self->slice_output && self->best_prev
-          && GST_CLOCK_TIME_IS_VALID (buf->pts)
-          && GST_CLOCK_TIME_IS_VALID (self->buf_pts_prev)
-          && buf->pts == self->buf_pts_prev)
-      best = NULL;
-  self->buf_pts_prev = buf->pts;
-
-  if (best) {
-    gst_video_codec_frame_ref (best);
-    if (self->slice_output) {
-      if (self->best_prev)
-        gst_video_codec_frame_unref (self->best_prev);
-      self->best_prev = gst_video_codec_frame_ref (best);
+  i = gst_v4l2_video_enc_frame_hash (key);
+  while (slots[i].frame)
+    i = (i + 1) & GST_V4L2_VIDEO_ENC_FRAME_MASK;
+  slots[i].key = key;
+  slots[i].frame = gst_video_codec_frame_ref (frame);
+  self->n_frames++;
+
+  g_mutex_unlock (&self->frame_lock);
+
+  if (ghost) {
+    GST_WARNING_OBJECT (self, "frame %d was never encoded",
+        ghost->system_frame_number);
+    gst_video_codec_frame_unref (ghost);
+  }
+}
+
+static void
+gst_v4l2_video_enc_remove_frame (GstV4l2VideoEnc * self,
+    GstVideoCodecFrame * frame)
+{
+  GstVideoCodecFrame *tmp;
+
+  g_mutex_lock (&self->frame_lock);
+  tmp = gst_v4l2_video_enc_steal_frame (self,
+      gst_v4l2_video_enc_frame_key (frame->pts), frame);
+  g_mutex_unlock (&self->frame_lock);
+
+  if (tmp)
+    gst_video_codec_frame_unref (tmp);
+}
+
+/* TRUE if the first slice in @buf is not the first one of its picture, that
+ * is its first_mb_in_slice is not 0. Only H.264 has slice output. */
+static gboolean
+gst_v4l2_video_enc_continues_picture (GstBuffer * buf)
+{
+  GstMapInfo map;
+  gboolean ret = FALSE;
+  gsize i;
+
+  if (!gst_buffer_map (buf, &map, GST_MAP_READ))
+    return FALSE;
+
+  for (i = 0; i + 4 < map.size; i++) {
+    guint8 nal_type;
+
+    if (map.data[i] != 0 || map.data[i + 1] != 0 || map.data[i + 2] != 1)
+      continue;
+
+    nal_type = map.data[i + 3] & 0x1f;
+    if (nal_type == 1 || nal_type == 5) {
+      /* first_mb_in_slice is ue(v), 0 is coded as a single 1 bit */
+      ret = !(map.data[i + 4] & 0x80);
+      break;
     }
-  } else if (self->slice_output) {
-    best = gst_video_codec_frame_ref (self->best_prev);
-    /* Presentation_frame_number == 0 means discontinues. Need avoid it */
-    if (best->presentation_frame_number == 0)
-      best->presentation_frame_number = 1;
+    i += 3;
   }
 
-  g_list_foreach (frames, (GFunc) gst_video_codec_frame_unref, NULL);
-  g_list_free (frames);
+  gst_buffer_unmap (buf, &map);
 
-  return best;
+  return ret;
+}
+
+/* Looks up the frame of the bitstream in @buf. In slice output mode the
+ * encoder outputs one buffer per slice, all with the timestamp of their
+ * frame: the first slice of a picture looks its frame up and makes it the
+ * current one, the following slices go to the current frame until the
+ * first slice of the next picture. */
+static GstVideoCodecFrame *
+gst_v4l2_video_enc_take_frame (GstV4l2VideoEnc * self, GstBuffer * buf)
+{
+  GstVideoCodecFrame *frame;
+  GstClockTime key = GST_BUFFER_TIMESTAMP (buf);
+
+  if (self->slice_frame && gst_v4l2_video_enc_continues_picture (buf))
+    goto next_slice;
+
+  g_mutex_lock (&self->frame_lock);
+  frame = gst_v4l2_video_enc_steal_frame (self, key, NULL);
+  g_mutex_unlock (&self->frame_lock);
+
+  if (self->slice_output) {
+    /* Slices without a parsable header belong to the current picture */
+    if (frame == NULL && self->slice_frame &&
+        gst_v4l2_video_enc_frame_key (self->slice_frame->pts) == key)
+      goto next_slice;
+
+    if (self->slice_frame)
+      gst_video_codec_frame_unref (self->slice_frame);
+    self->slice_frame = frame ? gst_video_codec_frame_ref (frame) : NULL;
+  }
+
+  return frame;
+
+next_slice:
+  /* The frame already went through finish_frame(), a presentation frame
+   * number of 0 would be taken as a discontinuity */
+  if (self->slice_frame->presentation_frame_number == 0)
+    self->slice_frame->presentation_frame_number = 1;
+
+  return gst_video_codec_frame_ref (self->slice_frame);
+}
+
+static void
+gst_v4l2_video_enc_clear_frames (GstV4l2VideoEnc * self)
+{
+  guint i;
+
+  g_mutex_lock (&self->frame_lock);
+  for (i = 0; i < GST_V4L2_VIDEO_ENC_FRAME_INDEX_SIZE; i++) {
+    if (self->frame_index[i].frame) {
+      gst_video_codec_frame_unref (self->frame_index[i].frame);
+      self->frame_index[i].frame = NULL;
+    }
+  }
+  self->n_frames = 0;
+  g_mutex_unlock (&self->frame_lock);
+
+  if (self->slice_frame) {
+    gst_video_codec_frame_unref (self->slice_frame);
+    self->slice_frame = NULL;
+  }
 }
 #else
 static GstVideoCodecFrame *
@@ -1202,16 +1441,20 @@ gst_v4l2_video_enc_loop (GstVideoEncoder * encoder)
   GstVideoCodecFrame *frame;
   GstBuffer *buffer = NULL;
   GstFlowReturn ret;
-#ifdef USE_V4L2_TARGET_NV
-  struct timeval ts;
-  guint64 done_time;
-  guint64 *in_time_pt;
-#endif
 
   GST_LOG_OBJECT (encoder, "Allocate output buffer");
+  GST_V4L2_TRACE (self->v4l2capture, GST_V4L2_TRACE_ACQUIRE, -1, -1, 0,
+      GST_CLOCK_TIME_NONE);
 
-  buffer = gst_video_encoder_allocate_output_buffer (encoder,
-      self->v4l2capture->info.size);
+#ifdef USE_V4L2_TARGET_NV
+  /* The pool hands over its own memory when exporting, and only allocates
+   * when it has to fall back to a copy */
+  if (self->export_bitstream)
+    buffer = gst_buffer_new ();
+  else
+#endif
+    buffer = gst_video_encoder_allocate_output_buffer (encoder,
+        self->v4l2capture->info.size);
 
   if (NULL == buffer) {
     ret = GST_FLOW_FLUSHING;
@@ -1248,46 +1491,24 @@ gst_v4l2_video_enc_loop (GstVideoEncoder * encoder)
     goto beach;
 
 #ifdef USE_V4L2_TARGET_NV
-  frame = gst_v4l2_video_enc_find_nearest_frame (self, buffer,
-          gst_video_encoder_get_frames (GST_VIDEO_ENCODER (self)));
+  frame = gst_v4l2_video_enc_take_frame (self, buffer);
 #else
   frame = gst_v4l2_video_enc_get_oldest_frame (encoder);
 #endif
 
   if (frame) {
+    GstClockTime pts = frame->pts;
+
     frame->output_buffer = buffer;
     buffer = NULL;
 
-    if(enable_latency_measurement) /* TODO with better option */
-    {
-      gpointer in_time = g_hash_table_lookup (self->hash_pts_systemtime,
-              &frame->pts);
-      gdouble input_time = *((gdouble*)in_time);
-      gdouble output_time = get_current_system_timestamp ();
-      if (output_time < input_time)
-      {
-          gdouble time = G_MAXDOUBLE - input_time;
-          g_print ("Encode Latency = %f \n", output_time + time);
-      }
-      else
-      {
-          g_print ("Encode Latency = %f \n", (output_time - input_time));
-      }
-      GstCaps *reference = gst_caps_new_simple ("video/x-raw",
-          "component_name", G_TYPE_STRING, GST_ELEMENT_NAME(self),
-          /*"frame_num", G_TYPE_INT, self->frame_num++,*/
-          "in_timestamp", G_TYPE_DOUBLE, input_time,
-          "out_timestamp", G_TYPE_DOUBLE, output_time,
-          NULL);
-      GstReferenceTimestampMeta * enc_meta =
-        gst_buffer_add_reference_timestamp_meta (frame->output_buffer, reference,
-            0, 0);
-      if(enc_meta == NULL)
-      {
-        GST_DEBUG_OBJECT (encoder, "enc_meta: %p", enc_meta);
-      }
-      gst_caps_unref(reference);
-    }
+    gst_v4l2_latency_output (&self->latency, frame->system_frame_number,
+        frame->output_buffer, self->v4l2output, self->v4l2capture,
+        self->latency_meta,
+        self->latency_reference ? GST_ELEMENT_NAME (self) : NULL);
+
+    GST_V4L2_TRACE (self->v4l2capture, GST_V4L2_TRACE_FINISH_FRAME, -1, -1,
+        gst_buffer_get_size (frame->output_buffer), frame->pts);
 
 #ifdef USE_V4L2_TARGET_NV
 
@@ -1299,23 +1520,25 @@ gst_v4l2_video_enc_loop (GstVideoEncoder * encoder)
         }
     }
 
-    if (self->tracing_file_enc) {
-      gettimeofday (&ts, NULL);
-      done_time = ((gint64) ts.tv_sec * 1000000 + ts.tv_usec) / 1000;
-
-      in_time_pt = g_queue_pop_head (self->got_frame_pt);
-      gst_v4l2_trace_printf (self->tracing_file_enc,
-          "KPI: v4l2: frameNumber= %lld encoder= %lld ms pts= %lld\n",
-          frame->system_frame_number, done_time - *in_time_pt, frame->pts);
-
-      g_free (in_time_pt);
-    }
+    if (self->trace_writer)
+      gst_v4l2_trace_writer_push (self->trace_writer, V4L2_TRACE_EVENT_OUTPUT,
+          frame->system_frame_number, frame->pts,
+          gst_buffer_get_size (frame->output_buffer),
+          GST_VIDEO_CODEC_FRAME_IS_SYNC_POINT (frame) ?
+          V4L2_TRACE_FLAG_KEYFRAME : 0);
 #endif
 
     ret = gst_video_encoder_finish_frame (encoder, frame);
 
     if (ret != GST_FLOW_OK)
       goto beach;
+
+    GST_V4L2_TRACE (self->v4l2capture, GST_V4L2_TRACE_PUSHED, -1, -1, 0, pts);
+
+#ifdef USE_V4L2_TARGET_NV
+    gst_v4l2_object_post_m2m_stats (GST_ELEMENT (self), self->v4l2output,
+        self->v4l2capture, self->stats_interval, &self->stats_last_post);
+#endif
   } else {
     GST_WARNING_OBJECT (encoder, "Encoder is producing too many buffers");
     gst_buffer_unref (buffer);
@@ -1354,27 +1577,21 @@ gst_v4l2_video_enc_handle_frame (GstVideoEncoder * encoder,
   GstV4l2VideoEnc *self = GST_V4L2_VIDEO_ENC (encoder);
   GstFlowReturn ret = GST_FLOW_OK;
   GstTaskState task_state;
-#ifdef USE_V4L2_TARGET_NV
-  guint64 *in_time;
-  struct timeval ts;
-#endif
 
   GST_DEBUG_OBJECT (self, "Handling frame %d", frame->system_frame_number);
+  GST_V4L2_TRACE (self->v4l2output, GST_V4L2_TRACE_HANDLE_FRAME, -1, -1,
+      gst_buffer_get_size (frame->input_buffer), frame->pts);
 
 #ifdef USE_V4L2_TARGET_NV
-  if (self->tracing_file_enc) {
-    gettimeofday (&ts, NULL);
-    in_time = g_malloc (sizeof (guint64));
-    *in_time = ((gint64) ts.tv_sec * 1000000 + ts.tv_usec) / 1000;
-    g_queue_push_tail (self->got_frame_pt, in_time);
-  }
+  if (self->trace_writer)
+    gst_v4l2_trace_writer_push (self->trace_writer, V4L2_TRACE_EVENT_INPUT,
+        frame->system_frame_number, frame->pts, 0, 0);
 #endif
 
-  if (enable_latency_measurement)
-  {
-      self->buffer_in_time = get_current_system_timestamp ();
-      g_hash_table_insert (self->hash_pts_systemtime, &frame->pts, &self->buffer_in_time);
-  }
+  gst_v4l2_latency_input (&self->latency, frame->system_frame_number);
+#ifdef USE_V4L2_TARGET_NV
+  gst_v4l2_video_enc_add_frame (self, frame);
+#endif
 
   if (G_UNLIKELY (!g_atomic_int_get (&self->active)))
     goto flushing;
@@ -1494,6 +1711,9 @@ process_failed:
   }
 drop:
   {
+#ifdef USE_V4L2_TARGET_NV
+    gst_v4l2_video_enc_remove_frame (self, frame);
+#endif
     gst_video_encoder_finish_frame (encoder, frame);
     return ret;
   }
@@ -1534,6 +1754,12 @@ gst_v4l2_video_enc_decide_allocation (GstVideoEncoder *
     ret = enc_class->decide_allocation (encoder, query);
   }
 
+#ifdef USE_V4L2_TARGET_NV
+  if (self->v4l2capture->pool)
+    gst_v4l2_buffer_pool_enable_export (GST_V4L2_BUFFER_POOL
+        (self->v4l2capture->pool), self->export_bitstream);
+#endif
+
   /* FIXME This may not be entirely correct, as encoder may keep some
    * observation withouth delaying the encoding. Linux Media API need some
    * more work to explicitly expressed the decoder / encoder latency. This
@@ -1734,8 +1960,14 @@ gst_v4l2_video_enc_finalize (GObject * object)
 {
   GstV4l2VideoEnc *self = GST_V4L2_VIDEO_ENC (object);
 
+#ifdef USE_V4L2_TARGET_NV
+  gst_v4l2_video_enc_clear_frames (self);
+  g_mutex_clear (&self->frame_lock);
+#endif
+
   gst_v4l2_object_destroy (self->v4l2capture);
   gst_v4l2_object_destroy (self->v4l2output);
+  gst_v4l2_latency_clear (&self->latency);
 
   G_OBJECT_CLASS (parent_class)->finalize (object);
 }
@@ -1766,22 +1998,20 @@ gst_v4l2_video_enc_init (GstV4l2VideoEnc * self)
   self->maxperf_enable = FALSE;
   self->measure_latency = FALSE;
   self->slice_output = FALSE;
-  self->best_prev = NULL;
-  self->buf_pts_prev = GST_CLOCK_STIME_NONE;
+  self->slice_frame = NULL;
+  g_mutex_init (&self->frame_lock);
   if (is_cuvid == TRUE)
   {
     self->cudaenc_gpu_id = DEFAULT_CUDAENC_GPU_ID;
     self->cudaenc_preset_id = DEFAULT_CUDAENC_PRESET_ID;
     self->cudaenc_tuning_info_id = DEFAULT_TUNING_INFO_PRESET;
   }
-
-  const gchar * latency = g_getenv("NVDS_ENABLE_LATENCY_MEASUREMENT");
-  if(latency)
-  {
-    enable_latency_measurement = TRUE;
-  }
-
 #endif
+
+  gst_v4l2_latency_init (&self->latency);
+  self->latency_reference =
+      g_getenv ("NVDS_ENABLE_LATENCY_MEASUREMENT") != NULL;
+  self->latency_meta = self->latency_reference;
 }
 
 static void
@@ -1856,6 +2086,38 @@ gst_v4l2_video_enc_class_init (GstV4l2VideoEncClass * klass)
           G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
           GST_PARAM_MUTABLE_READY));
 
+  g_object_class_install_property (gobject_class, PROP_STATS,
+      g_param_spec_boxed ("stats", "Statistics",
+          "Queue statistics of the output and capture buffer pools",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_STATS_INTERVAL,
+      g_param_spec_uint ("stats-interval", "Statistics interval",
+          "Interval in ms at which the stats are posted as element message, 0 to disable",
+          0, G_MAXUINT, 0,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_LATENCY,
+      g_param_spec_boxed ("latency", "Latency",
+          "p50/p95/p99 in us of the input to push time and its parts over the last frames",
+          GST_TYPE_STRUCTURE, G_PARAM_READABLE | G_PARAM_STATIC_STRINGS));
+
+  g_object_class_install_property (gobject_class, PROP_LATENCY_META,
+      g_param_spec_boolean ("latency-meta", "Latency meta",
+          "Attach the per-frame latency stamps to the output buffers",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_PLAYING));
+
+  g_object_class_install_property (gobject_class, PROP_EXPORT_BITSTREAM,
+      g_param_spec_boolean ("export-bitstream", "Export bitstream",
+          "Push the encoded frames in the capture buffers instead of copying them, "
+          "they are requeued once downstream drops them",
+          FALSE,
+          G_PARAM_READWRITE | G_PARAM_STATIC_STRINGS |
+          GST_PARAM_MUTABLE_READY));
+
   if (is_cuvid == TRUE) {
     g_object_class_install_property (gobject_class, PROP_CUDAENC_GPU_ID,
         g_param_spec_uint ("gpu-id",
@@ -2163,50 +2425,25 @@ gst_v4l2_video_enc_register (GstPlugin * plugin, GType type,
 
 
 #ifdef USE_V4L2_TARGET_NV
-gint
-gst_v4l2_trace_file_open (FILE ** TracingFile)
+static GstV4l2TraceWriter *
+gst_v4l2_trace_writer_open (void)
 {
-  gchar buf[4096] = { };
+  GstV4l2TraceWriter *writer;
+  gchar *path;
 
   const gchar *homedir = g_getenv ("HOME");
   if (!homedir)
     homedir = g_get_home_dir ();
 
   if (homedir == NULL)
-    return -1;
-
-  snprintf (buf, sizeof (buf) - 1, "%s/gst_v4l2_enc_latency_%d.log",
-      homedir, (gint) getpid ());
+    return NULL;
 
-  *TracingFile = fopen (buf, "w");
+  path = g_strdup_printf ("%s/gst_v4l2_enc_latency_%d.trace", homedir,
+      (gint) getpid ());
+  writer = gst_v4l2_trace_writer_new (path);
+  g_free (path);
 
-  if (*TracingFile == NULL) {
-    return -1;
-  }
-  return 0;
-}
-
-void
-gst_v4l2_trace_file_close (FILE * TracingFile)
-{
-  if (TracingFile == NULL)
-    return;
-  fclose (TracingFile);
-  TracingFile = NULL;
-}
-
-void
-gst_v4l2_trace_printf (FILE * TracingFile, const gchar *fmt, ...)
-{
-  va_list ap;
-
-  if (TracingFile != NULL) {
-    va_start (ap, fmt);
-    vfprintf (TracingFile, fmt, ap);
-    fprintf (TracingFile, "\n");
-    fflush (TracingFile);
-    va_end (ap);
-  }
+  return writer;
 }
 
 static GType
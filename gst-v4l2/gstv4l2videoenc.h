@@ -30,6 +30,8 @@
 
 #include <gstv4l2object.h>
 #include <gstv4l2bufferpool.h>
+#include <gstv4l2latency.h>
+#include <gstv4l2tracewriter.h>
 
 G_BEGIN_DECLS
 #define GST_TYPE_V4L2_VIDEO_ENC \
@@ -48,9 +50,24 @@ G_BEGIN_DECLS
 typedef struct _GstV4l2VideoEnc GstV4l2VideoEnc;
 typedef struct _GstV4l2VideoEncClass GstV4l2VideoEncClass;
 
+#ifdef USE_V4L2_TARGET_NV
+/* Must be a power of two, and well above the number of frames in flight */
+#define GST_V4L2_VIDEO_ENC_FRAME_INDEX_SIZE 256
+
+/* Open addressing slot of the in-flight frame index, empty without frame */
+typedef struct
+{
+  GstClockTime key;         /* PTS as it comes back through v4l2_buffer */
+  GstVideoCodecFrame *frame;
+} GstV4l2VideoEncFrameSlot;
+#endif
+
 struct _GstV4l2VideoEnc
 {
   GstVideoEncoder parent;
+  GstV4l2Latency latency;
+  gboolean latency_meta;
+  gboolean latency_reference;   /* NVDS_ENABLE_LATENCY_MEASUREMENT */
 #ifdef USE_V4L2_TARGET_NV
   guint32 ratecontrol;
   guint32 bitrate;
@@ -74,17 +91,23 @@ struct _GstV4l2VideoEnc
   gboolean force_idr;
   gboolean force_intra;
   gboolean maxperf_enable;
-  FILE *tracing_file_enc;
-  GQueue *got_frame_pt;
+  GstV4l2TraceWriter *trace_writer;
   guint32 cudaenc_gpu_id;
   guint32 cudaenc_preset_id;
   guint32 cudaenc_tuning_info_id;
   gboolean slice_output;
-  GstVideoCodecFrame *best_prev;
-  GstClockTime buf_pts_prev;
-  gdouble buffer_in_time;
-  GHashTable* hash_pts_systemtime;
+  /* Frame of the access unit whose slices are being output, NULL between
+   * access units */
+  GstVideoCodecFrame *slice_frame;
   gboolean copy_meta;
+  guint stats_interval;
+  gint64 stats_last_post;
+  gboolean export_bitstream;
+
+  /* Frames queued to the driver, hashed by timestamp */
+  GMutex frame_lock;
+  GstV4l2VideoEncFrameSlot frame_index[GST_V4L2_VIDEO_ENC_FRAME_INDEX_SIZE];
+  guint n_frames;
 #endif
 
   /* < private > */
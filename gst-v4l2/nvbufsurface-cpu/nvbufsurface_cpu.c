@@ -0,0 +1,1213 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* CPU reference implementation of the NvBufSurface / NvBufSurfTransform
+ * entry points used by the nvvideo4linux2 plugin. Every buffer is backed by
+ * a memfd (or a dma-heap buffer when NVBUFSURFACE_CPU_USE_DMA_HEAP is set),
+ * so it can be passed around as a dmabuf fd and resolved again with
+ * NvBufSurfaceFromFd(). Copies and transforms touch every pixel, which keeps
+ * the cost of redundant copies visible when profiling on a host. */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/dma-heap.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nvbufsurface.h"
+#include "nvbufsurftransform.h"
+#include "nvbufsurface_cpu.h"
+
+#define CPU_SURFACE_MAGIC 0x53555043    /* "CPUS" */
+#define CPU_PITCH_ALIGN 64
+#define CPU_ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+#define CPU_MIN(a, b) ((a) < (b) ? (a) : (b))
+#define CPU_STAT_ADD(field, n) \
+    __atomic_fetch_add (&cpu_stats.field, (n), __ATOMIC_RELAXED)
+
+typedef struct
+{
+  int fd;
+  uint8_t *base;
+  size_t size;
+  int map_count;
+  dev_t dev;
+  ino_t ino;
+} CpuBuffer;
+
+typedef struct _CpuSurface CpuSurface;
+
+struct _CpuSurface
+{
+  uint32_t magic;
+  /* imported from an fd the library did not allocate */
+  int imported;
+  /* the last fd it was looked up with, it is released once that is gone */
+  int src_fd;
+  NvBufSurface surf;
+  NvBufSurfaceParams *params;
+  CpuBuffer *buffers;
+  CpuSurface *next;
+};
+
+typedef struct
+{
+  uint32_t num_planes;
+  /* bytes per element of each plane, an element covers wdiv pixels */
+  uint32_t bpp[NVBUF_MAX_PLANES];
+  uint32_t wdiv[NVBUF_MAX_PLANES];
+  uint32_t hdiv[NVBUF_MAX_PLANES];
+} CpuFormatInfo;
+
+/* Where a Y, U or V sample of an 8 bit YUV format lives */
+typedef struct
+{
+  int plane;
+  uint32_t offset;
+  uint32_t step;
+  uint32_t wdiv;
+  uint32_t hdiv;
+} CpuComponent;
+
+typedef struct
+{
+  uint32_t left;
+  uint32_t top;
+  uint32_t width;
+  uint32_t height;
+} CpuRect;
+
+static pthread_mutex_t cpu_lock = PTHREAD_MUTEX_INITIALIZER;
+static CpuSurface *cpu_surfaces = NULL;
+static NvBufSurfaceCpuStats cpu_stats;
+
+static int
+cpu_format_info (NvBufSurfaceColorFormat format, CpuFormatInfo * info)
+{
+  memset (info, 0, sizeof (*info));
+
+#define PLANE(i, b, w, h) \
+  do { info->bpp[i] = (b); info->wdiv[i] = (w); info->hdiv[i] = (h); } while (0)
+
+  switch (format) {
+    case NVBUF_COLOR_FORMAT_GRAY8:
+      info->num_planes = 1;
+      PLANE (0, 1, 1, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_YUV420:
+    case NVBUF_COLOR_FORMAT_YVU420:
+    case NVBUF_COLOR_FORMAT_YUV420_ER:
+    case NVBUF_COLOR_FORMAT_YVU420_ER:
+    case NVBUF_COLOR_FORMAT_YUV420_709:
+    case NVBUF_COLOR_FORMAT_YUV420_709_ER:
+    case NVBUF_COLOR_FORMAT_YUV420_2020:
+      info->num_planes = 3;
+      PLANE (0, 1, 1, 1);
+      PLANE (1, 1, 2, 2);
+      PLANE (2, 1, 2, 2);
+      break;
+    case NVBUF_COLOR_FORMAT_YUV422:
+      info->num_planes = 3;
+      PLANE (0, 1, 1, 1);
+      PLANE (1, 1, 2, 1);
+      PLANE (2, 1, 2, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_YUV444:
+    case NVBUF_COLOR_FORMAT_R8_G8_B8:
+    case NVBUF_COLOR_FORMAT_B8_G8_R8:
+      info->num_planes = 3;
+      PLANE (0, 1, 1, 1);
+      PLANE (1, 1, 1, 1);
+      PLANE (2, 1, 1, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_R32F_G32F_B32F:
+    case NVBUF_COLOR_FORMAT_B32F_G32F_R32F:
+      info->num_planes = 3;
+      PLANE (0, 4, 1, 1);
+      PLANE (1, 4, 1, 1);
+      PLANE (2, 4, 1, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_NV12:
+    case NVBUF_COLOR_FORMAT_NV12_ER:
+    case NVBUF_COLOR_FORMAT_NV21:
+    case NVBUF_COLOR_FORMAT_NV21_ER:
+    case NVBUF_COLOR_FORMAT_NV12_709:
+    case NVBUF_COLOR_FORMAT_NV12_709_ER:
+    case NVBUF_COLOR_FORMAT_NV12_2020:
+      info->num_planes = 2;
+      PLANE (0, 1, 1, 1);
+      PLANE (1, 2, 2, 2);
+      break;
+    case NVBUF_COLOR_FORMAT_NV12_10LE:
+    case NVBUF_COLOR_FORMAT_NV12_12LE:
+    case NVBUF_COLOR_FORMAT_NV12_10LE_ER:
+    case NVBUF_COLOR_FORMAT_NV12_10LE_709:
+    case NVBUF_COLOR_FORMAT_NV12_10LE_709_ER:
+    case NVBUF_COLOR_FORMAT_NV12_10LE_2020:
+    case NVBUF_COLOR_FORMAT_NV21_10LE:
+    case NVBUF_COLOR_FORMAT_NV21_12LE:
+    case NVBUF_COLOR_FORMAT_NV12_12LE_2020:
+      info->num_planes = 2;
+      PLANE (0, 2, 1, 1);
+      PLANE (1, 4, 2, 2);
+      break;
+    case NVBUF_COLOR_FORMAT_NV16:
+    case NVBUF_COLOR_FORMAT_NV16_ER:
+    case NVBUF_COLOR_FORMAT_NV16_709:
+    case NVBUF_COLOR_FORMAT_NV16_709_ER:
+      info->num_planes = 2;
+      PLANE (0, 1, 1, 1);
+      PLANE (1, 2, 2, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_NV16_10LE:
+      info->num_planes = 2;
+      PLANE (0, 2, 1, 1);
+      PLANE (1, 4, 2, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_NV24:
+    case NVBUF_COLOR_FORMAT_NV24_ER:
+    case NVBUF_COLOR_FORMAT_NV24_709:
+    case NVBUF_COLOR_FORMAT_NV24_709_ER:
+      info->num_planes = 2;
+      PLANE (0, 1, 1, 1);
+      PLANE (1, 2, 1, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_NV24_10LE:
+    case NVBUF_COLOR_FORMAT_NV24_10LE_709:
+    case NVBUF_COLOR_FORMAT_NV24_10LE_709_ER:
+    case NVBUF_COLOR_FORMAT_NV24_10LE_2020:
+    case NVBUF_COLOR_FORMAT_NV24_12LE_2020:
+      info->num_planes = 2;
+      PLANE (0, 2, 1, 1);
+      PLANE (1, 4, 1, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_UYVY:
+    case NVBUF_COLOR_FORMAT_UYVY_ER:
+    case NVBUF_COLOR_FORMAT_VYUY:
+    case NVBUF_COLOR_FORMAT_VYUY_ER:
+    case NVBUF_COLOR_FORMAT_YUYV:
+    case NVBUF_COLOR_FORMAT_YUYV_ER:
+    case NVBUF_COLOR_FORMAT_YVYU:
+    case NVBUF_COLOR_FORMAT_YVYU_ER:
+      info->num_planes = 1;
+      PLANE (0, 4, 2, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_RGB:
+    case NVBUF_COLOR_FORMAT_BGR:
+      info->num_planes = 1;
+      PLANE (0, 3, 1, 1);
+      break;
+    case NVBUF_COLOR_FORMAT_RGBA:
+    case NVBUF_COLOR_FORMAT_BGRA:
+    case NVBUF_COLOR_FORMAT_ARGB:
+    case NVBUF_COLOR_FORMAT_ABGR:
+    case NVBUF_COLOR_FORMAT_RGBx:
+    case NVBUF_COLOR_FORMAT_BGRx:
+    case NVBUF_COLOR_FORMAT_xRGB:
+    case NVBUF_COLOR_FORMAT_xBGR:
+    case NVBUF_COLOR_FORMAT_RGBA_10_10_10_2_709:
+    case NVBUF_COLOR_FORMAT_RGBA_10_10_10_2_2020:
+    case NVBUF_COLOR_FORMAT_BGRA_10_10_10_2_709:
+    case NVBUF_COLOR_FORMAT_BGRA_10_10_10_2_2020:
+    case NVBUF_COLOR_FORMAT_SIGNED_R16G16:
+    case NVBUF_COLOR_FORMAT_A32:
+      info->num_planes = 1;
+      PLANE (0, 4, 1, 1);
+      break;
+    default:
+      return -1;
+  }
+
+#undef PLANE
+
+  return 0;
+}
+
+/* Describes the Y, U and V samples of the 8 bit YUV formats that can be
+ * converted into each other. Returns the number of components, 0 if the
+ * format is not one of them. */
+static int
+cpu_yuv_components (NvBufSurfaceColorFormat format, CpuComponent comp[3])
+{
+#define COMP(i, p, o, s, w, h) \
+  do { comp[i].plane = (p); comp[i].offset = (o); comp[i].step = (s); \
+       comp[i].wdiv = (w); comp[i].hdiv = (h); } while (0)
+
+  switch (format) {
+    case NVBUF_COLOR_FORMAT_GRAY8:
+      COMP (0, 0, 0, 1, 1, 1);
+      return 1;
+    case NVBUF_COLOR_FORMAT_YUV420:
+    case NVBUF_COLOR_FORMAT_YUV420_ER:
+    case NVBUF_COLOR_FORMAT_YUV420_709:
+    case NVBUF_COLOR_FORMAT_YUV420_709_ER:
+    case NVBUF_COLOR_FORMAT_YUV420_2020:
+      COMP (0, 0, 0, 1, 1, 1);
+      COMP (1, 1, 0, 1, 2, 2);
+      COMP (2, 2, 0, 1, 2, 2);
+      return 3;
+    case NVBUF_COLOR_FORMAT_YVU420:
+    case NVBUF_COLOR_FORMAT_YVU420_ER:
+      COMP (0, 0, 0, 1, 1, 1);
+      COMP (1, 2, 0, 1, 2, 2);
+      COMP (2, 1, 0, 1, 2, 2);
+      return 3;
+    case NVBUF_COLOR_FORMAT_YUV422:
+      COMP (0, 0, 0, 1, 1, 1);
+      COMP (1, 1, 0, 1, 2, 1);
+      COMP (2, 2, 0, 1, 2, 1);
+      return 3;
+    case NVBUF_COLOR_FORMAT_YUV444:
+      COMP (0, 0, 0, 1, 1, 1);
+      COMP (1, 1, 0, 1, 1, 1);
+      COMP (2, 2, 0, 1, 1, 1);
+      return 3;
+    case NVBUF_COLOR_FORMAT_NV12:
+    case NVBUF_COLOR_FORMAT_NV12_ER:
+    case NVBUF_COLOR_FORMAT_NV12_709:
+    case NVBUF_COLOR_FORMAT_NV12_709_ER:
+    case NVBUF_COLOR_FORMAT_NV12_2020:
+      COMP (0, 0, 0, 1, 1, 1);
+      COMP (1, 1, 0, 2, 2, 2);
+      COMP (2, 1, 1, 2, 2, 2);
+      return 3;
+    case NVBUF_COLOR_FORMAT_NV21:
+    case NVBUF_COLOR_FORMAT_NV21_ER:
+      COMP (0, 0, 0, 1, 1, 1);
+      COMP (1, 1, 1, 2, 2, 2);
+      COMP (2, 1, 0, 2, 2, 2);
+      return 3;
+    case NVBUF_COLOR_FORMAT_NV16:
+    case NVBUF_COLOR_FORMAT_NV16_ER:
+    case NVBUF_COLOR_FORMAT_NV16_709:
+    case NVBUF_COLOR_FORMAT_NV16_709_ER:
+      COMP (0, 0, 0, 1, 1, 1);
+      COMP (1, 1, 0, 2, 2, 1);
+      COMP (2, 1, 1, 2, 2, 1);
+      return 3;
+    case NVBUF_COLOR_FORMAT_NV24:
+    case NVBUF_COLOR_FORMAT_NV24_ER:
+    case NVBUF_COLOR_FORMAT_NV24_709:
+    case NVBUF_COLOR_FORMAT_NV24_709_ER:
+      COMP (0, 0, 0, 1, 1, 1);
+      COMP (1, 1, 0, 2, 1, 1);
+      COMP (2, 1, 1, 2, 1, 1);
+      return 3;
+    default:
+      return 0;
+  }
+
+#undef COMP
+}
+
+static CpuSurface *
+cpu_surface_get (NvBufSurface * surf)
+{
+  CpuSurface *cs;
+
+  if (!surf)
+    return NULL;
+
+  cs = (CpuSurface *) surf->_reserved[0];
+  if (!cs || cs->magic != CPU_SURFACE_MAGIC || &cs->surf != surf)
+    return NULL;
+
+  return cs;
+}
+
+/* Computes pitches, offsets and the total size of one buffer */
+static int
+cpu_layout (NvBufSurfaceParams * params, uint32_t width, uint32_t height,
+    NvBufSurfaceColorFormat format)
+{
+  NvBufSurfacePlaneParams *pp = &params->planeParams;
+  CpuFormatInfo info;
+  uint32_t offset = 0, i;
+
+  if (cpu_format_info (format, &info) < 0)
+    return -1;
+
+  memset (pp, 0, sizeof (*pp));
+  pp->num_planes = info.num_planes;
+
+  for (i = 0; i < info.num_planes; i++) {
+    pp->width[i] = (width + info.wdiv[i] - 1) / info.wdiv[i];
+    pp->height[i] = (height + info.hdiv[i] - 1) / info.hdiv[i];
+    pp->bytesPerPix[i] = info.bpp[i];
+    pp->pitch[i] = CPU_ALIGN (pp->width[i] * info.bpp[i], CPU_PITCH_ALIGN);
+    pp->offset[i] = offset;
+    pp->psize[i] = pp->pitch[i] * pp->height[i];
+    offset += CPU_ALIGN (pp->psize[i], CPU_PITCH_ALIGN);
+  }
+
+  params->width = width;
+  params->height = height;
+  params->pitch = pp->pitch[0];
+  params->colorFormat = format;
+  params->layout = NVBUF_LAYOUT_PITCH;
+  params->dataSize = offset;
+
+  return 0;
+}
+
+static int
+cpu_alloc_fd (size_t size)
+{
+  int fd;
+
+  if (getenv ("NVBUFSURFACE_CPU_USE_DMA_HEAP")) {
+    int heap = open ("/dev/dma_heap/system", O_RDWR | O_CLOEXEC);
+
+    if (heap >= 0) {
+      struct dma_heap_allocation_data data = { 0 };
+
+      data.len = size;
+      data.fd_flags = O_RDWR | O_CLOEXEC;
+      fd = ioctl (heap, DMA_HEAP_IOCTL_ALLOC, &data) < 0 ? -1 : (int) data.fd;
+      close (heap);
+      if (fd >= 0)
+        return fd;
+    }
+  }
+
+  fd = memfd_create ("nvbufsurface-cpu", MFD_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  if (ftruncate (fd, size) < 0) {
+    close (fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static int
+cpu_buffer_init (CpuBuffer * buf, int fd, size_t size)
+{
+  struct stat st;
+
+  if (fstat (fd, &st) < 0)
+    return -1;
+
+  buf->base = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (buf->base == MAP_FAILED) {
+    buf->base = NULL;
+    return -1;
+  }
+
+  buf->fd = fd;
+  buf->size = size;
+  buf->dev = st.st_dev;
+  buf->ino = st.st_ino;
+
+  return 0;
+}
+
+static CpuSurface *
+cpu_surface_new (uint32_t batch_size, NvBufSurfaceMemType mem_type)
+{
+  CpuSurface *cs = calloc (1, sizeof (CpuSurface));
+
+  if (!cs)
+    return NULL;
+
+  cs->params = calloc (batch_size, sizeof (NvBufSurfaceParams));
+  cs->buffers = calloc (batch_size, sizeof (CpuBuffer));
+  if (!cs->params || !cs->buffers) {
+    free (cs->params);
+    free (cs->buffers);
+    free (cs);
+    return NULL;
+  }
+
+  cs->magic = CPU_SURFACE_MAGIC;
+  cs->surf.batchSize = batch_size;
+  cs->surf.memType = mem_type;
+  cs->surf.surfaceList = cs->params;
+  cs->surf._reserved[0] = cs;
+
+  return cs;
+}
+
+static void
+cpu_surface_free (CpuSurface * cs)
+{
+  uint32_t i;
+
+  for (i = 0; i < cs->surf.batchSize; i++) {
+    if (cs->buffers[i].base)
+      munmap (cs->buffers[i].base, cs->buffers[i].size);
+    if (cs->buffers[i].fd > 0)
+      close (cs->buffers[i].fd);
+  }
+
+  cs->magic = 0;
+  free (cs->params);
+  free (cs->buffers);
+  free (cs);
+}
+
+static void
+cpu_register (CpuSurface * cs)
+{
+  pthread_mutex_lock (&cpu_lock);
+  cs->next = cpu_surfaces;
+  cpu_surfaces = cs;
+  pthread_mutex_unlock (&cpu_lock);
+}
+
+static void
+cpu_unregister (CpuSurface * cs)
+{
+  CpuSurface **l;
+
+  pthread_mutex_lock (&cpu_lock);
+  for (l = &cpu_surfaces; *l; l = &(*l)->next) {
+    if (*l == cs) {
+      *l = cs->next;
+      break;
+    }
+  }
+  pthread_mutex_unlock (&cpu_lock);
+}
+
+int
+NvBufSurfaceAllocate (NvBufSurface ** surf, uint32_t batchSize,
+    NvBufSurfaceAllocateParams * paramsext)
+{
+  NvBufSurfaceCreateParams *params;
+  CpuSurface *cs;
+  uint32_t i;
+
+  if (!surf || !paramsext || batchSize == 0)
+    return -1;
+
+  params = &paramsext->params;
+  cs = cpu_surface_new (batchSize, params->memType == NVBUF_MEM_DEFAULT ?
+      NVBUF_MEM_SURFACE_ARRAY : params->memType);
+  if (!cs)
+    return -1;
+
+  cs->surf.gpuId = params->gpuId;
+  cs->surf.isContiguous = params->isContiguous;
+
+  for (i = 0; i < batchSize; i++) {
+    NvBufSurfaceParams *p = &cs->params[i];
+    int fd;
+
+    if (params->size) {
+      memset (p, 0, sizeof (*p));
+      p->dataSize = params->size;
+    } else if (cpu_layout (p, params->width, params->height,
+            params->colorFormat) < 0) {
+      goto failed;
+    }
+
+    fd = cpu_alloc_fd (p->dataSize);
+    if (fd < 0)
+      goto failed;
+
+    if (cpu_buffer_init (&cs->buffers[i], fd, p->dataSize) < 0) {
+      close (fd);
+      goto failed;
+    }
+
+    p->bufferDesc = fd;
+    p->dataPtr = cs->buffers[i].base;
+  }
+
+  cpu_register (cs);
+  CPU_STAT_ADD (allocations, batchSize);
+  *surf = &cs->surf;
+
+  return 0;
+
+failed:
+  cpu_surface_free (cs);
+  return -1;
+}
+
+int
+NvBufSurfaceCreate (NvBufSurface ** surf, uint32_t batchSize,
+    NvBufSurfaceCreateParams * params)
+{
+  NvBufSurfaceAllocateParams allocate_params;
+
+  if (!params)
+    return -1;
+
+  memset (&allocate_params, 0, sizeof (allocate_params));
+  allocate_params.params = *params;
+
+  return NvBufSurfaceAllocate (surf, batchSize, &allocate_params);
+}
+
+int
+NvBufSurfaceDestroy (NvBufSurface * surf)
+{
+  CpuSurface *cs = cpu_surface_get (surf);
+
+  if (!cs)
+    return -1;
+
+  cpu_unregister (cs);
+  cpu_surface_free (cs);
+
+  return 0;
+}
+
+/* Imported fds have no format attached; the whole buffer is a single plane
+ * until a copy or a transform gives it the layout of its source. */
+static CpuSurface *
+cpu_import_fd (int dmabuf_fd)
+{
+  CpuSurface *cs;
+  struct stat st;
+  int fd;
+
+  if (fstat (dmabuf_fd, &st) < 0 || st.st_size <= 0)
+    return NULL;
+
+  cs = cpu_surface_new (1, NVBUF_MEM_SURFACE_ARRAY);
+  if (!cs)
+    return NULL;
+
+  fd = fcntl (dmabuf_fd, F_DUPFD_CLOEXEC, 0);
+  if (fd < 0 || cpu_buffer_init (&cs->buffers[0], fd, st.st_size) < 0) {
+    if (fd >= 0)
+      close (fd);
+    cpu_surface_free (cs);
+    return NULL;
+  }
+
+  cs->imported = 1;
+  cs->src_fd = dmabuf_fd;
+  cs->surf.numFilled = 1;
+  cs->params[0].colorFormat = NVBUF_COLOR_FORMAT_INVALID;
+  cs->params[0].layout = NVBUF_LAYOUT_PITCH;
+  cs->params[0].dataSize = st.st_size;
+  cs->params[0].bufferDesc = fd;
+  cs->params[0].dataPtr = cs->buffers[0].base;
+  cs->params[0].planeParams.num_planes = 1;
+  cs->params[0].planeParams.psize[0] = st.st_size;
+
+  CPU_STAT_ADD (imports, 1);
+
+  return cs;
+}
+
+/* Unlinks the unmapped imports whose fd was closed or now refers to another
+ * file, the caller has no way left to use them. Called with cpu_lock held,
+ * the surfaces are returned in a list to free after unlocking. */
+static CpuSurface *
+cpu_collect_stale_imports (void)
+{
+  CpuSurface **l, *cs, *stale = NULL;
+  struct stat st;
+
+  for (l = &cpu_surfaces; (cs = *l);) {
+    if (cs->imported && cs->buffers[0].map_count == 0 &&
+        (fstat (cs->src_fd, &st) < 0 || st.st_dev != cs->buffers[0].dev ||
+            st.st_ino != cs->buffers[0].ino)) {
+      *l = cs->next;
+      cs->next = stale;
+      stale = cs;
+    } else {
+      l = &cs->next;
+    }
+  }
+
+  return stale;
+}
+
+int
+NvBufSurfaceFromFd (int dmabuf_fd, void **buffer)
+{
+  CpuSurface *cs, *next, *stale, *found = NULL;
+  struct stat st;
+  uint32_t i;
+
+  if (!buffer || fstat (dmabuf_fd, &st) < 0)
+    return -1;
+
+  CPU_STAT_ADD (from_fd, 1);
+
+  pthread_mutex_lock (&cpu_lock);
+  stale = cpu_collect_stale_imports ();
+  for (cs = cpu_surfaces; cs && !found; cs = cs->next) {
+    for (i = 0; i < cs->surf.batchSize; i++) {
+      if (cs->buffers[i].dev == st.st_dev && cs->buffers[i].ino == st.st_ino) {
+        found = cs;
+        if (cs->imported)
+          cs->src_fd = dmabuf_fd;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock (&cpu_lock);
+
+  for (cs = stale; cs; cs = next) {
+    next = cs->next;
+    cpu_surface_free (cs);
+    CPU_STAT_ADD (releases, 1);
+  }
+
+  if (!found) {
+    /* Imported surfaces stay registered until their fd is closed and the
+     * next lookup notices it, or until NvBufSurfaceDestroy() */
+    found = cpu_import_fd (dmabuf_fd);
+    if (!found)
+      return -1;
+    cpu_register (found);
+  }
+
+  *buffer = &found->surf;
+
+  return 0;
+}
+
+static int
+cpu_for_each (NvBufSurface * surf, int index, int plane,
+    int (*func) (CpuSurface * cs, uint32_t index, uint32_t plane, void *data),
+    void *data)
+{
+  CpuSurface *cs = cpu_surface_get (surf);
+  uint32_t i, p, first, last;
+
+  if (!cs || index >= (int) surf->batchSize)
+    return -1;
+
+  first = index < 0 ? 0 : index;
+  last = index < 0 ? surf->batchSize : (uint32_t) index + 1;
+
+  for (i = first; i < last; i++) {
+    uint32_t num_planes = surf->surfaceList[i].planeParams.num_planes;
+
+    if (plane >= (int) num_planes)
+      return -1;
+
+    for (p = (plane < 0 ? 0 : plane); p < (plane < 0 ? num_planes :
+            (uint32_t) plane + 1); p++) {
+      if (func (cs, i, p, data) < 0)
+        return -1;
+    }
+  }
+
+  return 0;
+}
+
+static uint8_t *
+cpu_plane_ptr (CpuSurface * cs, uint32_t index, uint32_t plane)
+{
+  return cs->buffers[index].base +
+      cs->params[index].planeParams.offset[plane];
+}
+
+static int
+cpu_map_plane (CpuSurface * cs, uint32_t index, uint32_t plane, void *data)
+{
+  NvBufSurfaceParams *p = &cs->params[index];
+
+  if (!p->mappedAddr.addr[plane])
+    p->mappedAddr.addr[plane] = cpu_plane_ptr (cs, index, plane);
+  cs->buffers[index].map_count++;
+  CPU_STAT_ADD (maps, 1);
+
+  return 0;
+}
+
+static int
+cpu_unmap_plane (CpuSurface * cs, uint32_t index, uint32_t plane, void *data)
+{
+  NvBufSurfaceParams *p = &cs->params[index];
+
+  if (!p->mappedAddr.addr[plane])
+    return -1;
+
+  p->mappedAddr.addr[plane] = NULL;
+  if (cs->buffers[index].map_count > 0)
+    cs->buffers[index].map_count--;
+  CPU_STAT_ADD (unmaps, 1);
+
+  return 0;
+}
+
+static int
+cpu_sync_plane (CpuSurface * cs, uint32_t index, uint32_t plane, void *data)
+{
+  /* memfd and system heap buffers are cached and coherent */
+  CPU_STAT_ADD (syncs, 1);
+
+  return 0;
+}
+
+static int
+cpu_memset_plane (CpuSurface * cs, uint32_t index, uint32_t plane, void *data)
+{
+  NvBufSurfacePlaneParams *pp = &cs->params[index].planeParams;
+
+  memset (cpu_plane_ptr (cs, index, plane), *(uint8_t *) data,
+      pp->psize[plane]);
+
+  return 0;
+}
+
+int
+NvBufSurfaceMap (NvBufSurface * surf, int index, int plane,
+    NvBufSurfaceMemMapFlags type)
+{
+  return cpu_for_each (surf, index, plane, cpu_map_plane, NULL);
+}
+
+int
+NvBufSurfaceUnMap (NvBufSurface * surf, int index, int plane)
+{
+  return cpu_for_each (surf, index, plane, cpu_unmap_plane, NULL);
+}
+
+int
+NvBufSurfaceSyncForCpu (NvBufSurface * surf, int index, int plane)
+{
+  return cpu_for_each (surf, index, plane, cpu_sync_plane, NULL);
+}
+
+int
+NvBufSurfaceSyncForDevice (NvBufSurface * surf, int index, int plane)
+{
+  return cpu_for_each (surf, index, plane, cpu_sync_plane, NULL);
+}
+
+int
+NvBufSurfaceMemSet (NvBufSurface * surf, int index, int plane, uint8_t value)
+{
+  return cpu_for_each (surf, index, plane, cpu_memset_plane, &value);
+}
+
+int
+NvBufSurfaceMapEglImage (NvBufSurface * surf, int index)
+{
+  return -1;
+}
+
+int
+NvBufSurfaceUnMapEglImage (NvBufSurface * surf, int index)
+{
+  return -1;
+}
+
+/* Gives an imported buffer the layout of the surface written into it */
+static int
+cpu_adopt_layout (CpuSurface * dst, uint32_t index,
+    const NvBufSurfaceParams * src, uint32_t width, uint32_t height)
+{
+  NvBufSurfaceParams *p = &dst->params[index];
+  NvBufSurfaceParams layout;
+
+  if (!dst->imported || p->colorFormat != NVBUF_COLOR_FORMAT_INVALID)
+    return 0;
+
+  memset (&layout, 0, sizeof (layout));
+  if (cpu_layout (&layout, width, height, src->colorFormat) < 0 ||
+      layout.dataSize > dst->buffers[index].size)
+    return -1;
+
+  p->width = layout.width;
+  p->height = layout.height;
+  p->pitch = layout.pitch;
+  p->colorFormat = layout.colorFormat;
+  p->layout = layout.layout;
+  p->planeParams = layout.planeParams;
+
+  return 0;
+}
+
+int
+NvBufSurfaceCopy (NvBufSurface * srcSurf, NvBufSurface * dstSurf)
+{
+  CpuSurface *src = cpu_surface_get (srcSurf);
+  CpuSurface *dst = cpu_surface_get (dstSurf);
+  uint64_t copied = 0;
+  uint32_t i, p, y;
+
+  if (!src || !dst || src->surf.batchSize > dst->surf.batchSize)
+    return -1;
+
+  for (i = 0; i < src->surf.batchSize; i++) {
+    NvBufSurfaceParams *sp = &src->params[i];
+    NvBufSurfaceParams *dp = &dst->params[i];
+
+    if (sp->colorFormat == NVBUF_COLOR_FORMAT_INVALID) {
+      size_t size = CPU_MIN (src->buffers[i].size, dst->buffers[i].size);
+
+      memcpy (dst->buffers[i].base, src->buffers[i].base, size);
+      copied += size;
+      continue;
+    }
+
+    if (cpu_adopt_layout (dst, i, sp, sp->width, sp->height) < 0)
+      return -1;
+
+    if (dp->colorFormat != sp->colorFormat || dp->width != sp->width ||
+        dp->height != sp->height)
+      return -1;
+
+    for (p = 0; p < sp->planeParams.num_planes; p++) {
+      uint8_t *s = cpu_plane_ptr (src, i, p);
+      uint8_t *d = cpu_plane_ptr (dst, i, p);
+      uint32_t row = sp->planeParams.width[p] * sp->planeParams.bytesPerPix[p];
+
+      if (sp->planeParams.pitch[p] == dp->planeParams.pitch[p]) {
+        memcpy (d, s, sp->planeParams.psize[p]);
+        copied += sp->planeParams.psize[p];
+        continue;
+      }
+
+      for (y = 0; y < sp->planeParams.height[p]; y++) {
+        memcpy (d, s, row);
+        s += sp->planeParams.pitch[p];
+        d += dp->planeParams.pitch[p];
+      }
+      copied += (uint64_t) row * sp->planeParams.height[p];
+    }
+  }
+
+  CPU_STAT_ADD (copies, 1);
+  CPU_STAT_ADD (bytes_copied, copied);
+
+  return 0;
+}
+
+static int
+cpu_raw_copy (NvBufSurface * surf, unsigned int index, unsigned int plane,
+    unsigned int width, unsigned int height, unsigned char *ptr, int to_raw)
+{
+  CpuSurface *cs = cpu_surface_get (surf);
+  NvBufSurfacePlaneParams *pp;
+  uint32_t row, y;
+  uint8_t *data;
+
+  if (!cs || index >= surf->batchSize)
+    return -1;
+
+  pp = &cs->params[index].planeParams;
+  if (plane >= pp->num_planes || width > pp->width[plane] ||
+      height > pp->height[plane])
+    return -1;
+
+  data = cpu_plane_ptr (cs, index, plane);
+  row = width * pp->bytesPerPix[plane];
+  for (y = 0; y < height; y++) {
+    if (to_raw)
+      memcpy (ptr + y * row, data + y * pp->pitch[plane], row);
+    else
+      memcpy (data + y * pp->pitch[plane], ptr + y * row, row);
+  }
+
+  CPU_STAT_ADD (copies, 1);
+  CPU_STAT_ADD (bytes_copied, (uint64_t) row * height);
+
+  return 0;
+}
+
+int
+NvBufSurface2Raw (NvBufSurface * Surf, unsigned int index, unsigned int plane,
+    unsigned int outwidth, unsigned int outheight, unsigned char *ptr)
+{
+  return cpu_raw_copy (Surf, index, plane, outwidth, outheight, ptr, 1);
+}
+
+int
+Raw2NvBufSurface (unsigned char *ptr, unsigned int index, unsigned int plane,
+    unsigned int inwidth, unsigned int inheight, NvBufSurface * Surf)
+{
+  return cpu_raw_copy (Surf, index, plane, inwidth, inheight, ptr, 0);
+}
+
+/* A rectangle of elements inside one plane. Elements are elem bytes wide and
+ * step bytes apart, which lets interleaved chroma be addressed per
+ * component. */
+typedef struct
+{
+  uint8_t *data;
+  uint32_t pitch;
+  uint32_t step;
+  uint32_t width;
+  uint32_t height;
+} CpuView;
+
+static uint64_t
+cpu_scale (const CpuView * s, const CpuView * d, uint32_t elem, int bilinear)
+{
+  uint32_t x, y;
+
+  if (s->width == 0 || s->height == 0 || d->width == 0 || d->height == 0)
+    return 0;
+
+  if (s->width == d->width && s->height == d->height && s->step == elem &&
+      d->step == elem) {
+    for (y = 0; y < d->height; y++)
+      memcpy (d->data + y * d->pitch, s->data + y * s->pitch, d->width * elem);
+    return (uint64_t) d->width * d->height * elem;
+  }
+
+  if (bilinear && elem == 1 && s->width > 1 && s->height > 1) {
+    /* 16.16 fixed point, pixel centres aligned */
+    int64_t fx = ((int64_t) s->width << 16) / d->width;
+    int64_t fy = ((int64_t) s->height << 16) / d->height;
+
+    for (y = 0; y < d->height; y++) {
+      int64_t sy = ((int64_t) y * fy) + (fy >> 1) - 0x8000;
+      uint32_t y0, y1, wy;
+      uint8_t *drow = d->data + y * d->pitch;
+
+      if (sy < 0)
+        sy = 0;
+      y0 = CPU_MIN ((uint32_t) (sy >> 16), s->height - 1);
+      y1 = CPU_MIN (y0 + 1, s->height - 1);
+      wy = (sy & 0xffff) >> 8;
+
+      for (x = 0; x < d->width; x++) {
+        int64_t sx = ((int64_t) x * fx) + (fx >> 1) - 0x8000;
+        uint32_t x0, x1, wx, top, bottom;
+        const uint8_t *r0, *r1;
+
+        if (sx < 0)
+          sx = 0;
+        x0 = CPU_MIN ((uint32_t) (sx >> 16), s->width - 1);
+        x1 = CPU_MIN (x0 + 1, s->width - 1);
+        wx = (sx & 0xffff) >> 8;
+
+        r0 = s->data + y0 * s->pitch;
+        r1 = s->data + y1 * s->pitch;
+        top = r0[x0 * s->step] * (256 - wx) + r0[x1 * s->step] * wx;
+        bottom = r1[x0 * s->step] * (256 - wx) + r1[x1 * s->step] * wx;
+        drow[x * d->step] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+      }
+    }
+    return (uint64_t) d->width * d->height;
+  }
+
+  for (y = 0; y < d->height; y++) {
+    const uint8_t *srow =
+        s->data + (uint64_t) y * s->height / d->height * s->pitch;
+    uint8_t *drow = d->data + y * d->pitch;
+
+    for (x = 0; x < d->width; x++) {
+      const uint8_t *sp = srow + (uint64_t) x * s->width / d->width * s->step;
+
+      if (elem == 1)
+        drow[x * d->step] = *sp;
+      else
+        memcpy (drow + x * d->step, sp, elem);
+    }
+  }
+
+  return (uint64_t) d->width * d->height * elem;
+}
+
+static void
+cpu_view_init (CpuView * v, CpuSurface * cs, uint32_t index, uint32_t plane,
+    uint32_t offset, uint32_t step, uint32_t wdiv, uint32_t hdiv,
+    const CpuRect * r)
+{
+  NvBufSurfacePlaneParams *pp = &cs->params[index].planeParams;
+  uint32_t left = r->left / wdiv, top = r->top / hdiv;
+
+  v->pitch = pp->pitch[plane];
+  v->step = step;
+  v->width = CPU_MIN ((r->width + wdiv - 1) / wdiv, pp->width[plane] - left);
+  v->height = CPU_MIN ((r->height + hdiv - 1) / hdiv, pp->height[plane] - top);
+  v->data = cpu_plane_ptr (cs, index, plane) + top * v->pitch +
+      left * step + offset;
+}
+
+static void
+cpu_rect (const NvBufSurfaceParams * p, const NvBufSurfTransformRect * r,
+    CpuRect * out)
+{
+  if (r) {
+    out->left = r->left;
+    out->top = r->top;
+    out->width = r->width;
+    out->height = r->height;
+  } else {
+    out->left = 0;
+    out->top = 0;
+    out->width = p->width;
+    out->height = p->height;
+  }
+}
+
+NvBufSurfTransform_Error
+NvBufSurfTransform (NvBufSurface * src, NvBufSurface * dst,
+    NvBufSurfTransformParams * transform_params)
+{
+  CpuSurface *scs = cpu_surface_get (src);
+  CpuSurface *dcs = cpu_surface_get (dst);
+  NvBufSurfTransformParams *tp = transform_params;
+  uint64_t copied = 0;
+  uint32_t i, c;
+  int bilinear;
+
+  if (!scs || !dcs || !tp || src->batchSize > dst->batchSize)
+    return NvBufSurfTransformError_Invalid_Params;
+
+  if ((tp->transform_flag & NVBUFSURF_TRANSFORM_FLIP) &&
+      tp->transform_flip != NvBufSurfTransform_None)
+    return NvBufSurfTransformError_Unsupported;
+
+  bilinear = (tp->transform_flag & NVBUFSURF_TRANSFORM_FILTER) &&
+      tp->transform_filter != NvBufSurfTransformInter_Nearest;
+
+  for (i = 0; i < src->batchSize; i++) {
+    NvBufSurfaceParams *sp = &scs->params[i];
+    NvBufSurfaceParams *dp = &dcs->params[i];
+    CpuComponent scomp[3], dcomp[3];
+    CpuRect sr, dr;
+    int sn, dn;
+
+    if (sp->colorFormat == NVBUF_COLOR_FORMAT_INVALID)
+      return NvBufSurfTransformError_Invalid_Params;
+
+    if (cpu_adopt_layout (dcs, i, sp, sp->width, sp->height) < 0)
+      return NvBufSurfTransformError_Invalid_Params;
+
+    cpu_rect (sp, (tp->transform_flag & NVBUFSURF_TRANSFORM_CROP_SRC) ?
+        &tp->src_rect[i] : NULL, &sr);
+    cpu_rect (dp, (tp->transform_flag & NVBUFSURF_TRANSFORM_CROP_DST) ?
+        &tp->dst_rect[i] : NULL, &dr);
+
+    if (sr.width == 0 || sr.height == 0 || dr.width == 0 || dr.height == 0 ||
+        sr.left + sr.width > sp->width || sr.top + sr.height > sp->height ||
+        dr.left + dr.width > dp->width || dr.top + dr.height > dp->height)
+      return NvBufSurfTransformError_ROI_Error;
+
+    if (sp->colorFormat == dp->colorFormat) {
+      CpuFormatInfo info;
+
+      cpu_format_info (sp->colorFormat, &info);
+      for (c = 0; c < info.num_planes; c++) {
+        CpuView sv, dv;
+
+        cpu_view_init (&sv, scs, i, c, 0, info.bpp[c], info.wdiv[c],
+            info.hdiv[c], &sr);
+        cpu_view_init (&dv, dcs, i, c, 0, info.bpp[c], info.wdiv[c],
+            info.hdiv[c], &dr);
+        copied += cpu_scale (&sv, &dv, info.bpp[c], bilinear);
+      }
+      continue;
+    }
+
+    /* Conversions are limited to moving 8 bit Y, U and V samples around */
+    sn = cpu_yuv_components (sp->colorFormat, scomp);
+    dn = cpu_yuv_components (dp->colorFormat, dcomp);
+    if (sn == 0 || dn == 0)
+      return NvBufSurfTransformError_Unsupported;
+
+    for (c = 0; c < (uint32_t) dn; c++) {
+      CpuView sv, dv;
+
+      cpu_view_init (&dv, dcs, i, dcomp[c].plane, dcomp[c].offset,
+          dcomp[c].step, dcomp[c].wdiv, dcomp[c].hdiv, &dr);
+
+      if (c >= (uint32_t) sn) {
+        uint32_t y, x;
+
+        /* Grey source, neutral chroma */
+        for (y = 0; y < dv.height; y++)
+          for (x = 0; x < dv.width; x++)
+            dv.data[y * dv.pitch + x * dv.step] = 128;
+        continue;
+      }
+
+      cpu_view_init (&sv, scs, i, scomp[c].plane, scomp[c].offset,
+          scomp[c].step, scomp[c].wdiv, scomp[c].hdiv, &sr);
+      copied += cpu_scale (&sv, &dv, 1, bilinear);
+    }
+  }
+
+  CPU_STAT_ADD (transforms, 1);
+  CPU_STAT_ADD (bytes_copied, copied);
+
+  return NvBufSurfTransformError_Success;
+}
+
+void
+NvBufSurfaceCpuGetStats (NvBufSurfaceCpuStats * stats)
+{
+  if (!stats)
+    return;
+
+  stats->allocations = __atomic_load_n (&cpu_stats.allocations,
+      __ATOMIC_RELAXED);
+  stats->imports = __atomic_load_n (&cpu_stats.imports, __ATOMIC_RELAXED);
+  stats->from_fd = __atomic_load_n (&cpu_stats.from_fd, __ATOMIC_RELAXED);
+  stats->maps = __atomic_load_n (&cpu_stats.maps, __ATOMIC_RELAXED);
+  stats->unmaps = __atomic_load_n (&cpu_stats.unmaps, __ATOMIC_RELAXED);
+  stats->syncs = __atomic_load_n (&cpu_stats.syncs, __ATOMIC_RELAXED);
+  stats->copies = __atomic_load_n (&cpu_stats.copies, __ATOMIC_RELAXED);
+  stats->transforms = __atomic_load_n (&cpu_stats.transforms,
+      __ATOMIC_RELAXED);
+  stats->bytes_copied = __atomic_load_n (&cpu_stats.bytes_copied,
+      __ATOMIC_RELAXED);
+  stats->releases = __atomic_load_n (&cpu_stats.releases, __ATOMIC_RELAXED);
+}
+
+void
+NvBufSurfaceCpuResetStats (void)
+{
+  uint64_t *counters = (uint64_t *) & cpu_stats;
+  size_t i;
+
+  for (i = 0; i < sizeof (cpu_stats) / sizeof (uint64_t); i++)
+    __atomic_store_n (&counters[i], 0, __ATOMIC_RELAXED);
+}
+
+__attribute__ ((destructor))
+static void
+cpu_print_stats (void)
+{
+  NvBufSurfaceCpuStats s;
+
+  if (!getenv ("NVBUFSURFACE_CPU_STATS"))
+    return;
+
+  NvBufSurfaceCpuGetStats (&s);
+  fprintf (stderr, "nvbufsurface-cpu: allocations %llu imports %llu "
+      "from-fd %llu maps %llu unmaps %llu syncs %llu copies %llu "
+      "transforms %llu bytes-copied %llu releases %llu\n",
+      (unsigned long long) s.allocations, (unsigned long long) s.imports,
+      (unsigned long long) s.from_fd, (unsigned long long) s.maps,
+      (unsigned long long) s.unmaps, (unsigned long long) s.syncs,
+      (unsigned long long) s.copies, (unsigned long long) s.transforms,
+      (unsigned long long) s.bytes_copied, (unsigned long long) s.releases);
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef NVBUFSURFACE_CPU_H_
+#define NVBUFSURFACE_CPU_H_
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/* Counters kept by libnvbufsurface-cpu since the library was loaded. They
+ * are printed at exit when NVBUFSURFACE_CPU_STATS is set. */
+typedef struct
+{
+  uint64_t allocations;
+  uint64_t imports;
+  uint64_t from_fd;
+  uint64_t maps;
+  uint64_t unmaps;
+  uint64_t syncs;
+  uint64_t copies;
+  uint64_t transforms;
+  uint64_t bytes_copied;
+  uint64_t releases;            /* imports dropped once their fd was closed */
+} NvBufSurfaceCpuStats;
+
+void NvBufSurfaceCpuGetStats (NvBufSurfaceCpuStats * stats);
+void NvBufSurfaceCpuResetStats (void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NVBUFSURFACE_CPU_H_ */
@@ -0,0 +1,108 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Subset of the Jetson Multimedia API nvbufsurftransform.h implemented by
+ * libnvbufsurface-cpu. Only used when building with NVBUF_CPU=1. */
+
+#ifndef NVBUFSURFTRANSFORM_H_
+#define NVBUFSURFTRANSFORM_H_
+
+#include "nvbufsurface.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef enum
+{
+  NvBufSurfTransformCompute_Default,
+  NvBufSurfTransformCompute_GPU,
+  NvBufSurfTransformCompute_VIC
+} NvBufSurfTransform_Compute;
+
+typedef enum
+{
+  NvBufSurfTransform_None,
+  NvBufSurfTransform_Rotate90,
+  NvBufSurfTransform_Rotate180,
+  NvBufSurfTransform_Rotate270,
+  NvBufSurfTransform_FlipX,
+  NvBufSurfTransform_FlipY,
+  NvBufSurfTransform_Transpose,
+  NvBufSurfTransform_InvTranspose,
+} NvBufSurfTransform_Flip;
+
+typedef enum
+{
+  NvBufSurfTransformInter_Nearest = 0,
+  NvBufSurfTransformInter_Bilinear,
+  NvBufSurfTransformInter_Algo1,
+  NvBufSurfTransformInter_Algo2,
+  NvBufSurfTransformInter_Algo3,
+  NvBufSurfTransformInter_Algo4,
+  NvBufSurfTransformInter_Default
+} NvBufSurfTransform_Inter;
+
+typedef enum
+{
+  NvBufSurfTransformError_ROI_Error = -4,
+  NvBufSurfTransformError_Invalid_Params = -3,
+  NvBufSurfTransformError_Execution_Error = -2,
+  NvBufSurfTransformError_Unsupported = -1,
+  NvBufSurfTransformError_Success = 0
+} NvBufSurfTransform_Error;
+
+typedef enum
+{
+  NVBUFSURF_TRANSFORM_CROP_SRC = 1,
+  NVBUFSURF_TRANSFORM_CROP_DST = 1 << 1,
+  NVBUFSURF_TRANSFORM_FILTER = 1 << 2,
+  NVBUFSURF_TRANSFORM_FLIP = 1 << 3,
+  NVBUFSURF_TRANSFORM_ALLOW_ODD_CROP = 1 << 4
+} NvBufSurfTransform_Transform_Flag;
+
+typedef struct
+{
+  uint32_t top;
+  uint32_t left;
+  uint32_t width;
+  uint32_t height;
+} NvBufSurfTransformRect;
+
+typedef struct _NvBufSurfaceTransformParams
+{
+  uint32_t transform_flag;
+  NvBufSurfTransform_Flip transform_flip;
+  NvBufSurfTransform_Inter transform_filter;
+  NvBufSurfTransformRect *src_rect;
+  NvBufSurfTransformRect *dst_rect;
+
+  void *_reserved[STRUCTURE_PADDING];
+} NvBufSurfTransformParams;
+
+NvBufSurfTransform_Error NvBufSurfTransform (NvBufSurface * src,
+    NvBufSurface * dst, NvBufSurfTransformParams * transform_params);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* NVBUFSURFTRANSFORM_H_ */
@@ -0,0 +1,417 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Measures the per-call cost of an ioctl through libv4l2 and, when the
+ * device is a kernel V4L2 device, through ioctl(2) directly:
+ *
+ *   nvv4l2-ioctl-bench [-s] [-n iterations] <device>
+ *   nvv4l2-ioctl-bench -f [-n iterations] nvdec|nvenc
+ *
+ * VIDIOC_G_FMT goes through the libv4l2 format emulation checks, the same
+ * as QBUF and DQBUF, but does not need buffers to be set up. With -s the
+ * device must be a memory-to-memory one, such as vim2m: OUTPUT buffers are
+ * queued and dequeued while the CAPTURE ones are recycled, the way the
+ * decoder and the encoder stream, and only the QBUF and DQBUF calls on the
+ * OUTPUT queue are timed, not the waits for the device in between.
+ *
+ * -f runs the streaming calls against the in-process fake device of the
+ * plugin (see v4l2-fake.h) instead, which like the NVDEC/NVENC devices on
+ * Jetson is not a kernel device, so it has no direct path to compare to.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+#include <libv4l2.h>
+
+#include <gst/gst.h>
+
+#include "v4l2-fake.h"
+
+#define STREAM_BUFFERS 4
+#define STREAM_TIMEOUT_MS 1000
+
+typedef int (*IoctlFunc) (int fd, unsigned long request, ...);
+
+/* Used by the fake device */
+GST_DEBUG_CATEGORY (v4l2_debug);
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Returns the average cost of a call in ns, or a negative value when the
+ * call fails */
+static double
+bench (IoctlFunc func, int fd, unsigned long request, void *arg,
+    long iterations)
+{
+  double start;
+  long i;
+
+  if (func (fd, request, arg) < 0)
+    return -1;
+
+  start = now_ns ();
+  for (i = 0; i < iterations; i++)
+    func (fd, request, arg);
+
+  return (now_ns () - start) / iterations;
+}
+
+static void
+report (const char *name, IoctlFunc libv4l2, IoctlFunc raw, int fd,
+    unsigned long request, void *arg, long iterations)
+{
+  double via_libv4l2, direct;
+
+  via_libv4l2 = bench (libv4l2, fd, request, arg, iterations);
+  direct = bench (raw, fd, request, arg, iterations);
+
+  printf ("%-16s", name);
+  if (via_libv4l2 < 0)
+    printf (" %12s", "failed");
+  else
+    printf (" %12.1f", via_libv4l2);
+  if (direct < 0)
+    printf (" %12s\n", "n/a");
+  else
+    printf (" %12.1f %+11.1f%%\n", direct,
+        via_libv4l2 > 0 ? (via_libv4l2 - direct) * 100 / via_libv4l2 : 0);
+}
+
+/* Sets up @count MMAP buffers on the queue of @type, returns the number
+ * of buffers or -1 */
+static int
+queue_setup (IoctlFunc func, int fd, unsigned int type, unsigned int count,
+    struct v4l2_format *fmt)
+{
+  struct v4l2_requestbuffers req;
+
+  memset (fmt, 0, sizeof (*fmt));
+  fmt->type = type;
+  if (func (fd, VIDIOC_G_FMT, fmt) < 0)
+    return -1;
+
+  memset (&req, 0, sizeof (req));
+  req.type = type;
+  req.memory = V4L2_MEMORY_MMAP;
+  req.count = count;
+  if (func (fd, VIDIOC_REQBUFS, &req) < 0 || req.count == 0)
+    return -1;
+
+  return MIN (req.count, VIDEO_MAX_FRAME);
+}
+
+static void
+queue_release (IoctlFunc func, int fd, unsigned int type)
+{
+  struct v4l2_requestbuffers req;
+
+  func (fd, VIDIOC_STREAMOFF, &type);
+
+  memset (&req, 0, sizeof (req));
+  req.type = type;
+  req.memory = V4L2_MEMORY_MMAP;
+  func (fd, VIDIOC_REQBUFS, &req);
+}
+
+static void
+buffer_init (struct v4l2_buffer *buf, struct v4l2_plane *planes,
+    const struct v4l2_format *fmt)
+{
+  memset (buf, 0, sizeof (*buf));
+  memset (planes, 0, VIDEO_MAX_PLANES * sizeof (*planes));
+  buf->type = fmt->type;
+  buf->memory = V4L2_MEMORY_MMAP;
+  buf->length = fmt->fmt.pix_mp.num_planes;
+  buf->m.planes = planes;
+}
+
+static int
+queue_buffer (IoctlFunc func, int fd, const struct v4l2_format *fmt,
+    unsigned int index)
+{
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
+  struct v4l2_buffer buf;
+  unsigned int i;
+
+  buffer_init (&buf, planes, fmt);
+  buf.index = index;
+  if (V4L2_TYPE_IS_OUTPUT (fmt->type))
+    for (i = 0; i < buf.length; i++)
+      planes[i].bytesused = fmt->fmt.pix_mp.plane_fmt[i].sizeimage;
+
+  return func (fd, VIDIOC_QBUF, &buf);
+}
+
+/* Returns the index of the buffer dequeued, or -1 */
+static int
+dequeue_buffer (IoctlFunc func, int fd, const struct v4l2_format *fmt)
+{
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
+  struct v4l2_buffer buf;
+
+  buffer_init (&buf, planes, fmt);
+
+  return func (fd, VIDIOC_DQBUF, &buf) < 0 ? -1 : (int) buf.index;
+}
+
+/* Streams @iterations OUTPUT buffers through a memory-to-memory device and
+ * returns the average cost in ns of the QBUF and of the DQBUF calls on the
+ * OUTPUT queue, the CAPTURE buffers are requeued as they come back. Returns
+ * -1 when the device can't be set up or stops returning buffers. */
+static int
+bench_streaming (IoctlFunc func, int fd, long iterations, double *qbuf_ns,
+    double *dqbuf_ns)
+{
+  struct pollfd pfd = { fd, POLLIN | POLLOUT | POLLPRI, 0 };
+  struct v4l2_format out, cap;
+  struct v4l2_event event;
+  unsigned int free_out[VIDEO_MAX_FRAME], type;
+  int n_out, n_cap, n_free, index, i, ret = -1;
+  long queued = 0, dequeued = 0;
+  double qbuf = 0, dqbuf = 0, start;
+
+  n_out = queue_setup (func, fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+      STREAM_BUFFERS, &out);
+  n_cap = queue_setup (func, fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+      STREAM_BUFFERS, &cap);
+  if (n_out < 0 || n_cap < 0)
+    goto done;
+
+  for (i = 0; i < n_cap; i++)
+    if (queue_buffer (func, fd, &cap, i) < 0)
+      goto done;
+  for (n_free = 0; n_free < n_out; n_free++)
+    free_out[n_free] = n_free;
+
+  type = out.type;
+  if (func (fd, VIDIOC_STREAMON, &type) < 0)
+    goto done;
+  type = cap.type;
+  if (func (fd, VIDIOC_STREAMON, &type) < 0)
+    goto done;
+
+  while (dequeued < iterations) {
+    if (n_free > 0 && queued < iterations) {
+      index = free_out[--n_free];
+      start = now_ns ();
+      if (queue_buffer (func, fd, &out, index) < 0)
+        goto done;
+      qbuf += now_ns () - start;
+      queued++;
+      continue;
+    }
+
+    if (poll (&pfd, 1, STREAM_TIMEOUT_MS) <= 0) {
+      fprintf (stderr, "no buffer back from the device after %d ms\n",
+          STREAM_TIMEOUT_MS);
+      goto done;
+    }
+
+    /* Pending events, e.g. the decoder source change, keep fd readable */
+    memset (&event, 0, sizeof (event));
+    while (func (fd, VIDIOC_DQEVENT, &event) == 0)
+      memset (&event, 0, sizeof (event));
+
+    while ((index = dequeue_buffer (func, fd, &cap)) >= 0)
+      if (queue_buffer (func, fd, &cap, index) < 0)
+        goto done;
+
+    start = now_ns ();
+    index = dequeue_buffer (func, fd, &out);
+    if (index >= 0) {
+      dqbuf += now_ns () - start;
+      free_out[n_free++] = index;
+      dequeued++;
+    }
+  }
+
+  *qbuf_ns = qbuf / queued;
+  *dqbuf_ns = dqbuf / dequeued;
+  ret = 0;
+
+done:
+  queue_release (func, fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+  queue_release (func, fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+  return ret;
+}
+
+static void
+report_streaming (IoctlFunc libv4l2, IoctlFunc raw, int fd, long iterations)
+{
+  double qbuf[2], dqbuf[2];
+  int ok[2];
+
+  ok[0] = bench_streaming (libv4l2, fd, iterations, &qbuf[0], &dqbuf[0]) == 0;
+  ok[1] = raw && bench_streaming (raw, fd, iterations, &qbuf[1],
+      &dqbuf[1]) == 0;
+
+  printf ("%-16s", "VIDIOC_QBUF");
+  if (ok[0])
+    printf (" %12.1f", qbuf[0]);
+  else
+    printf (" %12s", "failed");
+  if (ok[0] && ok[1])
+    printf (" %12.1f %+11.1f%%\n", qbuf[1],
+        qbuf[0] > 0 ? (qbuf[0] - qbuf[1]) * 100 / qbuf[0] : 0);
+  else
+    printf (" %12s\n", "n/a");
+
+  printf ("%-16s", "VIDIOC_DQBUF");
+  if (ok[0])
+    printf (" %12.1f", dqbuf[0]);
+  else
+    printf (" %12s", "failed");
+  if (ok[0] && ok[1])
+    printf (" %12.1f %+11.1f%%\n", dqbuf[1],
+        dqbuf[0] > 0 ? (dqbuf[0] - dqbuf[1]) * 100 / dqbuf[0] : 0);
+  else
+    printf (" %12s\n", "n/a");
+}
+
+/* Streams through the fake device, on which the plugin's calls end up
+ * without going through libv4l2 or the kernel */
+static int
+bench_fake (const char *name, long iterations)
+{
+  int fd;
+
+  gst_init (NULL, NULL);
+  GST_DEBUG_CATEGORY_INIT (v4l2_debug, "v4l2", 0, "fake device");
+
+  fd = gst_v4l2_fake_open (name, O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror ("fake device");
+    return 1;
+  }
+
+  printf ("fake %s, %ld buffers, ns per call\n", name, iterations);
+  printf ("%-16s %12s %12s %12s\n", "ioctl", "fake", "direct", "saved");
+  report_streaming ((IoctlFunc) gst_v4l2_fake_ioctl, NULL, fd, iterations);
+
+  gst_v4l2_fake_close (fd);
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  struct v4l2_capability cap;
+  struct v4l2_format fmt;
+  long iterations = 100000;
+  int fd, opt, fake = 0, streaming = 0;
+  unsigned int caps;
+
+  while ((opt = getopt (argc, argv, "fn:s")) != -1) {
+    switch (opt) {
+      case 'f':
+        fake = 1;
+        break;
+      case 's':
+        streaming = 1;
+        break;
+      case 'n':
+        iterations = strtol (optarg, NULL, 0);
+        if (iterations <= 0)
+          goto usage;
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+  if (optind != argc - 1)
+    goto usage;
+
+  if (fake)
+    return bench_fake (argv[optind], iterations);
+
+  /* DQBUF must not block while no buffer is ready */
+  fd = open (argv[optind], O_RDWR | O_NONBLOCK);
+  if (fd < 0) {
+    perror (argv[optind]);
+    return 1;
+  }
+
+  if (v4l2_fd_open (fd, V4L2_ENABLE_ENUM_FMT_EMULATION) < 0)
+    fprintf (stderr, "v4l2_fd_open failed, libv4l2 passes calls through\n");
+
+  memset (&cap, 0, sizeof (cap));
+  if (v4l2_ioctl (fd, VIDIOC_QUERYCAP, &cap) < 0) {
+    fprintf (stderr, "%s: VIDIOC_QUERYCAP failed: %s\n", argv[optind],
+        strerror (errno));
+    return 1;
+  }
+
+  caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+      cap.device_caps : cap.capabilities;
+
+  memset (&fmt, 0, sizeof (fmt));
+  if (caps & V4L2_CAP_VIDEO_M2M_MPLANE)
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+  else if (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  else if (caps & V4L2_CAP_VIDEO_OUTPUT)
+    fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+  else
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+  printf ("%s (%s), %ld calls, ns per call\n", cap.card, cap.driver,
+      iterations);
+  printf ("%-16s %12s %12s %12s\n", "ioctl", "libv4l2", "direct", "saved");
+
+  report ("VIDIOC_QUERYCAP", v4l2_ioctl, (IoctlFunc) ioctl, fd,
+      VIDIOC_QUERYCAP, &cap, iterations);
+  report ("VIDIOC_G_FMT", v4l2_ioctl, (IoctlFunc) ioctl, fd, VIDIOC_G_FMT,
+      &fmt, iterations);
+
+  if (streaming) {
+    if (caps & V4L2_CAP_VIDEO_M2M_MPLANE)
+      report_streaming (v4l2_ioctl, (IoctlFunc) ioctl, fd, iterations);
+    else
+      fprintf (stderr, "-s needs a multi-planar memory-to-memory device\n");
+  }
+
+  v4l2_close (fd);
+
+  return 0;
+
+usage:
+  fprintf (stderr, "usage: %s [-s] [-n iterations] <device>\n"
+      "       %s -f [-n iterations] nvdec|nvenc\n", argv[0], argv[0]);
+  return 1;
+}
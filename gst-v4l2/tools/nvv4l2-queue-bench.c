@@ -0,0 +1,446 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Measures what tracking the queued buffers costs when QBUF and DQBUF run
+ * on different threads, the way the pool is driven by the streaming thread
+ * and by the decoder/encoder task:
+ *
+ *   nvv4l2-queue-bench [-n iterations] nvdec|nvenc
+ *
+ * The main thread queues OUTPUT buffers of the in-process fake device (see
+ * v4l2-fake.h) while a second thread waits for queued buffers, dequeues
+ * them and hands them back, recycling the CAPTURE buffers on the way. The
+ * stream is run twice, tracking the queue the way the pool did before,
+ * under the object lock with an "empty" condition variable, and the way it
+ * does now, with the queued bitmap, the atomic count and an eventfd wake-up
+ * on the empty to non-empty transition.
+ *
+ * QBUF is timed with the tracking around it, DQBUF with the tracking after
+ * it, the waits in between are not. "sleeps" counts the times the dequeuing
+ * thread had to block for a buffer to be queued.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/videodev2.h>
+
+#include <gst/gst.h>
+
+#include "v4l2-fake.h"
+
+#define STREAM_BUFFERS 4
+#define STREAM_TIMEOUT_MS 1000
+
+/* Used by the fake device */
+GST_DEBUG_CATEGORY (v4l2_debug);
+
+typedef struct
+{
+  int fd;
+  struct v4l2_format out, cap;
+  int n_cap;
+  long iterations;
+  gboolean atomic;
+
+  /* Tracking, as in GstV4l2BufferPool */
+  gpointer buffers[VIDEO_MAX_FRAME];
+  gint num_queued;
+  GMutex lock;
+  GCond empty_cond;
+  gboolean empty;
+  guint queued_mask[(VIDEO_MAX_FRAME + 31) / 32];
+  int wake_fd;
+
+  /* OUTPUT buffers back from the device, the pool's free list */
+  GAsyncQueue *free_out;
+
+  double qbuf, dqbuf;
+  long sleeps;
+  gboolean failed;
+} Bench;
+
+static double
+now_ns (void)
+{
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int
+queue_setup (int fd, unsigned int type, unsigned int count,
+    struct v4l2_format *fmt)
+{
+  struct v4l2_requestbuffers req;
+
+  memset (fmt, 0, sizeof (*fmt));
+  fmt->type = type;
+  if (gst_v4l2_fake_ioctl (fd, VIDIOC_G_FMT, fmt) < 0)
+    return -1;
+
+  memset (&req, 0, sizeof (req));
+  req.type = type;
+  req.memory = V4L2_MEMORY_MMAP;
+  req.count = count;
+  if (gst_v4l2_fake_ioctl (fd, VIDIOC_REQBUFS, &req) < 0 || req.count == 0)
+    return -1;
+
+  return MIN (req.count, VIDEO_MAX_FRAME);
+}
+
+static void
+queue_release (int fd, unsigned int type)
+{
+  struct v4l2_requestbuffers req;
+
+  gst_v4l2_fake_ioctl (fd, VIDIOC_STREAMOFF, &type);
+
+  memset (&req, 0, sizeof (req));
+  req.type = type;
+  req.memory = V4L2_MEMORY_MMAP;
+  gst_v4l2_fake_ioctl (fd, VIDIOC_REQBUFS, &req);
+}
+
+static void
+buffer_init (struct v4l2_buffer *buf, struct v4l2_plane *planes,
+    const struct v4l2_format *fmt)
+{
+  memset (buf, 0, sizeof (*buf));
+  memset (planes, 0, VIDEO_MAX_PLANES * sizeof (*planes));
+  buf->type = fmt->type;
+  buf->memory = V4L2_MEMORY_MMAP;
+  buf->length = fmt->fmt.pix_mp.num_planes;
+  buf->m.planes = planes;
+}
+
+static int
+queue_buffer (int fd, const struct v4l2_format *fmt, unsigned int index)
+{
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
+  struct v4l2_buffer buf;
+  unsigned int i;
+
+  buffer_init (&buf, planes, fmt);
+  buf.index = index;
+  if (V4L2_TYPE_IS_OUTPUT (fmt->type))
+    for (i = 0; i < buf.length; i++)
+      planes[i].bytesused = fmt->fmt.pix_mp.plane_fmt[i].sizeimage;
+
+  return gst_v4l2_fake_ioctl (fd, VIDIOC_QBUF, &buf);
+}
+
+/* Returns the index of the buffer dequeued, or -1 */
+static int
+dequeue_buffer (int fd, const struct v4l2_format *fmt)
+{
+  struct v4l2_plane planes[VIDEO_MAX_PLANES];
+  struct v4l2_buffer buf;
+
+  buffer_init (&buf, planes, fmt);
+
+  return gst_v4l2_fake_ioctl (fd, VIDIOC_DQBUF, &buf) < 0 ?
+      -1 : (int) buf.index;
+}
+
+/* gst_v4l2_buffer_pool_qbuf() */
+static int
+track_qbuf (Bench * b, unsigned int index)
+{
+  gboolean was_empty;
+  guint64 one = 1;
+  int ret;
+
+  if (!b->atomic) {
+    g_mutex_lock (&b->lock);
+    g_atomic_int_inc (&b->num_queued);
+    b->buffers[index] = b;
+    ret = queue_buffer (b->fd, &b->out, index);
+    b->empty = FALSE;
+    g_cond_signal (&b->empty_cond);
+    g_mutex_unlock (&b->lock);
+    return ret;
+  }
+
+  b->buffers[index] = b;
+  g_atomic_int_or (&b->queued_mask[index / 32], 1u << (index % 32));
+  was_empty = g_atomic_int_add (&b->num_queued, 1) == 0;
+  ret = queue_buffer (b->fd, &b->out, index);
+  if (was_empty && write (b->wake_fd, &one, sizeof (one)) < 0)
+    ret = -1;
+
+  return ret;
+}
+
+/* gst_v4l2_buffer_pool_dqbuf() */
+static void
+track_dqbuf (Bench * b, unsigned int index)
+{
+  b->buffers[index] = NULL;
+
+  if (!b->atomic) {
+    if (g_atomic_int_dec_and_test (&b->num_queued)) {
+      g_mutex_lock (&b->lock);
+      b->empty = TRUE;
+      g_mutex_unlock (&b->lock);
+    }
+    return;
+  }
+
+  g_atomic_int_and (&b->queued_mask[index / 32], ~(1u << (index % 32)));
+  g_atomic_int_add (&b->num_queued, -1);
+}
+
+/* gst_v4l2_buffer_pool_poll(), before the device poll */
+static void
+wait_queued (Bench * b)
+{
+  guint64 value;
+
+  if (!b->atomic) {
+    g_mutex_lock (&b->lock);
+    while (b->empty) {
+      b->sleeps++;
+      g_cond_wait (&b->empty_cond, &b->lock);
+    }
+    g_mutex_unlock (&b->lock);
+    return;
+  }
+
+  /* The eventfd is blocking here, a stale wake-up only loops once more */
+  while (g_atomic_int_get (&b->num_queued) == 0) {
+    b->sleeps++;
+    if (read (b->wake_fd, &value, sizeof (value)) < 0 && errno != EINTR)
+      break;
+  }
+}
+
+static gpointer
+dequeue_thread (gpointer data)
+{
+  Bench *b = data;
+  struct pollfd pfd = { b->fd, POLLIN | POLLOUT | POLLPRI, 0 };
+  struct v4l2_event event;
+  long dequeued = 0;
+  double start;
+  int index;
+
+  while (dequeued < b->iterations) {
+    wait_queued (b);
+
+    if (poll (&pfd, 1, STREAM_TIMEOUT_MS) <= 0) {
+      fprintf (stderr, "no buffer back from the device after %d ms\n",
+          STREAM_TIMEOUT_MS);
+      goto failed;
+    }
+
+    /* Pending events, e.g. the decoder source change, keep fd readable */
+    memset (&event, 0, sizeof (event));
+    while (gst_v4l2_fake_ioctl (b->fd, VIDIOC_DQEVENT, &event) == 0)
+      memset (&event, 0, sizeof (event));
+
+    while ((index = dequeue_buffer (b->fd, &b->cap)) >= 0)
+      if (queue_buffer (b->fd, &b->cap, index) < 0)
+        goto failed;
+
+    start = now_ns ();
+    index = dequeue_buffer (b->fd, &b->out);
+    if (index < 0)
+      continue;
+    track_dqbuf (b, index);
+    b->dqbuf += now_ns () - start;
+
+    g_async_queue_push (b->free_out, GINT_TO_POINTER (index + 1));
+    dequeued++;
+  }
+
+  return NULL;
+
+failed:
+  b->failed = TRUE;
+  /* Unblock the queuing thread */
+  g_async_queue_push (b->free_out, GINT_TO_POINTER (-1));
+  return NULL;
+}
+
+/* Streams @iterations OUTPUT buffers through the fake device with QBUF and
+ * DQBUF on separate threads, returns the wall time in ns or -1 */
+static double
+bench_tracking (Bench * b)
+{
+  unsigned int type;
+  GThread *thread;
+  double start, qbuf_start, wall = -1;
+  int n_out, i, index;
+  long queued;
+
+  b->num_queued = 0;
+  b->empty = TRUE;
+  memset (b->buffers, 0, sizeof (b->buffers));
+  memset (b->queued_mask, 0, sizeof (b->queued_mask));
+  b->qbuf = b->dqbuf = 0;
+  b->sleeps = 0;
+  b->failed = FALSE;
+
+  n_out = queue_setup (b->fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,
+      STREAM_BUFFERS, &b->out);
+  b->n_cap = queue_setup (b->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE,
+      STREAM_BUFFERS, &b->cap);
+  if (n_out < 0 || b->n_cap < 0)
+    goto done;
+
+  for (i = 0; i < b->n_cap; i++)
+    if (queue_buffer (b->fd, &b->cap, i) < 0)
+      goto done;
+  for (i = 0; i < n_out; i++)
+    g_async_queue_push (b->free_out, GINT_TO_POINTER (i + 1));
+
+  type = b->out.type;
+  if (gst_v4l2_fake_ioctl (b->fd, VIDIOC_STREAMON, &type) < 0)
+    goto done;
+  type = b->cap.type;
+  if (gst_v4l2_fake_ioctl (b->fd, VIDIOC_STREAMON, &type) < 0)
+    goto done;
+
+  start = now_ns ();
+  thread = g_thread_new ("dequeue", dequeue_thread, b);
+
+  for (queued = 0; queued < b->iterations; queued++) {
+    index = GPOINTER_TO_INT (g_async_queue_pop (b->free_out)) - 1;
+    if (index < 0)
+      break;
+
+    qbuf_start = now_ns ();
+    if (track_qbuf (b, index) < 0) {
+      fprintf (stderr, "VIDIOC_QBUF failed: %s\n", strerror (errno));
+      b->failed = TRUE;
+      break;
+    }
+    b->qbuf += now_ns () - qbuf_start;
+  }
+
+  if (!b->failed) {
+    g_thread_join (thread);
+    wall = b->failed ? -1 : now_ns () - start;
+  } else {
+    /* The dequeuing thread may be stuck waiting, leave it behind */
+    g_thread_unref (thread);
+  }
+
+done:
+  while (g_async_queue_try_pop (b->free_out))
+    continue;
+  queue_release (b->fd, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+  queue_release (b->fd, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+  return wall;
+}
+
+static int
+report (Bench * b, const char *name, gboolean atomic)
+{
+  double wall;
+
+  b->atomic = atomic;
+  wall = bench_tracking (b);
+
+  printf ("%-16s", name);
+  if (wall < 0) {
+    printf (" %10s\n", "failed");
+    return -1;
+  }
+  printf (" %10.1f %10.1f %10ld %12.0f\n", b->qbuf / b->iterations,
+      b->dqbuf / b->iterations, b->sleeps, b->iterations * 1e9 / wall);
+
+  return 0;
+}
+
+int
+main (int argc, char *argv[])
+{
+  Bench b;
+  int opt;
+
+  memset (&b, 0, sizeof (b));
+  b.iterations = 100000;
+
+  while ((opt = getopt (argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        b.iterations = strtol (optarg, NULL, 0);
+        if (b.iterations <= 0)
+          goto usage;
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+  if (optind != argc - 1)
+    goto usage;
+
+  gst_init (NULL, NULL);
+  GST_DEBUG_CATEGORY_INIT (v4l2_debug, "v4l2", 0, "fake device");
+
+  b.fd = gst_v4l2_fake_open (argv[optind], O_RDWR | O_NONBLOCK);
+  if (b.fd < 0) {
+    perror ("fake device");
+    return 1;
+  }
+
+  b.wake_fd = eventfd (0, EFD_CLOEXEC);
+  if (b.wake_fd < 0) {
+    perror ("eventfd");
+    return 1;
+  }
+
+  g_mutex_init (&b.lock);
+  g_cond_init (&b.empty_cond);
+  b.free_out = g_async_queue_new ();
+
+  printf ("fake %s, %ld buffers, %d per queue, ns per call\n", argv[optind],
+      b.iterations, STREAM_BUFFERS);
+  printf ("%-16s %10s %10s %10s %12s\n", "tracking", "qbuf", "dqbuf",
+      "sleeps", "frames/s");
+  /* A failed run may leave its dequeuing thread behind, don't go on */
+  if (report (&b, "mutex+condvar", FALSE) < 0 ||
+      report (&b, "bitmap+eventfd", TRUE) < 0)
+    return 1;
+
+  g_async_queue_unref (b.free_out);
+  g_cond_clear (&b.empty_cond);
+  g_mutex_clear (&b.lock);
+  close (b.wake_fd);
+  gst_v4l2_fake_close (b.fd);
+
+  return 0;
+
+usage:
+  fprintf (stderr, "usage: %s [-n iterations] nvdec|nvenc\n", argv[0]);
+  return 1;
+}
@@ -0,0 +1,243 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Measures the seek latency of a decoder: plays the pipeline, then does
+ * flushing key unit seeks to random positions and times each one from the
+ * seek to the first buffer out of the decoder, which must be named "dec":
+ *
+ *   nvv4l2-seek-bench [-n seeks] [-s seed] "<pipeline>"
+ *
+ *   nvv4l2-seek-bench -n 200 "filesrc location=clip.mp4 ! qtdemux !
+ *       h264parse ! nvv4l2decoder name=dec fast-flush=1 ! fakesink"
+ *
+ * Running it with and without fast-flush=1 on the decoder compares both
+ * flush modes on the same positions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <gst/gst.h>
+
+#define SEEK_TIMEOUT_S 10
+
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  gboolean flushed;
+  gint64 first_buffer;
+} Seek;
+
+/* Stamps the first buffer after the flush of the seek */
+static GstPadProbeReturn
+dec_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  Seek *seek = user_data;
+
+  g_mutex_lock (&seek->lock);
+  if (info->type & GST_PAD_PROBE_TYPE_EVENT_FLUSH) {
+    if (GST_EVENT_TYPE (GST_PAD_PROBE_INFO_EVENT (info)) ==
+        GST_EVENT_FLUSH_STOP)
+      seek->flushed = TRUE;
+  } else if (seek->flushed && !seek->first_buffer) {
+    seek->first_buffer = g_get_monotonic_time ();
+    g_cond_signal (&seek->cond);
+  }
+  g_mutex_unlock (&seek->lock);
+
+  return GST_PAD_PROBE_OK;
+}
+
+static int
+compare_us (const void *a, const void *b)
+{
+  gint64 va = *(const gint64 *) a, vb = *(const gint64 *) b;
+
+  return (va > vb) - (va < vb);
+}
+
+static void
+summary (const char *name, gint64 * values, int n)
+{
+  gint64 sum = 0;
+  int i;
+
+  qsort (values, n, sizeof (gint64), compare_us);
+  for (i = 0; i < n; i++)
+    sum += values[i];
+
+  printf ("%-14s min %9.3f avg %9.3f p50 %9.3f p95 %9.3f max %9.3f\n", name,
+      values[0] / 1000.0, sum / 1000.0 / n,
+      values[(n * 50 + 99) / 100 - 1] / 1000.0,
+      values[(n * 95 + 99) / 100 - 1] / 1000.0, values[n - 1] / 1000.0);
+}
+
+/* Waits for the first buffer after the last seek, returns the time in us
+ * from @start or -1 */
+static gint64
+wait_buffer (Seek * seek, gint64 start)
+{
+  gint64 deadline = start + SEEK_TIMEOUT_S * G_TIME_SPAN_SECOND;
+  gint64 elapsed = -1;
+
+  g_mutex_lock (&seek->lock);
+  while (!seek->first_buffer)
+    if (!g_cond_wait_until (&seek->cond, &seek->lock, deadline))
+      break;
+  if (seek->first_buffer)
+    elapsed = seek->first_buffer - start;
+  g_mutex_unlock (&seek->lock);
+
+  return elapsed;
+}
+
+int
+main (int argc, char *argv[])
+{
+  GstElement *pipeline = NULL, *dec = NULL;
+  GError *error = NULL;
+  GstPad *pad;
+  GRand *rand;
+  Seek seek = { 0 };
+  gint64 *latency, duration = 0, start;
+  guint32 seed = 1;
+  int seeks = 100, n = 0, opt, i, ret = 1;
+
+  gst_init (&argc, &argv);
+
+  while ((opt = getopt (argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+      case 'n':
+        seeks = strtol (optarg, NULL, 0);
+        if (seeks <= 0)
+          goto usage;
+        break;
+      case 's':
+        seed = strtoul (optarg, NULL, 0);
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+  if (optind != argc - 1)
+    goto usage;
+
+  pipeline = gst_parse_launch (argv[optind], &error);
+  if (!pipeline) {
+    fprintf (stderr, "could not create pipeline: %s\n", error->message);
+    g_error_free (error);
+    return 1;
+  }
+
+  dec = gst_bin_get_by_name (GST_BIN (pipeline), "dec");
+  if (!dec) {
+    fprintf (stderr, "no element named \"dec\" in the pipeline\n");
+    gst_object_unref (pipeline);
+    return 1;
+  }
+
+  g_mutex_init (&seek.lock);
+  g_cond_init (&seek.cond);
+  /* The first buffer after PLAYING counts as flushed */
+  seek.flushed = TRUE;
+
+  pad = gst_element_get_static_pad (dec, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER |
+      GST_PAD_PROBE_TYPE_EVENT_FLUSH, dec_probe, &seek, NULL);
+  gst_object_unref (pad);
+
+  start = g_get_monotonic_time ();
+  if (gst_element_set_state (pipeline,
+          GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+    fprintf (stderr, "could not set the pipeline to PLAYING\n");
+    goto done;
+  }
+
+  if (wait_buffer (&seek, start) < 0) {
+    fprintf (stderr, "no frame after %d s\n", SEEK_TIMEOUT_S);
+    goto done;
+  }
+
+  if (!gst_element_query_duration (pipeline, GST_FORMAT_TIME, &duration) ||
+      duration <= 0) {
+    fprintf (stderr, "the pipeline has no duration to seek in\n");
+    goto done;
+  }
+
+  latency = g_new (gint64, seeks);
+  rand = g_rand_new_with_seed (seed);
+
+  printf ("%4s %14s %12s\n", "seek", "position(s)", "latency(ms)");
+
+  for (i = 0; i < seeks; i++) {
+    gint64 position = g_rand_double (rand) * duration, elapsed;
+
+    g_mutex_lock (&seek.lock);
+    seek.flushed = FALSE;
+    seek.first_buffer = 0;
+    g_mutex_unlock (&seek.lock);
+
+    start = g_get_monotonic_time ();
+    if (!gst_element_seek_simple (pipeline, GST_FORMAT_TIME,
+            GST_SEEK_FLAG_FLUSH | GST_SEEK_FLAG_KEY_UNIT, position)) {
+      fprintf (stderr, "seek to %.3f s failed\n",
+          (double) position / GST_SECOND);
+      continue;
+    }
+
+    elapsed = wait_buffer (&seek, start);
+    if (elapsed < 0) {
+      fprintf (stderr, "no frame %d s after the seek to %.3f s\n",
+          SEEK_TIMEOUT_S, (double) position / GST_SECOND);
+      continue;
+    }
+
+    latency[n++] = elapsed;
+    printf ("%4d %14.3f %12.3f\n", i, (double) position / GST_SECOND,
+        elapsed / 1000.0);
+  }
+
+  if (n) {
+    summary ("seek", latency, n);
+    ret = 0;
+  } else {
+    fprintf (stderr, "no seek produced a frame\n");
+  }
+
+  g_rand_free (rand);
+  g_free (latency);
+
+done:
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (dec);
+  gst_object_unref (pipeline);
+  g_cond_clear (&seek.cond);
+  g_mutex_clear (&seek.lock);
+
+  return ret;
+
+usage:
+  fprintf (stderr, "usage: %s [-n seeks] [-s seed] \"<pipeline with a decoder "
+      "named dec>\"\n", argv[0]);
+  return 1;
+}
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Measures the time to the first decoded frame: builds the pipeline, sets
+ * it to PLAYING and waits for the first buffer out of the decoder, which
+ * must be named "dec", then tears it down again:
+ *
+ *   nvv4l2-startup-bench [-n runs] "<pipeline>"
+ *
+ *   nvv4l2-startup-bench -n 20 "filesrc location=cam.h264 ! h264parse !
+ *       nvv4l2decoder name=dec ! fakesink"
+ *
+ * For each run it prints the time from PLAYING to that buffer and the
+ * decoder's "first-frame-us" and "format-wait-us" latency fields.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <gst/gst.h>
+
+#define STARTUP_TIMEOUT_S 10
+
+typedef struct
+{
+  GMutex lock;
+  GCond cond;
+  gint64 first_buffer;
+} Run;
+
+static GstPadProbeReturn
+first_buffer_probe (GstPad * pad, GstPadProbeInfo * info, gpointer user_data)
+{
+  Run *run = user_data;
+
+  g_mutex_lock (&run->lock);
+  run->first_buffer = g_get_monotonic_time ();
+  g_cond_signal (&run->cond);
+  g_mutex_unlock (&run->lock);
+
+  return GST_PAD_PROBE_REMOVE;
+}
+
+static int
+compare_us (const void *a, const void *b)
+{
+  gint64 va = *(const gint64 *) a, vb = *(const gint64 *) b;
+
+  return (va > vb) - (va < vb);
+}
+
+static void
+summary (const char *name, gint64 * values, int n)
+{
+  gint64 sum = 0;
+  int i;
+
+  qsort (values, n, sizeof (gint64), compare_us);
+  for (i = 0; i < n; i++)
+    sum += values[i];
+
+  printf ("%-14s min %9.3f avg %9.3f p50 %9.3f p95 %9.3f max %9.3f\n", name,
+      values[0] / 1000.0, sum / 1000.0 / n,
+      values[(n * 50 + 99) / 100 - 1] / 1000.0,
+      values[(n * 95 + 99) / 100 - 1] / 1000.0, values[n - 1] / 1000.0);
+}
+
+/* Returns the time in us from PLAYING to the first decoded buffer, or -1 */
+static gint64
+run_once (const char *description, guint64 * first_frame,
+    guint64 * format_wait)
+{
+  GstElement *pipeline, *dec;
+  GstStructure *latency = NULL;
+  GError *error = NULL;
+  GstPad *pad;
+  Run run = { 0 };
+  gint64 start, deadline, elapsed = -1;
+
+  pipeline = gst_parse_launch (description, &error);
+  if (!pipeline) {
+    fprintf (stderr, "could not create pipeline: %s\n", error->message);
+    g_error_free (error);
+    return -1;
+  }
+
+  dec = gst_bin_get_by_name (GST_BIN (pipeline), "dec");
+  if (!dec) {
+    fprintf (stderr, "no element named \"dec\" in the pipeline\n");
+    gst_object_unref (pipeline);
+    return -1;
+  }
+
+  g_mutex_init (&run.lock);
+  g_cond_init (&run.cond);
+
+  pad = gst_element_get_static_pad (dec, "src");
+  gst_pad_add_probe (pad, GST_PAD_PROBE_TYPE_BUFFER, first_buffer_probe,
+      &run, NULL);
+  gst_object_unref (pad);
+
+  start = g_get_monotonic_time ();
+  deadline = start + STARTUP_TIMEOUT_S * G_TIME_SPAN_SECOND;
+  if (gst_element_set_state (pipeline,
+          GST_STATE_PLAYING) == GST_STATE_CHANGE_FAILURE) {
+    fprintf (stderr, "could not set the pipeline to PLAYING\n");
+    goto done;
+  }
+
+  g_mutex_lock (&run.lock);
+  while (!run.first_buffer)
+    if (!g_cond_wait_until (&run.cond, &run.lock, deadline))
+      break;
+  if (run.first_buffer)
+    elapsed = run.first_buffer - start;
+  g_mutex_unlock (&run.lock);
+
+  if (elapsed < 0) {
+    fprintf (stderr, "no frame after %d s\n", STARTUP_TIMEOUT_S);
+    goto done;
+  }
+
+  g_object_get (dec, "latency", &latency, NULL);
+  *first_frame = *format_wait = 0;
+  if (latency) {
+    gst_structure_get_uint64 (latency, "first-frame-us", first_frame);
+    gst_structure_get_uint64 (latency, "format-wait-us", format_wait);
+    gst_structure_free (latency);
+  }
+
+done:
+  gst_element_set_state (pipeline, GST_STATE_NULL);
+  gst_object_unref (dec);
+  gst_object_unref (pipeline);
+  g_cond_clear (&run.cond);
+  g_mutex_clear (&run.lock);
+
+  return elapsed;
+}
+
+int
+main (int argc, char *argv[])
+{
+  gint64 *startup, *first_frame, *format_wait;
+  int runs = 10, n = 0, opt, i;
+
+  gst_init (&argc, &argv);
+
+  while ((opt = getopt (argc, argv, "n:")) != -1) {
+    switch (opt) {
+      case 'n':
+        runs = strtol (optarg, NULL, 0);
+        if (runs <= 0)
+          goto usage;
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+  if (optind != argc - 1)
+    goto usage;
+
+  startup = g_new (gint64, runs);
+  first_frame = g_new (gint64, runs);
+  format_wait = g_new (gint64, runs);
+
+  printf ("%4s %14s %16s %16s\n", "run", "startup(ms)", "first-frame(ms)",
+      "format-wait(ms)");
+
+  for (i = 0; i < runs; i++) {
+    guint64 ff = 0, fw = 0;
+    gint64 elapsed = run_once (argv[optind], &ff, &fw);
+
+    if (elapsed < 0)
+      continue;
+
+    startup[n] = elapsed;
+    first_frame[n] = ff;
+    format_wait[n] = fw;
+    n++;
+
+    printf ("%4d %14.3f %16.3f %16.3f\n", i, elapsed / 1000.0, ff / 1000.0,
+        fw / 1000.0);
+  }
+
+  if (n) {
+    summary ("startup", startup, n);
+    summary ("first-frame", first_frame, n);
+    summary ("format-wait", format_wait, n);
+  } else {
+    fprintf (stderr, "no run reached the first frame\n");
+  }
+
+  g_free (startup);
+  g_free (first_frame);
+  g_free (format_wait);
+
+  return n ? 0 : 1;
+
+usage:
+  fprintf (stderr, "usage: %s [-n runs] \"<pipeline with a decoder named "
+      "dec>\"\n", argv[0]);
+  return 1;
+}
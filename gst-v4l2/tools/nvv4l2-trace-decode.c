@@ -0,0 +1,205 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* Turns the binary trace written by the encoder with measure-latency=1
+ * (~/gst_v4l2_enc_latency_<pid>.trace) into a per-frame latency table:
+ *
+ *   nvv4l2-trace-decode [-c] [-s] <file>
+ *
+ *   -c  print CSV instead of aligned columns
+ *   -s  only print the summary
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "v4l2-trace-format.h"
+
+static int
+compare_records (const void *a, const void *b)
+{
+  const V4l2TraceRecord *ra = a, *rb = b;
+
+  if (ra->frame_number != rb->frame_number)
+    return ra->frame_number < rb->frame_number ? -1 : 1;
+  return (int) ra->event - (int) rb->event;
+}
+
+static int
+compare_latency (const void *a, const void *b)
+{
+  int64_t va = *(const int64_t *) a, vb = *(const int64_t *) b;
+
+  return (va > vb) - (va < vb);
+}
+
+static V4l2TraceRecord *
+read_records (FILE * file, const char *path, size_t * n_records,
+    int64_t * start_time)
+{
+  V4l2TraceHeader header;
+  V4l2TraceRecord *records = NULL;
+  size_t n = 0, allocated = 0;
+
+  if (fread (&header, sizeof (header), 1, file) != 1
+      || memcmp (header.magic, V4L2_TRACE_MAGIC, sizeof (header.magic))) {
+    fprintf (stderr, "%s: not a v4l2 trace file\n", path);
+    return NULL;
+  }
+
+  if (header.version != V4L2_TRACE_VERSION
+      || header.record_size != sizeof (V4l2TraceRecord)) {
+    fprintf (stderr, "%s: unsupported trace version %u (record size %u)\n",
+        path, header.version, header.record_size);
+    return NULL;
+  }
+
+  for (;;) {
+    if (n == allocated) {
+      allocated = allocated ? allocated * 2 : 4096;
+      records = realloc (records, allocated * sizeof (V4l2TraceRecord));
+      if (!records) {
+        fprintf (stderr, "out of memory\n");
+        return NULL;
+      }
+    }
+    if (fread (&records[n], sizeof (V4l2TraceRecord), 1, file) != 1)
+      break;
+    n++;
+  }
+
+  *n_records = n;
+  *start_time = header.start_time_us;
+
+  return records;
+}
+
+int
+main (int argc, char *argv[])
+{
+  V4l2TraceRecord *records;
+  int64_t *latencies, start_time, sum = 0;
+  size_t n_records, n_frames = 0, unmatched = 0, i;
+  int csv = 0, summary_only = 0, opt;
+  FILE *file;
+
+  while ((opt = getopt (argc, argv, "cs")) != -1) {
+    switch (opt) {
+      case 'c':
+        csv = 1;
+        break;
+      case 's':
+        summary_only = 1;
+        break;
+      default:
+        goto usage;
+    }
+  }
+
+  if (optind != argc - 1)
+    goto usage;
+
+  file = fopen (argv[optind], "rb");
+  if (!file) {
+    perror (argv[optind]);
+    return 1;
+  }
+
+  records = read_records (file, argv[optind], &n_records, &start_time);
+  fclose (file);
+  if (!records)
+    return 1;
+
+  /* Input and output records of a frame end up next to each other */
+  qsort (records, n_records, sizeof (V4l2TraceRecord), compare_records);
+  latencies = malloc ((n_records + 1) * sizeof (int64_t));
+  if (!latencies) {
+    fprintf (stderr, "out of memory\n");
+    return 1;
+  }
+
+  if (!summary_only) {
+    if (csv)
+      printf ("frame,pts_ns,input_ms,latency_ms,size,keyframe\n");
+    else
+      printf ("%8s %16s %12s %12s %10s %4s\n", "frame", "pts(ns)",
+          "input(ms)", "latency(ms)", "size", "key");
+  }
+
+  for (i = 0; i < n_records; i++) {
+    V4l2TraceRecord *in = &records[i], *out;
+    int64_t latency;
+
+    if (in->event != V4L2_TRACE_EVENT_INPUT || i + 1 == n_records
+        || records[i + 1].frame_number != in->frame_number
+        || records[i + 1].event != V4L2_TRACE_EVENT_OUTPUT) {
+      /* Frame without input or output, e.g. dropped by the encoder or the
+       * trace ring */
+      unmatched++;
+      continue;
+    }
+
+    out = &records[++i];
+    latency = out->time_us - in->time_us;
+    latencies[n_frames++] = latency;
+    sum += latency;
+
+    if (summary_only)
+      continue;
+
+    if (csv)
+      printf ("%" PRIu32 ",%" PRIu64 ",%.3f,%.3f,%" PRIu32 ",%d\n",
+          in->frame_number, in->pts, (in->time_us - start_time) / 1000.0,
+          latency / 1000.0, out->size,
+          !!(out->flags & V4L2_TRACE_FLAG_KEYFRAME));
+    else
+      printf ("%8" PRIu32 " %16" PRIu64 " %12.3f %12.3f %10" PRIu32 " %4s\n",
+          in->frame_number, in->pts, (in->time_us - start_time) / 1000.0,
+          latency / 1000.0, out->size,
+          out->flags & V4L2_TRACE_FLAG_KEYFRAME ? "K" : "");
+  }
+
+  if (n_frames) {
+    qsort (latencies, n_frames, sizeof (int64_t), compare_latency);
+    fprintf (summary_only ? stdout : stderr,
+        "frames %zu unmatched %zu latency(ms) min %.3f avg %.3f p50 %.3f "
+        "p95 %.3f p99 %.3f max %.3f\n", n_frames, unmatched,
+        latencies[0] / 1000.0, sum / 1000.0 / n_frames,
+        latencies[(n_frames * 50 + 99) / 100 - 1] / 1000.0,
+        latencies[(n_frames * 95 + 99) / 100 - 1] / 1000.0,
+        latencies[(n_frames * 99 + 99) / 100 - 1] / 1000.0,
+        latencies[n_frames - 1] / 1000.0);
+  } else {
+    fprintf (stderr, "no complete frame in trace (%zu unmatched)\n",
+        unmatched);
+  }
+
+  free (latencies);
+  free (records);
+
+  return 0;
+
+usage:
+  fprintf (stderr, "usage: %s [-c] [-s] <file>\n", argv[0]);
+  return 1;
+}
@@ -0,0 +1,1368 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gstv4l2object.h"
+#include "v4l2-fake.h"
+
+GST_DEBUG_CATEGORY_EXTERN (v4l2_debug);
+#define GST_CAT_DEFAULT v4l2_debug
+
+#define FAKE_MAX_BUFFERS 32
+#define FAKE_MAX_PLANES 3
+#define FAKE_ALIGN(x, a) (((x) + (a) - 1) & ~((a) - 1))
+#define FAKE_PAGE_SIZE 4096
+
+typedef enum
+{
+  FAKE_BUF_DEQUEUED,
+  FAKE_BUF_QUEUED,
+  FAKE_BUF_ACTIVE,
+  FAKE_BUF_DONE
+} FakeBufState;
+
+typedef struct
+{
+  gint memfd;
+  gpointer data;
+  guint32 length;
+  guint32 bytesused;
+  guint32 offset;
+} FakePlane;
+
+typedef struct
+{
+  FakeBufState state;
+  guint32 flags;
+  guint32 sequence;
+  struct timeval timestamp;
+  guint n_planes;
+  FakePlane planes[FAKE_MAX_PLANES];
+} FakeBuffer;
+
+typedef struct
+{
+  enum v4l2_buf_type type;
+  struct v4l2_format format;
+  guint32 memory;
+  guint count;
+  FakeBuffer buffers[FAKE_MAX_BUFFERS];
+  gboolean streaming;
+  guint32 sequence;
+  GQueue queued;
+  GQueue done;
+} FakeQueue;
+
+typedef struct
+{
+  enum v4l2_buf_type type;
+  guint index;
+  gint64 at;
+} FakeJob;
+
+typedef struct
+{
+  gint refcount;
+  gint event_fd;
+  gboolean is_decoder;
+
+  GMutex lock;
+  /* signalled when a buffer or an event becomes ready */
+  GCond cond;
+  /* signalled when the worker has something new to look at */
+  GCond worker_cond;
+  GThread *worker;
+  gboolean quit;
+
+  FakeQueue output;
+  FakeQueue capture;
+
+  /* FakeJob, sorted by completion time */
+  GQueue inflight;
+  gint64 next_start;
+
+  GQueue events;
+  guint32 event_sequence;
+  gboolean source_change_sent;
+  /* A mid-stream source change was sent, no job starts until the capture
+   * plane is stopped */
+  gboolean resizing;
+
+  gboolean draining;
+  gboolean interrupted;
+  gboolean signalled;
+
+  struct v4l2_streamparm parm;
+  guint64 frames;
+} FakeDevice;
+
+typedef struct
+{
+  gint64 latency_us;
+  guint fps;
+  guint width;
+  guint height;
+  guint min_buffers;
+  guint bitstream_size;
+  guint64 resize_after;
+  guint resize_width;
+  guint resize_height;
+} FakeConfig;
+
+static FakeConfig fake_config;
+static GMutex fake_lock;
+static GHashTable *fake_fds = NULL;
+static gint fake_next_cookie = 1;
+
+static const guint32 fake_dec_coded_formats[] = {
+  V4L2_PIX_FMT_H264, V4L2_PIX_FMT_H265, V4L2_PIX_FMT_VP8, V4L2_PIX_FMT_VP9,
+  V4L2_PIX_FMT_MPEG2, V4L2_PIX_FMT_MPEG4, V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_AV1
+};
+
+static const guint32 fake_dec_raw_formats[] = {
+  V4L2_PIX_FMT_NV12M
+};
+
+static const guint32 fake_enc_raw_formats[] = {
+  V4L2_PIX_FMT_YUV420M, V4L2_PIX_FMT_NV12M, V4L2_PIX_FMT_NV24M,
+  V4L2_PIX_FMT_P010M
+};
+
+static const guint32 fake_enc_coded_formats[] = {
+  V4L2_PIX_FMT_H264, V4L2_PIX_FMT_H265, V4L2_PIX_FMT_VP8, V4L2_PIX_FMT_VP9,
+  V4L2_PIX_FMT_AV1
+};
+
+static void
+fake_config_init (void)
+{
+  static gsize initialized = 0;
+
+  if (g_once_init_enter (&initialized)) {
+    const gchar *env = g_getenv (GST_V4L2_FAKE_DEVICE_ENV);
+    gchar **params;
+    guint i;
+
+    fake_config.latency_us = 0;
+    fake_config.fps = 0;
+    fake_config.width = 1920;
+    fake_config.height = 1080;
+    fake_config.min_buffers = 4;
+    fake_config.bitstream_size = 4096;
+    fake_config.resize_after = 0;
+    fake_config.resize_width = 0;
+    fake_config.resize_height = 0;
+
+    params = g_strsplit (env ? env : "", ",", -1);
+    for (i = 0; params[i]; i++) {
+      gchar **kv = g_strsplit (params[i], "=", 2);
+
+      if (kv[0] && kv[1]) {
+        guint64 value = g_ascii_strtoull (kv[1], NULL, 10);
+
+        if (!g_strcmp0 (kv[0], "latency-us"))
+          fake_config.latency_us = value;
+        else if (!g_strcmp0 (kv[0], "fps"))
+          fake_config.fps = value;
+        else if (!g_strcmp0 (kv[0], "width"))
+          fake_config.width = CLAMP (value, 16, 8192);
+        else if (!g_strcmp0 (kv[0], "height"))
+          fake_config.height = CLAMP (value, 16, 8192);
+        else if (!g_strcmp0 (kv[0], "min-buffers"))
+          fake_config.min_buffers = CLAMP (value, 1, FAKE_MAX_BUFFERS);
+        else if (!g_strcmp0 (kv[0], "bitstream-size"))
+          fake_config.bitstream_size = MAX (value, 8);
+        else if (!g_strcmp0 (kv[0], "resize-after"))
+          fake_config.resize_after = value;
+        else if (!g_strcmp0 (kv[0], "resize-width"))
+          fake_config.resize_width = CLAMP (value, 16, 8192);
+        else if (!g_strcmp0 (kv[0], "resize-height"))
+          fake_config.resize_height = CLAMP (value, 16, 8192);
+        else
+          GST_WARNING ("Unknown fake device parameter '%s'", kv[0]);
+      }
+      g_strfreev (kv);
+    }
+    g_strfreev (params);
+
+    GST_INFO ("Fake device: latency %" G_GINT64_FORMAT " us, %u fps, %ux%u, "
+        "%u min buffers", fake_config.latency_us, fake_config.fps,
+        fake_config.width, fake_config.height, fake_config.min_buffers);
+
+    g_once_init_leave (&initialized, 1);
+  }
+}
+
+gboolean
+gst_v4l2_fake_device_enabled (void)
+{
+  return g_getenv (GST_V4L2_FAKE_DEVICE_ENV) != NULL;
+}
+
+static FakeDevice *
+fake_lookup (gint fd)
+{
+  FakeDevice *dev = NULL;
+
+  g_mutex_lock (&fake_lock);
+  if (fake_fds)
+    dev = g_hash_table_lookup (fake_fds, GINT_TO_POINTER (fd));
+  g_mutex_unlock (&fake_lock);
+
+  return dev;
+}
+
+static FakeQueue *
+fake_get_queue (FakeDevice * dev, guint32 type)
+{
+  if (type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+    return &dev->output;
+  if (type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+    return &dev->capture;
+  return NULL;
+}
+
+static const guint32 *
+fake_get_formats (FakeDevice * dev, guint32 type, guint * n)
+{
+  gboolean coded = (dev->is_decoder == V4L2_TYPE_IS_OUTPUT (type));
+
+  if (dev->is_decoder && coded) {
+    *n = G_N_ELEMENTS (fake_dec_coded_formats);
+    return fake_dec_coded_formats;
+  } else if (dev->is_decoder) {
+    *n = G_N_ELEMENTS (fake_dec_raw_formats);
+    return fake_dec_raw_formats;
+  } else if (coded) {
+    *n = G_N_ELEMENTS (fake_enc_coded_formats);
+    return fake_enc_coded_formats;
+  }
+
+  *n = G_N_ELEMENTS (fake_enc_raw_formats);
+  return fake_enc_raw_formats;
+}
+
+static gboolean
+fake_format_is_coded (FakeDevice * dev, guint32 type)
+{
+  return dev->is_decoder == V4L2_TYPE_IS_OUTPUT (type);
+}
+
+static void
+fake_set_plane (struct v4l2_pix_format_mplane *pix, guint i,
+    guint32 bytesperline, guint32 sizeimage)
+{
+  pix->plane_fmt[i].bytesperline = bytesperline;
+  pix->plane_fmt[i].sizeimage = sizeimage;
+}
+
+static void
+fake_adjust_format (FakeDevice * dev, struct v4l2_format *fmt)
+{
+  struct v4l2_pix_format_mplane *pix = &fmt->fmt.pix_mp;
+  const guint32 *formats;
+  guint32 w, h, stride;
+  guint n, i;
+
+  formats = fake_get_formats (dev, fmt->type, &n);
+  for (i = 0; i < n; i++)
+    if (formats[i] == pix->pixelformat)
+      break;
+  if (i == n)
+    pix->pixelformat = formats[0];
+
+  w = pix->width ? CLAMP (pix->width, 16, 8192) : fake_config.width;
+  h = pix->height ? CLAMP (pix->height, 16, 8192) : fake_config.height;
+  pix->width = w;
+  pix->height = h;
+  pix->field = V4L2_FIELD_NONE;
+
+  if (fake_format_is_coded (dev, fmt->type)) {
+    pix->num_planes = 1;
+    fake_set_plane (pix, 0, 0, pix->plane_fmt[0].sizeimage ?
+        pix->plane_fmt[0].sizeimage : MAX (w * h * 3 / 4, 1024 * 1024));
+    return;
+  }
+
+  switch (pix->pixelformat) {
+    case V4L2_PIX_FMT_YUV420M:
+      pix->num_planes = 3;
+      stride = FAKE_ALIGN (w, 64);
+      fake_set_plane (pix, 0, stride, stride * h);
+      stride = FAKE_ALIGN ((w + 1) / 2, 64);
+      fake_set_plane (pix, 1, stride, stride * ((h + 1) / 2));
+      fake_set_plane (pix, 2, stride, stride * ((h + 1) / 2));
+      break;
+    case V4L2_PIX_FMT_NV24M:
+      pix->num_planes = 2;
+      stride = FAKE_ALIGN (w, 64);
+      fake_set_plane (pix, 0, stride, stride * h);
+      stride = FAKE_ALIGN (w * 2, 64);
+      fake_set_plane (pix, 1, stride, stride * h);
+      break;
+    case V4L2_PIX_FMT_P010M:
+      pix->num_planes = 2;
+      stride = FAKE_ALIGN (w * 2, 64);
+      fake_set_plane (pix, 0, stride, stride * h);
+      fake_set_plane (pix, 1, stride, stride * ((h + 1) / 2));
+      break;
+    case V4L2_PIX_FMT_NV12M:
+    default:
+      pix->num_planes = 2;
+      stride = FAKE_ALIGN (w, 64);
+      fake_set_plane (pix, 0, stride, stride * h);
+      fake_set_plane (pix, 1, stride, stride * ((h + 1) / 2));
+      break;
+  }
+}
+
+static void
+fake_queue_init (FakeDevice * dev, FakeQueue * q, enum v4l2_buf_type type)
+{
+  q->type = type;
+  q->format.type = type;
+  fake_adjust_format (dev, &q->format);
+  g_queue_init (&q->queued);
+  g_queue_init (&q->done);
+}
+
+static gboolean
+fake_is_drained (FakeDevice * dev)
+{
+  GList *l;
+
+  if (!g_queue_is_empty (&dev->output.queued)
+      || !g_queue_is_empty (&dev->capture.done))
+    return FALSE;
+
+  for (l = dev->inflight.head; l; l = l->next) {
+    FakeJob *job = l->data;
+    if (!V4L2_TYPE_IS_OUTPUT (job->type))
+      return FALSE;
+  }
+
+  return TRUE;
+}
+
+static void
+fake_update_signal (FakeDevice * dev)
+{
+  gboolean ready;
+  guint64 value = 1;
+
+  ready = !g_queue_is_empty (&dev->capture.done)
+      || !g_queue_is_empty (&dev->output.done)
+      || !g_queue_is_empty (&dev->events) || dev->interrupted
+      || (dev->draining && fake_is_drained (dev));
+
+  if (ready && !dev->signalled) {
+    if (write (dev->event_fd, &value, sizeof (value)) == sizeof (value))
+      dev->signalled = TRUE;
+  } else if (!ready && dev->signalled) {
+    if (read (dev->event_fd, &value, sizeof (value)) == sizeof (value))
+      dev->signalled = FALSE;
+  }
+
+  if (ready)
+    g_cond_broadcast (&dev->cond);
+}
+
+static gint
+fake_job_compare (gconstpointer a, gconstpointer b, gpointer user_data)
+{
+  const FakeJob *ja = a, *jb = b;
+
+  return (ja->at > jb->at) - (ja->at < jb->at);
+}
+
+static void
+fake_schedule (FakeDevice * dev, FakeQueue * q, guint index, gint64 at)
+{
+  FakeJob *job = g_slice_new (FakeJob);
+
+  job->type = q->type;
+  job->index = index;
+  job->at = at;
+  q->buffers[index].state = FAKE_BUF_ACTIVE;
+  g_queue_insert_sorted (&dev->inflight, job, fake_job_compare, NULL);
+}
+
+static void fake_push_source_change (FakeDevice * dev);
+
+/* Switches the coded size in the middle of the stream the way the Tegra
+ * decoder does: the pictures already decoded are still handed out, then
+ * only the event is sent, without a last buffer, and nothing is decoded
+ * until the capture plane is stopped and set up again */
+static void
+fake_resize (FakeDevice * dev)
+{
+  struct v4l2_pix_format_mplane *pix = &dev->capture.format.fmt.pix_mp;
+
+  pix->width = fake_config.resize_width ?
+      fake_config.resize_width : MAX (pix->width / 2, 16);
+  pix->height = fake_config.resize_height ?
+      fake_config.resize_height : MAX (pix->height / 2, 16);
+  fake_adjust_format (dev, &dev->capture.format);
+
+  GST_INFO ("Fake decoder switching to %ux%u after %" G_GUINT64_FORMAT
+      " frames", pix->width, pix->height, dev->frames);
+
+  dev->resizing = TRUE;
+  fake_push_source_change (dev);
+}
+
+static void
+fake_retire (FakeDevice * dev, FakeJob * job)
+{
+  FakeQueue *q = fake_get_queue (dev, job->type);
+  FakeBuffer *b = &q->buffers[job->index];
+  guint i;
+
+  b->state = FAKE_BUF_DONE;
+  b->sequence = q->sequence++;
+
+  if (!V4L2_TYPE_IS_OUTPUT (q->type)) {
+    if (dev->is_decoder) {
+      for (i = 0; i < b->n_planes; i++)
+        b->planes[i].bytesused = b->planes[i].length;
+    } else {
+      static const guint8 start_code[] = { 0x00, 0x00, 0x00, 0x01 };
+      FakePlane *plane = &b->planes[0];
+
+      plane->bytesused = MIN (fake_config.bitstream_size, plane->length);
+      if (plane->data && plane->bytesused >= sizeof (start_code))
+        memcpy (plane->data, start_code, sizeof (start_code));
+      if (b->sequence % 30 == 0)
+        b->flags |= V4L2_BUF_FLAG_KEYFRAME;
+    }
+    dev->frames++;
+
+    if (dev->is_decoder && dev->frames == fake_config.resize_after)
+      fake_resize (dev);
+  }
+
+  g_queue_push_tail (&q->done, GUINT_TO_POINTER (job->index));
+}
+
+static gpointer
+fake_worker (FakeDevice * dev)
+{
+  g_mutex_lock (&dev->lock);
+
+  while (!dev->quit) {
+    gint64 now = g_get_monotonic_time ();
+    gboolean retired = FALSE;
+    FakeJob *job;
+
+    /* Start a job for every pair of queued OUTPUT / CAPTURE buffers. The
+     * start time is limited by the throughput, the completion time by the
+     * per frame latency. */
+    while (dev->output.streaming && dev->capture.streaming && !dev->resizing
+        && !g_queue_is_empty (&dev->output.queued)
+        && !g_queue_is_empty (&dev->capture.queued)) {
+      guint out = GPOINTER_TO_UINT (g_queue_pop_head (&dev->output.queued));
+      guint cap = GPOINTER_TO_UINT (g_queue_pop_head (&dev->capture.queued));
+      gint64 start = MAX (now, dev->next_start);
+
+      if (fake_config.fps)
+        dev->next_start = start + G_USEC_PER_SEC / fake_config.fps;
+
+      dev->capture.buffers[cap].timestamp = dev->output.buffers[out].timestamp;
+      dev->capture.buffers[cap].flags = 0;
+
+      fake_schedule (dev, &dev->output, out, start);
+      fake_schedule (dev, &dev->capture, cap, start + fake_config.latency_us);
+    }
+
+    while ((job = g_queue_peek_head (&dev->inflight)) && job->at <= now) {
+      g_queue_pop_head (&dev->inflight);
+      fake_retire (dev, job);
+      g_slice_free (FakeJob, job);
+      retired = TRUE;
+    }
+
+    if (retired)
+      fake_update_signal (dev);
+
+    job = g_queue_peek_head (&dev->inflight);
+    if (job)
+      g_cond_wait_until (&dev->worker_cond, &dev->lock, job->at);
+    else
+      g_cond_wait (&dev->worker_cond, &dev->lock);
+  }
+
+  g_mutex_unlock (&dev->lock);
+
+  return NULL;
+}
+
+static gboolean
+fake_plane_alloc (FakePlane * plane, guint32 length)
+{
+  plane->memfd = memfd_create ("v4l2-fake", MFD_CLOEXEC);
+  if (plane->memfd < 0)
+    return FALSE;
+
+  if (ftruncate (plane->memfd, length) < 0)
+    goto failed;
+
+  plane->data = mmap (NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED,
+      plane->memfd, 0);
+  if (plane->data == MAP_FAILED)
+    goto failed;
+
+  plane->length = length;
+  plane->offset = (guint32) g_atomic_int_add (&fake_next_cookie, 1)
+      * FAKE_PAGE_SIZE;
+
+  return TRUE;
+
+failed:
+  close (plane->memfd);
+  plane->memfd = -1;
+  plane->data = NULL;
+  return FALSE;
+}
+
+static void
+fake_queue_free_buffers (FakeDevice * dev, FakeQueue * q)
+{
+  GList *l, *next;
+  guint i, j;
+
+  for (l = dev->inflight.head; l; l = next) {
+    FakeJob *job = l->data;
+
+    next = l->next;
+    if (job->type == q->type) {
+      g_queue_delete_link (&dev->inflight, l);
+      g_slice_free (FakeJob, job);
+    }
+  }
+
+  for (i = 0; i < q->count; i++) {
+    FakeBuffer *b = &q->buffers[i];
+
+    for (j = 0; j < b->n_planes; j++) {
+      if (b->planes[j].data)
+        munmap (b->planes[j].data, b->planes[j].length);
+      if (b->planes[j].memfd >= 0)
+        close (b->planes[j].memfd);
+    }
+  }
+
+  memset (q->buffers, 0, sizeof (q->buffers));
+  q->count = 0;
+  g_queue_clear (&q->queued);
+  g_queue_clear (&q->done);
+}
+
+static FakeDevice *
+fake_device_new (const gchar * path, gint fd)
+{
+  FakeDevice *dev = g_new0 (FakeDevice, 1);
+
+  dev->refcount = 1;
+  dev->event_fd = dup (fd);
+  dev->is_decoder = (path == NULL || strstr (path, "enc") == NULL);
+
+  g_mutex_init (&dev->lock);
+  g_cond_init (&dev->cond);
+  g_cond_init (&dev->worker_cond);
+  g_queue_init (&dev->inflight);
+  g_queue_init (&dev->events);
+
+  fake_queue_init (dev, &dev->output, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE);
+  fake_queue_init (dev, &dev->capture, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+
+  dev->parm.parm.output.timeperframe.numerator = 1;
+  dev->parm.parm.output.timeperframe.denominator = 30;
+
+  dev->worker = g_thread_new ("v4l2-fake", (GThreadFunc) fake_worker, dev);
+
+  return dev;
+}
+
+static void
+fake_device_free (FakeDevice * dev)
+{
+  g_mutex_lock (&dev->lock);
+  dev->quit = TRUE;
+  g_cond_signal (&dev->worker_cond);
+  g_mutex_unlock (&dev->lock);
+  g_thread_join (dev->worker);
+
+  GST_INFO ("Fake %s processed %" G_GUINT64_FORMAT " frames",
+      dev->is_decoder ? "decoder" : "encoder", dev->frames);
+
+  fake_queue_free_buffers (dev, &dev->output);
+  fake_queue_free_buffers (dev, &dev->capture);
+  g_queue_foreach (&dev->events, (GFunc) g_free, NULL);
+  g_queue_clear (&dev->events);
+
+  close (dev->event_fd);
+  g_cond_clear (&dev->worker_cond);
+  g_cond_clear (&dev->cond);
+  g_mutex_clear (&dev->lock);
+  g_free (dev);
+}
+
+static void
+fake_push_source_change (FakeDevice * dev)
+{
+  struct v4l2_event *ev = g_new0 (struct v4l2_event, 1);
+  struct timespec ts;
+
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  ev->type = V4L2_EVENT_SOURCE_CHANGE;
+  ev->u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION;
+  ev->sequence = dev->event_sequence++;
+  ev->timestamp = ts;
+
+  g_queue_push_tail (&dev->events, ev);
+  dev->source_change_sent = TRUE;
+}
+
+static gint
+fake_querycap (FakeDevice * dev, struct v4l2_capability *cap)
+{
+  memset (cap, 0, sizeof (*cap));
+  g_strlcpy ((gchar *) cap->driver, "v4l2-fake", sizeof (cap->driver));
+  g_strlcpy ((gchar *) cap->card, dev->is_decoder ? "NVDEC" : "NVENC",
+      sizeof (cap->card));
+  g_strlcpy ((gchar *) cap->bus_info, "platform:v4l2-fake",
+      sizeof (cap->bus_info));
+  cap->device_caps = V4L2_CAP_VIDEO_M2M_MPLANE | V4L2_CAP_STREAMING;
+  cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+
+  return 0;
+}
+
+static gint
+fake_enum_fmt (FakeDevice * dev, struct v4l2_fmtdesc *desc)
+{
+  const guint32 *formats;
+  guint n, index = desc->index;
+  enum v4l2_buf_type type = desc->type;
+
+  if (!fake_get_queue (dev, type))
+    return EINVAL;
+
+  formats = fake_get_formats (dev, type, &n);
+  if (index >= n)
+    return EINVAL;
+
+  memset (desc, 0, sizeof (*desc));
+  desc->index = index;
+  desc->type = type;
+  desc->pixelformat = formats[index];
+  if (fake_format_is_coded (dev, type))
+    desc->flags = V4L2_FMT_FLAG_COMPRESSED;
+  g_snprintf ((gchar *) desc->description, sizeof (desc->description),
+      "%" GST_FOURCC_FORMAT, GST_FOURCC_ARGS (formats[index]));
+
+  return 0;
+}
+
+static gint
+fake_s_fmt (FakeDevice * dev, struct v4l2_format *fmt, gboolean try_only)
+{
+  FakeQueue *q = fake_get_queue (dev, fmt->type);
+
+  if (!q)
+    return EINVAL;
+
+  fake_adjust_format (dev, fmt);
+  if (try_only)
+    return 0;
+
+  if (q->count > 0)
+    return EBUSY;
+
+  q->format = *fmt;
+
+  /* The coded size comes from the bitstream on a real decoder, use the size
+   * of the OUTPUT format instead */
+  if (dev->is_decoder && V4L2_TYPE_IS_OUTPUT (fmt->type)
+      && dev->capture.count == 0) {
+    dev->capture.format.fmt.pix_mp.width = fmt->fmt.pix_mp.width;
+    dev->capture.format.fmt.pix_mp.height = fmt->fmt.pix_mp.height;
+    fake_adjust_format (dev, &dev->capture.format);
+  }
+
+  return 0;
+}
+
+static gint
+fake_enum_framesizes (FakeDevice * dev, struct v4l2_frmsizeenum *size)
+{
+  if (size->index > 0)
+    return EINVAL;
+
+  size->type = V4L2_FRMSIZE_TYPE_STEPWISE;
+  size->stepwise.min_width = 16;
+  size->stepwise.max_width = 8192;
+  size->stepwise.step_width = 2;
+  size->stepwise.min_height = 16;
+  size->stepwise.max_height = 8192;
+  size->stepwise.step_height = 2;
+
+  return 0;
+}
+
+static gint
+fake_get_rect (FakeDevice * dev, guint32 type, struct v4l2_rect *r)
+{
+  FakeQueue *q = fake_get_queue (dev, type);
+
+  if (!q)
+    return EINVAL;
+
+  r->left = 0;
+  r->top = 0;
+  r->width = q->format.fmt.pix_mp.width;
+  r->height = q->format.fmt.pix_mp.height;
+
+  return 0;
+}
+
+static gint
+fake_cropcap (FakeDevice * dev, struct v4l2_cropcap *cropcap)
+{
+  gint ret = fake_get_rect (dev, cropcap->type, &cropcap->bounds);
+
+  if (ret)
+    return ret;
+
+  cropcap->defrect = cropcap->bounds;
+  cropcap->pixelaspect.numerator = 1;
+  cropcap->pixelaspect.denominator = 1;
+
+  return 0;
+}
+
+static gint
+fake_reqbufs (FakeDevice * dev, struct v4l2_requestbuffers *req)
+{
+  FakeQueue *q = fake_get_queue (dev, req->type);
+  struct v4l2_pix_format_mplane *pix;
+  guint i, j;
+
+  if (!q)
+    return EINVAL;
+
+  if (req->memory != V4L2_MEMORY_MMAP && req->memory != V4L2_MEMORY_DMABUF
+      && req->memory != V4L2_MEMORY_USERPTR)
+    return EINVAL;
+
+  if (q->streaming)
+    return EBUSY;
+
+  fake_queue_free_buffers (dev, q);
+
+  pix = &q->format.fmt.pix_mp;
+  req->count = MIN (req->count, FAKE_MAX_BUFFERS);
+
+  for (i = 0; i < req->count; i++) {
+    FakeBuffer *b = &q->buffers[i];
+
+    b->n_planes = pix->num_planes;
+    /* Before any allocation, a failure frees the whole buffer */
+    for (j = 0; j < b->n_planes; j++)
+      b->planes[j].memfd = -1;
+
+    for (j = 0; j < b->n_planes; j++) {
+      FakePlane *plane = &b->planes[j];
+
+      if (req->memory == V4L2_MEMORY_MMAP) {
+        if (!fake_plane_alloc (plane, pix->plane_fmt[j].sizeimage)) {
+          q->count = i + 1;
+          fake_queue_free_buffers (dev, q);
+          return ENOMEM;
+        }
+      } else {
+        plane->length = pix->plane_fmt[j].sizeimage;
+      }
+    }
+  }
+
+  q->count = req->count;
+  q->memory = req->memory;
+  q->sequence = 0;
+
+  return 0;
+}
+
+static guint32
+fake_buffer_flags (FakeBuffer * b)
+{
+  guint32 flags = b->flags & ~(V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE);
+
+  if (b->state == FAKE_BUF_QUEUED || b->state == FAKE_BUF_ACTIVE)
+    flags |= V4L2_BUF_FLAG_QUEUED;
+  else if (b->state == FAKE_BUF_DONE)
+    flags |= V4L2_BUF_FLAG_DONE;
+
+  return flags;
+}
+
+static FakeBuffer *
+fake_get_buffer (FakeDevice * dev, struct v4l2_buffer *buf, FakeQueue ** q)
+{
+  *q = fake_get_queue (dev, buf->type);
+
+  if (!*q || buf->index >= (*q)->count || buf->m.planes == NULL
+      || buf->length < (*q)->buffers[buf->index].n_planes)
+    return NULL;
+
+  return &(*q)->buffers[buf->index];
+}
+
+static void
+fake_fill_buffer (FakeQueue * q, FakeBuffer * b, struct v4l2_buffer *buf)
+{
+  guint i;
+
+  buf->memory = q->memory;
+  buf->flags = fake_buffer_flags (b);
+  buf->field = V4L2_FIELD_NONE;
+  buf->timestamp = b->timestamp;
+  buf->sequence = b->sequence;
+  buf->length = b->n_planes;
+
+  for (i = 0; i < b->n_planes; i++) {
+    buf->m.planes[i].length = b->planes[i].length;
+    buf->m.planes[i].bytesused = b->planes[i].bytesused;
+    buf->m.planes[i].data_offset = 0;
+    if (q->memory == V4L2_MEMORY_MMAP)
+      buf->m.planes[i].m.mem_offset = b->planes[i].offset;
+  }
+}
+
+static gint
+fake_querybuf (FakeDevice * dev, struct v4l2_buffer *buf)
+{
+  FakeQueue *q;
+  FakeBuffer *b = fake_get_buffer (dev, buf, &q);
+
+  if (!b)
+    return EINVAL;
+
+  fake_fill_buffer (q, b, buf);
+
+  return 0;
+}
+
+static gint
+fake_qbuf (FakeDevice * dev, struct v4l2_buffer *buf)
+{
+  FakeQueue *q;
+  FakeBuffer *b = fake_get_buffer (dev, buf, &q);
+  guint i;
+
+  if (!b || buf->memory != q->memory || b->state != FAKE_BUF_DEQUEUED)
+    return EINVAL;
+
+  for (i = 0; i < b->n_planes; i++)
+    b->planes[i].bytesused = V4L2_TYPE_IS_OUTPUT (q->type) ?
+        buf->m.planes[i].bytesused : 0;
+
+  b->flags = buf->flags & ~(V4L2_BUF_FLAG_QUEUED | V4L2_BUF_FLAG_DONE);
+  b->timestamp = buf->timestamp;
+  b->state = FAKE_BUF_QUEUED;
+  g_queue_push_tail (&q->queued, GUINT_TO_POINTER (buf->index));
+
+  /* Real decoders report the stream format once the headers are parsed */
+  if (dev->is_decoder && V4L2_TYPE_IS_OUTPUT (q->type)
+      && !dev->source_change_sent) {
+    fake_push_source_change (dev);
+    fake_update_signal (dev);
+  }
+
+  buf->flags = fake_buffer_flags (b);
+  g_cond_signal (&dev->worker_cond);
+
+  return 0;
+}
+
+static gint
+fake_dqbuf (FakeDevice * dev, struct v4l2_buffer *buf)
+{
+  FakeQueue *q = fake_get_queue (dev, buf->type);
+  FakeBuffer *b;
+  guint index;
+
+  if (!q || buf->m.planes == NULL)
+    return EINVAL;
+
+  /* The Tegra drivers report a stopped queue as a broken pipe, which is
+   * what ends the DQBUF loop of the allocator on flush */
+  if (!q->streaming)
+    return EPIPE;
+
+  if (g_queue_is_empty (&q->done)) {
+    if (!V4L2_TYPE_IS_OUTPUT (q->type) && dev->draining && fake_is_drained (dev))
+      return EPIPE;
+    return EAGAIN;
+  }
+
+  index = GPOINTER_TO_UINT (g_queue_peek_head (&q->done));
+  b = &q->buffers[index];
+  if (buf->length < b->n_planes)
+    return EINVAL;
+
+  g_queue_pop_head (&q->done);
+  buf->index = index;
+  fake_fill_buffer (q, b, buf);
+  b->state = FAKE_BUF_DEQUEUED;
+
+  fake_update_signal (dev);
+
+  return 0;
+}
+
+static gint
+fake_streamon (FakeDevice * dev, guint32 type, gboolean on)
+{
+  FakeQueue *q = fake_get_queue (dev, type);
+  GList *l, *next;
+  guint i;
+
+  if (!q)
+    return EINVAL;
+
+  q->streaming = on;
+  if (!V4L2_TYPE_IS_OUTPUT (type)) {
+    dev->draining = FALSE;
+    if (!on)
+      dev->resizing = FALSE;
+  }
+
+  if (!on) {
+    /* All buffers are returned to the application */
+    for (l = dev->inflight.head; l; l = next) {
+      FakeJob *job = l->data;
+
+      next = l->next;
+      if (job->type == q->type) {
+        g_queue_delete_link (&dev->inflight, l);
+        g_slice_free (FakeJob, job);
+      }
+    }
+    for (i = 0; i < q->count; i++)
+      q->buffers[i].state = FAKE_BUF_DEQUEUED;
+    g_queue_clear (&q->queued);
+    g_queue_clear (&q->done);
+    q->sequence = 0;
+  }
+
+  fake_update_signal (dev);
+  g_cond_signal (&dev->worker_cond);
+
+  return 0;
+}
+
+static gint
+fake_dqevent (FakeDevice * dev, struct v4l2_event *ev)
+{
+  struct v4l2_event *pending = g_queue_pop_head (&dev->events);
+
+  if (!pending)
+    return ENOENT;
+
+  *ev = *pending;
+  ev->pending = g_queue_get_length (&dev->events);
+  g_free (pending);
+
+  fake_update_signal (dev);
+
+  return 0;
+}
+
+static gint
+fake_device_poll (FakeDevice * dev, v4l2_ctrl_video_device_poll * poll)
+{
+  guint16 resp;
+
+  if (!poll)
+    return EINVAL;
+
+  while (TRUE) {
+    resp = 0;
+
+    if ((poll->req_events & POLLIN) && (!g_queue_is_empty (&dev->capture.done)
+            || (dev->draining && fake_is_drained (dev))))
+      resp |= POLLIN;
+    if ((poll->req_events & POLLOUT) && !g_queue_is_empty (&dev->output.done))
+      resp |= POLLOUT;
+    if ((poll->req_events & POLLPRI) && !g_queue_is_empty (&dev->events))
+      resp |= POLLPRI;
+
+    if (resp || dev->interrupted || dev->quit)
+      break;
+
+    g_cond_wait (&dev->cond, &dev->lock);
+  }
+
+  poll->resp_events = resp;
+
+  return 0;
+}
+
+static gint
+fake_s_ext_ctrls (FakeDevice * dev, struct v4l2_ext_controls *ctrls)
+{
+  guint i;
+  gint ret = 0;
+
+  for (i = 0; i < ctrls->count && ret == 0; i++) {
+    struct v4l2_ext_control *ctrl = &ctrls->controls[i];
+
+    switch (ctrl->id) {
+      case V4L2_CID_MPEG_SET_POLL_INTERRUPT:
+        /* 0 interrupts pending and future polls, 1 re-arms them */
+        dev->interrupted = (ctrl->value == 0);
+        fake_update_signal (dev);
+        g_cond_broadcast (&dev->cond);
+        break;
+      case V4L2_CID_MPEG_VIDEO_DEVICE_POLL:
+        ret = fake_device_poll (dev,
+            (v4l2_ctrl_video_device_poll *) ctrl->string);
+        break;
+      default:
+        break;
+    }
+  }
+
+  return ret;
+}
+
+static gint
+fake_g_ctrl (FakeDevice * dev, struct v4l2_control *ctrl)
+{
+  switch (ctrl->id) {
+    case V4L2_CID_MIN_BUFFERS_FOR_CAPTURE:
+    case V4L2_CID_MIN_BUFFERS_FOR_OUTPUT:
+      ctrl->value = fake_config.min_buffers;
+      break;
+    default:
+      ctrl->value = 0;
+      break;
+  }
+
+  return 0;
+}
+
+static gint
+fake_codec_cmd (FakeDevice * dev, guint32 cmd)
+{
+  /* V4L2_DEC_CMD_* and V4L2_ENC_CMD_* share the START / STOP values */
+  if (cmd == V4L2_DEC_CMD_STOP)
+    dev->draining = TRUE;
+  else if (cmd == V4L2_DEC_CMD_START)
+    dev->draining = FALSE;
+
+  fake_update_signal (dev);
+  g_cond_signal (&dev->worker_cond);
+
+  return 0;
+}
+
+static gint
+fake_expbuf (FakeDevice * dev, struct v4l2_exportbuffer *expbuf)
+{
+  FakeQueue *q = fake_get_queue (dev, expbuf->type);
+  FakeBuffer *b;
+
+  if (!q || q->memory != V4L2_MEMORY_MMAP || expbuf->index >= q->count)
+    return EINVAL;
+
+  b = &q->buffers[expbuf->index];
+  if (expbuf->plane >= b->n_planes)
+    return EINVAL;
+
+  expbuf->fd = fcntl (b->planes[expbuf->plane].memfd, F_DUPFD_CLOEXEC, 0);
+  if (expbuf->fd < 0)
+    return errno;
+
+  return 0;
+}
+
+static gint
+fake_do_ioctl (FakeDevice * dev, gulong request, gpointer arg)
+{
+  switch (request) {
+    case VIDIOC_QUERYCAP:
+      return fake_querycap (dev, arg);
+    case VIDIOC_ENUM_FMT:
+      return fake_enum_fmt (dev, arg);
+    case VIDIOC_G_FMT:{
+      struct v4l2_format *fmt = arg;
+      FakeQueue *q = fake_get_queue (dev, fmt->type);
+
+      if (!q)
+        return EINVAL;
+      *fmt = q->format;
+      return 0;
+    }
+    case VIDIOC_S_FMT:
+      return fake_s_fmt (dev, arg, FALSE);
+    case VIDIOC_TRY_FMT:
+      return fake_s_fmt (dev, arg, TRUE);
+    case VIDIOC_ENUM_FRAMESIZES:
+      return fake_enum_framesizes (dev, arg);
+    case VIDIOC_G_SELECTION:{
+      struct v4l2_selection *sel = arg;
+      return fake_get_rect (dev, sel->type, &sel->r);
+    }
+    case VIDIOC_G_CROP:{
+      struct v4l2_crop *crop = arg;
+      return fake_get_rect (dev, crop->type, &crop->c);
+    }
+    case VIDIOC_CROPCAP:
+      return fake_cropcap (dev, arg);
+    case VIDIOC_S_SELECTION:
+    case VIDIOC_S_CROP:
+    case VIDIOC_SUBSCRIBE_EVENT:
+    case VIDIOC_UNSUBSCRIBE_EVENT:
+    case VIDIOC_S_CTRL:
+    case VIDIOC_TRY_DECODER_CMD:
+    case VIDIOC_TRY_ENCODER_CMD:
+      return 0;
+    case VIDIOC_G_PARM:{
+      struct v4l2_streamparm *parm = arg;
+      enum v4l2_buf_type type = parm->type;
+
+      *parm = dev->parm;
+      parm->type = type;
+      parm->parm.output.capability = V4L2_CAP_TIMEPERFRAME;
+      return 0;
+    }
+    case VIDIOC_S_PARM:
+      dev->parm = *(struct v4l2_streamparm *) arg;
+      return 0;
+    case VIDIOC_G_CTRL:
+      return fake_g_ctrl (dev, arg);
+    case VIDIOC_S_EXT_CTRLS:
+      return fake_s_ext_ctrls (dev, arg);
+    case VIDIOC_REQBUFS:
+      return fake_reqbufs (dev, arg);
+    case VIDIOC_QUERYBUF:
+      return fake_querybuf (dev, arg);
+    case VIDIOC_EXPBUF:
+      return fake_expbuf (dev, arg);
+    case VIDIOC_QBUF:
+      return fake_qbuf (dev, arg);
+    case VIDIOC_DQBUF:
+      return fake_dqbuf (dev, arg);
+    case VIDIOC_STREAMON:
+      return fake_streamon (dev, *(guint32 *) arg, TRUE);
+    case VIDIOC_STREAMOFF:
+      return fake_streamon (dev, *(guint32 *) arg, FALSE);
+    case VIDIOC_DQEVENT:
+      return fake_dqevent (dev, arg);
+    case VIDIOC_DECODER_CMD:
+      return fake_codec_cmd (dev, ((struct v4l2_decoder_cmd *) arg)->cmd);
+    case VIDIOC_ENCODER_CMD:
+      return fake_codec_cmd (dev, ((struct v4l2_encoder_cmd *) arg)->cmd);
+    default:
+      return ENOTTY;
+  }
+}
+
+gint
+gst_v4l2_fake_open (const gchar * path, gint flags)
+{
+  FakeDevice *dev;
+  gint fd;
+
+  fake_config_init ();
+
+  /* The eventfd gives every device a real, pollable and dup-able fd. It is
+   * readable whenever a buffer or an event is ready to be dequeued. */
+  fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (fd < 0)
+    return -1;
+
+  dev = fake_device_new (path, fd);
+
+  g_mutex_lock (&fake_lock);
+  if (!fake_fds)
+    fake_fds = g_hash_table_new (NULL, NULL);
+  g_hash_table_insert (fake_fds, GINT_TO_POINTER (fd), dev);
+  g_mutex_unlock (&fake_lock);
+
+  GST_DEBUG ("Opened fake %s '%s' as fd %d",
+      dev->is_decoder ? "decoder" : "encoder", path, fd);
+
+  return fd;
+}
+
+gint
+gst_v4l2_fake_dup (gint fd)
+{
+  FakeDevice *dev;
+  gint newfd;
+
+  newfd = dup (fd);
+  if (newfd < 0)
+    return newfd;
+
+  g_mutex_lock (&fake_lock);
+  dev = fake_fds ? g_hash_table_lookup (fake_fds, GINT_TO_POINTER (fd)) : NULL;
+  if (dev) {
+    dev->refcount++;
+    g_hash_table_insert (fake_fds, GINT_TO_POINTER (newfd), dev);
+  }
+  g_mutex_unlock (&fake_lock);
+
+  return newfd;
+}
+
+gint
+gst_v4l2_fake_close (gint fd)
+{
+  FakeDevice *dev;
+
+  g_mutex_lock (&fake_lock);
+  dev = fake_fds ? g_hash_table_lookup (fake_fds, GINT_TO_POINTER (fd)) : NULL;
+  if (dev) {
+    g_hash_table_remove (fake_fds, GINT_TO_POINTER (fd));
+    if (--dev->refcount > 0)
+      dev = NULL;
+  }
+  g_mutex_unlock (&fake_lock);
+
+  if (dev)
+    fake_device_free (dev);
+
+  return close (fd);
+}
+
+gint
+gst_v4l2_fake_ioctl (gint fd, gulong request, ...)
+{
+  FakeDevice *dev;
+  gpointer arg;
+  va_list args;
+  gint err;
+
+  va_start (args, request);
+  arg = va_arg (args, gpointer);
+  va_end (args);
+
+  dev = fake_lookup (fd);
+  if (!dev)
+    return ioctl (fd, request, arg);
+
+  g_mutex_lock (&dev->lock);
+  err = fake_do_ioctl (dev, request, arg);
+  g_mutex_unlock (&dev->lock);
+
+  if (err) {
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+}
+
+gssize
+gst_v4l2_fake_read (gint fd, gpointer buffer, gsize n)
+{
+  if (fake_lookup (fd)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return read (fd, buffer, n);
+}
+
+static gint
+fake_find_plane (FakeQueue * q, guint32 offset)
+{
+  guint i, j;
+
+  if (q->memory != V4L2_MEMORY_MMAP)
+    return -1;
+
+  for (i = 0; i < q->count; i++)
+    for (j = 0; j < q->buffers[i].n_planes; j++)
+      if (q->buffers[i].planes[j].offset == offset)
+        return q->buffers[i].planes[j].memfd;
+
+  return -1;
+}
+
+gpointer
+gst_v4l2_fake_mmap (gpointer start, gsize length, gint prot, gint flags,
+    gint fd, off_t offset)
+{
+  GHashTableIter iter;
+  gpointer value;
+  gint memfd = -1;
+
+  /* Planes are identified by their offset cookie, whether they are mapped
+   * through the device fd or through an EXPBUF fd */
+  g_mutex_lock (&fake_lock);
+  if (fake_fds && offset > 0) {
+    g_hash_table_iter_init (&iter, fake_fds);
+    while (memfd < 0 && g_hash_table_iter_next (&iter, NULL, &value)) {
+      FakeDevice *dev = value;
+
+      g_mutex_lock (&dev->lock);
+      memfd = fake_find_plane (&dev->output, offset);
+      if (memfd < 0)
+        memfd = fake_find_plane (&dev->capture, offset);
+      g_mutex_unlock (&dev->lock);
+    }
+  }
+  g_mutex_unlock (&fake_lock);
+
+  if (memfd < 0)
+    return mmap (start, length, prot, flags, fd, offset);
+
+  return mmap (start, length, prot, flags, memfd, 0);
+}
+
+gint
+gst_v4l2_fake_munmap (gpointer start, gsize length)
+{
+  return munmap (start, length);
+}
@@ -0,0 +1,68 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+#ifndef __V4L2_FAKE_H__
+#define __V4L2_FAKE_H__
+
+#include <sys/types.h>
+#include <glib.h>
+
+G_BEGIN_DECLS
+
+/* In-process memory-to-memory codec device used in place of the NVDEC/NVENC
+ * kernel drivers. It is selected by setting GST_V4L2_FAKE_DEVICE in the
+ * environment, either to "1" or to a comma separated list of key=value
+ * pairs:
+ *
+ *   latency-us      time between a job starting and its capture buffer
+ *                   becoming ready (default 0)
+ *   fps             maximum number of jobs started per second, 0 for
+ *                   unlimited (default 0)
+ *   width, height   coded size reported by the decoder (default 1920x1080)
+ *   min-buffers     value of V4L2_CID_MIN_BUFFERS_FOR_CAPTURE/OUTPUT
+ *                   (default 4)
+ *   bitstream-size  bytesused of each encoder capture buffer (default 4096)
+ *   resize-after    decoded frames after which the decoder switches to
+ *                   another coded size and sends a source change event,
+ *                   0 for never (default 0)
+ *   resize-width, resize-height
+ *                   coded size switched to (default half of the current)
+ *
+ * e.g. GST_V4L2_FAKE_DEVICE="latency-us=8000,fps=240"
+ *
+ * Like the Tegra drivers, DQBUF never blocks and fails with EAGAIN while no
+ * buffer is ready; V4L2_CID_MPEG_VIDEO_DEVICE_POLL and poll() on the fd can
+ * be used to wait. */
+#define GST_V4L2_FAKE_DEVICE_ENV "GST_V4L2_FAKE_DEVICE"
+
+gboolean gst_v4l2_fake_device_enabled (void);
+
+gint gst_v4l2_fake_open (const gchar * path, gint flags);
+gint gst_v4l2_fake_close (gint fd);
+gint gst_v4l2_fake_dup (gint fd);
+gint gst_v4l2_fake_ioctl (gint fd, gulong request, ...);
+gssize gst_v4l2_fake_read (gint fd, gpointer buffer, gsize n);
+gpointer gst_v4l2_fake_mmap (gpointer start, gsize length, gint prot,
+    gint flags, gint fd, off_t offset);
+gint gst_v4l2_fake_munmap (gpointer start, gsize length);
+
+G_END_DECLS
+
+#endif /* __V4L2_FAKE_H__ */
@@ -0,0 +1,61 @@
+/*
+ * Copyright (c) 2018-2022, NVIDIA CORPORATION. All rights reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Library General Public
+ * License as published by the Free Software Foundation; either
+ * version 2 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Library General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin St, Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ *
+ */
+
+/* On-disk format of the encoder KPI trace, shared between the plugin and
+ * tools/nvv4l2-trace-decode. The file is a V4l2TraceHeader followed by
+ * V4l2TraceRecords in host byte order. Records of different events are not
+ * ordered relative to each other. */
+
+#ifndef __V4L2_TRACE_FORMAT_H__
+#define __V4L2_TRACE_FORMAT_H__
+
+#include <stdint.h>
+
+#define V4L2_TRACE_MAGIC      "NVV4L2TR"
+#define V4L2_TRACE_VERSION    1
+
+enum
+{
+  V4L2_TRACE_EVENT_INPUT,       /* frame received by handle_frame */
+  V4L2_TRACE_EVENT_OUTPUT,      /* encoded frame handed to finish_frame */
+  V4L2_TRACE_N_EVENTS
+};
+
+#define V4L2_TRACE_FLAG_KEYFRAME  (1 << 0)
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t record_size;
+  int64_t start_time_us;        /* monotonic time the trace was opened */
+} V4l2TraceHeader;
+
+typedef struct
+{
+  uint32_t event;
+  uint32_t frame_number;        /* system_frame_number */
+  uint64_t pts;                 /* ns */
+  int64_t time_us;              /* monotonic */
+  uint32_t size;                /* bytes of the output frame */
+  uint32_t flags;
+} V4l2TraceRecord;
+
+#endif /* __V4L2_TRACE_FORMAT_H__ */
@@ -34,6 +34,9 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#ifdef USE_V4L2_TARGET_NV
+#include <poll.h>
+#endif
 #ifdef __sun
 /* Needed on older Solaris Nevada builds (72 at least) */
 #include <stropts.h>
@@ -49,11 +52,17 @@
 #endif
 
 #include "gstv4l2videodec.h"
+#include "v4l2-fake.h"
 
 #include "gst/gst-i18n-plugin.h"
 GST_DEBUG_CATEGORY_EXTERN (v4l2_debug);
 #define GST_CAT_DEFAULT v4l2_debug
 
+#ifdef USE_V4L2_TARGET_NV
+/* DQEVENT retry interval on devices that do not report events by poll */
+#define GST_V4L2_EVENT_RETRY_MS 10
+#endif
+
 /******************************************************
  * gst_v4l2_get_capabilities():
  *   get the device's capturing capabilities
@@ -537,7 +546,10 @@ gst_v4l2_open (GstV4l2Object * v4l2object)
 
   char buf[30];
   int i = 0;
-  if (is_cuvid == TRUE) {
+  if (gst_v4l2_fake_device_enabled ()) {
+    v4l2object->video_fd =
+        gst_v4l2_fake_open (v4l2object->videodev, O_RDWR);
+  } else if (is_cuvid == TRUE) {
     for (i = 0; i < 16; i++)
     {
       g_snprintf(buf, sizeof(buf), "/dev/nvidia%d", i);
@@ -734,6 +746,112 @@ not_open:
 }
 
 
+#ifdef USE_V4L2_TARGET_NV
+/******************************************************
+ * gst_v4l2_probe_direct_ioctl():
+ *   pick the ioctl used for the streaming calls. With
+ *   GST_V4L2_DIRECT_IOCTL set, libv4l2 is bypassed once
+ *   the format is set, provided the fd is a kernel V4L2
+ *   device and libv4l2 does not convert the format.
+ *   Devices implemented by a libv4l2 plugin fail the raw
+ *   ioctl and stay on libv4l2, which is the case of the
+ *   NVDEC/NVENC devices on Jetson: there this does nothing.
+ ******************************************************/
+void
+gst_v4l2_probe_direct_ioctl (GstV4l2Object * v4l2object)
+{
+  struct v4l2_format raw = { 0 }, emulated = { 0 };
+
+  v4l2object->stream_ioctl = v4l2object->ioctl;
+
+  if (!v4l2object->direct_ioctl || v4l2object->ioctl == ioctl
+      || gst_v4l2_fake_device_enabled ())
+    return;
+
+  raw.type = emulated.type = v4l2object->type;
+
+  if (ioctl (v4l2object->video_fd, VIDIOC_G_FMT, &raw) < 0) {
+    GST_INFO_OBJECT (v4l2object->dbg_obj, "%s is not a kernel device (%s), "
+        "keeping libv4l2", v4l2object->videodev, g_strerror (errno));
+    return;
+  }
+
+  if (v4l2object->ioctl (v4l2object->video_fd, VIDIOC_G_FMT, &emulated) < 0)
+    return;
+
+  if (V4L2_TYPE_IS_MULTIPLANAR (v4l2object->type) ?
+      raw.fmt.pix_mp.pixelformat != emulated.fmt.pix_mp.pixelformat :
+      raw.fmt.pix.pixelformat != emulated.fmt.pix.pixelformat) {
+    GST_INFO_OBJECT (v4l2object->dbg_obj, "libv4l2 converts the format, "
+        "keeping it");
+    return;
+  }
+
+  GST_INFO_OBJECT (v4l2object->dbg_obj, "using direct ioctls for streaming");
+  v4l2object->stream_ioctl = ioctl;
+}
+
+/******************************************************
+ * gst_v4l2_wait_event():
+ *   dequeue the next event into @event, waiting up to
+ *   @timeout_us for one, or forever when negative.
+ *   Kernel devices raise POLLPRI when an event is queued
+ *   and the wait ends right then. Devices implemented by
+ *   a libv4l2 plugin do not poll, there DQEVENT is
+ *   retried every GST_V4L2_EVENT_RETRY_MS.
+ * return value: 0 on success, -1 with errno set on
+ *   error, ETIMEDOUT when no event came in time
+ ******************************************************/
+gint
+gst_v4l2_wait_event (GstV4l2Object * v4l2object, struct v4l2_event * event,
+    gint64 timeout_us)
+{
+  gint64 deadline = timeout_us < 0 ? -1 : g_get_monotonic_time () + timeout_us;
+  gboolean pollable = TRUE;
+  gboolean woken = FALSE;
+
+  for (;;) {
+    struct pollfd pfd = { v4l2object->video_fd, POLLPRI, 0 };
+    gint wait_ms = GST_V4L2_EVENT_RETRY_MS;
+    gint ret;
+
+    memset (event, 0, sizeof (*event));
+    if (v4l2object->ioctl (v4l2object->video_fd, VIDIOC_DQEVENT, event) == 0)
+      return 0;
+    if (errno == EINVAL)
+      return -1;
+
+    /* Woken up without an event to dequeue: the fd does not report events */
+    if (woken && pollable) {
+      GST_DEBUG_OBJECT (v4l2object->dbg_obj, "POLLPRI is not usable on %s, "
+          "retrying DQEVENT every %d ms", v4l2object->videodev,
+          GST_V4L2_EVENT_RETRY_MS);
+      pollable = FALSE;
+    }
+
+    if (deadline >= 0) {
+      gint64 remaining = deadline - g_get_monotonic_time ();
+
+      if (remaining <= 0) {
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      wait_ms = MIN (wait_ms, (remaining + 999) / 1000);
+    }
+
+    if (!pollable) {
+      g_usleep (wait_ms * 1000);
+      continue;
+    }
+
+    ret = poll (&pfd, 1, wait_ms);
+    if (ret < 0 && errno != EINTR)
+      return -1;
+    woken = ret > 0;
+  }
+}
+#endif
+
 /******************************************************
  * gst_v4l2_close():
  *   close the video device (v4l2object->video_fd)